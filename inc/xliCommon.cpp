@@ -124,3 +124,17 @@ uint64_t StringToUInt64(const char *strData)
 
   return retValue;
 }
+
+// CRC-32 (IEEE 802.3), pass the previous result to continue over several blocks
+uint32_t CRC32(const void *pData, uint16_t nLen, uint32_t crc)
+{
+  const uint8_t *pByte = (const uint8_t *)pData;
+  crc = ~crc;
+  while( nLen-- ) {
+    crc ^= *pByte++;
+    for( uint8_t i = 0; i < 8; i++ ) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
@@ -132,6 +132,9 @@ typedef enum
   sensorCO2
 } sensors_t;
 
+// Number of sensor types, including the ones without bit position
+#define MAX_SENSOR_TYPES            (sensorCO2 + 1)
+
 // Sensor scope
 #define SR_SCOPE_CONTROLLER         0     // Sensor on controller
 #define SR_SCOPE_NODE               1     // Sensor on specific node
@@ -148,6 +151,18 @@ typedef enum
 #define SR_SYM_BW                   6     // Between
 #define SR_SYM_NB                   7     // Not Between
 
+// Sensor data aggregation over the rule window
+#define SR_AGGR_NONE                0     // Latest value
+#define SR_AGGR_AVG                 1     // Average
+#define SR_AGGR_MAX                 2     // Maximum
+#define SR_AGGR_MIN                 3     // Minimum
+
+// Aggregation window of a rule
+#define SR_WIN_5MIN                 0
+#define SR_WIN_15MIN                1
+#define SR_WIN_30MIN                2
+#define SR_WIN_60MIN                3
+
 // Condition logic symbols
 #define COND_SYM_NOT                0     // NOT
 #define COND_SYM_AND                1     // AND
@@ -235,6 +250,7 @@ uint8_t h2i(const char c);
 char* PrintUint64(char *buf, uint64_t value, bool bHex = true);
 char* PrintMacAddress(char *buf, const uint8_t *mac, char delim = ':', bool bShort = true);
 uint64_t StringToUInt64(const char *strData);
+uint32_t CRC32(const void *pData, uint16_t nLen, uint32_t crc = 0);
 inline time_t tmConvert_t(US YYYY, UC MM, UC DD, UC hh, UC mm, UC ss)  // inlined for speed
 {
   struct tm t;
@@ -38,6 +38,14 @@
 //------------------------------------------------------------------
 #define MEM_EXT_FLASH_BASE        0x000000
 
+// Logical page of the wear-levelled device (4096 bytes less 2 for the page mapper),
+/// erasePage() clears the whole logical page that holds the address
+#define MEM_EXT_FLASH_PAGE        4094
+
+// Round a region bound to logical pages, so erasing stays inside the region
+#define FLASH_PAGE_FLOOR(addr, page)  ((addr) - (addr) % (page))
+#define FLASH_PAGE_CEIL(addr, page)   FLASH_PAGE_FLOOR((addr) + (page) - 1, page)
+
 // Rules (65536 bytes)
 #define MEM_RULES_OFFSET          MEM_EXT_FLASH_BASE
 #define MEM_RULES_LEN             0x010000
@@ -69,12 +77,39 @@
 #define MEM_NODECONFIG_OFFSET     MEM_MISC_OFFSET
 #define MEM_NODECONFIG_LEN        0x004000
 
+// Config backup of earlier versions, only read once to fill the config slots
 #define MEM_CONFIG_BACKUP_OFFSET  (MEM_NODECONFIG_OFFSET + MEM_NODECONFIG_LEN)
 #define MEM_CONFIG_BACKUP_LEN     0x0100
 
 #define MEM_NODELIST_BACKUP_OFFSET  (MEM_CONFIG_BACKUP_OFFSET + MEM_CONFIG_BACKUP_LEN)
 #define MEM_NODELIST_BACKUP_LEN     0x0300
 
+// Persistent log ring (65536 bytes), whole logical pages inside are used
+#define MEM_FLASHLOG_OFFSET       (MEM_MISC_OFFSET + 0x010000)
+#define MEM_FLASHLOG_LEN          0x010000
+
+// Record log of rules, scenarios and schedules (2 * 65536 bytes), whole logical pages inside are used
+/// Active and spare areas swap on compaction
+#define MEM_RECLOG_OFFSET         (MEM_MISC_OFFSET + 0x020000)
+#define MEM_RECLOG_LEN            0x020000
+
+// A/B slots of the system config (2 * 4096 bytes), one sector each
+#define MEM_CONFIG_SLOTS_OFFSET   (MEM_MISC_OFFSET + 0x040000)
+#define MEM_CONFIG_SLOTS_LEN      0x002000
+
+// A/B slots of the group membership table (2 * 4096 bytes), one sector each
+#define MEM_GROUPS_OFFSET         (MEM_MISC_OFFSET + 0x042000)
+#define MEM_GROUPS_LEN            0x002000
+
+// Firmware image of nodes for OTA (236K), whole logical pages inside are used
+/// OTAImageHead_t and the image, staged from cloud
+#define MEM_FIRMWARE_OFFSET       (MEM_MISC_OFFSET + 0x044000)
+#define MEM_FIRMWARE_LEN          0x03B000
+
+// RF capture dump (4K)
+#define MEM_CAPTURE_OFFSET        (MEM_MISC_OFFSET + 0x07F000)
+#define MEM_CAPTURE_LEN           0x001000
+
 //-------------------------------
 
 #endif /* xliMemoryMap_h */
@@ -167,3 +167,216 @@ bool ChainClass<T>::unshift(T _t)
 
 	return LinkedList<T>::unshift(_t);
 }
+
+//------------------------------------------------------------------
+// LRU Chain Class, a chain of rows cached from flash
+// Rows are found by uid and the least recently used saved row is
+// evicted when full. The recency list is kept by uid in arrays, so
+// hit, touch and choosing the victim don't walk the chain
+//------------------------------------------------------------------
+#define CHAIN_LRU_UIDS				64			// Cached uids are 0 .. 63
+#define CHAIN_LRU_NONE				0xFF
+
+template <typename T>
+class LruChainClass : public ChainClass<T>
+{
+private:
+	ListNode<T> *m_node[CHAIN_LRU_UIDS];	// Row of uid, NULL if not in chain
+	UC m_newer[CHAIN_LRU_UIDS];				// Recency list of uids in chain
+	UC m_older[CHAIN_LRU_UIDS];
+	UC m_newest;
+	UC m_oldest;
+	UL m_hits;
+	UL m_misses;
+	UL m_evictions;
+
+	void link(ListNode<T> *node);			// Make node the most recent
+	void unlink(UC uid);
+	void forget(ListNode<T> *node);
+
+public:
+	LruChainClass(UC max);
+
+	ListNode<T>* find(uint8_t uid);			// Lookup only, no counter or touch
+	ListNode<T>* search(uint8_t uid);		// Counts hit or miss, a hit becomes the most recent
+	ListNode<T>* add_lru(T _t);				// Add, reusing the least recently used saved row if full
+
+	UL getHits() { return m_hits; }
+	UL getMisses() { return m_misses; }
+	UL getEvictions() { return m_evictions; }
+	void resetStats() { m_hits = m_misses = m_evictions = 0; }
+	void showStatus(const char *_name);
+
+	//keep the uid index in step with every change of the chain
+	virtual bool add(int index, T);
+	virtual bool add(T);
+	virtual bool unshift(T);
+	virtual T remove(int index);
+	virtual T pop();
+	virtual T shift();					// clear() shifts every row
+};
+
+template<typename T>
+LruChainClass<T>::LruChainClass(UC max)
+ : ChainClass<T>(max)
+{
+	memset(m_node, 0x00, sizeof(m_node));
+	m_newest = m_oldest = CHAIN_LRU_NONE;
+	m_hits = m_misses = m_evictions = 0;
+}
+
+template<typename T>
+void LruChainClass<T>::link(ListNode<T> *node)
+{
+	UC uid = node->data.uid;
+	if (uid >= CHAIN_LRU_UIDS)
+		return;
+	if (m_node[uid])
+		unlink(uid);
+	m_node[uid] = node;
+	m_older[uid] = m_newest;
+	m_newer[uid] = CHAIN_LRU_NONE;
+	if (m_newest != CHAIN_LRU_NONE)
+		m_newer[m_newest] = uid;
+	else
+		m_oldest = uid;
+	m_newest = uid;
+}
+
+template<typename T>
+void LruChainClass<T>::unlink(UC uid)
+{
+	if (m_newer[uid] != CHAIN_LRU_NONE)
+		m_older[m_newer[uid]] = m_older[uid];
+	else
+		m_newest = m_older[uid];
+	if (m_older[uid] != CHAIN_LRU_NONE)
+		m_newer[m_older[uid]] = m_newer[uid];
+	else
+		m_oldest = m_newer[uid];
+	m_node[uid] = NULL;
+}
+
+// Called before the node is freed, a node already forgotten is ignored
+template<typename T>
+void LruChainClass<T>::forget(ListNode<T> *node)
+{
+	if (node == NULL)
+		return;
+	UC uid = node->data.uid;
+	if (uid < CHAIN_LRU_UIDS && m_node[uid] == node)
+		unlink(uid);
+}
+
+template<typename T>
+ListNode<T>* LruChainClass<T>::find(uint8_t uid)
+{
+	if (uid >= CHAIN_LRU_UIDS)
+		return ChainClass<T>::search(uid);
+	return m_node[uid];
+}
+
+template<typename T>
+ListNode<T>* LruChainClass<T>::search(uint8_t uid)
+{
+	ListNode<T> *tmp = find(uid);
+	if (tmp)
+	{
+		m_hits++;
+		link(tmp);
+	}
+	else
+	{
+		m_misses++;
+	}
+	return tmp;
+}
+
+template<typename T>
+ListNode<T>* LruChainClass<T>::add_lru(T _t)
+{
+	if (_t.uid >= CHAIN_LRU_UIDS)
+		return NULL;
+
+	if (!ChainClass<T>::isFull())
+	{
+		if (!add(_t))
+			return NULL;
+		return LinkedList<T>::last;
+	}
+
+	//reuse the oldest row that has a copy in flash and is not pending
+	UC uid = m_oldest;
+	while (uid != CHAIN_LRU_NONE)
+	{
+		ListNode<T> *tmp = m_node[uid];
+		if (tmp->data.flash_flag == SAVED && tmp->data.run_flag == EXECUTED)
+		{
+			unlink(uid);
+			tmp->data = _t;
+			link(tmp);
+			m_evictions++;
+			return tmp;
+		}
+		uid = m_newer[uid];
+	}
+	return NULL;
+}
+
+template<typename T>
+void LruChainClass<T>::showStatus(const char *_name)
+{
+	UL total = m_hits + m_misses;
+	SERIAL_LN("%s cache: %d rows, %lu hits, %lu misses (%lu%% hit), %lu evictions", _name,
+			LinkedList<T>::size(), m_hits, m_misses, (total > 0 ? m_hits * 100 / total : 0), m_evictions);
+}
+
+template<typename T>
+bool LruChainClass<T>::add(int index, T _t)
+{
+	if (!ChainClass<T>::add(index, _t))
+		return false;
+	//index beyond the end appends
+	link(LinkedList<T>::getNode(index < LinkedList<T>::size() ? index : LinkedList<T>::size() - 1));
+	return true;
+}
+
+template<typename T>
+bool LruChainClass<T>::add(T _t)
+{
+	if (!ChainClass<T>::add(_t))
+		return false;
+	link(LinkedList<T>::last);
+	return true;
+}
+
+template<typename T>
+bool LruChainClass<T>::unshift(T _t)
+{
+	if (!ChainClass<T>::unshift(_t))
+		return false;
+	link(LinkedList<T>::root);
+	return true;
+}
+
+template<typename T>
+T LruChainClass<T>::remove(int index)
+{
+	if (index >= 0 && index < LinkedList<T>::size())
+		forget(LinkedList<T>::getNode(index));
+	return ChainClass<T>::remove(index);
+}
+
+template<typename T>
+T LruChainClass<T>::pop()
+{
+	forget(LinkedList<T>::last);
+	return ChainClass<T>::pop();
+}
+
+template<typename T>
+T LruChainClass<T>::shift()
+{
+	forget(LinkedList<T>::root);
+	return ChainClass<T>::shift();
+}
@@ -28,6 +28,7 @@
 #include "xlxConfig.h"
 #include "xlxLogger.h"
 #include "xlxBLEInterface.h"
+#include "xlxCloudPublisher.h"
 
 //------------------------------------------------------------------
 // Xlight Cloud Object Class
@@ -39,48 +40,8 @@ CloudObjClass::CloudObjClass()
   m_nAppVersion = VERSION_CONFIG_DATA;
   m_SysStatus = STATUS_OFF;
 
-  m_temperature.node_id = 0;
-  m_temperature.data = 0.0;
-
-  m_humidity.node_id = 0;
-  m_humidity.data = 0.0;
-
-  m_brightness.node_id = 0;
-  m_brightness.data = 0;
-
-  m_motion.node_id = 0;
-  m_motion.data = false;
-
-  m_irKey.node_id = 0;
-  m_irKey.data = false;
-
-  m_sound.node_id = 0;
-  m_sound.data = false;
-
-  m_gas.node_id = 0;
-  m_gas.data = 0;
-
-
-  m_smoke.node_id = 0;
-  m_smoke.data = 0;
-
-  m_noise.node_id = 0;
-  m_noise.data = 0;
-
-  m_pm25.node_id = 0;
-  m_pm25.data = 0;
-
-  m_pm10.node_id = 0;
-  m_pm10.data = 0;
-
-  m_tvoc.node_id = 0;
-  m_tvoc.data = 0;
-
-  m_ch2o.node_id = 0;
-  m_ch2o.data = 0;
-
-  m_co2.node_id = 0;
-  m_co2.data = 0;
+  m_nSensorReported = 0;
+  m_nSensorFiltered = 0;
 
   m_strCldCmd = "";
 }
@@ -135,48 +96,70 @@ int CloudObjClass::CldJSONConfig(String jsonData)
   return 1;
 }
 
-BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
+// Store the latest reading of the node and decide whether it is worth reporting,
+/// according to the filter of the sensor type: deadband, minimum interval and heartbeat.
+/// Only reported readings are published and trigger rule evaluation.
+BOOL CloudObjClass::UpdateSensorState(const UC _sr, const UC _nd, const float _value)
 {
-  static float preTemp = 255;
-  static float preHumi = 255;
+  if( _sr >= MAX_SENSOR_TYPES ) return true;
+
+  SensorState_t *pState = m_srState.Update(_nd, _sr, _value);
+
+  const SensorFilter_t *pFilter = theConfig.GetSensorFilter(_sr);
+  UL now = millis();
+  BOOL bReport = false;
+
+  if( _sr == sensorIRKey || pState->tick == 0 ) {
+    // Key events or first reading
+    bReport = true;
+  } else if( pFilter->heartbeat > 0 && now - pState->tick >= (UL)pFilter->heartbeat * 60000 ) {
+    // Heartbeat
+    bReport = true;
+  } else if( _value != pState->reported ) {
+    if( now - pState->tick >= (UL)pFilter->minInterval * 1000 ) {
+      float _delta = (_value > pState->reported ? _value - pState->reported : pState->reported - _value);
+      float _band = pFilter->deadband / 10.0;
+      if( pFilter->relative ) {
+        _band = (pState->reported >= 0 ? pState->reported : -pState->reported) * pFilter->deadband / 1000.0;
+      }
+      bReport = (_delta >= _band);
+    }
+  }
 
+  if( bReport ) {
+    pState->reported = _value;
+    pState->tick = (now > 0 ? now : 1);
+    m_nSensorReported++;
+  } else {
+    m_nSensorFiltered++;
+  }
+  return bReport;
+}
+
+BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
+{
   if( _temp > 100 && (_humi > 100 || _humi < 0) ) return false;
 
   BOOL temp_ok = false;
   BOOL humi_ok = false;
   if( nid > 0 ) {
     if( _humi >= 0 && _humi <= 100 ) {
-      if( m_humidity.data != _humi || m_humidity.node_id != nid ) {
-        m_humidity.node_id = nid;
-        m_humidity.data = _humi;
-        humi_ok = true;
-      }
+      humi_ok = UpdateSensorState(sensorDHT_h, nid, _humi);
     }
     if( _temp <= 100 ) {
-      if( m_temperature.data != _temp || m_temperature.node_id != nid )
-      {
-        m_temperature.node_id = nid;
-        m_temperature.data = _temp;
-        temp_ok = true;
-      }
+      temp_ok = UpdateSensorState(sensorDHT, nid, _temp);
     }
   } else {
     if( _humi >= 0 && _humi <= 100 ) {
       if( m_sysHumi.AddData(_humi) ) {
         _humi = m_sysHumi.GetValue();
-        if( _humi != preHumi ) {
-          preHumi = _humi;
-          humi_ok = true;
-        }
+        humi_ok = UpdateSensorState(sensorDHT_h, nid, _humi);
       }
     }
     if( _temp <= 100 ) {
       if( m_sysTemp.AddData(_temp) ) {
         _temp = m_sysTemp.GetValue();
-        if( _temp != preTemp ) {
-          preTemp = _temp;
-          temp_ok = true;
-        }
+        temp_ok = UpdateSensorState(sensorDHT, nid, _temp);
       }
     }
   }
@@ -184,23 +167,20 @@ BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
   if( temp_ok ) OnSensorDataChanged(sensorDHT, nid);
   if( humi_ok ) OnSensorDataChanged(sensorDHT_h, nid);
 
-  if( !theConfig.GetDisableWiFi() ) {
-    // Publis right away
-    if( Particle.connected() && (temp_ok || humi_ok) ) {
-      String strTemp;
-
-      // Temperature Message
-      if( humi_ok && _temp < 100 ) temp_ok = true;
-
-      if( temp_ok && humi_ok ) {
-        strTemp = String::format("{'nd':%d,'DHTt':%.2f,'DHTh':%.2f}", nid, _temp, _humi);
-      } else if( temp_ok ) {
-        strTemp = String::format("{'nd':%d,'DHTt':%.2f}", nid, _temp);
-      } else {
-        strTemp = String::format("{'nd':%d,'DHTh':%.2f}", nid, _humi);
-      }
-      Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_SensorData, PRIVATE);
+  if( temp_ok || humi_ok ) {
+    String strTemp;
+
+    // Temperature Message
+    if( humi_ok && _temp < 100 ) temp_ok = true;
+
+    if( temp_ok && humi_ok ) {
+      strTemp = String::format("{'nd':%d,'DHTt':%.2f,'DHTh':%.2f}", nid, _temp, _humi);
+    } else if( temp_ok ) {
+      strTemp = String::format("{'nd':%d,'DHTt':%.2f}", nid, _temp);
+    } else {
+      strTemp = String::format("{'nd':%d,'DHTh':%.2f}", nid, _humi);
     }
+    PublishSensorData(strTemp.c_str(), CLT_TTL_SensorData);
   }
 
   return true;
@@ -208,17 +188,10 @@ BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
 
 BOOL CloudObjClass::UpdateBrightness(uint8_t nid, uint8_t value)
 {
-  if( m_brightness.data != value || m_brightness.node_id != nid ) {
-    m_brightness.node_id = nid;
-    m_brightness.data = value;
+  if( UpdateSensorState(sensorALS, nid, value) ) {
     OnSensorDataChanged(sensorALS, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'ALS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'ALS':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
@@ -227,26 +200,18 @@ BOOL CloudObjClass::UpdateBrightness(uint8_t nid, uint8_t value)
 BOOL CloudObjClass::UpdateMotion(uint8_t nid, uint8_t sensor, uint8_t value)
 {
   if( sensor == S_MOTION || sensor == S_IR ) {
+    BOOL bReport;
     if( sensor == S_MOTION ) {
-      if( m_motion.data != value || m_motion.node_id != nid ) {
-        m_motion.node_id = nid;
-        m_motion.data = value;
-        OnSensorDataChanged(sensorPIR, nid);
-      }
-    } else if( sensor == S_IR ) {
-      if( m_irKey.data != value || m_irKey.node_id != nid ) {
-        m_irKey.node_id = nid;
-        m_irKey.data = value;
-        OnSensorDataChanged(sensorIRKey, nid);
-      }
+      bReport = UpdateSensorState(sensorPIR, nid, value);
+      if( bReport ) OnSensorDataChanged(sensorPIR, nid);
+    } else {
+      bReport = UpdateSensorState(sensorIRKey, nid, value);
+      if( bReport ) OnSensorDataChanged(sensorIRKey, nid);
     }
 
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'%s':%d}", nid, (sensor == S_MOTION ? "PIR" : "IRK"), value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
+    if( bReport ) {
+      String strTemp = String::format("{'nd':%d,'%s':%d}", nid, (sensor == S_MOTION ? "PIR" : "IRK"), value);
+      PublishSensorData(strTemp.c_str());
     }
     return true;
   }
@@ -255,17 +220,10 @@ BOOL CloudObjClass::UpdateMotion(uint8_t nid, uint8_t sensor, uint8_t value)
 
 BOOL CloudObjClass::UpdateGas(uint8_t nid, uint16_t value)
 {
-  if( m_gas.data != value || m_gas.node_id != nid ) {
-    m_gas.node_id = nid;
-    m_gas.data = value;
+  if( UpdateSensorState(sensorGAS, nid, value) ) {
     OnSensorDataChanged(sensorGAS, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'GAS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'GAS':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
@@ -274,66 +232,45 @@ BOOL CloudObjClass::UpdateGas(uint8_t nid, uint16_t value)
 BOOL CloudObjClass::UpdateAirQuality(uint8_t nid, uint16_t pm25,uint16_t pm10,float tvoc,float ch2o,uint16_t co2)
 {
 	BOOL bNeedSendMsg = false;
-	if( m_pm25.data != pm25 || m_pm25.node_id != nid )
-		{
-			m_pm25.node_id = nid;
-			m_pm25.data = pm25;
-			OnSensorDataChanged(sensorPM25, nid);
-			bNeedSendMsg = true;
-		}
-		if( m_pm10.data != pm10 || m_pm10.node_id != nid )
-		{
-			m_pm10.node_id = nid;
-			m_pm10.data = pm10;
-			OnSensorDataChanged(sensorPM10, nid);
-			bNeedSendMsg = true;
-		}
-		if( m_tvoc.data != tvoc || m_tvoc.node_id != nid )
-		{
-			m_tvoc.node_id = nid;
-			m_tvoc.data = tvoc;
-			OnSensorDataChanged(sensorTVOC, nid);
-			bNeedSendMsg = true;
-		}
-		if( m_ch2o.data != ch2o || m_ch2o.node_id != nid )
-		{
-			m_ch2o.node_id = nid;
-			m_ch2o.data = ch2o;
-			OnSensorDataChanged(sensorCH2O, nid);
-			bNeedSendMsg = true;
-		}
-		if( m_co2.data != co2 || m_co2.node_id != nid )
-		{
-			m_co2.node_id = nid;
-			m_co2.data = co2;
-			OnSensorDataChanged(sensorCO2, nid);
-			bNeedSendMsg = true;
-		}
-
+	if( UpdateSensorState(sensorPM25, nid, pm25) )
+	{
+		OnSensorDataChanged(sensorPM25, nid);
+		bNeedSendMsg = true;
+	}
+	if( UpdateSensorState(sensorPM10, nid, pm10) )
+	{
+		OnSensorDataChanged(sensorPM10, nid);
+		bNeedSendMsg = true;
+	}
+	if( UpdateSensorState(sensorTVOC, nid, tvoc) )
+	{
+		OnSensorDataChanged(sensorTVOC, nid);
+		bNeedSendMsg = true;
+	}
+	if( UpdateSensorState(sensorCH2O, nid, ch2o) )
+	{
+		OnSensorDataChanged(sensorCH2O, nid);
+		bNeedSendMsg = true;
+	}
+	if( UpdateSensorState(sensorCO2, nid, co2) )
+	{
+		OnSensorDataChanged(sensorCO2, nid);
+		bNeedSendMsg = true;
+	}
 
-		if( !theConfig.GetDisableWiFi() && bNeedSendMsg ) {
-			// Publis right away
-			if( Particle.connected() ) {
-				String strTemp = String::format("{'nd':%d,'PM25':%d,'PM10':%d,'TVOC':%.2f,'CH2O':%.2f,'CO2':%d}", nid,pm25,pm10,tvoc,ch2o,co2 );
-				Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-			}
-		}
-		return true;
+	if( bNeedSendMsg ) {
+		String strTemp = String::format("{'nd':%d,'PM25':%d,'PM10':%d,'TVOC':%.2f,'CH2O':%.2f,'CO2':%d}", nid,pm25,pm10,tvoc,ch2o,co2 );
+		PublishSensorData(strTemp.c_str());
+	}
+	return true;
 }
 
 BOOL CloudObjClass::UpdateDust(uint8_t nid, uint16_t value)
 {
-  if( m_pm25.data != value || m_pm25.node_id != nid ) {
-    m_pm25.node_id = nid;
-    m_pm25.data = value;
+  if( UpdateSensorState(sensorPM25, nid, value) ) {
     OnSensorDataChanged(sensorPM25, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'PM25':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'PM25':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
@@ -341,17 +278,10 @@ BOOL CloudObjClass::UpdateDust(uint8_t nid, uint16_t value)
 
 BOOL CloudObjClass::UpdateSmoke(uint8_t nid, uint16_t value)
 {
-  if( m_smoke.data != value || m_smoke.node_id != nid ) {
-    m_smoke.node_id = nid;
-    m_smoke.data = value;
+  if( UpdateSensorState(sensorSMOKE, nid, value) ) {
     OnSensorDataChanged(sensorSMOKE, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'SMK':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'SMK':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
@@ -359,17 +289,10 @@ BOOL CloudObjClass::UpdateSmoke(uint8_t nid, uint16_t value)
 
 BOOL CloudObjClass::UpdateSound(uint8_t nid, uint8_t value)
 {
-  if( m_sound.data != value || m_sound.node_id != nid ) {
-    m_sound.node_id = nid;
-    m_sound.data = value;
+  if( UpdateSensorState(sensorMIC_b, nid, value) ) {
     OnSensorDataChanged(sensorMIC_b, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'MIC':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'MIC':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
@@ -377,32 +300,26 @@ BOOL CloudObjClass::UpdateSound(uint8_t nid, uint8_t value)
 
 BOOL CloudObjClass::UpdateNoise(uint8_t nid, uint16_t value)
 {
-  if( m_noise.data != value || m_noise.node_id != nid ) {
-    m_noise.node_id = nid;
-    m_noise.data = value;
+  if( UpdateSensorState(sensorMIC, nid, value) ) {
     OnSensorDataChanged(sensorMIC, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'NOS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    String strTemp = String::format("{'nd':%d,'NOS':%d}", nid, value);
+    PublishSensorData(strTemp.c_str());
     return true;
   }
   return false;
 }
 
+// Publish sensor data
+BOOL CloudObjClass::PublishSensorData(const char *msg, US ttl)
+{
+  return thePublisher.Enqueue(CLT_ID_SensorData, msg, ttl);
+}
+
 // Publish LOG message and update cloud variable
 BOOL CloudObjClass::PublishLog(const char *msg)
 {
-  BOOL rc = true;
   m_lastMsg = msg;
-  if( !theConfig.GetDisableWiFi() ) {
-    if( Particle.connected() ) {
-      rc = Particle.publish(CLT_NAME_LOGMSG, msg, CLT_TTL_LOGMSG, PRIVATE);
-    }
-  }
+  BOOL rc = thePublisher.Enqueue(CLT_ID_LOGMSG, msg, CLT_TTL_LOGMSG);
 
 #ifndef DISABLE_BLE
   // Notify via BLE
@@ -415,12 +332,7 @@ BOOL CloudObjClass::PublishLog(const char *msg)
 // Publish Device status
 BOOL CloudObjClass::PublishDeviceStatus(const char *msg)
 {
-  BOOL rc = true;
-  if( !theConfig.GetDisableWiFi() ) {
-    if( Particle.connected() ) {
-      rc = Particle.publish(CLT_NAME_DeviceStatus, msg, CLT_TTL_DeviceStatus, PRIVATE);
-    }
-  }
+  BOOL rc = thePublisher.Enqueue(CLT_ID_DeviceStatus, msg, CLT_TTL_DeviceStatus);
 
 #ifndef DISABLE_BLE
   // Notify via BLE
@@ -443,12 +355,7 @@ void CloudObjClass::GotNodeConfigAck(const UC _nodeID, const UC *data)
 // Publish Device Config
 BOOL CloudObjClass::PublishDeviceConfig(const char *msg)
 {
-  BOOL rc = true;
-  if( !theConfig.GetDisableWiFi() ) {
-    if( Particle.connected() ) {
-      rc = Particle.publish(CLT_NAME_DeviceConfig, msg, CLT_TTL_DeviceConfig, PRIVATE);
-    }
-  }
+  BOOL rc = thePublisher.Enqueue(CLT_ID_DeviceConfig, msg, CLT_TTL_DeviceConfig);
 
 #ifndef DISABLE_BLE
   // Notify via BLE
@@ -461,12 +368,7 @@ BOOL CloudObjClass::PublishDeviceConfig(const char *msg)
 // Publish Alarm
 BOOL CloudObjClass::PublishAlarm(const char *msg)
 {
-  BOOL rc = true;
-  if( !theConfig.GetDisableWiFi() ) {
-    if( Particle.connected() ) {
-      rc = Particle.publish(CLT_NAME_Alarm, msg, CLT_TTL_Alarm, PRIVATE);
-    }
-  }
+  BOOL rc = thePublisher.Enqueue(CLT_ID_Alarm, msg, CLT_TTL_Alarm);
 
 #ifndef DISABLE_BLE
   // Notify via BLE
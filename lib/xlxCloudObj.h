@@ -7,6 +7,7 @@
 #include "ArduinoJson.h"
 #include "LinkedList.h"
 #include "MoveAverage.h"
+#include "xlxSensorState.h"
 
 // Comment it off if we don't use Particle public cloud
 /// Notes:
@@ -54,24 +55,6 @@
 #define CLT_NAME_DeviceConfig   "xlc-config-device"
 #define CLT_TTL_DeviceConfig    30
 
-typedef struct
-{
-  UC node_id;                       // RF nodeID
-  float data;
-} nd_float_t;
-
-typedef struct
-{
-  UC node_id;                       // RF nodeID
-  US data;
-} nd_us_t;
-
-typedef struct
-{
-  UC node_id;                       // RF nodeID
-  UC data;
-} nd_uc_t;
-
 //------------------------------------------------------------------
 // Xlight CloudObj Class
 //------------------------------------------------------------------
@@ -92,20 +75,11 @@ public:
   CMoveAverage m_sysHumi;
 
   // Sensor Data from Node
-  nd_float_t m_temperature;
-  nd_float_t m_humidity;
-  nd_us_t m_brightness;
-  nd_uc_t m_motion;
-  nd_uc_t m_irKey;
-  nd_us_t m_gas;
-  nd_us_t m_smoke;
-  nd_uc_t m_sound;
-  nd_us_t m_noise;
-  nd_us_t m_pm25;
-  nd_us_t m_pm10;
-  nd_float_t m_tvoc;
-  nd_float_t m_ch2o;
-  nd_us_t m_co2;
+  SensorStateClass m_srState;
+
+  // Sensor data filter statistics
+  UL m_nSensorReported;
+  UL m_nSensorFiltered;
 
 public:
   CloudObjClass();
@@ -131,6 +105,7 @@ public:
   BOOL UpdateNoise(uint8_t nid, uint16_t value);
   BOOL UpdateAirQuality(uint8_t nid, uint16_t pm25,uint16_t pm10,float tvoc,float ch2o,uint16_t co2);
 
+  BOOL PublishSensorData(const char *msg, US ttl = CLT_TTL_MotionData);
   BOOL PublishLog(const char *msg);
   BOOL PublishDeviceStatus(const char *msg);
   BOOL PublishDeviceConfig(const char *msg);
@@ -139,6 +114,7 @@ public:
 
 protected:
   void InitCloudObj();
+  BOOL UpdateSensorState(const UC _sr, const UC _nd, const float _value);
 
   JsonObject *m_jpCldCmd;
 
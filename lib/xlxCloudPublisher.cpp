@@ -0,0 +1,517 @@
+/**
+ * xlxCloudPublisher.cpp - Xlight cloud publish queue
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Particle cloud accepts about 1 event per second, bursts are dropped.
+ * All cloud events are buffered here and published at the allowed pace:
+ * 1. Token bucket: one token per RTE_PUB_TOKEN_INTERVAL, up to RTE_PUB_TOKEN_BURST
+ * 2. Priority: alarm > device status & config > sensor data > log
+ * 3. JSON objects of the same topic are packed into one event, e.g.
+ *    [{'nd':8,'BR':50},{'nd':9,'BR':50}], up to 255 bytes
+ * 4. Newest wins: a new object for the same node (and ring/sub-id) is merged
+ *    into the pending one key by key, instead of being queued again
+ * 5. If the queue is full, the oldest packet with the lowest priority is dropped
+ * 6. While offline, sensor readings and device events go to the offline
+ *    journal (xlxOfflineJournal.cpp). After reconnecting they are replayed
+ *    with their original time, only when no live event is pending and one
+ *    token is left for the next live event
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxCloudPublisher.h"
+#include "xlxCloudObj.h"
+#include "xlxConfig.h"
+
+//------------------------------------------------------------------
+// the one and only instance of CloudPublisherClass
+CloudPublisherClass thePublisher;
+
+// Reserve room for the brackets of a packed event
+#define PUB_MAX_PACK_LEN        (PUB_MAX_DATA_LEN - 2)
+
+//------------------------------------------------------------------
+// Flat JSON object helpers
+//------------------------------------------------------------------
+// Skip a JSON value, return the position of the next ',' or closing bracket
+static US pubSkipValue(const char *s, US pos, US len)
+{
+  UC depth = 0;
+  char quote = 0;
+  while( pos < len ) {
+    char c = s[pos];
+    if( quote ) {
+      if( c == quote ) quote = 0;
+    } else if( c == '\'' || c == '"' ) {
+      quote = c;
+    } else if( c == '{' || c == '[' ) {
+      depth++;
+    } else if( c == '}' || c == ']' ) {
+      if( depth == 0 ) break;
+      depth--;
+    } else if( c == ',' && depth == 0 ) {
+      break;
+    }
+    pos++;
+  }
+  return pos;
+}
+
+// Get next 'key':value pair of an object, pos starts right after '{'
+static bool pubNextPair(const char *obj, US len, US &pos, US &kStart, US &kLen, US &vStart, US &vLen)
+{
+  while( pos < len && (obj[pos] == ',' || obj[pos] == ' ') ) pos++;
+  if( pos >= len || (obj[pos] != '\'' && obj[pos] != '"') ) return false;
+
+  char quote = obj[pos++];
+  kStart = pos;
+  while( pos < len && obj[pos] != quote ) pos++;
+  if( pos >= len ) return false;
+  kLen = pos - kStart;
+  pos++;
+  if( pos >= len || obj[pos] != ':' ) return false;
+  vStart = ++pos;
+  pos = pubSkipValue(obj, pos, len);
+  vLen = pos - vStart;
+  return true;
+}
+
+// Find the value of key in an object
+static bool pubFindKey(const char *obj, US len, const char *key, US keyLen, US &vStart, US &vLen)
+{
+  US pos = 1, kStart, kLen;
+  while( pubNextPair(obj, len, pos, kStart, kLen, vStart, vLen) ) {
+    if( kLen == keyLen && strncmp(obj + kStart, key, kLen) == 0 ) return true;
+  }
+  return false;
+}
+
+// Identity of an object: node, sub-id and ring. Objects with the same
+// identity describe the same thing, so the newer values win.
+static void pubIdentity(const char *obj, US len, char *id, US size)
+{
+  static const char *idKeys[] = {"nd", "sid", "subid", "Ring"};
+  US vStart, vLen, used = 0;
+
+  id[0] = '\0';
+  for( UC i = 0; i < sizeof(idKeys) / sizeof(idKeys[0]); i++ ) {
+    if( pubFindKey(obj, len, idKeys[i], strlen(idKeys[i]), vStart, vLen) ) {
+      if( used + vLen + 2 >= size ) break;
+      id[used++] = '0' + i;
+      memcpy(id + used, obj + vStart, vLen);
+      used += vLen;
+      id[used++] = ';';
+      id[used] = '\0';
+    }
+  }
+}
+
+// Merge two objects key by key, values of the new object win
+static US pubMergeObject(const char *pOld, US oldLen, const char *pNew, US newLen, char *out, US size)
+{
+  US pos = 1, kStart, kLen, vStart, vLen, nvStart, nvLen;
+  US used = 0;
+
+  out[used++] = '{';
+  // Old keys, updated with new values
+  while( pubNextPair(pOld, oldLen, pos, kStart, kLen, vStart, vLen) ) {
+    const char *pSrc = pOld;
+    if( pubFindKey(pNew, newLen, pOld + kStart, kLen, nvStart, nvLen) ) {
+      pSrc = pNew;
+      vStart = nvStart;
+      vLen = nvLen;
+    }
+    if( used + kLen + vLen + 5 >= size ) return 0;
+    if( used > 1 ) out[used++] = ',';
+    out[used++] = '\'';
+    memcpy(out + used, pOld + kStart, kLen); used += kLen;
+    out[used++] = '\'';
+    out[used++] = ':';
+    memcpy(out + used, pSrc + vStart, vLen); used += vLen;
+  }
+  // Keys only in the new object
+  pos = 1;
+  while( pubNextPair(pNew, newLen, pos, kStart, kLen, vStart, vLen) ) {
+    if( pubFindKey(pOld, oldLen, pNew + kStart, kLen, nvStart, nvLen) ) continue;
+    if( used + kLen + vLen + 5 >= size ) return 0;
+    if( used > 1 ) out[used++] = ',';
+    out[used++] = '\'';
+    memcpy(out + used, pNew + kStart, kLen); used += kLen;
+    out[used++] = '\'';
+    out[used++] = ':';
+    memcpy(out + used, pNew + vStart, vLen); used += vLen;
+  }
+  out[used++] = '}';
+  out[used] = '\0';
+  return used;
+}
+
+static UC pubPriority(UC topic)
+{
+  switch( topic ) {
+  case CLT_ID_Alarm:        return PUB_PRI_ALARM;
+  case CLT_ID_DeviceStatus:
+  case CLT_ID_DeviceConfig: return PUB_PRI_STATUS;
+  case CLT_ID_SensorData:   return PUB_PRI_SENSOR;
+  default:                  return PUB_PRI_LOG;
+  }
+}
+
+static US pubTopicTTL(UC topic)
+{
+  switch( topic ) {
+  case CLT_ID_Alarm:        return CLT_TTL_Alarm;
+  case CLT_ID_SensorData:   return CLT_TTL_SensorData;
+  case CLT_ID_DeviceStatus: return CLT_TTL_DeviceStatus;
+  case CLT_ID_DeviceConfig: return CLT_TTL_DeviceConfig;
+  default:                  return CLT_TTL_LOGMSG;
+  }
+}
+
+static const char *pubTopicName(UC topic)
+{
+  switch( topic ) {
+  case CLT_ID_Alarm:        return CLT_NAME_Alarm;
+  case CLT_ID_SensorData:   return CLT_NAME_SensorData;
+  case CLT_ID_DeviceStatus: return CLT_NAME_DeviceStatus;
+  case CLT_ID_DeviceConfig: return CLT_NAME_DeviceConfig;
+  default:                  return CLT_NAME_LOGMSG;
+  }
+}
+
+// Alarms are delivered one by one, logs are plain text
+static bool pubCanPack(UC topic)
+{
+  return( topic == CLT_ID_SensorData || topic == CLT_ID_DeviceStatus || topic == CLT_ID_DeviceConfig );
+}
+
+//------------------------------------------------------------------
+// Xlight Cloud Publisher Class
+//------------------------------------------------------------------
+CloudPublisherClass::CloudPublisherClass()
+{
+  m_sink = NULL;
+  m_online = NULL;
+  m_seq = 0;
+  m_tokens = RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST;
+  m_tickRefill = 0;
+  m_nQueued = 0;
+  m_nMerged = 0;
+  m_nDropped = 0;
+  m_nPublished = 0;
+  m_nFailed = 0;
+  m_nReplayed = 0;
+  Clear();
+}
+
+// Redirect events to another sink instead of Particle cloud, NULL to restore.
+// The sink is always online unless online() says otherwise
+void CloudPublisherClass::SetSink(PubSink_t sink, PubOnline_t online)
+{
+  m_sink = sink;
+  m_online = online;
+}
+
+BOOL CloudPublisherClass::IsOnline()
+{
+  if( m_sink ) return(!m_online || m_online());
+  return(!theConfig.GetDisableWiFi() && Particle.connected());
+}
+
+BOOL CloudPublisherClass::InitJournal(UL addr, UL size)
+{
+  return InitJournal(theConfig.getP1Flash(), addr, size);
+}
+
+// Offline journal on flash, pDevice is NULL to disable it
+BOOL CloudPublisherClass::InitJournal(Flashee::FlashDevice *pDevice, UL addr, UL size)
+{
+  return m_journal.Init(pDevice, addr, size);
+}
+
+void CloudPublisherClass::Clear()
+{
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    m_packets[i].topic = 0;
+  }
+}
+
+UC CloudPublisherClass::GetPending()
+{
+  UC count = 0;
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    if( m_packets[i].topic ) count++;
+  }
+  return count;
+}
+
+// Queue an event for publishing
+BOOL CloudPublisherClass::Enqueue(UC topic, const char *msg, US ttl)
+{
+  if( !msg ) return false;
+  if( theConfig.GetDisableWiFi() && !m_sink ) return true;
+
+  US len = strlen(msg);
+  m_nQueued++;
+
+  // Store and forward, logs are kept by the flash log already
+  if( m_journal.IsReady() && topic != CLT_ID_LOGMSG && !IsOnline() ) {
+    if( topic == CLT_ID_SensorData && JournalReadings(msg, len) ) return true;
+    if( len <= JNL_MAX_PAYLOAD && m_journal.Append(Time.now(), topic, 0, msg, len) ) return true;
+  }
+
+  if( pubCanPack(topic) && len > 2 && len <= PUB_MAX_PACK_LEN && msg[0] == '{' && msg[len - 1] == '}' ) {
+    if( !MergeObject(topic, msg, len, ttl) ) {
+      if( !AppendObject(topic, msg, len, ttl) ) return false;
+    }
+  } else {
+    PubPacket_t *pkt = NewPacket(topic, pubPriority(topic));
+    if( !pkt ) return false;
+    if( len > PUB_MAX_DATA_LEN ) len = PUB_MAX_DATA_LEN;
+    memcpy(pkt->data, msg, len);
+    pkt->data[len] = '\0';
+    pkt->len = len;
+    pkt->ttl = ttl;
+  }
+  return true;
+}
+
+// Find pending object with the same identity and merge new values into it
+BOOL CloudPublisherClass::MergeObject(UC topic, const char *obj, US len, US ttl)
+{
+  char newID[32], oldID[32];
+  char merged[PUB_MAX_DATA_LEN + 1];
+  US pos, end, mLen;
+
+  pubIdentity(obj, len, newID, sizeof(newID));
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    PubPacket_t *pkt = &m_packets[i];
+    if( pkt->topic != topic || pkt->items == 0 ) continue;
+
+    pos = 0;
+    while( pos < pkt->len ) {
+      end = pubSkipValue(pkt->data, pos, pkt->len);
+      pubIdentity(pkt->data + pos, end - pos, oldID, sizeof(oldID));
+      if( strcmp(oldID, newID) == 0 ) {
+        mLen = pubMergeObject(pkt->data + pos, end - pos, obj, len, merged, sizeof(merged));
+        if( mLen == 0 || mLen > PUB_MAX_PACK_LEN ) {
+          // Can't merge, replace it
+          memcpy(merged, obj, len);
+          mLen = len;
+        }
+        if( pkt->len - (end - pos) + mLen <= PUB_MAX_PACK_LEN ) {
+          // Update in place
+          memmove(pkt->data + pos + mLen, pkt->data + end, pkt->len - end + 1);
+          memcpy(pkt->data + pos, merged, mLen);
+          pkt->len = pkt->len - (end - pos) + mLen;
+          if( pkt->ttl < ttl ) pkt->ttl = ttl;
+        } else {
+          // Remove the old one and append the merged object
+          if( end < pkt->len ) end++;               // with trailing ','
+          else if( pos > 0 ) pos--;                 // or leading ','
+          memmove(pkt->data + pos, pkt->data + end, pkt->len - end + 1);
+          pkt->len -= (end - pos);
+          if( --pkt->items == 0 ) pkt->topic = 0;
+          if( !AppendObject(topic, merged, mLen, ttl) ) return true;
+        }
+        m_nMerged++;
+        return true;
+      }
+      pos = end + 1;
+    }
+  }
+  return false;
+}
+
+// Pack object into a pending event of the same topic, or start a new one.
+// The event keeps the longest ttl of its objects
+BOOL CloudPublisherClass::AppendObject(UC topic, const char *obj, US len, US ttl)
+{
+  PubPacket_t *pkt = NULL;
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    if( m_packets[i].topic == topic && m_packets[i].items > 0 &&
+        m_packets[i].len + len + 1 <= PUB_MAX_PACK_LEN ) {
+      pkt = &m_packets[i];
+      break;
+    }
+  }
+
+  if( pkt ) {
+    pkt->data[pkt->len++] = ',';
+    m_nMerged++;
+  } else {
+    pkt = NewPacket(topic, pubPriority(topic));
+    if( !pkt ) return false;
+  }
+  memcpy(pkt->data + pkt->len, obj, len);
+  pkt->len += len;
+  pkt->data[pkt->len] = '\0';
+  pkt->items++;
+  if( pkt->ttl < ttl ) pkt->ttl = ttl;
+  return true;
+}
+
+// Get a free packet, evict the oldest lowest-priority one if full
+PubPacket_t *CloudPublisherClass::NewPacket(UC topic, UC priority)
+{
+  PubPacket_t *pkt = NULL;
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    if( m_packets[i].topic == 0 ) {
+      pkt = &m_packets[i];
+      break;
+    }
+    if( !pkt || m_packets[i].priority > pkt->priority ||
+        (m_packets[i].priority == pkt->priority && m_packets[i].seq < pkt->seq) ) {
+      pkt = &m_packets[i];
+    }
+  }
+
+  if( pkt->topic ) {
+    if( pkt->priority < priority ) {
+      // Everything queued is more important
+      m_nDropped++;
+      return NULL;
+    }
+    m_nDropped += (pkt->items > 0 ? pkt->items : 1);
+  }
+
+  pkt->topic = topic;
+  pkt->priority = priority;
+  pkt->items = 0;
+  pkt->len = 0;
+  pkt->ttl = 0;
+  pkt->seq = ++m_seq;
+  pkt->data[0] = '\0';
+  return pkt;
+}
+
+void CloudPublisherClass::RefillTokens()
+{
+  UL now = millis();
+  UL elapsed = now - m_tickRefill;
+  m_tickRefill = now;
+  if( elapsed > RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST ) elapsed = RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST;
+  m_tokens += elapsed;
+  if( m_tokens > RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST ) m_tokens = RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST;
+}
+
+// Publish the most important pending event if a token is available
+void CloudPublisherClass::Process()
+{
+  RefillTokens();
+  if( m_tokens < RTE_PUB_TOKEN_INTERVAL ) return;
+  if( !IsOnline() ) return;
+
+  PubPacket_t *pkt = NULL;
+  for( UC i = 0; i < MQ_MAX_CLOUD_PUB; i++ ) {
+    if( m_packets[i].topic == 0 ) continue;
+    if( !pkt || m_packets[i].priority < pkt->priority ||
+        (m_packets[i].priority == pkt->priority && m_packets[i].seq < pkt->seq) ) {
+      pkt = &m_packets[i];
+    }
+  }
+  if( !pkt ) {
+    Replay();
+    return;
+  }
+
+  const char *pData = pkt->data;
+  char buffer[PUB_MAX_DATA_LEN + 1];
+  if( pkt->items > 1 ) {
+    buffer[0] = '[';
+    memcpy(buffer + 1, pkt->data, pkt->len);
+    buffer[pkt->len + 1] = ']';
+    buffer[pkt->len + 2] = '\0';
+    pData = buffer;
+  }
+
+  if( Send(pkt->topic, pData, pkt->ttl) ) {
+    m_nPublished++;
+    pkt->topic = 0;
+  }
+}
+
+BOOL CloudPublisherClass::Send(UC topic, const char *data, US ttl)
+{
+  BOOL rc;
+  if( m_sink ) {
+    rc = m_sink(pubTopicName(topic), data, ttl);
+  } else {
+    rc = Particle.publish(pubTopicName(topic), data, ttl, PRIVATE);
+  }
+  m_tokens -= RTE_PUB_TOKEN_INTERVAL;
+
+  // Keep it and try again later
+  if( !rc ) m_nFailed++;
+  return rc;
+}
+
+// Journal a sensor data object in binary, false if it has keys other than readings
+BOOL CloudPublisherClass::JournalReadings(const char *msg, US len)
+{
+  JournalReading_t readings[JNL_MAX_READINGS];
+  US pos = 1, kStart, kLen, vStart, vLen;
+  UC count = 0;
+  int node = -1;
+
+  if( len < 2 || msg[0] != '{' || msg[len - 1] != '}' ) return false;
+  while( pubNextPair(msg, len, pos, kStart, kLen, vStart, vLen) ) {
+    if( kLen == 2 && strncmp(msg + kStart, "nd", 2) == 0 ) {
+      node = atoi(msg + vStart);
+      continue;
+    }
+    if( count >= JNL_MAX_READINGS ) return false;
+    readings[count].key = OfflineJournalClass::GetKeyIndex(msg + kStart, kLen);
+    if( readings[count].key == JNL_KEY_NONE ) return false;
+    readings[count++].value = atof(msg + vStart);
+  }
+  if( node < 0 || node > 255 || count == 0 ) return false;
+  return m_journal.Append(Time.now(), JNL_TYPE_READING, node, readings, count * sizeof(JournalReading_t));
+}
+
+// Replay journaled events, keep one token for live events
+void CloudPublisherClass::Replay()
+{
+  if( !m_journal.IsReady() || m_journal.GetPending() == 0 ) return;
+  if( m_tokens < RTE_PUB_TOKEN_INTERVAL * 2 ) return;
+
+  char buffer[PUB_MAX_DATA_LEN + 1];
+  UC topic;
+  US len;
+  UC items = m_journal.NextBatch(topic, buffer + 1, PUB_MAX_PACK_LEN, len);
+  if( items == 0 ) return;
+  if( len == 0 ) {
+    // Unreadable record
+    m_journal.Consume();
+    return;
+  }
+
+  const char *pData = buffer + 1;
+  if( items > 1 ) {
+    buffer[0] = '[';
+    buffer[len + 1] = ']';
+    buffer[len + 2] = '\0';
+    pData = buffer;
+  }
+  if( Send(topic, pData, pubTopicTTL(topic)) ) {
+    m_journal.Consume();
+    m_nReplayed += items;
+  }
+}
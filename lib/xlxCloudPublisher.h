@@ -0,0 +1,91 @@
+//  xlxCloudPublisher.h - Xlight cloud publish queue with priority and rate control
+
+#ifndef xlxCloudPublisher_h
+#define xlxCloudPublisher_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+#include "xlxOfflineJournal.h"
+
+// Publish priority classes, lower value goes first
+#define PUB_PRI_ALARM           0
+#define PUB_PRI_STATUS          1
+#define PUB_PRI_SENSOR          2
+#define PUB_PRI_LOG             3
+
+// Maximum data length of one cloud event
+#define PUB_MAX_DATA_LEN        255
+
+typedef struct
+{
+  UC topic;                         // CLT_ID_*, 0 means free slot
+  UC priority;                      // PUB_PRI_*
+  UC items;                         // Number of JSON objects in data
+  US len;                           // Length of data
+  US ttl;
+  UL seq;                           // Enqueue order
+  char data[PUB_MAX_DATA_LEN + 1];  // Objects separated by ',', or a plain text
+} PubPacket_t;
+
+// Publish sink, returns true if the event was accepted
+typedef bool (*PubSink_t)(const char *topic, const char *data, int ttl);
+// Connection state of the sink
+typedef bool (*PubOnline_t)();
+
+//------------------------------------------------------------------
+// Xlight Cloud Publisher Class
+//------------------------------------------------------------------
+class CloudPublisherClass
+{
+public:
+  CloudPublisherClass();
+
+  BOOL Enqueue(UC topic, const char *msg, US ttl);
+  void Process();
+  void SetSink(PubSink_t sink, PubOnline_t online = NULL);
+  void Clear();
+  BOOL IsOnline();
+
+  BOOL InitJournal(UL addr, UL size);
+  BOOL InitJournal(Flashee::FlashDevice *pDevice, UL addr, UL size);
+  OfflineJournalClass &GetJournal() { return m_journal; }
+
+  UC GetPending();
+  UL GetQueued() { return m_nQueued; }
+  UL GetPublished() { return m_nPublished; }
+  UL GetMerged() { return m_nMerged; }
+  UL GetDropped() { return m_nDropped; }
+  UL GetFailed() { return m_nFailed; }
+  UL GetReplayed() { return m_nReplayed; }
+
+private:
+  PubPacket_t m_packets[MQ_MAX_CLOUD_PUB];
+  PubSink_t m_sink;
+  PubOnline_t m_online;
+  OfflineJournalClass m_journal;
+  UL m_seq;
+  US m_tokens;                      // in ms, RTE_PUB_TOKEN_INTERVAL per event
+  UL m_tickRefill;
+
+  UL m_nQueued;
+  UL m_nMerged;
+  UL m_nDropped;
+  UL m_nPublished;
+  UL m_nFailed;
+  UL m_nReplayed;
+
+  BOOL MergeObject(UC topic, const char *obj, US len, US ttl);
+  BOOL AppendObject(UC topic, const char *obj, US len, US ttl);
+  PubPacket_t *NewPacket(UC topic, UC priority);
+  void RefillTokens();
+  BOOL Send(UC topic, const char *data, US ttl);
+  BOOL JournalReadings(const char *msg, US len);
+  void Replay();
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern CloudPublisherClass thePublisher;
+
+#endif /* xlxCloudPublisher_h */
@@ -26,6 +26,10 @@
  * 2. Use EEPROM class (high level API) to access the emulated EEPROM.
  * 3. Use spark-flashee-eeprom (low level 3rd party API) to access P1 external Flash.
  * 4. Please refer to xliMemoryMap.h for memory allocation.
+ * 5. Schedule, rule and scenario rows are written back in batches: dirty rows
+ *    are tracked in a bitmap and flushed with one rewrite per touched page.
+ * 6. On P1 these rows are appended to a record log (xlxRecordLog.cpp) instead,
+ *    rows in the old in-place tables are moved into it once.
  *
  * ToDo:
  * 1. Move default config values to header as global #define's
@@ -34,6 +38,7 @@
 **/
 
 #include "xlxConfig.h"
+#include "xlxTableReader.h"
 #include "xliPinMap.h"
 #include "xlxLogger.h"
 #include "xliMemoryMap.h"
@@ -109,35 +114,93 @@ bool NodeListClass::loadList()
 	return bEEPROMLoadRet;
 }
 
-bool NodeListClass::saveList()
-{
-	if( m_isChanged ) {
-		m_isChanged = false;
-		/*
-		for(int i = 0; i < count(); i++) {
-			int offset = MEM_NODELIST_OFFSET + i * sizeof(NodeIdRow_t);
-			if( offset > MEM_NODELIST_OFFSET + MEM_NODELIST_LEN - sizeof(NodeIdRow_t) ) break;
-			EEPROM.put(offset, _pItems[i]);
-		}*/
-		NodeIdRow_t lv_buf[MAX_NODE_PER_CONTROLLER];
-		memset(lv_buf, 0x00, sizeof(lv_buf));
-		memcpy(lv_buf, _pItems, sizeof(NodeIdRow_t) * count());
-		EEPROM.put(MEM_NODELIST_OFFSET, lv_buf);
-		uint8_t attemps = 0;
-		while(++attemps <=3 )
-		{
-			if(theConfig.getP1Flash()->write<NodeIdRow_t[MAX_NODE_PER_CONTROLLER]>(lv_buf, MEM_NODELIST_BACKUP_OFFSET))
-			{
-				Serial.println("write nodelist backup success!");
-				break;
-			}
-			else
-			{
-				Serial.println("write nodelist backup failed!");
-			}
+void NodeListClass::markDirty(const UC _first, const UC _last)
+{
+	for( UC i = _first; i <= _last && i < NODELIST_MAX_ROWS; i++ ) {
+		m_dirty[i / 8] |= BITMASK(i % 8);
+	}
+	m_isChanged = true;
+}
 
+// Keep-alive only moves recentActive, which is saved lazily
+int NodeListClass::update(NodeIdRow_t *_pT)
+{
+	int pos = search(_pT);
+	if( pos >= 0 ) {
+		NodeIdRow_t lv_Node = _pItems[pos];
+		lv_Node.recentActive = _pT->recentActive;
+		if( memcmp(&lv_Node, _pT, sizeof(NodeIdRow_t)) != 0 ) {
+			markDirty(pos, pos);
+		} else if( _pItems[pos].recentActive != _pT->recentActive && pos < NODELIST_MAX_ROWS ) {
+			m_activeDirty[pos / 8] |= BITMASK(pos % 8);
+			m_isChanged = true;
 		}
-		theConfig.SetNumNodes(count());
+		_pItems[pos] = *_pT;
+	}
+	return pos;
+}
+
+// Rows after the inserted one move down
+int NodeListClass::add(NodeIdRow_t *_pT)
+{
+	UC lv_count = _count;
+	int pos = OrderdList<NodeIdRow_t>::add(_pT);
+	if( pos >= 0 ) markDirty(pos, _count > lv_count ? _count - 1 : pos);
+	return pos;
+}
+
+// Rows after the removed one move up, the old last row is cleared
+bool NodeListClass::remove(NodeIdRow_t *_pT)
+{
+	int pos = search(_pT);
+	if( !OrderdList<NodeIdRow_t>::remove(_pT) ) return false;
+	markDirty(pos, _count);
+	return true;
+}
+
+bool NodeListClass::isActiveDue()
+{
+	return(millis() - m_tmActive >= NODELIST_ACTIVE_DELAY);
+}
+
+// Mark rows to save in the cache, only rows marked by a change are taken
+UC NodeListClass::markRows(RowWriteBackClass &_cache, const bool _active)
+{
+	UC lv_rows = 0;
+	for( UC i = 0; i < _cache.GetRows(); i++ ) {
+		if( BITTEST(m_dirty[i / 8], i % 8) || (_active && BITTEST(m_activeDirty[i / 8], i % 8)) ) {
+			if( _cache.MarkDirty(i) ) lv_rows++;
+		}
+	}
+	return lv_rows;
+}
+
+// Rows are in the caches now, only timestamps not due remain
+void NodeListClass::clearDirty(const bool _active)
+{
+	memset(m_dirty, 0x00, sizeof(m_dirty));
+	if( _active ) {
+		memset(m_activeDirty, 0x00, sizeof(m_activeDirty));
+		m_tmActive = millis();
+	}
+	m_isChanged = false;
+	for( UC i = 0; i < sizeof(m_activeDirty); i++ ) {
+		if( m_activeDirty[i] ) m_isChanged = true;
+	}
+}
+
+// Write the rows marked in the cache, rows beyond the list are cleared
+bool NodeListClass::flushRows(RowWriteBackClass &_cache)
+{
+	NodeIdRow_t lv_blank;
+	memset(&lv_blank, 0x00, sizeof(NodeIdRow_t));
+	while( _cache.LoadNextPage() ) {
+		for( UC i = 0; i < _cache.GetRows(); i++ ) {
+			if( _cache.InPage(i) && _cache.IsDirty(i) ) {
+				_cache.PutRow(i, i < _count ? &_pItems[i] : &lv_blank);
+			}
+		}
+		if( !_cache.CommitPage() ) return false;
 	}
 	return true;
 }
@@ -352,12 +415,185 @@ BOOL NodeListClass::clearNodeId(UC nodeID)
 	return true;
 }
 
+//------------------------------------------------------------------
+// Table Write-back Class
+//------------------------------------------------------------------
+UC RowWriteBackClass::m_pageBuf[WB_BUFFER_SIZE];
+
+RowWriteBackClass::RowWriteBackClass()
+{
+	Init(NULL, 0, 0, 0);
+}
+
+void RowWriteBackClass::Init(Flashee::FlashDevice *pDevice, UL _base, US _rowSize, UC _rows)
+{
+	m_pDevice = pDevice;
+	m_pLog = NULL;
+	m_logType = 0;
+	m_base = _base;
+	m_rowSize = _rowSize;
+	m_rows = min(_rows, WB_MAX_ROWS);
+	memset(m_dirty, 0x00, sizeof(m_dirty));
+	memset(m_put, 0x00, sizeof(m_put));
+	m_tmDirty = 0;
+	m_pageFirst = m_pageLast = 0;
+	m_nRows = m_nPages = m_nFailed = 0;
+}
+
+// Rows are appended to the record log, no page rewrite at all
+void RowWriteBackClass::InitLog(RecordLogClass *pLog, UC _type, US _rowSize, UC _rows)
+{
+	Init(NULL, 0, _rowSize, _rows);
+	m_pLog = pLog;
+	m_logType = _type;
+}
+
+// Page index of an address; the emulated EEPROM and record log are handled as one page
+UL RowWriteBackClass::GetPage(const UL _addr)
+{
+	if( !m_pDevice ) return 0;
+	return _addr / m_pDevice->pageSize();
+}
+
+BOOL RowWriteBackClass::MarkDirty(const UC _row)
+{
+	if( _row >= m_rows ) return false;
+	if( GetDirtyCount() == 0 ) m_tmDirty = millis();
+	m_dirty[_row / 8] |= BITMASK(_row % 8);
+	return true;
+}
+
+BOOL RowWriteBackClass::IsDirty(const UC _row)
+{
+	if( _row >= m_rows ) return false;
+	return BITTEST(m_dirty[_row / 8], _row % 8);
+}
+
+UC RowWriteBackClass::GetDirtyCount()
+{
+	UC _count = 0;
+	for( UC _row = 0; _row < m_rows; _row++ ) {
+		if( IsDirty(_row) ) _count++;
+	}
+	return _count;
+}
+
+// Pending rows are written back once the oldest one reaches the deadline
+BOOL RowWriteBackClass::IsDue(const BOOL _force)
+{
+	if( GetDirtyCount() == 0 ) return false;
+	return(_force || millis() - m_tmDirty >= WB_FLUSH_DELAY);
+}
+
+// Read the row span of the first pages holding dirty rows into the buffer
+BOOL RowWriteBackClass::LoadNextPage()
+{
+	UC _row;
+	for( _row = 0; _row < m_rows; _row++ ) {
+		if( IsDirty(_row) ) break;
+	}
+	if( _row >= m_rows ) return false;
+
+	// Extend the span over dirty rows starting in a page it already touches,
+	/// so a row across the page boundary doesn't cost another rewrite
+	m_pageFirst = m_pageLast = _row;
+	memset(m_put, 0x00, sizeof(m_put));
+	for( _row++; _row < m_rows; _row++ ) {
+		if( GetPage(m_base + _row * m_rowSize) > GetPage(m_base + (m_pageLast + 1) * m_rowSize - 1) ) break;
+		if( (_row - m_pageFirst + 1) * m_rowSize > WB_BUFFER_SIZE ) break;
+		if( IsDirty(_row) ) m_pageLast = _row;
+	}
+
+	// Record log only takes the rows put
+	if( m_pLog ) return true;
+
+	// Clean rows inside the span keep their current content
+	UL _addr = m_base + m_pageFirst * m_rowSize;
+	UL _len = (m_pageLast - m_pageFirst + 1) * m_rowSize;
+	if( m_pDevice ) {
+		if( !m_pDevice->read(m_pageBuf, _addr, _len) ) {
+			m_nFailed++;
+			return false;
+		}
+	} else {
+		for( UL i = 0; i < _len; i++ ) m_pageBuf[i] = EEPROM.read(_addr + i);
+	}
+	return true;
+}
+
+BOOL RowWriteBackClass::InPage(const UC _row)
+{
+	return(_row >= m_pageFirst && _row <= m_pageLast);
+}
+
+BOOL RowWriteBackClass::PutRow(const UC _row, const void *_data)
+{
+	if( !InPage(_row) ) return false;
+	memcpy(m_pageBuf + (_row - m_pageFirst) * m_rowSize, _data, m_rowSize);
+	m_put[_row / 8] |= BITMASK(_row % 8);
+	return true;
+}
+
+// Write the buffered span back with a single page rewrite
+BOOL RowWriteBackClass::CommitPage()
+{
+	UL _addr = m_base + m_pageFirst * m_rowSize;
+	UL _len = (m_pageLast - m_pageFirst + 1) * m_rowSize;
+	if( m_pLog ) {
+		for( UC _row = m_pageFirst; _row <= m_pageLast; _row++ ) {
+			if( !IsDirty(_row) || !BITTEST(m_put[_row / 8], _row % 8) ) continue;
+			if( !m_pLog->Append(m_logType, _row, m_pageBuf + (_row - m_pageFirst) * m_rowSize, m_rowSize) ) {
+				m_nFailed++;
+				return false;
+			}
+			m_dirty[_row / 8] &= ~BITMASK(_row % 8);
+			m_nRows++;
+		}
+		// Rows gone from the chain have nothing to write
+		for( UC _row = m_pageFirst; _row <= m_pageLast; _row++ ) {
+			m_dirty[_row / 8] &= ~BITMASK(_row % 8);
+		}
+		return true;
+	} else if( m_pDevice ) {
+		if( !m_pDevice->write(m_pageBuf, _addr, _len) ) {
+			m_nFailed++;
+			return false;
+		}
+	} else {
+		for( UL i = 0; i < _len; i++ ) {
+			if( EEPROM.read(_addr + i) != m_pageBuf[i] ) EEPROM.write(_addr + i, m_pageBuf[i]);
+		}
+	}
+
+	for( UC _row = m_pageFirst; _row <= m_pageLast; _row++ ) {
+		if( IsDirty(_row) ) {
+			m_dirty[_row / 8] &= ~BITMASK(_row % 8);
+			m_nRows++;
+		}
+	}
+	m_nPages += GetPage(_addr + _len - 1) - GetPage(_addr) + 1;
+	return true;
+}
+
+void RowWriteBackClass::showStatus(const char *_name)
+{
+	SERIAL_LN("%s: %d of %d rows pending, %lu rows in %lu page writes, %lu failed",
+			_name, GetDirtyCount(), m_rows, m_nRows, m_nPages, m_nFailed);
+}
+
 //------------------------------------------------------------------
 // Xlight Config Class
 //------------------------------------------------------------------
 ConfigClass::ConfigClass()
 {
 	P1Flash = Devices::createWearLevelErase();
+	m_sctCache.Init(NULL, MEM_SCHEDULE_OFFSET, SCT_ROW_SIZE, MAX_SCT_ROWS);
+#ifdef MCU_TYPE_P1
+	m_rtCache.Init(P1Flash, MEM_RULES_OFFSET, RT_ROW_SIZE, MAX_RT_ROWS);
+	m_sntCache.Init(P1Flash, MEM_SCENARIOS_OFFSET, SNT_ROW_SIZE, MAX_SNT_ROWS);
+#endif
+	m_nlCache.Init(NULL, MEM_NODELIST_OFFSET, sizeof(NodeIdRow_t), MAX_NODE_PER_CONTROLLER);
+	m_nlBackup.Init(P1Flash, MEM_NODELIST_BACKUP_OFFSET, sizeof(NodeIdRow_t), MAX_NODE_PER_CONTROLLER);
 
   m_isLoaded = false;
   m_isChanged = false;
@@ -416,6 +652,26 @@ void ConfigClass::InitConfig()
 	for(UC _btn = 0; _btn < MAX_NUM_BUTTONS; _btn++ ) {
 		SetExtBtnAction(_btn, 0, DEVICE_SW_TOGGLE, 0x01 << _btn);
 	}
+	InitSensorFilters();
+}
+
+// Default sensor filters: deadband (0.1 unit or 0.1%), min interval (s), heartbeat (min)
+/// Binary sensors and smoke report every change
+void ConfigClass::InitSensorFilters()
+{
+	memset(m_config.srFilter, 0x00, sizeof(m_config.srFilter));
+	SetSensorFilter(sensorDHT, 2, false, 10, 10);				// 0.2 degree
+	SetSensorFilter(sensorDHT_h, 10, false, 10, 10);		// 1%
+	SetSensorFilter(sensorALS, 30, false, 2, 10);
+	SetSensorFilter(sensorMIC, 30, false, 5, 10);				// 3dB
+	SetSensorFilter(sensorGAS, 50, true, 5, 10);				// 5%
+	SetSensorFilter(sensorSMOKE, 0, false, 0, 10);
+	SetSensorFilter(sensorDUST, 50, true, 10, 10);
+	SetSensorFilter(sensorPM25, 50, true, 10, 10);
+	SetSensorFilter(sensorPM10, 50, true, 10, 10);
+	SetSensorFilter(sensorTVOC, 50, true, 10, 10);
+	SetSensorFilter(sensorCH2O, 50, true, 10, 10);
+	SetSensorFilter(sensorCO2, 500, false, 10, 10);			// 50ppm
 }
 
 BOOL ConfigClass::InitDevStatus(UC nodeID)
@@ -449,24 +705,110 @@ BOOL ConfigClass::InitDevStatus(UC nodeID)
 	return theSys.DevStatus_table.add(first_row);
 }
 
-BOOL ConfigClass::MemWriteScenarioRow(ScenarioRow_t row, uint32_t address)
+BOOL ConfigClass::MemWriteScenarioRow(ScenarioRow_t row, UC uid)
 {
 #ifdef MCU_TYPE_P1
-	return P1Flash->write<ScenarioRow_t>(row, address);
+	return m_recLog.Append(RECLOG_TYPE_SCENARIO, uid, &row, SNT_ROW_SIZE);
 #else
 	return false;
 #endif
 }
 
-BOOL ConfigClass::MemReadScenarioRow(ScenarioRow_t &row, uint32_t address)
+BOOL ConfigClass::MemReadScenarioRow(ScenarioRow_t &row, UC uid)
 {
 #ifdef MCU_TYPE_P1
-	return P1Flash->read<ScenarioRow_t>(row, address);
+	return m_recLog.Read(RECLOG_TYPE_SCENARIO, uid, &row, SNT_ROW_SIZE);
 #else
 	return false;
 #endif
 }
 
+BOOL ConfigClass::MemReadScheduleRow(ScheduleRow_t &row, UC uid)
+{
+#ifdef MCU_TYPE_P1
+	return m_recLog.Read(RECLOG_TYPE_SCHEDULE, uid, &row, SCT_ROW_SIZE);
+#else
+	EEPROM.get(MEM_SCHEDULE_OFFSET + uid*SCT_ROW_SIZE, row);
+	return true;
+#endif
+}
+
+// Rules, scenarios and schedules are kept in the record log on P1 flash
+BOOL ConfigClass::LoadRecordLog()
+{
+#ifdef MCU_TYPE_P1
+	if( !m_recLog.Init(P1Flash, MEM_RECLOG_OFFSET, MEM_RECLOG_LEN) ) {
+		LOGE(LOGTAG_MSG, "Failed to read the record log from flash.");
+		return false;
+	}
+	if( !m_recLog.IsFormatted() ) {
+		// First boot with the record log, take over rows saved in place
+		if( !m_recLog.Format() ) {
+			LOGE(LOGTAG_MSG, "Failed to format the record log.");
+			return false;
+		}
+		ImportLegacyTables();
+	}
+	m_sctCache.InitLog(&m_recLog, RECLOG_TYPE_SCHEDULE, SCT_ROW_SIZE, MAX_SCT_ROWS);
+	m_rtCache.InitLog(&m_recLog, RECLOG_TYPE_RULE, RT_ROW_SIZE, MAX_RT_ROWS);
+	m_sntCache.InitLog(&m_recLog, RECLOG_TYPE_SCENARIO, SNT_ROW_SIZE, MAX_SNT_ROWS);
+#endif
+	return true;
+}
+
+// Copy rows from the in-place tables of earlier versions into the record log
+void ConfigClass::ImportLegacyTables()
+{
+#ifdef MCU_TYPE_P1
+	ScheduleRow_t lv_sct;
+	RuleRow_t lv_rt;
+	ScenarioRow_t lv_snt;
+	UC lv_count = 0;
+
+	for( UC i = 0; i < MAX_SCT_ROWS; i++ ) {
+		EEPROM.get(MEM_SCHEDULE_OFFSET + i*SCT_ROW_SIZE, lv_sct);
+		if( lv_sct.op_flag == POST && lv_sct.flash_flag == SAVED && lv_sct.run_flag == EXECUTED && lv_sct.uid == i ) {
+			if( m_recLog.Append(RECLOG_TYPE_SCHEDULE, i, &lv_sct, SCT_ROW_SIZE) ) lv_count++;
+		}
+	}
+	TableReaderClass lv_rtReader(P1Flash, MEM_RULES_OFFSET, RT_ROW_SIZE * MAX_RT_ROWS);
+	for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+		if( !lv_rtReader.Read(lv_rt) ) break;
+		if( lv_rt.op_flag == POST && lv_rt.flash_flag == SAVED && lv_rt.run_flag == EXECUTED && lv_rt.uid == i ) {
+			if( m_recLog.Append(RECLOG_TYPE_RULE, i, &lv_rt, RT_ROW_SIZE) ) lv_count++;
+		}
+	}
+	TableReaderClass lv_sntReader(P1Flash, MEM_SCENARIOS_OFFSET, SNT_ROW_SIZE * MAX_SNT_ROWS);
+	for( UC i = 0; i < MAX_SNT_ROWS; i++ ) {
+		if( !lv_sntReader.Read(lv_snt) ) break;
+		if( lv_snt.op_flag == POST && lv_snt.flash_flag == SAVED && lv_snt.run_flag == EXECUTED && lv_snt.uid == i ) {
+			if( m_recLog.Append(RECLOG_TYPE_SCENARIO, i, &lv_snt, SNT_ROW_SIZE) ) lv_count++;
+		}
+	}
+	LOGI(LOGTAG_MSG, "%d table rows moved into the record log.", lv_count);
+#endif
+}
+
+// Rule rows of earlier versions never set sr_aggr, sr_window or sr_id_hi, whatever is in these bits is garbage
+UC ConfigClass::ClearLegacyRuleBits(RecordLogClass &_log, UC _version)
+{
+	RuleRow_t lv_row;
+	UC lv_count = 0;
+	BOOL lv_changed;
+
+	for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+		if( !_log.Read(RECLOG_TYPE_RULE, i, &lv_row, RT_ROW_SIZE) ) continue;
+		lv_changed = false;
+		if( _version < VERSION_RULE_AGGR && ClearRuleAggregation(&lv_row) ) lv_changed = true;
+		if( _version < VERSION_RULE_SRID && ClearRuleSensorHigh(&lv_row) ) lv_changed = true;
+		if( lv_changed ) {
+			if( _log.Append(RECLOG_TYPE_RULE, i, &lv_row, RT_ROW_SIZE) ) lv_count++;
+		}
+	}
+	LOGI(LOGTAG_MSG, "%d rule rows of an earlier version cleared.", lv_count);
+	return lv_count;
+}
+
 BOOL ConfigClass::IsValidConfig()
 {
 	LOGW(LOGTAG_MSG, "v=%d,typeMainDevice=%d,maindev=%d",m_config.version,m_config.typeMainDevice, m_config.mainDevID);
@@ -492,11 +834,26 @@ BOOL ConfigClass::IsValidConfig()
 
 BOOL ConfigClass::LoadConfig()
 {
+  UC lv_version = VERSION_CONFIG_DATA;
+
   // Load System Configuration
   if( sizeof(Config_t) <= MEM_CONFIG_LEN )
   {
-    EEPROM.get(MEM_CONFIG_OFFSET, m_config);
-    if(!IsValidConfig())
+    BOOL lv_inSlot = false;
+#ifdef MCU_TYPE_P1
+    // Newest A/B slot, earlier versions kept it in EEPROM with a backup on flash
+    m_cfgSlots.Init(P1Flash, MEM_CONFIG_SLOTS_OFFSET, MEM_CONFIG_SLOTS_LEN);
+    lv_inSlot = m_cfgSlots.Load(&m_config, sizeof(Config_t)) && IsValidConfig();
+    if( !lv_inSlot ) EEPROM.get(MEM_CONFIG_OFFSET, m_config);
+#else
+    m_cfgSlots.Init(NULL, MEM_CONFIG_OFFSET, MEM_CONFIG_LEN);
+    m_cfgSlots.Load(&m_config, sizeof(Config_t));
+#endif
+    if( lv_inSlot )
+    {
+      LOGW(LOGTAG_MSG, "Sysconfig loaded from slot %d.", m_cfgSlots.GetActive());
+    }
+    else if(!IsValidConfig())
     {
 	  LOGW(LOGTAG_MSG, "Sysconfig is empty, load backup config from flash.");
 	  LoadBackupConfig();
@@ -514,11 +871,18 @@ BOOL ConfigClass::LoadConfig()
     }
     else
     {
-			m_config.version = VERSION_CONFIG_DATA;
       LOGW(LOGTAG_MSG, "Sysconfig loaded.");
     }
     m_isLoaded = true;
-    m_isChanged = false;
+    // Not in a slot yet
+    m_isChanged = !m_cfgSlots.IsValid();
+		// Initialize fields appended in later versions
+		lv_version = m_config.version;
+		if( m_config.version < 28 ) {
+			InitSensorFilters();
+			m_isChanged = true;
+		}
+		m_config.version = VERSION_CONFIG_DATA;
 		UpdateTimeZone();
   } else {
     LOGE(LOGTAG_MSG, "Failed to load Sysconfig, too large.");
@@ -530,6 +894,13 @@ BOOL ConfigClass::LoadConfig()
 	// We don't load Schedule Table directly
 	// We don't load Scenario Table directly
 
+	// Open the record log of rules, scenarios and schedules
+	LoadRecordLog();
+	if( lv_version < VERSION_RULE_SRID ) {
+		ClearLegacyRuleBits(m_recLog, lv_version);
+		m_isChanged = true;
+	}
+
 	// Load Rules
 	LoadRuleTable();
 
@@ -539,38 +910,35 @@ BOOL ConfigClass::LoadConfig()
   return m_isLoaded;
 }
 
-BOOL ConfigClass::SaveConfig()
+BOOL ConfigClass::SaveConfig(const BOOL _force)
 {
 	// Check changes on Panel
 	SetBrightIndicator(thePanel.GetDimmerValue());
 
+  // Setters may flag a change without changing any field, then nothing is written
   if( m_isChanged )
   {
-    EEPROM.put(MEM_CONFIG_OFFSET, m_config);
-    m_isChanged = false;
-    LOGI(LOGTAG_MSG, "Sysconfig saved.");
-	uint8_t attemps = 0;
-	while(++attemps <=3 )
+    BOOL lv_dirty = m_cfgSlots.IsChanged(&m_config, sizeof(Config_t));
+    if( m_cfgSlots.Save(&m_config, sizeof(Config_t)) )
     {
-		if(SaveBackupConfig())
-			break;
+      m_isChanged = false;
+      if( lv_dirty ) LOGI(LOGTAG_MSG, "Sysconfig saved to slot %d.", m_cfgSlots.GetActive());
+    }
+    else
+    {
+      // Retry on next tick
+      LOGE(LOGTAG_MSG, "Failed to save Sysconfig.");
     }
   }
 
 	// Save Device Status
 	SaveDeviceStatus();
 
-	// Save Schedule Table
-	SaveScheduleTable();
-
-	// Save Rule Table
-	SaveRuleTable();
-
-	// Save Scenario Table
-	SaveScenarioTable();
+	// Save Schedule, Rule and Scenario Tables
+	FlushTables(_force);
 
 	// Save NodeID List
-	SaveNodeIDList();
+	SaveNodeIDList(_force);
 
   return true;
 }
@@ -1010,7 +1378,6 @@ BOOL ConfigClass::SetRemoteNodeDevice(UC remoteID, US devID)
 			if( lv_Node.device != devID ) {
 				lv_Node.device = devID % 256;
 				lstNodes.update(&lv_Node);
-				lstNodes.m_isChanged = true;
 			}
 			// Notify Remote Node anyway
 			return theRadio.SendNodeConfig(remoteID, NCF_DEV_ASSOCIATE, devID);
@@ -1465,6 +1832,44 @@ void ConfigClass::showButtonActions()
 	}
 }
 
+const SensorFilter_t *ConfigClass::GetSensorFilter(const UC _sr)
+{
+	if( _sr < MAX_SENSOR_TYPES ) {
+		return &(m_config.srFilter[_sr]);
+	}
+	return NULL;
+}
+
+BOOL ConfigClass::SetSensorFilter(const UC _sr, const US _deadband, const BOOL _relative, const UC _interval, const UC _heartbeat)
+{
+	if( _sr < MAX_SENSOR_TYPES && _deadband <= 0x7FFF ) {
+		SensorFilter_t *pFilter = &(m_config.srFilter[_sr]);
+		if( pFilter->deadband != _deadband || pFilter->relative != _relative ||
+				pFilter->minInterval != _interval || pFilter->heartbeat != _heartbeat ) {
+			pFilter->deadband = _deadband;
+			pFilter->relative = _relative;
+			pFilter->minInterval = _interval;
+			pFilter->heartbeat = _heartbeat;
+			m_isChanged = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ConfigClass::showSensorFilters()
+{
+	SERIAL_LN("\n\r**Sensor Filters**");
+	for( UC _sr = 0; _sr < MAX_SENSOR_TYPES; _sr++ ) {
+		const SensorFilter_t *pFilter = &(m_config.srFilter[_sr]);
+		if( pFilter->deadband > 0 || pFilter->minInterval > 0 || pFilter->heartbeat > 0 ) {
+			SERIAL_LN("sr%d: deadband %d%s, interval %ds, heartbeat %dm", _sr,
+					pFilter->deadband, pFilter->relative ? "(0.1%)" : "(0.1)",
+					pFilter->minInterval, pFilter->heartbeat);
+		}
+	}
+}
+
 // Load Device Status
 BOOL ConfigClass::LoadDeviceStatus()
 {
@@ -1530,47 +1935,33 @@ BOOL ConfigClass::LoadBackupConfig()
 BOOL ConfigClass::LoadBackupNodeList()
 {
 #ifdef MCU_TYPE_P1
-	NodeIdRow_t NodeArray[MAX_NODE_PER_CONTROLLER];
-	if (sizeof(NodeIdRow_t)*MAX_NODE_PER_CONTROLLER <= MEM_NODELIST_BACKUP_LEN)
+	NodeIdRow_t lv_node;
+	TableReaderClass lv_reader(P1Flash, MEM_NODELIST_BACKUP_OFFSET, MEM_NODELIST_BACKUP_LEN);
+	for (int i = 0; i < theConfig.GetNumNodes(); i++) //read row by row, no copy of whole list
 	{
-		if (P1Flash->read<NodeIdRow_t[MAX_NODE_PER_CONTROLLER]>(NodeArray, MEM_NODELIST_BACKUP_OFFSET))
+		if (!lv_reader.Read(lv_node))
 		{
-			for (int i = 0; i < theConfig.GetNumNodes(); i++) //interate through RuleArray for non-empty rows
-			{
-					if (lstNodes.add(&NodeArray[i]) < 0)
-					{
-						LOGW(LOGTAG_MSG, "Backup node row %d failed to load from flash", i);
-						return false;
-					}
-					else
-					{
-						LOGW(LOGTAG_MSG, "Backup node row %d success to load from flash-nodeid=%d", i,NodeArray[i].nid);
-					}
-			}
+			LOGW(LOGTAG_MSG, "Failed to read the backup node list from flash.");
+			return false;
 		}
-		else
+		if (lstNodes.add(&lv_node) < 0)
 		{
-			LOGW(LOGTAG_MSG, "Failed to read the backup node list from flash.");
+			LOGW(LOGTAG_MSG, "Backup node row %d failed to load from flash", i);
 			return false;
 		}
-	}
-	else
-	{
-		LOGW(LOGTAG_MSG, "Failed to load backup node list, too large.");
-		return false;
+		else
+		{
+			LOGW(LOGTAG_MSG, "Backup node row %d success to load from flash-nodeid=%d", i, lv_node.nid);
+		}
 	}
 #endif
 
 	return true;
 }
 
-BOOL ConfigClass::SaveBackupConfig()
+void ConfigClass::showConfigSlots()
 {
-#ifdef MCU_TYPE_P1
-	return P1Flash->write<Config_t>(m_config, MEM_CONFIG_BACKUP_OFFSET);
-#else
-	return false;
-#endif
+	m_cfgSlots.showStatus();
 }
 
 // Save Device Status
@@ -1632,29 +2023,45 @@ BOOL ConfigClass::SaveDeviceStatus()
 	}
 }
 
-// Save Schedule Table
-BOOL ConfigClass::SaveScheduleTable()
+// Mark unsaved rows dirty and write them back once due, one rewrite per touched page
+template<typename T>
+BOOL ConfigClass::FlushTableRows(ChainClass<T> &_table, RowWriteBackClass &_cache, const BOOL _force)
 {
-  if( m_isSCTChanged )
-  {
-	  bool success_flag = true;
+	bool success_flag = true;
+	ListNode<T> *rowptr;
 
-	  ListNode<ScheduleRow_t> *rowptr = theSys.Schedule_table.getRoot();
-	  while (rowptr != NULL)
-	  {
-		  if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED)
-		  {
-			  ScheduleRow_t tmpRow = rowptr->data; //copy of data to write to flash
+	for( rowptr = _table.getRoot(); rowptr != NULL; rowptr = rowptr->next )
+	{
+		if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED)
+		{
+			if( _cache.GetRows() == 0 ) {
+				// No storage for this table on the MCU
+				rowptr->data.flash_flag = SAVED;
+			} else if( !_cache.MarkDirty(rowptr->data.uid) ) {
+				LOGE(LOGTAG_MSG, "Error, cannot write row %d to flash, out of memory bounds", rowptr->data.uid);
+				success_flag = false;
+			}
+		}
+	}
+
+	if( !_cache.IsDue(_force) ) return success_flag;
+
+	while( _cache.LoadNextPage() )
+	{
+		for( rowptr = _table.getRoot(); rowptr != NULL; rowptr = rowptr->next )
+		{
+			if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED && _cache.InPage(rowptr->data.uid))
+			{
+				T tmpRow = rowptr->data; //copy of data to write to flash
 
-			  switch (rowptr->data.op_flag)
-			  {
+				switch (rowptr->data.op_flag)
+				{
 				case DELETE:
-					//change flags to 000 to indicate flash row is empty
+					//change flags to indicate flash row is empty
 					tmpRow.op_flag = GET;
 					tmpRow.flash_flag = UNSAVED;
 					tmpRow.run_flag = UNEXECUTED;
 					break;
-
 				case PUT:
 				case POST:
 				case GET:
@@ -1663,30 +2070,39 @@ BOOL ConfigClass::SaveScheduleTable()
 					tmpRow.flash_flag = SAVED;
 					tmpRow.run_flag = EXECUTED;
 					break;
-			  }
-
-			  //write tmpRow to flash
-			  int row_index = rowptr->data.uid;
-			  if (row_index < MAX_SCT_ROWS)
-			  {
-				  EEPROM.put(MEM_SCHEDULE_OFFSET + row_index*SCT_ROW_SIZE, tmpRow); //write to flash
-
-				  rowptr->data.flash_flag = SAVED; //toggle flash flag
-			  }
-			  else
-			  {
-				  LOGE(LOGTAG_MSG, "Error, cannot write Schedule row %d to flash, out of memory bounds", row_index);
-				  success_flag = false;
-			  }
-		  }
-		  rowptr = rowptr->next;
-	  }
+				}
+				_cache.PutRow(rowptr->data.uid, &tmpRow);
+			}
+		}
+
+		if( !_cache.CommitPage() ) {
+			success_flag = false;
+			break;
+		}
+
+		// toggle flash flag of rows written back
+		for( rowptr = _table.getRoot(); rowptr != NULL; rowptr = rowptr->next )
+		{
+			if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED && _cache.InPage(rowptr->data.uid))
+				rowptr->data.flash_flag = SAVED;
+		}
+	}
+
+	return success_flag;
+}
 
-	  if (success_flag)
+// Save Schedule Table
+BOOL ConfigClass::SaveScheduleTable(const BOOL _force)
+{
+  if( m_isSCTChanged )
+  {
+	  if( FlushTableRows(theSys.Schedule_table, m_sctCache, _force) )
 	  {
-		  m_isSCTChanged = false;
-		  LOGD(LOGTAG_MSG, "Schedule table saved.");
-			return true;
+		  if( m_sctCache.GetDirtyCount() == 0 ) {
+			  m_isSCTChanged = false;
+			  LOGD(LOGTAG_MSG, "Schedule table saved.");
+			  return true;
+		  }
 	  }
 	  else
 	  {
@@ -1698,60 +2114,17 @@ BOOL ConfigClass::SaveScheduleTable()
 }
 
 // Save Scenario Table
-BOOL ConfigClass::SaveScenarioTable()
+BOOL ConfigClass::SaveScenarioTable(const BOOL _force)
 {
   if (m_isSNTChanged)
   {
-	  bool success_flag = true;
-
-	  ListNode<ScenarioRow_t> *rowptr = theSys.Scenario_table.getRoot();
-	  while (rowptr != NULL)
+	  if( FlushTableRows(theSys.Scenario_table, m_sntCache, _force) )
 	  {
-		  if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED)
-		  {
-			  ScenarioRow_t tmpRow = rowptr->data; //copy of data to write to p1
-
-			  switch (rowptr->data.op_flag)
-			  {
-			  case DELETE:
-				  //change flags to indicate flash row is empty
-				  tmpRow.op_flag = GET;
-				  tmpRow.flash_flag = UNSAVED;
-				  tmpRow.run_flag = UNEXECUTED;
-				  break;
-			  case PUT:
-			  case POST:
-			  case GET:
-				  //change flags to 111 to indicate flash row is occupied
-				  tmpRow.op_flag = POST;
-				  tmpRow.flash_flag = SAVED;
-				  tmpRow.run_flag = EXECUTED;
-				  break;
-			  }
-
-			  //write tmpRow to p1
-			  int row_index = rowptr->data.uid;
-			  if (row_index < MAX_SNT_ROWS)
-			  {
-#ifdef MCU_TYPE_P1
-				  P1Flash->write<ScenarioRow_t>(tmpRow, MEM_SCENARIOS_OFFSET + row_index*SNT_ROW_SIZE);
-#endif
-				  rowptr->data.flash_flag = SAVED; //toggle flash flag
-			  }
-			  else
-			  {
-				  LOGE(LOGTAG_MSG, "Error, cannot write Scenario row %d to flash, out of memory bounds", row_index);
-				  success_flag = false;
-			  }
+		  if( m_sntCache.GetDirtyCount() == 0 ) {
+			  m_isSNTChanged = false;
+			  LOGD(LOGTAG_MSG, "Scenario table saved.");
+			  return true;
 		  }
-		  rowptr = rowptr->next;
-	  }
-
-	  if (success_flag)
-	  {
-		  m_isSNTChanged = false;
-		  LOGD(LOGTAG_MSG, "Scenario table saved.");
-			return true;
 	  }
 	  else
 	  {
@@ -1766,103 +2139,48 @@ BOOL ConfigClass::SaveScenarioTable()
 BOOL ConfigClass::LoadRuleTable()
 {
 #ifdef MCU_TYPE_P1
-	RuleRow_t RuleArray[MAX_RT_ROWS];
-	if (RT_ROW_SIZE*MAX_RT_ROWS <= MEM_RULES_LEN)
+	RuleRow_t lv_row;
+	for (int i = 0; i < MAX_RT_ROWS; i++)
 	{
-		if (P1Flash->read<RuleRow_t[MAX_RT_ROWS]>(RuleArray, MEM_RULES_OFFSET))
+		// Rows never saved are not in the record log
+		if (!m_recLog.Read(RECLOG_TYPE_RULE, i, &lv_row, RT_ROW_SIZE)) continue;
+
+		if (lv_row.op_flag == POST
+			&& lv_row.flash_flag == SAVED
+			&& lv_row.run_flag == EXECUTED
+			&& lv_row.uid == i)
 		{
-			for (int i = 0; i < MAX_RT_ROWS; i++) //interate through RuleArray for non-empty rows
+			//change flags to be written into working memory chain
+			lv_row.op_flag = POST;
+			lv_row.run_flag = UNEXECUTED;
+			lv_row.flash_flag = SAVED;		//Already know it exists in flash
+			lv_row.tmr_started = 0;
+			if (!theSys.Rule_table.add(lv_row)) //add non-empty row to working memory chain
 			{
-				if (RuleArray[i].op_flag == POST
-					&& RuleArray[i].flash_flag == SAVED
-					&& RuleArray[i].run_flag == EXECUTED
-					&& RuleArray[i].uid == i)
-				{
-					//change flags to be written into working memory chain
-					RuleArray[i].op_flag = POST;
-					RuleArray[i].run_flag = UNEXECUTED;
-					RuleArray[i].flash_flag = SAVED;		//Already know it exists in flash
-					RuleArray[i].tmr_started = 0;
-					if (!theSys.Rule_table.add(RuleArray[i])) //add non-empty row to working memory chain
-					{
-						LOGW(LOGTAG_MSG, "Rule row %d failed to load from flash", i);
-					}
-				}
-				//else: row is either empty or trash; do nothing
+				LOGW(LOGTAG_MSG, "Rule row %d failed to load from flash", i);
 			}
-			m_isRTChanged = false; //since we are not calling SaveConfig(), change flag to false again
 		}
-		else
-		{
-			LOGW(LOGTAG_MSG, "Failed to read the rule table from flash.");
-			return false;
-		}
-	}
-	else
-	{
-		LOGW(LOGTAG_MSG, "Failed to load rule table, too large.");
-		return false;
+		//else: row is either empty or trash; do nothing
 	}
+	theSys.UpdateSensorHistory();
+	m_isRTChanged = false; //since we are not calling SaveConfig(), change flag to false again
 #endif
 
 	return true;
 }
 
 // Save Rule Table
-BOOL ConfigClass::SaveRuleTable()
+BOOL ConfigClass::SaveRuleTable(const BOOL _force)
 {
 	if ( m_isRTChanged )
 	{
-		bool success_flag = true;
-
-		ListNode<RuleRow_t> *rowptr = theSys.Rule_table.getRoot();
-		while (rowptr != NULL)
+		if( FlushTableRows(theSys.Rule_table, m_rtCache, _force) )
 		{
-			if (rowptr->data.run_flag == EXECUTED && rowptr->data.flash_flag == UNSAVED)
-			{
-				RuleRow_t tmpRow = rowptr->data; //copy of data to write to p1
-
-				switch (rowptr->data.op_flag)
-				{
-				case DELETE:
-					//change flags to indicate flash row is empty
-					tmpRow.op_flag = GET;
-					tmpRow.flash_flag = UNSAVED;
-					tmpRow.run_flag = UNEXECUTED;
-					break;
-				case PUT:
-				case POST:
-				case GET:
-					//change flags to 111 to indicate flash row is occupied
-					tmpRow.op_flag = POST;
-					tmpRow.flash_flag = SAVED;
-					tmpRow.run_flag = EXECUTED;
-					break;
-				}
-
-				//write tmpRow to p1
-				int row_index = rowptr->data.uid;
-				if (row_index < MAX_RT_ROWS)
-				{
-	#ifdef MCU_TYPE_P1
-					P1Flash->write<RuleRow_t>(tmpRow, MEM_RULES_OFFSET + row_index*RT_ROW_SIZE);
-	#endif
-					rowptr->data.flash_flag = SAVED; //toggle flash flag
-				}
-				else
-				{
-					LOGE(LOGTAG_MSG, "Error, cannot write Schedule row %d to flash, out of memory bounds", row_index);
-					success_flag = false;
-				}
+			if( m_rtCache.GetDirtyCount() == 0 ) {
+				m_isRTChanged = false;
+				LOGD(LOGTAG_MSG, "Rule table saved.");
+				return true;
 			}
-			rowptr = rowptr->next;
-		}
-
-		if (success_flag)
-		{
-			m_isRTChanged = false;
-			LOGD(LOGTAG_MSG, "Rule table saved.");
-			return true;
 		}
 		else
 		{
@@ -1873,6 +2191,30 @@ BOOL ConfigClass::SaveRuleTable()
 	return false;
 }
 
+// Write back pending table rows, forced on restart
+BOOL ConfigClass::FlushTables(const BOOL _force)
+{
+	BOOL _saved = SaveScheduleTable(_force);
+	_saved |= SaveRuleTable(_force);
+	_saved |= SaveScenarioTable(_force);
+
+	// Prepare spare area and compact the record log in the background
+	m_recLog.Process();
+	return _saved;
+}
+
+void ConfigClass::showTableCache()
+{
+	m_sctCache.showStatus("Schedule");
+	m_rtCache.showStatus("Rule");
+	m_sntCache.showStatus("Scenario");
+	m_nlCache.showStatus("NodeList");
+#ifdef MCU_TYPE_P1
+	m_nlBackup.showStatus("NodeList backup");
+#endif
+	m_recLog.showStatus();
+}
+
 // Load NodeID List
 BOOL ConfigClass::LoadNodeIDList()
 {
@@ -1884,20 +2226,36 @@ BOOL ConfigClass::LoadNodeIDList()
 		rc = LoadBackupNodeList();
 	}
 	m_isChanged = true;
-	lstNodes.saveList();
+	// Sync EEPROM and backup, only rows that differ are written
+	lstNodes.markAll();
+	SaveNodeIDList(true);
 	return rc;
 }
 
 // Save NodeID List
-BOOL ConfigClass::SaveNodeIDList()
+BOOL ConfigClass::SaveNodeIDList(const BOOL _force)
 {
 	if( !IsNIDChanged() ) return true;
 
-	BOOL rc = lstNodes.saveList();
+	// Keep-alive timestamps are saved once per NODELIST_ACTIVE_DELAY
+	BOOL lv_active = _force || lstNodes.isActiveDue();
+	UC lv_rows = lstNodes.markRows(m_nlCache, lv_active);
+#ifdef MCU_TYPE_P1
+	lstNodes.markRows(m_nlBackup, lv_active);
+#endif
+	lstNodes.clearDirty(lv_active);
+
+	BOOL rc = lstNodes.flushRows(m_nlCache);
+#ifdef MCU_TYPE_P1
+	rc = lstNodes.flushRows(m_nlBackup) && rc;
+#endif
 	if( rc ) {
-		LOGI(LOGTAG_MSG, "NodeList saved.");
+		if( lv_rows > 0 ) LOGI(LOGTAG_MSG, "NodeList saved, %d rows.", lv_rows);
 	} else {
+		// Rows stay marked in the caches, retry on next tick
+		lstNodes.m_isChanged = true;
 		LOGW(LOGTAG_MSG, "Failed to save NodeList.");
 	}
+	SetNumNodes(lstNodes.count());
 	return rc;
 }
@@ -8,6 +8,8 @@
 #include "TimeAlarms.h"
 #include "OrderedList.h"
 #include "flashee-eeprom.h"
+#include "xlxRecordLog.h"
+#include "xlxConfigSlot.h"
 
 /*Note: if any of these structures are modified, the following print functions may need updating:
  - ConfigClass::print_config()
@@ -53,6 +55,15 @@ typedef struct
   UC keyMap;                                // Button Key Map: 8 bits for each button, one bit corresponds to one relay key
 } Button_Action_t;
 
+// Sensor data filter, applied before publishing and rule evaluation
+typedef struct
+{
+  US deadband                 :15;          // Minimum change to report, in 0.1 unit (or 0.1% if relative)
+  BOOL relative               :1;           // Deadband is relative to the last reported value
+  UC minInterval;                           // Minimum seconds between two reports
+  UC heartbeat;                             // Report anyway after n minutes, 0 to disable
+} SensorFilter_t;
+
 typedef struct
 #ifdef PACK
 	__attribute__((packed))
@@ -112,6 +123,7 @@ typedef struct
   UC asrSNT[MAX_ASR_SNT_ITEMS];
   HardKeyMap_t keyMap[MAX_KEY_MAP_ITEMS];
   Button_Action_t btnAction[MAX_NUM_BUTTONS][MAX_BTN_OP_TYPE];  // 0: press, 1: long press
+  SensorFilter_t srFilter[MAX_SENSOR_TYPES];  // Since version 28
 } Config_t;
 
 #else
@@ -269,14 +281,28 @@ typedef struct
 #endif
 {
 	UC enabled               : 1;    // Whether the condition is enabled
-  UC sr_scope              : 3;    // Sensor scope
+  UC sr_scope              : 2;    // Sensor scope
+  UC sr_id_hi              : 1;    // Sensor ID bit 4, use GetConditionSensor()
   UC symbol                : 4;    // Sensor logic symbols
   UC connector             : 2;    // Condition logic symbols
-	UC sr_id                 : 4;    // Sensor ID
+	UC sr_id                 : 4;    // Sensor ID bits 0-3
+  UC sr_aggr               : 2;    // Aggregation over rule window, SR_AGGR_*
   US sr_value1;
   US sr_value2;
 } Condition_t;
 
+// Sensor IDs go up to sensorCO2, more than sr_id holds
+inline UC GetConditionSensor(const Condition_t &_cond)
+{
+	return (_cond.sr_id | (_cond.sr_id_hi << 4));
+}
+
+inline void SetConditionSensor(Condition_t &_cond, UC _sr)
+{
+	_cond.sr_id = (_sr & 0x0F);
+	_cond.sr_id_hi = ((_sr >> 4) & 0x01);
+}
+
 typedef struct
 #ifdef PACK
 	__attribute__((packed))
@@ -293,6 +319,7 @@ typedef struct
   // Once rule triggered, whether repeatly check
   UC tmr_int               : 1; // Whether enable timer
   UC tmr_started           : 1; // Whether timer started
+  UC sr_window             : 2; // Aggregation window of conditions, SR_WIN_*
   US tmr_span;             // Timer span in minutes
   UL tmr_tic_start;        // Timer started tick
   // Other trigger conditions, e.g. sensor data
@@ -302,6 +329,35 @@ typedef struct
 #define RT_ROW_SIZE 	sizeof(RuleRow_t)
 #define MAX_RT_ROWS		64
 
+// Rules saved before this config version have random bits in sr_aggr and sr_window
+#define VERSION_RULE_AGGR		29
+
+// Latest value only, as rules were before aggregation; true if anything was changed
+inline BOOL ClearRuleAggregation(RuleRow_t *pRow)
+{
+	BOOL _changed = (pRow->sr_window != SR_WIN_5MIN);
+	pRow->sr_window = SR_WIN_5MIN;
+	for( UC _cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
+		if( pRow->actCond[_cond].sr_aggr != SR_AGGR_NONE ) _changed = true;
+		pRow->actCond[_cond].sr_aggr = SR_AGGR_NONE;
+	}
+	return _changed;
+}
+
+// sr_id_hi was the top bit of sr_scope before this config version
+#define VERSION_RULE_SRID		30
+
+// Sensor IDs below 16 only, as rules were before sr_id_hi; true if anything was changed
+inline BOOL ClearRuleSensorHigh(RuleRow_t *pRow)
+{
+	BOOL _changed = false;
+	for( UC _cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
+		if( pRow->actCond[_cond].sr_id_hi ) _changed = true;
+		pRow->actCond[_cond].sr_id_hi = 0;
+	}
+	return _changed;
+}
+
 //------------------------------------------------------------------
 // Xlight Scenerio Table Structures
 //------------------------------------------------------------------
@@ -350,13 +406,23 @@ typedef struct
 #define MAX_NCT_ROWS	    (int)(MEM_NODECONFIG_LEN / NCT_ROW_SIZE)
 
 // Node List Class
+/// Rows are saved one by one from a dirty bitmap. A change of recentActive alone
+/// only marks the row in a second bitmap, saved once per NODELIST_ACTIVE_DELAY
+#define NODELIST_MAX_ROWS           64
+#define NODELIST_ACTIVE_DELAY       3600000     // Keep-alive timestamps are saved hourly (ms)
+
+class RowWriteBackClass;
+
 class NodeListClass : public OrderdList<NodeIdRow_t>
 {
 public:
   bool m_isChanged;
 
   NodeListClass(uint8_t maxl = 64, bool desc = false, uint8_t initlen = 8) : OrderdList(maxl, desc, initlen) {
-    m_isChanged = false; };
+    m_isChanged = false;
+    memset(m_dirty, 0x00, sizeof(m_dirty));
+    memset(m_activeDirty, 0x00, sizeof(m_activeDirty));
+    m_tmActive = 0; };
   virtual int compare(NodeIdRow_t _first, NodeIdRow_t _second) {
     if( _first.nid > _second.nid ) {
       return 1;
@@ -369,16 +435,83 @@ public:
   int getMemSize();
   int getFlashSize();
   bool loadList();
-  bool saveList();
+  virtual int update(NodeIdRow_t *_pT);
+  virtual int add(NodeIdRow_t *_pT);
+  virtual bool remove(NodeIdRow_t *_pT);
+  bool isActiveDue();
+  void markAll() { markDirty(0, NODELIST_MAX_ROWS - 1); }
+  UC markRows(RowWriteBackClass &_cache, const bool _active);
+  void clearDirty(const bool _active);
+  bool flushRows(RowWriteBackClass &_cache);
   void showList(BOOL toCloud = false, UC nid = 0);
   void publishNode(NodeIdRow_t _node);
   UC requestNodeID(UC preferID, char type, uint64_t identity);
   BOOL clearNodeId(UC nodeID);
 
 protected:
+  UC m_dirty[NODELIST_MAX_ROWS / 8];          // Rows to save at next tick
+  UC m_activeDirty[NODELIST_MAX_ROWS / 8];    // Rows with only recentActive changed
+  UL m_tmActive;                              // When timestamps were last saved
+
+  void markDirty(const UC _first, const UC _last);
   UC getAvailableNodeId(UC preferID, UC defaultID, UC minID, UC maxID, uint64_t identity);
 };
 
+//------------------------------------------------------------------
+// Table Write-back Class: dirty row bitmap, one rewrite per flash page
+//------------------------------------------------------------------
+#define WB_MAX_ROWS             64
+#define WB_FLUSH_DELAY          5000        // Dirty rows are written back within this period (ms)
+#define WB_TABLE_SIZE(sz, n)    ((sz) * (n))
+#define WB_BUFFER_SIZE          (WB_TABLE_SIZE(RT_ROW_SIZE, MAX_RT_ROWS) > WB_TABLE_SIZE(SNT_ROW_SIZE, MAX_SNT_ROWS) ? \
+                                 WB_TABLE_SIZE(RT_ROW_SIZE, MAX_RT_ROWS) : WB_TABLE_SIZE(SNT_ROW_SIZE, MAX_SNT_ROWS))
+
+template <typename T> class ChainClass;
+
+class RowWriteBackClass
+{
+private:
+  Flashee::FlashDevice *m_pDevice;  // NULL for emulated EEPROM
+  RecordLogClass *m_pLog;           // Rows appended to record log instead
+  UC m_logType;
+  UL m_base;
+  US m_rowSize;
+  UC m_rows;
+  UC m_dirty[(WB_MAX_ROWS + 7) / 8];
+  UC m_put[(WB_MAX_ROWS + 7) / 8];   // Rows filled in the buffer
+  UL m_tmDirty;                     // When the oldest pending row was marked
+  UC m_pageFirst;                   // Row span of the page being rewritten
+  UC m_pageLast;
+  UL m_nRows;                       // Rows written back
+  UL m_nPages;                      // Page rewrites issued
+  UL m_nFailed;
+
+  static UC m_pageBuf[WB_BUFFER_SIZE];
+
+  UL GetPage(const UL _addr);
+
+public:
+  RowWriteBackClass();
+  void Init(Flashee::FlashDevice *pDevice, UL _base, US _rowSize, UC _rows);
+  void InitLog(RecordLogClass *pLog, UC _type, US _rowSize, UC _rows);
+  UC GetRows() { return m_rows; }
+  BOOL MarkDirty(const UC _row);
+  BOOL IsDirty(const UC _row);
+  UC GetDirtyCount();
+  BOOL IsDue(const BOOL _force = false);
+
+  // Flush: LoadNextPage(), PutRow() for pending rows InPage(), then CommitPage()
+  BOOL LoadNextPage();
+  BOOL InPage(const UC _row);
+  BOOL PutRow(const UC _row, const void *_data);
+  BOOL CommitPage();
+
+  UL GetRowWrites() { return m_nRows; }
+  UL GetPageWrites() { return m_nPages; }
+  UL GetFailed() { return m_nFailed; }
+  void showStatus(const char *_name);
+};
+
 //------------------------------------------------------------------
 // Xlight Configuration Class
 //------------------------------------------------------------------
@@ -395,42 +528,57 @@ private:
 
   Config_t m_config;
   Flashee::FlashDevice* P1Flash;
+  ConfigSlotClass m_cfgSlots;
+  RowWriteBackClass m_sctCache;
+  RowWriteBackClass m_rtCache;
+  RowWriteBackClass m_sntCache;
+  RowWriteBackClass m_nlCache;
+  RowWriteBackClass m_nlBackup;
+  RecordLogClass m_recLog;
 
   void UpdateTimeZone();
   void DoTimeSync();
+  BOOL LoadRecordLog();
+  void ImportLegacyTables();
+  template<typename T> BOOL FlushTableRows(ChainClass<T> &_table, RowWriteBackClass &_cache, const BOOL _force);
 
 public:
   ConfigClass();
   void InitConfig();
+  void InitSensorFilters();
   BOOL InitDevStatus(UC nodeID);
   Flashee::FlashDevice* getP1Flash()
   {
 	  return P1Flash;
   }
 
-  // write to P1 using spark-flashee-eeprom
-  BOOL MemWriteScenarioRow(ScenarioRow_t row, uint32_t address);
-  BOOL MemReadScenarioRow(ScenarioRow_t &row, uint32_t address);
+  // Rows in the record log on P1
+  BOOL MemWriteScenarioRow(ScenarioRow_t row, UC uid);
+  BOOL MemReadScenarioRow(ScenarioRow_t &row, UC uid);
+  BOOL MemReadScheduleRow(ScheduleRow_t &row, UC uid);
 
   BOOL LoadConfig();
-  BOOL SaveConfig();
+  BOOL SaveConfig(const BOOL _force = false);
   BOOL IsConfigLoaded();
   
   BOOL IsValidConfig();
   BOOL LoadBackupConfig();
-  BOOL SaveBackupConfig();
+  void showConfigSlots();
 
   BOOL LoadDeviceStatus();
   BOOL SaveDeviceStatus();
 
-  BOOL SaveScheduleTable();
-  BOOL SaveScenarioTable();
+  BOOL SaveScheduleTable(const BOOL _force = false);
+  BOOL SaveScenarioTable(const BOOL _force = false);
 
   BOOL LoadRuleTable();
-  BOOL SaveRuleTable();
+  BOOL SaveRuleTable(const BOOL _force = false);
+  UC ClearLegacyRuleBits(RecordLogClass &_log, UC _version);
+  BOOL FlushTables(const BOOL _force = false);
+  void showTableCache();
 
   BOOL LoadNodeIDList();
-  BOOL SaveNodeIDList();
+  BOOL SaveNodeIDList(const BOOL _force = false);
   BOOL LoadBackupNodeList();
 
   BOOL IsConfigChanged();
@@ -582,6 +730,10 @@ public:
   BOOL ExecuteBtnAction(const UC _btn, const UC _opt);
   void showButtonActions();
 
+  const SensorFilter_t *GetSensorFilter(const UC _sr);
+  BOOL SetSensorFilter(const UC _sr, const US _deadband, const BOOL _relative, const UC _interval, const UC _heartbeat);
+  void showSensorFilters();
+
   NodeListClass lstNodes;
   RemoteStatus_t m_stMainRemote;
 };
@@ -0,0 +1,181 @@
+/**
+ * xlxConfigSlot.cpp - Xlight A/B slots of the system configuration
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * The configuration image is kept in two slots, each in its own flash page.
+ * 1. Every slot has a head with generation and CRC32 over the image
+ * 2. At boot the valid slot with the highest generation is active
+ * 3. A save always goes to the inactive slot and is read back before the
+ *    slot becomes active, so power loss while saving leaves the last good
+ *    image untouched
+ * 4. A save whose image has the same CRC32 as the active one is skipped,
+ *    setters may flag a change without changing any field
+ * 5. Without a flash device there is only one copy in the emulated EEPROM,
+ *    and only bytes that differ are written
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxConfigSlot.h"
+
+UC ConfigSlotClass::m_slotBuf[sizeof(ConfigSlotHead_t) + CFGSLOT_MAX_DATA];
+
+//------------------------------------------------------------------
+// Xlight Config Slot Class
+//------------------------------------------------------------------
+ConfigSlotClass::ConfigSlotClass()
+{
+  m_pDevice = NULL;
+  m_base = 0;
+  m_slotSize = 0;
+  m_active = 0;
+  m_isValid = false;
+  m_generation = 0;
+  m_dataCRC = 0;
+  m_nWrites = 0;
+  m_nSkips = 0;
+  m_nFailed = 0;
+}
+
+// Find the newest valid slot, pDevice is NULL for the emulated EEPROM
+BOOL ConfigSlotClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  ConfigSlotHead_t *_head = (ConfigSlotHead_t *)m_slotBuf;
+
+  m_pDevice = pDevice;
+  m_base = _addr;
+  m_active = 0;
+  m_isValid = false;
+  m_generation = 0;
+  m_dataCRC = 0;
+  if( !m_pDevice ) {
+    m_slotSize = _size;
+    return true;
+  }
+
+  m_slotSize = _size / 2 / pDevice->pageSize() * pDevice->pageSize();
+  if( m_slotSize < sizeof(ConfigSlotHead_t) + CFGSLOT_MAX_DATA ) return false;
+
+  for( UC _slot = 0; _slot < 2; _slot++ ) {
+    if( !ReadSlot(_slot) ) continue;
+    if( !m_isValid || _head->generation > m_generation ) {
+      m_active = _slot;
+      m_isValid = true;
+      m_generation = _head->generation;
+      m_dataCRC = CRC32(m_slotBuf + sizeof(ConfigSlotHead_t), _head->len);
+    }
+  }
+  return true;
+}
+
+// Read a slot into the buffer, true if the head and CRC32 check out
+BOOL ConfigSlotClass::ReadSlot(const UC _slot)
+{
+  ConfigSlotHead_t *_head = (ConfigSlotHead_t *)m_slotBuf;
+  UC *_image = m_slotBuf + sizeof(ConfigSlotHead_t);
+
+  if( !m_pDevice->read(m_slotBuf, SlotAddr(_slot), sizeof(ConfigSlotHead_t)) ) return false;
+  if( _head->magic != CFGSLOT_MAGIC || _head->len > CFGSLOT_MAX_DATA ) return false;
+  if( !m_pDevice->read(_image, SlotAddr(_slot) + sizeof(ConfigSlotHead_t), _head->len) ) return false;
+  return(CRC32(&_head->generation, 8, CRC32(_image, _head->len)) == _head->crc);
+}
+
+// Copy the newest image, a shorter image from an earlier version leaves the tail of _data as is
+BOOL ConfigSlotClass::Load(void *_data, const US _len)
+{
+  ConfigSlotHead_t *_head = (ConfigSlotHead_t *)m_slotBuf;
+
+  if( !m_pDevice ) {
+    for( US i = 0; i < _len; i++ ) ((UC *)_data)[i] = EEPROM.read(m_base + i);
+    m_dataCRC = CRC32(_data, _len);
+    m_isValid = true;
+    return true;
+  }
+
+  if( !m_isValid ) return false;
+  // Fall back to the older slot if the active one went bad since Init()
+  for( UC i = 0; i < 2; i++ ) {
+    UC _slot = (i == 0 ? m_active : 1 - m_active);
+    if( !ReadSlot(_slot) ) continue;
+    memcpy(_data, m_slotBuf + sizeof(ConfigSlotHead_t), _head->len < _len ? _head->len : _len);
+    m_active = _slot;
+    m_generation = _head->generation;
+    m_dataCRC = CRC32(m_slotBuf + sizeof(ConfigSlotHead_t), _head->len);
+    return true;
+  }
+  m_isValid = false;
+  return false;
+}
+
+BOOL ConfigSlotClass::IsChanged(const void *_data, const US _len)
+{
+  return(!m_isValid || CRC32(_data, _len) != m_dataCRC);
+}
+
+// Write the image to the inactive slot, nothing is written if it has not changed
+BOOL ConfigSlotClass::Save(const void *_data, const US _len)
+{
+  ConfigSlotHead_t *_head = (ConfigSlotHead_t *)m_slotBuf;
+
+  if( _len > CFGSLOT_MAX_DATA ) {
+    m_nFailed++;
+    return false;
+  }
+  UL _crc = CRC32(_data, _len);
+  if( m_isValid && _crc == m_dataCRC ) {
+    m_nSkips++;
+    return true;
+  }
+
+  if( !m_pDevice ) {
+    for( US i = 0; i < _len; i++ ) {
+      if( EEPROM.read(m_base + i) != ((const UC *)_data)[i] ) EEPROM.write(m_base + i, ((const UC *)_data)[i]);
+    }
+  } else {
+    UC _slot = 1 - m_active;
+    _head->magic = CFGSLOT_MAGIC;
+    _head->generation = m_generation + 1;
+    _head->len = _len;
+    _head->crc = CRC32(&_head->generation, 8, _crc);
+    memcpy(m_slotBuf + sizeof(ConfigSlotHead_t), _data, _len);
+    // One page rewrite, then read back before the slot takes over
+    if( !m_pDevice->write(m_slotBuf, SlotAddr(_slot), sizeof(ConfigSlotHead_t) + _len)
+        || !ReadSlot(_slot) || _head->generation != m_generation + 1 ) {
+      m_nFailed++;
+      return false;
+    }
+    m_active = _slot;
+    m_generation++;
+  }
+  m_dataCRC = _crc;
+  m_isValid = true;
+  m_nWrites++;
+  return true;
+}
+
+void ConfigSlotClass::showStatus()
+{
+  if( m_pDevice ) {
+    SERIAL_LN("Config slots: slot %d gen %lu, %lu writes, %lu unchanged saves skipped, %lu failed",
+        m_active, m_generation, m_nWrites, m_nSkips, m_nFailed);
+  } else {
+    SERIAL_LN("Config in EEPROM: %lu writes, %lu unchanged saves skipped", m_nWrites, m_nSkips);
+  }
+}
@@ -0,0 +1,62 @@
+//  xlxConfigSlot.h - Xlight A/B slots of the system configuration
+
+#ifndef xlxConfigSlot_h
+#define xlxConfigSlot_h
+
+#include "xliCommon.h"
+#include "flashee-eeprom.h"
+
+#define CFGSLOT_MAGIC             0x47464358  // "XCFG"
+#define CFGSLOT_MAX_DATA          256         // Largest image, MEM_CONFIG_LEN
+
+// Slot head, the image follows
+typedef struct
+	__attribute__((packed))
+{
+  UL magic;
+  UL generation;                    // Newest valid slot wins
+  UL len;                           // Length of image
+  UL crc;                           // CRC32 over image, then generation and len
+} ConfigSlotHead_t;
+
+//------------------------------------------------------------------
+// Xlight Config Slot Class
+//------------------------------------------------------------------
+class ConfigSlotClass
+{
+public:
+  ConfigSlotClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL IsValid() { return m_isValid; }
+  BOOL Load(void *_data, const US _len);
+  BOOL IsChanged(const void *_data, const US _len);
+  BOOL Save(const void *_data, const US _len);
+
+  UC GetActive() { return m_active; }
+  UL GetGeneration() { return m_generation; }
+  UL GetWrites() { return m_nWrites; }
+  UL GetSkips() { return m_nSkips; }
+  UL GetFailed() { return m_nFailed; }
+  void showStatus();
+
+private:
+  Flashee::FlashDevice *m_pDevice;  // NULL: one copy in emulated EEPROM
+  UL m_base;
+  UL m_slotSize;
+  UC m_active;                      // Slot holding the newest image
+  BOOL m_isValid;
+  UL m_generation;
+  UL m_dataCRC;                     // CRC32 of the image last loaded or saved
+
+  UL m_nWrites;
+  UL m_nSkips;
+  UL m_nFailed;
+
+  static UC m_slotBuf[sizeof(ConfigSlotHead_t) + CFGSLOT_MAX_DATA];
+
+  UL SlotAddr(const UC _slot) { return(m_base + _slot * m_slotSize); }
+  BOOL ReadSlot(const UC _slot);
+};
+
+#endif /* xlxConfigSlot_h */
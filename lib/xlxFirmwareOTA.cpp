@@ -0,0 +1,432 @@
+/**
+ * xlxFirmwareOTA.cpp - Xlight firmware distribution to RF nodes
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * A node image is streamed to lamps and remotes in C_STREAM messages.
+ * 1. The image is staged in P1 flash behind an OTAImageHead_t, a session
+ *    starts with an announce (ST_FIRMWARE_CONFIG_RESPONSE) of type,
+ *    version, blocks and CRC32, the node replies with its first ack
+ * 2. Chunks (ST_FIRMWARE_RESPONSE) carry OTA_BLOCK_SIZE bytes and a CRC,
+ *    up to OTA_WINDOW chunks are in flight per session
+ * 3. The node acks (ST_FIRMWARE_REQUEST) with the first missing block and
+ *    a bitmap of blocks received after it. Blocks missing before a
+ *    received one are resent at once, others after OTA_TM_RETRY ms
+ * 4. Sessions to several nodes are served round robin, one frame per
+ *    OTA_TM_CHUNK ms and only while sendMQ is nearly empty, so commands
+ *    are not held behind chunks
+ * 5. The node checks the CRC32 of the whole image and acks blocks of
+ *    image as base when it is complete
+ * 6. The image is staged from cloud in chunks of up to OTA_STAGE_CHUNK
+ *    bytes, each with its CRC32. Chunks come in order, pages are erased as
+ *    they are reached, and the head is written once the CRC32 of the whole
+ *    image read back from flash matches
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxFirmwareOTA.h"
+#include "xliMemoryMap.h"
+#include "xlxLogger.h"
+#include "xlxRF24Server.h"
+
+//------------------------------------------------------------------
+// the one and only instance of FirmwareOTAClass
+FirmwareOTAClass theOTA;
+
+static bool SendFrame(MyMessage &_msg)
+{
+  if( theRadio.GetMQLength() >= OTA_MAX_MQ ) return false;
+  return theRadio.ProcessSend(&_msg);
+}
+
+FirmwareOTAClass::FirmwareOTAClass()
+{
+  m_pDevice = NULL;
+  m_addr = 0;
+  m_capacity = 0;
+  m_read = NULL;
+  m_send = SendFrame;
+  memset(&m_image, 0x00, sizeof(m_image));
+  m_blocks = 0;
+  m_isStaging = false;
+  memset(&m_stage, 0x00, sizeof(m_stage));
+  m_staged = 0;
+  memset(m_sessions, 0x00, sizeof(m_sessions));
+  m_rr = 0;
+  m_tmChunk = OTA_TM_CHUNK;
+  m_tmLast = 0;
+  m_nChunks = 0;
+  m_nResent = 0;
+  m_nDone = 0;
+  m_nFailed = 0;
+}
+
+// Image staged in flash, on whole logical pages of the area
+BOOL FirmwareOTAClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  m_pDevice = pDevice;
+  m_addr = 0;
+  m_capacity = 0;
+  m_read = NULL;
+  m_blocks = 0;
+  m_isStaging = false;
+  memset(&m_image, 0x00, sizeof(m_image));
+  if( !m_pDevice ) return false;
+
+  UL lv_end = FLASH_PAGE_FLOOR(_addr + _size, m_pDevice->pageSize());
+  m_addr = FLASH_PAGE_CEIL(_addr, m_pDevice->pageSize());
+  if( lv_end <= m_addr + sizeof(OTAImageHead_t) ) return false;
+  m_capacity = lv_end - m_addr - sizeof(OTAImageHead_t);
+
+  OTAImageHead_t lv_head;
+  if( !m_pDevice->read(&lv_head, m_addr, sizeof(lv_head)) ) return false;
+  if( lv_head.magic != OTA_IMAGE_MAGIC || lv_head.size == 0 || lv_head.size > m_capacity ) {
+    return false;
+  }
+  m_image = lv_head;
+  m_blocks = (m_image.size + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+  LOGI(LOGTAG_MSG, "OTA image type:%d ver:%d, %lu bytes", m_image.type, m_image.version, m_image.size);
+  return true;
+}
+
+// Image from another source, CRC is calculated here
+BOOL FirmwareOTAClass::SetImage(OTARead_t _read, const US _type, const US _version, const UL _size)
+{
+  m_read = _read;
+  m_isStaging = false;
+  m_image.magic = OTA_IMAGE_MAGIC;
+  m_image.type = _type;
+  m_image.version = _version;
+  m_image.size = _size;
+  m_image.crc = 0;
+  m_blocks = (_size + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+
+  UC lv_buf[OTA_BLOCK_SIZE];
+  UL lv_len;
+  for( US lv_block = 0; lv_block < m_blocks; lv_block++ ) {
+    if( !ReadBlock(lv_block, lv_buf) ) {
+      m_blocks = 0;
+      return false;
+    }
+    lv_len = min(_size - (UL)lv_block * OTA_BLOCK_SIZE, OTA_BLOCK_SIZE);
+    m_image.crc = CRC32(lv_buf, lv_len, m_image.crc);
+  }
+  return(m_blocks > 0);
+}
+
+// Drop the staged image and expect a new one of _size bytes with CRC32 _crc
+BOOL FirmwareOTAClass::BeginImage(const US _type, const US _version, const UL _size, const UL _crc)
+{
+  if( !m_pDevice || IsBusy() || _size == 0 || _size > m_capacity ) return false;
+
+  m_read = NULL;
+  m_blocks = 0;
+  memset(&m_image, 0x00, sizeof(m_image));
+  // Head stays blank until the image is complete
+  m_isStaging = false;
+  if( !m_pDevice->erasePage(m_addr) ) return false;
+  m_stage.magic = OTA_IMAGE_MAGIC;
+  m_stage.type = _type;
+  m_stage.version = _version;
+  m_stage.size = _size;
+  m_stage.crc = _crc;
+  m_staged = 0;
+  m_isStaging = true;
+  LOGI(LOGTAG_MSG, "OTA staging type:%d ver:%d, %lu bytes", _type, _version, _size);
+  return true;
+}
+
+// Write the chunk at _offset, chunks must come in order. _crc is CRC32 of the chunk
+BOOL FirmwareOTAClass::WriteImage(const UL _offset, const UC *_data, const US _len, const UL _crc)
+{
+  if( !m_isStaging || _offset != m_staged || _len == 0 || _len > OTA_STAGE_CHUNK ) return false;
+  if( _offset + _len > m_stage.size || CRC32(_data, _len) != _crc ) return false;
+
+  UL lv_pageSize = m_pDevice->pageSize();
+  UL lv_addr = m_addr + sizeof(OTAImageHead_t) + _offset;
+  US lv_done = 0;
+  US lv_part;
+  while( lv_done < _len ) {
+    // Erase each page as it is reached, the first one was erased with the head
+    if( lv_addr % lv_pageSize == 0 && !m_pDevice->erasePage(lv_addr) ) return false;
+    lv_part = min(_len - lv_done, lv_pageSize - lv_addr % lv_pageSize);
+    if( !m_pDevice->writePage(_data + lv_done, lv_addr, lv_part) ) return false;
+    lv_addr += lv_part;
+    lv_done += lv_part;
+  }
+  m_staged += _len;
+  if( m_staged < m_stage.size ) return true;
+
+  m_isStaging = false;
+  return CommitImage();
+}
+
+// Check the image read back and write the head, magic last
+BOOL FirmwareOTAClass::CommitImage()
+{
+  UC lv_buf[OTA_BLOCK_SIZE];
+  UL lv_crc = 0;
+  UL lv_len;
+  for( UL lv_offset = 0; lv_offset < m_stage.size; lv_offset += lv_len ) {
+    lv_len = min(m_stage.size - lv_offset, OTA_BLOCK_SIZE);
+    if( !m_pDevice->read(lv_buf, m_addr + sizeof(OTAImageHead_t) + lv_offset, lv_len) ) return false;
+    lv_crc = CRC32(lv_buf, lv_len, lv_crc);
+  }
+  if( lv_crc != m_stage.crc ) {
+    LOGW(LOGTAG_MSG, "OTA image CRC 0x%08lX, expected 0x%08lX", lv_crc, m_stage.crc);
+    return false;
+  }
+  if( !m_pDevice->writePage((UC *)&m_stage + sizeof(m_stage.magic), m_addr + sizeof(m_stage.magic), sizeof(m_stage) - sizeof(m_stage.magic)) ) return false;
+  if( !m_pDevice->writePage(&m_stage.magic, m_addr, sizeof(m_stage.magic)) ) return false;
+  m_image = m_stage;
+  m_blocks = (m_image.size + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+  LOGI(LOGTAG_MSG, "OTA image type:%d ver:%d, %lu bytes", m_image.type, m_image.version, m_image.size);
+  return true;
+}
+
+void FirmwareOTAClass::SetSender(OTASend_t _send)
+{
+  m_send = (_send ? _send : SendFrame);
+}
+
+US FirmwareOTAClass::ChunkCRC(const OTAChunk_t &_chunk)
+{
+  return (US)(CRC32(&_chunk, sizeof(_chunk) - sizeof(_chunk.crc)) & 0xFFFF);
+}
+
+OTASession_t *FirmwareOTAClass::GetSession(const UC _node)
+{
+  for( UC i = 0; i < OTA_MAX_SESSIONS; i++ ) {
+    if( m_sessions[i].node == _node ) return m_sessions + i;
+  }
+  return NULL;
+}
+
+BOOL FirmwareOTAClass::Start(const UC _node, const UL _now)
+{
+  if( !m_blocks ) {
+    LOGW(LOGTAG_MSG, "No OTA image");
+    return false;
+  }
+  if( _node == NODEID_GATEWAY || _node == BROADCAST_ADDRESS || IS_GROUP_NODEID(_node) ) return false;
+
+  OTASession_t *lv_pSession = GetSession(_node);
+  if( !lv_pSession ) {
+    // Free slot or a finished session
+    for( UC i = 0; i < OTA_MAX_SESSIONS && !lv_pSession; i++ ) {
+      if( m_sessions[i].state != OTA_ST_ANNOUNCE && m_sessions[i].state != OTA_ST_SENDING ) {
+        lv_pSession = m_sessions + i;
+      }
+    }
+    if( !lv_pSession ) {
+      LOGW(LOGTAG_MSG, "Too many OTA sessions, node:%d not started", _node);
+      return false;
+    }
+  }
+
+  memset(lv_pSession, 0x00, sizeof(OTASession_t));
+  lv_pSession->node = _node;
+  lv_pSession->state = OTA_ST_ANNOUNCE;
+  lv_pSession->tmAnnounce = _now - OTA_TM_RETRY;
+  lv_pSession->tmAck = _now;
+  lv_pSession->tmStart = _now;
+  LOGI(LOGTAG_MSG, "OTA to node:%d, %d blocks", _node, m_blocks);
+  return true;
+}
+
+void FirmwareOTAClass::Stop(const UC _node)
+{
+  OTASession_t *lv_pSession = GetSession(_node);
+  if( lv_pSession ) {
+    lv_pSession->node = 0;
+    lv_pSession->state = OTA_ST_IDLE;
+  }
+}
+
+BOOL FirmwareOTAClass::ReadBlock(const US _block, UC *_buf)
+{
+  UL lv_offset = (UL)_block * OTA_BLOCK_SIZE;
+  UC lv_len = min(m_image.size - lv_offset, OTA_BLOCK_SIZE);
+  memset(_buf + lv_len, 0xFF, OTA_BLOCK_SIZE - lv_len);
+  if( m_read ) return m_read(lv_offset, _buf, lv_len);
+  if( !m_pDevice ) return false;
+  return m_pDevice->read(_buf, m_addr + sizeof(OTAImageHead_t) + lv_offset, lv_len);
+}
+
+BOOL FirmwareOTAClass::SendAnnounce(OTASession_t *_pSession, const UL _now)
+{
+  OTAAnnounce_t lv_announce;
+  lv_announce.type = m_image.type;
+  lv_announce.version = m_image.version;
+  lv_announce.blocks = m_blocks;
+  lv_announce.crc = m_image.crc;
+
+  MyMessage lv_msg;
+  lv_msg.build(NODEID_GATEWAY, _pSession->node, 0, C_STREAM, ST_FIRMWARE_CONFIG_RESPONSE, false);
+  lv_msg.set((void *)&lv_announce, sizeof(lv_announce));
+  if( !m_send(lv_msg) ) return false;
+  _pSession->tmAnnounce = _now;
+  return true;
+}
+
+BOOL FirmwareOTAClass::SendChunk(OTASession_t *_pSession, const US _block, const UL _now)
+{
+  OTAChunk_t lv_chunk;
+  lv_chunk.block = _block;
+  if( !ReadBlock(_block, lv_chunk.data) ) return false;
+  lv_chunk.crc = ChunkCRC(lv_chunk);
+
+  MyMessage lv_msg;
+  lv_msg.build(NODEID_GATEWAY, _pSession->node, 0, C_STREAM, ST_FIRMWARE_RESPONSE, false);
+  lv_msg.set((void *)&lv_chunk, sizeof(lv_chunk));
+  if( !m_send(lv_msg) ) return false;
+  _pSession->tmSent[_block % OTA_WINDOW] = _now;
+  m_nChunks++;
+  return true;
+}
+
+// Send one frame of the session: a missing chunk, a timed out chunk or a new chunk
+BOOL FirmwareOTAClass::Serve(OTASession_t *_pSession, const UL _now)
+{
+  if( _pSession->state == OTA_ST_ANNOUNCE ) {
+    if( _now - _pSession->tmAnnounce < OTA_TM_RETRY ) return false;
+    return SendAnnounce(_pSession, _now);
+  }
+
+  US lv_block;
+  UL lv_bit;
+  for( UC i = 0; i < _pSession->next - _pSession->base; i++ ) {
+    lv_block = _pSession->base + i;
+    lv_bit = (1UL << i);
+    if( _pSession->acked & lv_bit ) continue;
+    if( (_pSession->nacked & lv_bit) || _now - _pSession->tmSent[lv_block % OTA_WINDOW] >= OTA_TM_RETRY ) {
+      if( !SendChunk(_pSession, lv_block, _now) ) return false;
+      _pSession->nacked &= ~lv_bit;
+      _pSession->nResent++;
+      m_nResent++;
+      return true;
+    }
+  }
+
+  if( _pSession->next < m_blocks && _pSession->next - _pSession->base < OTA_WINDOW ) {
+    if( !SendChunk(_pSession, _pSession->next, _now) ) return false;
+    _pSession->next++;
+    return true;
+  }
+  return false;
+}
+
+void FirmwareOTAClass::Process(const UL _now)
+{
+  if( _now - m_tmLast < m_tmChunk ) return;
+
+  OTASession_t *lv_pSession;
+  for( UC i = 0; i < OTA_MAX_SESSIONS; i++ ) {
+    lv_pSession = m_sessions + (m_rr + i) % OTA_MAX_SESSIONS;
+    if( !lv_pSession->node ) continue;
+    if( lv_pSession->state != OTA_ST_ANNOUNCE && lv_pSession->state != OTA_ST_SENDING ) continue;
+    if( _now - lv_pSession->tmAck >= OTA_TM_SILENCE ) {
+      lv_pSession->state = OTA_ST_FAILED;
+      lv_pSession->tmDone = _now;
+      m_nFailed++;
+      LOGW(LOGTAG_MSG, "OTA to node:%d failed at block %d", lv_pSession->node, lv_pSession->base);
+      continue;
+    }
+    if( Serve(lv_pSession, _now) ) {
+      m_tmLast = _now;
+      m_rr = (m_rr + i + 1) % OTA_MAX_SESSIONS;
+      return;
+    }
+  }
+}
+
+BOOL FirmwareOTAClass::GotAck(const UC _node, const OTAAck_t &_ack, const UL _now)
+{
+  OTASession_t *lv_pSession = GetSession(_node);
+  if( !lv_pSession ) return false;
+  if( lv_pSession->state == OTA_ST_ANNOUNCE ) {
+    // Node may resume from a block it already has
+    lv_pSession->state = OTA_ST_SENDING;
+    lv_pSession->base = min(_ack.base, m_blocks);
+    lv_pSession->next = lv_pSession->base;
+  } else if( lv_pSession->state != OTA_ST_SENDING ) {
+    return false;
+  }
+  lv_pSession->tmAck = _now;
+
+  // Stale ack
+  if( _ack.base < lv_pSession->base || _ack.base > lv_pSession->next ) return false;
+
+  UC lv_inFlight = lv_pSession->next - _ack.base;
+  UL lv_mask = (lv_inFlight >= 32 ? 0xFFFFFFFF : (1UL << lv_inFlight) - 1);
+  lv_pSession->base = _ack.base;
+  lv_pSession->acked = _ack.bitmap & lv_mask;
+  lv_pSession->nacked = 0;
+  // Blocks missing before the last received one are lost
+  for( UC i = 0; i < lv_inFlight; i++ ) {
+    if( (lv_pSession->acked >> i) == 0 ) break;
+    if( !(lv_pSession->acked & (1UL << i)) ) lv_pSession->nacked |= (1UL << i);
+  }
+
+  if( lv_pSession->base >= m_blocks ) {
+    lv_pSession->state = OTA_ST_DONE;
+    lv_pSession->tmDone = _now;
+    m_nDone++;
+    LOGI(LOGTAG_MSG, "OTA to node:%d done in %lums, %d resent", _node, _now - lv_pSession->tmStart, lv_pSession->nResent);
+  }
+  return true;
+}
+
+BOOL FirmwareOTAClass::IsBusy()
+{
+  for( UC i = 0; i < OTA_MAX_SESSIONS; i++ ) {
+    if( m_sessions[i].node && (m_sessions[i].state == OTA_ST_ANNOUNCE || m_sessions[i].state == OTA_ST_SENDING) ) return true;
+  }
+  return false;
+}
+
+UC FirmwareOTAClass::GetState(const UC _node)
+{
+  OTASession_t *lv_pSession = GetSession(_node);
+  return(lv_pSession ? lv_pSession->state : OTA_ST_IDLE);
+}
+
+UL FirmwareOTAClass::GetDuration(const UC _node)
+{
+  OTASession_t *lv_pSession = GetSession(_node);
+  if( !lv_pSession || !lv_pSession->tmDone ) return 0;
+  return lv_pSession->tmDone - lv_pSession->tmStart;
+}
+
+void FirmwareOTAClass::showStatus()
+{
+  const char *lv_states[] = {"idle", "announce", "sending", "done", "failed"};
+  SERIAL_LN("OTA image type:%d ver:%d, %lu bytes, %d blocks, crc:0x%08lX", m_image.type, m_image.version, m_image.size, m_blocks, m_image.crc);
+  SERIAL_LN("  chunks:%lu, resent:%lu, done:%lu, failed:%lu", m_nChunks, m_nResent, m_nDone, m_nFailed);
+  if( m_isStaging ) {
+    SERIAL_LN("  staging type:%d ver:%d, %lu of %lu bytes", m_stage.type, m_stage.version, m_staged, m_stage.size);
+  }
+  for( UC i = 0; i < OTA_MAX_SESSIONS; i++ ) {
+    OTASession_t *lv_pSession = m_sessions + i;
+    if( !lv_pSession->node ) continue;
+    SERIAL_LN("  node:%d %s, block %d/%d, resent:%d", lv_pSession->node, lv_states[lv_pSession->state],
+        lv_pSession->base, m_blocks, lv_pSession->nResent);
+  }
+}
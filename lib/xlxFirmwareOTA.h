@@ -0,0 +1,157 @@
+//  xlxFirmwareOTA.h - Xlight firmware distribution to RF nodes
+
+#ifndef xlxFirmwareOTA_h
+#define xlxFirmwareOTA_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+#include "flashee-eeprom.h"
+#include "MyMessage.h"
+
+#define OTA_IMAGE_MAGIC           0x41544F58  // "XOTA"
+#define OTA_BLOCK_SIZE            16          // Image bytes per chunk
+#define OTA_WINDOW                8           // Chunks in flight per session, up to 32
+#define OTA_MAX_SESSIONS          4
+#define OTA_TM_CHUNK              10          // ms between two frames of all sessions
+#define OTA_TM_RETRY              400         // ms to resend a chunk or the announce without ack
+#define OTA_TM_SILENCE            10000       // ms without ack to give up a session
+#define OTA_MAX_MQ                2           // Frames are held while so many messages wait in sendMQ
+#define OTA_STAGE_CHUNK           128         // Max image bytes per staging write
+
+// Session states
+#define OTA_ST_IDLE               0
+#define OTA_ST_ANNOUNCE           1           // Waiting for the first ack
+#define OTA_ST_SENDING            2
+#define OTA_ST_DONE               3
+#define OTA_ST_FAILED             4
+
+// Image head at the first whole logical page of the image area, the image follows
+typedef struct
+	__attribute__((packed))
+{
+  UL magic;
+  US type;                          // Device type the image is built for
+  US version;
+  UL size;
+  UL crc;                           // CRC32 over the image
+} OTAImageHead_t;
+
+// ST_FIRMWARE_CONFIG_RESPONSE to node: image announce
+typedef struct
+	__attribute__((packed))
+{
+  US type;
+  US version;
+  US blocks;
+  UL crc;
+} OTAAnnounce_t;
+
+// ST_FIRMWARE_RESPONSE to node: one chunk, the last one is padded with 0xFF
+typedef struct
+	__attribute__((packed))
+{
+  US block;
+  UC data[OTA_BLOCK_SIZE];
+  US crc;                           // Low half of CRC32 over block and data
+} OTAChunk_t;
+
+// ST_FIRMWARE_REQUEST from node: cumulative and selective ack
+typedef struct
+	__attribute__((packed))
+{
+  US base;                          // First block missing, blocks of image when done
+  UL bitmap;                        // Bit i: block base + i received
+} OTAAck_t;
+
+// Send a frame, false if the radio is busy
+typedef bool (*OTASend_t)(MyMessage &_msg);
+// Read image bytes at _offset
+typedef bool (*OTARead_t)(const UL _offset, UC *_buf, const UC _len);
+
+typedef struct
+{
+  UC node;
+  UC state;
+  US base;                          // First block not acked
+  US next;                          // Next block never sent
+  UL acked;                         // Bit i: block base + i acked
+  UL nacked;                        // Bit i: block base + i missing before an acked one
+  UL tmSent[OTA_WINDOW];            // millis() of sending block, by block % OTA_WINDOW
+  UL tmAnnounce;
+  UL tmAck;                         // Last heard from node
+  UL tmStart;
+  UL tmDone;
+  US nResent;
+} OTASession_t;
+
+//------------------------------------------------------------------
+// Xlight Firmware OTA Class
+//------------------------------------------------------------------
+class FirmwareOTAClass
+{
+public:
+  FirmwareOTAClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL SetImage(OTARead_t _read, const US _type, const US _version, const UL _size);
+  BOOL BeginImage(const US _type, const US _version, const UL _size, const UL _crc);
+  BOOL WriteImage(const UL _offset, const UC *_data, const US _len, const UL _crc);
+  BOOL IsStaging() { return m_isStaging; }
+  UL GetStaged() { return m_staged; }
+  void SetSender(OTASend_t _send);
+  void SetRate(const UL _tmChunk) { m_tmChunk = _tmChunk; }
+
+  BOOL Start(const UC _node, const UL _now);
+  void Stop(const UC _node);
+  void Process(const UL _now);
+  BOOL GotAck(const UC _node, const OTAAck_t &_ack, const UL _now);
+
+  BOOL IsBusy();
+  UC GetState(const UC _node);
+  UL GetDuration(const UC _node);
+  UL GetImageSize() { return m_image.size; }
+  UL GetImageCRC() { return m_image.crc; }
+  US GetBlocks() { return m_blocks; }
+  UL GetChunks() { return m_nChunks; }
+  UL GetResent() { return m_nResent; }
+  UL GetDone() { return m_nDone; }
+  UL GetFailed() { return m_nFailed; }
+  void showStatus();
+
+  static US ChunkCRC(const OTAChunk_t &_chunk);
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_addr;                        // Image head
+  UL m_capacity;                    // Max image bytes
+  OTARead_t m_read;
+  OTASend_t m_send;
+  OTAImageHead_t m_image;
+  US m_blocks;
+  BOOL m_isStaging;
+  OTAImageHead_t m_stage;           // Head of the image being staged
+  UL m_staged;                      // Image bytes written so far
+  OTASession_t m_sessions[OTA_MAX_SESSIONS];
+  UC m_rr;                          // Session to serve first
+  UL m_tmChunk;
+  UL m_tmLast;
+
+  UL m_nChunks;
+  UL m_nResent;
+  UL m_nDone;
+  UL m_nFailed;
+
+  OTASession_t *GetSession(const UC _node);
+  BOOL ReadBlock(const US _block, UC *_buf);
+  BOOL CommitImage();
+  BOOL SendAnnounce(OTASession_t *_pSession, const UL _now);
+  BOOL SendChunk(OTASession_t *_pSession, const US _block, const UL _now);
+  BOOL Serve(OTASession_t *_pSession, const UL _now);
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern FirmwareOTAClass theOTA;
+
+#endif /* xlxFirmwareOTA_h */
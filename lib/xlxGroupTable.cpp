@@ -0,0 +1,163 @@
+/**
+ * xlxGroupTable.cpp - Xlight group membership of devices
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Devices join groups (NodeID 192 - 223), so that the state confirmed for
+ * a group applies to all members without querying each of them.
+ * 1. Members of a group are a bitmap of device NodeIDs (1 - 63), the table
+ *    of 32 groups is 256 bytes
+ * 2. The table is kept in A/B config slots on P1 flash and saved with the
+ *    deferred table writes, in RAM only otherwise
+ * 3. Each change is sent to the device with NCF_DEV_SET_GROUPS, the
+ *    payload lists all groups of the device
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxGroupTable.h"
+#include "xlxLogger.h"
+#include "xlxRF24Server.h"
+#include "xliNodeConfig.h"
+
+//------------------------------------------------------------------
+// the one and only instance of GroupTableClass
+GroupTableClass theGroups;
+
+GroupTableClass::GroupTableClass()
+{
+  memset(m_members, 0x00, sizeof(m_members));
+  m_isChanged = false;
+  m_isPersistent = false;
+  m_nProvisioned = 0;
+}
+
+BOOL GroupTableClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  memset(m_members, 0x00, sizeof(m_members));
+  m_isChanged = false;
+  m_isPersistent = (pDevice != NULL);
+  if( !m_isPersistent ) return false;
+
+  m_slots.Init(pDevice, _addr, _size);
+  if( !m_slots.Load(m_members, sizeof(m_members)) ) {
+    memset(m_members, 0x00, sizeof(m_members));
+    return false;
+  }
+  return true;
+}
+
+// Called with the deferred table writes
+BOOL GroupTableClass::Save()
+{
+  if( !m_isChanged || !m_isPersistent ) return false;
+  if( !m_slots.Save(m_members, sizeof(m_members)) ) return false;
+  m_isChanged = false;
+  LOGI(LOGTAG_MSG, "Groups saved to slot %d", m_slots.GetActive());
+  return true;
+}
+
+BOOL GroupTableClass::IsValidMember(const UC _group, const UC _node)
+{
+  return( IS_GROUP_NODEID(_group) && !IS_NOT_DEVICE_NODEID(_node) );
+}
+
+BOOL GroupTableClass::AddMember(const UC _group, const UC _node)
+{
+  if( !IsValidMember(_group, _node) ) return false;
+  if( IsMember(_group, _node) ) return true;
+  if( GetGroups(_node, NULL, GRP_MAX_GROUPS) >= GRP_MAX_PER_NODE ) {
+    LOGW(LOGTAG_MSG, "Node:%d already in %d groups", _node, GRP_MAX_PER_NODE);
+    return false;
+  }
+  m_members[GRP_INDEX(_group)] |= GRP_NODE_BIT(_node);
+  m_isChanged = true;
+  Provision(_node);
+  return true;
+}
+
+BOOL GroupTableClass::RemoveMember(const UC _group, const UC _node)
+{
+  if( !IsMember(_group, _node) ) return false;
+  m_members[GRP_INDEX(_group)] &= ~GRP_NODE_BIT(_node);
+  m_isChanged = true;
+  Provision(_node);
+  return true;
+}
+
+BOOL GroupTableClass::IsMember(const UC _group, const UC _node)
+{
+  if( !IsValidMember(_group, _node) ) return false;
+  return( (m_members[GRP_INDEX(_group)] & GRP_NODE_BIT(_node)) != 0 );
+}
+
+// Member NodeIDs in ascending order, _nodes can be NULL to count only
+UC GroupTableClass::GetMembers(const UC _group, UC *_nodes, const UC _max)
+{
+  if( !IS_GROUP_NODEID(_group) ) return 0;
+  uint64_t lv_bits = m_members[GRP_INDEX(_group)];
+  UC lv_count = 0;
+  for( UC lv_node = 0; lv_bits && lv_count < _max; lv_node++, lv_bits >>= 1 ) {
+    if( lv_bits & 0x01 ) {
+      if( _nodes ) _nodes[lv_count] = lv_node;
+      lv_count++;
+    }
+  }
+  return lv_count;
+}
+
+// Groups of a device in ascending order, _groups can be NULL to count only
+UC GroupTableClass::GetGroups(const UC _node, UC *_groups, const UC _max)
+{
+  if( IS_NOT_DEVICE_NODEID(_node) ) return 0;
+  UC lv_count = 0;
+  for( UC i = 0; i < GRP_MAX_GROUPS && lv_count < _max; i++ ) {
+    if( m_members[i] & GRP_NODE_BIT(_node) ) {
+      if( _groups ) _groups[lv_count] = NODEID_MIN_GROUP + i;
+      lv_count++;
+    }
+  }
+  return lv_count;
+}
+
+// Send all groups of the device to it
+BOOL GroupTableClass::Provision(const UC _node)
+{
+  UC lv_groups[GRP_MAX_PER_NODE];
+  UC lv_count = GetGroups(_node, lv_groups, GRP_MAX_PER_NODE);
+  if( !theRadio.SendNodeConfig(_node, NCF_DEV_SET_GROUPS, lv_groups, lv_count) ) return false;
+  m_nProvisioned++;
+  return true;
+}
+
+void GroupTableClass::showStatus()
+{
+  UC lv_nodes[NODEID_MAX_DEVCIE + 1];
+  UC lv_count;
+  SERIAL_LN("Groups: %s, %lu provisioned", m_isPersistent ? (m_isChanged ? "unsaved" : "saved") : "not persistent", m_nProvisioned);
+  for( UC lv_group = NODEID_MIN_GROUP; lv_group <= NODEID_MAX_GROUP; lv_group++ ) {
+    lv_count = GetMembers(lv_group, lv_nodes, sizeof(lv_nodes));
+    if( !lv_count ) continue;
+    String strMembers;
+    for( UC i = 0; i < lv_count; i++ ) {
+      strMembers += String::format(" %d", lv_nodes[i]);
+    }
+    SERIAL_LN("  %d:%s", lv_group, strMembers.c_str());
+  }
+}
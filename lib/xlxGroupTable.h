@@ -0,0 +1,52 @@
+//  xlxGroupTable.h - Xlight group membership of devices
+
+#ifndef xlxGroupTable_h
+#define xlxGroupTable_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+#include "xlxConfigSlot.h"
+
+#define GRP_MAX_GROUPS            (NODEID_MAX_GROUP - NODEID_MIN_GROUP + 1)
+#define GRP_MAX_PER_NODE          8           // Groups a device can join, NCF_DEV_SET_GROUPS payload
+#define GRP_INDEX(gid)            ((gid) - NODEID_MIN_GROUP)
+#define GRP_NODE_BIT(nid)         ((uint64_t)1 << (nid))
+
+//------------------------------------------------------------------
+// Xlight Group Table Class
+//------------------------------------------------------------------
+class GroupTableClass
+{
+public:
+  GroupTableClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL Save();
+
+  BOOL AddMember(const UC _group, const UC _node);
+  BOOL RemoveMember(const UC _group, const UC _node);
+  BOOL IsMember(const UC _group, const UC _node);
+  UC GetMembers(const UC _group, UC *_nodes, const UC _max);
+  UC GetGroups(const UC _node, UC *_groups, const UC _max);
+  BOOL Provision(const UC _node);
+
+  UL GetProvisioned() { return m_nProvisioned; }
+  void showStatus();
+
+private:
+  uint64_t m_members[GRP_MAX_GROUPS];  // Bitmap of device node ids per group
+  BOOL m_isChanged;
+  BOOL m_isPersistent;
+  ConfigSlotClass m_slots;
+
+  UL m_nProvisioned;
+
+  static BOOL IsValidMember(const UC _group, const UC _node);
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern GroupTableClass theGroups;
+
+#endif /* xlxGroupTable_h */
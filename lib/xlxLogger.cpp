@@ -20,21 +20,35 @@
  * DESCRIPTION
  * 1. Define basic interfaces
  * 2. Serial logging
+ * 3. Async logging: LOGN/LOGI/LOGD only store a compact record (time, level,
+ *    tag, format pointer and raw arguments) into a ring, Process() formats
+ *    and outputs them in idle time. Warnings and above are still written
+ *    synchronously, after the pending records so the order is kept. Until
+ *    the first Process() call (end of setup) every log is synchronous.
+ *    If the ring is full, the record is dropped and counted
+ * 4. Flash logging: compact binary records with sequence numbers in a ring
+ *    on the P1 external flash. Records are buffered per 256-byte block and
+ *    each block is programmed once (or a few times when flushed early).
+ *    A sector is a logical page of the device holding whole blocks, the
+ *    ring only uses the pages inside its region. Process() erases the next
+ *    sector ahead, so a log call never waits for an erase. The newest
+ *    block is found by sequence number after reboot
  *
  * ToDo:
  * 1. syslog, refer to psyslog.cpp
  * 2. http/cloud
- * 3. Flash
- * 4. Offline Data Cache in Flash (loop overwrite)
+ * 3. Offline Data Cache in Flash (loop overwrite)
 **/
 
 #include "xlxLogger.h"
+#include "xlxConfig.h"
 #include "xlSmartController.h"
 
 // the one and only instance of LoggerClass
 LoggerClass theLog = LoggerClass();
 char strDestNames[][7] = {"serial", "flash", "syslog", "cloud", "all"};
 char strLevelNames[][9] = {"none", "alert", "critical", "error", "warn", "notice", "info", "debug"};
+char strTagNames[][4] = {"sta", "evt", "act", "dat", "msg"};
 
 //------------------------------------------------------------------
 // Xlight Logger Class
@@ -45,6 +59,29 @@ LoggerClass::LoggerClass()
   m_level[LOGDEST_FLASH] = LEVEL_WARNING;
   m_level[LOGDEST_SYSLOG] = LEVEL_INFO;
   m_level[LOGDEST_CLOUD] = LEVEL_NOTICE;
+  for( UC i = 0; i < LOGTAG_ID_DUMMY; i++ ) {
+    m_tagLevel[i] = LEVEL_DEBUG;
+  }
+
+  m_async = true;
+  m_looping = false;
+  m_draining = false;
+  memset(m_records, 0x00, sizeof(m_records));
+  m_head = m_tail = 0;
+  m_nAsync = m_nSync = m_nDropped = 0;
+  m_usAsync = m_usSync = 0;
+
+  m_flash = NULL;
+  m_flashBase = m_flashSize = m_flashSector = 0;
+  m_flashAddr = 0;
+  m_flashSeq = 1;
+  m_flashFill = m_flashFlushed = 0;
+  m_flashTick = 0;
+  m_flashUrgent = false;
+  m_flashAhead = false;
+  m_nFlashRecords = m_nFlashBytes = m_nFlashProgBytes = m_nFlashErases = 0;
+  m_nFlashDropped = 0;
+  UpdateMaxLevel();
 }
 
 void LoggerClass::Init(String sysid)
@@ -54,10 +91,198 @@ void LoggerClass::Init(String sysid)
 
 BOOL LoggerClass::InitFlash(UL addr, UL size)
 {
-  //ToDo:
+  return InitFlash(theConfig.getP1Flash(), addr, size);
+}
+
+// Check a record in flash log block, returns its length or 0 if invalid
+static UC logCheckRecord(const UC *pData, US nLeft)
+{
+  if( nLeft < FLASHLOG_HEAD_LEN || pData[0] != FLASHLOG_MAGIC ) return 0;
+  UC _len = pData[1];
+  if( _len < FLASHLOG_HEAD_LEN || _len > FLASHLOG_HEAD_LEN + FLASHLOG_MAX_TEXT || _len > nLeft ) return 0;
+  UC _crc = 0;
+  for( UC i = 0; i < _len; i++ ) {
+    if( i != 3 ) _crc += pData[i];
+  }
+  return ((UC)~_crc == pData[3] ? _len : 0);
+}
+
+// Find the newest block by sequence number, and continue from the next empty block
+BOOL LoggerClass::InitFlash(Flashee::FlashDevice *pDevice, UL addr, UL size)
+{
+  m_flash = NULL;
+  if( !pDevice ) return false;
+  m_flashSector = pDevice->pageSize();
+  if( m_flashSector < FLASHLOG_BLOCK ) return false;
+  m_flashBase = FLASH_PAGE_CEIL(addr, m_flashSector);
+  if( addr + size < m_flashBase + 2 * m_flashSector ) return false;
+  m_flashSize = FLASH_PAGE_FLOOR(addr + size, m_flashSector) - m_flashBase;
+
+  // Newest sector, by the sequence number of its first record
+  UL lv_sector = 0, lv_seq = 0;
+  BOOL lv_found = false;
+  UL _offset, _seq;
+  for( _offset = 0; _offset < m_flashSize; _offset += m_flashSector ) {
+    if( !pDevice->readPage(m_flashBuf, m_flashBase + _offset, FLASHLOG_BLOCK) ) return false;
+    if( logCheckRecord(m_flashBuf, FLASHLOG_BLOCK) ) {
+      memcpy(&_seq, m_flashBuf + 4, sizeof(UL));
+      if( !lv_found || _seq > lv_seq ) {
+        lv_found = true;
+        lv_seq = _seq;
+        lv_sector = _offset;
+      }
+    }
+  }
+
+  m_flashAddr = 0;
+  m_flashSeq = 1;
+  BOOL lv_clean = false;
+  if( lv_found ) {
+    // Last record and the first clean block in the newest sector
+    m_flashAddr = FlashNextSector(lv_sector);
+    for( _offset = lv_sector; _offset + FLASHLOG_BLOCK <= lv_sector + m_flashSector; _offset += FLASHLOG_BLOCK ) {
+      if( !pDevice->readPage(m_flashBuf, m_flashBase + _offset, FLASHLOG_BLOCK) ) return false;
+      US _pos = 0;
+      UC _len;
+      while( (_len = logCheckRecord(m_flashBuf + _pos, FLASHLOG_BLOCK - _pos)) > 0 ) {
+        memcpy(&lv_seq, m_flashBuf + _pos + 4, sizeof(UL));
+        _pos += _len;
+      }
+      lv_clean = true;
+      for( _pos = 0; _pos < FLASHLOG_BLOCK; _pos++ ) {
+        if( m_flashBuf[_pos] != 0xFF ) { lv_clean = false; break; }
+      }
+      if( lv_clean ) {
+        m_flashAddr = _offset;
+        break;
+      }
+    }
+    m_flashSeq = lv_seq + 1;
+  }
+  // Newest sector is full, or no log yet
+  if( !lv_clean ) {
+    if( !pDevice->erasePage(m_flashBase + m_flashAddr) ) return false;
+    m_nFlashErases++;
+  }
+
+  memset(m_flashBuf, 0xFF, FLASHLOG_BLOCK);
+  m_flashFill = m_flashFlushed = 0;
+  m_flashTick = millis();
+  m_flashAhead = false;
+  m_flash = pDevice;
+  UpdateMaxLevel();
   return true;
 }
 
+// Append a record to the current block
+void LoggerClass::WriteFlash(UC level, const char *tag, UL time, const char *text)
+{
+  UC _textLen = (strlen(text) > FLASHLOG_MAX_TEXT ? FLASHLOG_MAX_TEXT : strlen(text));
+  UC _len = FLASHLOG_HEAD_LEN + _textLen;
+  if( m_flashFill + _len > FLASHLOG_BLOCK ) {
+    FlushFlash();
+    // Don't erase here, wait for Process() to get the next sector ready
+    if( FlashNextBlock(m_flashAddr) % m_flashSector == 0 && !m_flashAhead ) {
+      m_nFlashDropped++;
+      return;
+    }
+    NextFlashBlock();
+  }
+
+  UC *pData = m_flashBuf + m_flashFill;
+  pData[0] = FLASHLOG_MAGIC;
+  pData[1] = _len;
+  pData[2] = level;
+  memcpy(pData + 4, &m_flashSeq, sizeof(UL));
+  memcpy(pData + 8, &time, sizeof(UL));
+  memset(pData + 12, ' ', 3);
+  memcpy(pData + 12, tag, (strlen(tag) > 3 ? 3 : strlen(tag)));
+  memcpy(pData + FLASHLOG_HEAD_LEN, text, _textLen);
+  UC _crc = 0;
+  for( UC i = 0; i < _len; i++ ) {
+    if( i != 3 ) _crc += pData[i];
+  }
+  pData[3] = ~_crc;
+
+  m_flashFill += _len;
+  m_flashSeq++;
+  m_nFlashRecords++;
+  m_nFlashBytes += _len;
+  if( level <= LEVEL_ERROR ) m_flashUrgent = true;
+}
+
+// Offset of the block after _offset, blocks don't cross sectors
+UL LoggerClass::FlashNextBlock(UL _offset)
+{
+  _offset += FLASHLOG_BLOCK;
+  if( _offset % m_flashSector + FLASHLOG_BLOCK > m_flashSector ) _offset = FLASH_PAGE_CEIL(_offset, m_flashSector);
+  return(_offset >= m_flashSize ? 0 : _offset);
+}
+
+// Offset of the sector after the one holding _offset
+UL LoggerClass::FlashNextSector(UL _offset)
+{
+  _offset = FLASH_PAGE_FLOOR(_offset, m_flashSector) + m_flashSector;
+  return(_offset >= m_flashSize ? 0 : _offset);
+}
+
+void LoggerClass::NextFlashBlock()
+{
+  m_flashAddr = FlashNextBlock(m_flashAddr);
+  if( m_flashAddr % m_flashSector == 0 ) m_flashAhead = false;
+  memset(m_flashBuf, 0xFF, FLASHLOG_BLOCK);
+  m_flashFill = m_flashFlushed = 0;
+}
+
+// Program the unwritten part of current block
+BOOL LoggerClass::FlushFlash()
+{
+  m_flashTick = millis();
+  m_flashUrgent = false;
+  if( !m_flash || m_flashFill <= m_flashFlushed ) return true;
+
+  if( !m_flash->writePage(m_flashBuf + m_flashFlushed, m_flashBase + m_flashAddr + m_flashFlushed, m_flashFill - m_flashFlushed) ) {
+    return false;
+  }
+  m_nFlashProgBytes += m_flashFill - m_flashFlushed;
+  m_flashFlushed = m_flashFill;
+  return true;
+}
+
+// Print the last count records from the oldest, 0 for all
+UL LoggerClass::DumpFlash(UL count)
+{
+  if( !m_flash ) return 0;
+  FlushFlash();
+
+  UL lv_minSeq = (count > 0 && m_flashSeq > count ? m_flashSeq - count : 0);
+  UL lv_printed = 0;
+  UC lv_buf[FLASHLOG_BLOCK];
+  char lv_text[FLASHLOG_MAX_TEXT + 1];
+  UL _offset = FlashNextSector(m_flashAddr);
+  for( UL _blocks = m_flashSize / m_flashSector * (m_flashSector / FLASHLOG_BLOCK); _blocks > 0; _blocks-- ) {
+    if( !m_flash->readPage(lv_buf, m_flashBase + _offset, FLASHLOG_BLOCK) ) break;
+    US _pos = 0;
+    UC _len;
+    while( (_len = logCheckRecord(lv_buf + _pos, FLASHLOG_BLOCK - _pos)) > 0 ) {
+      UL _seq, _time;
+      memcpy(&_seq, lv_buf + _pos + 4, sizeof(UL));
+      memcpy(&_time, lv_buf + _pos + 8, sizeof(UL));
+      if( _seq >= lv_minSeq ) {
+        memcpy(lv_text, lv_buf + _pos + FLASHLOG_HEAD_LEN, _len - FLASHLOG_HEAD_LEN);
+        lv_text[_len - FLASHLOG_HEAD_LEN] = '\0';
+        SERIAL_LN("#%lu %s %02d:%02d:%02d %d %c%c%c %s", _seq, Time.format(_time, "%Y-%m-%d").c_str(),
+            Time.hour(_time), Time.minute(_time), Time.second(_time), lv_buf[_pos + 2],
+            lv_buf[_pos + 12], lv_buf[_pos + 13], lv_buf[_pos + 14], lv_text);
+        lv_printed++;
+      }
+      _pos += _len;
+    }
+    _offset = FlashNextBlock(_offset);
+  }
+  return lv_printed;
+}
+
 BOOL LoggerClass::InitSysLog(String host, US port)
 {
   //ToDo:
@@ -82,23 +307,38 @@ void LoggerClass::SetLevel(UC logDest, UC logLevel)
 {
   if( logDest < LOGDEST_DUMMY)
   {
-    if( m_level[logDest] != logLevel )
+    if( m_level[logDest] != logLevel ) {
       m_level[logDest] = logLevel;
+      UpdateMaxLevel();
+    }
   }
 }
 
-void LoggerClass::WriteLog(UC level, const char *tag, const char *msg, ...)
+UC LoggerClass::GetTagLevel(UC tagID)
 {
-  int nSize = 0;
-  char buf[MAX_MESSAGE_LEN];
+  if( tagID < LOGTAG_ID_DUMMY )
+    return m_tagLevel[tagID];
 
-  // Prepare message
-  int nPos = snprintf(buf, MAX_MESSAGE_LEN, "%02d:%02d:%02d %d %s ",
-      Time.hour(), Time.minute(), Time.second(), level, tag);
-  va_list args;
-  va_start(args, msg);
-  nSize = vsnprintf(buf + nPos, MAX_MESSAGE_LEN - nPos, msg, args);
+  return LEVEL_EMERGENCY;
+}
 
+void LoggerClass::SetTagLevel(UC tagID, UC logLevel)
+{
+  if( tagID < LOGTAG_ID_DUMMY )
+    m_tagLevel[tagID] = logLevel;
+}
+
+// Highest level wanted by any implemented destination, checked by IsEnabled()
+void LoggerClass::UpdateMaxLevel()
+{
+  UC lv_level = m_level[LOGDEST_SERIAL];
+  if( lv_level < m_level[LOGDEST_CLOUD] ) lv_level = m_level[LOGDEST_CLOUD];
+  if( m_flash && lv_level < m_level[LOGDEST_FLASH] ) lv_level = m_level[LOGDEST_FLASH];
+  m_maxLevel = lv_level;
+}
+
+void LoggerClass::OutputLog(UC level, const char *tag, UL time, const char *buf, int nPrefix)
+{
   // Send message to serial port
   if( level <= m_level[LOGDEST_SERIAL] )
   {
@@ -110,11 +350,269 @@ void LoggerClass::WriteLog(UC level, const char *tag, const char *msg, ...)
     theSys.PublishLog(buf);
   }
 
+  // Save Log to flash, only the message text
+  if( m_flash && level <= m_level[LOGDEST_FLASH] ) {
+    WriteFlash(level, tag, time, buf + nPrefix);
+  }
+
   // ToDo: send log to other destinations
   //if( level <= m_level[LOGDEST_SYSLOG] ) {
   //;}
-  //if( level <= m_level[LOGDEST_FLASH] ) {
-  //}
+}
+
+void LoggerClass::WriteLog(UC level, const char *tag, const char *msg, ...)
+{
+  if( level > m_maxLevel || level > m_tagLevel[logTagID(tag)] ) return;
+
+  UL lv_start = micros();
+  va_list args;
+  va_start(args, msg);
+
+  if( m_async && m_looping && level > LEVEL_WARNING ) {
+    int rc = PushLog(level, tag, msg, args);
+    va_end(args);
+    if( rc >= 0 ) {
+      if( rc > 0 ) {
+        m_nAsync++;
+        m_usAsync += micros() - lv_start;
+      }
+      return;
+    }
+    // Arguments can't be deferred, write it directly
+    va_start(args, msg);
+  }
+
+  // Earlier deferred records go first
+  DrainAsync();
+
+  char buf[MAX_MESSAGE_LEN];
+
+  // Prepare message
+  int nPos = snprintf(buf, MAX_MESSAGE_LEN, "%02d:%02d:%02d %d %s ",
+      Time.hour(), Time.minute(), Time.second(), level, tag);
+  vsnprintf(buf + nPos, MAX_MESSAGE_LEN - nPos, msg, args);
+  va_end(args);
+
+  OutputLog(level, tag, Time.now(), buf, nPos);
+  m_nSync++;
+  m_usSync += micros() - lv_start;
+}
+
+//------------------------------------------------------------------
+// Async logging
+//------------------------------------------------------------------
+// Parse a conversion specification, p points to the char after '%'
+/// Returns the pointer after the conversion char, stores the conversion char,
+/// length modifier (0: none, 1: l or z, 2: ll) and number of '*'
+static const char *logParseSpec(const char *p, char *conv, UC *lenMod, UC *stars)
+{
+  *lenMod = 0;
+  *stars = 0;
+  while( *p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' ) p++;
+  if( *p == '*' ) { (*stars)++; p++; }
+  while( *p >= '0' && *p <= '9' ) p++;
+  if( *p == '.' ) {
+    p++;
+    if( *p == '*' ) { (*stars)++; p++; }
+    while( *p >= '0' && *p <= '9' ) p++;
+  }
+  while( *p == 'h' ) p++;
+  if( *p == 'l' ) {
+    p++; *lenMod = 1;
+    if( *p == 'l' ) { p++; *lenMod = 2; }
+  } else if( *p == 'z' || *p == 't' || *p == 'j' ) {
+    p++; *lenMod = 1;
+  }
+  *conv = *p;
+  return (*p ? p + 1 : p);
+}
+
+#define LOG_PACK(type)  { type _v = va_arg(args, type); \
+    if( nLen + sizeof(type) > size ) return -1; \
+    memcpy(out + nLen, &_v, sizeof(type)); nLen += sizeof(type); }
+
+// Copy raw arguments according to the format, strings are copied as well
+/// Returns the length, or -1 if they don't fit or are not supported
+static int logPackArgs(UC *out, UC size, const char *fmt, va_list args)
+{
+  int nLen = 0;
+  char conv;
+  UC lenMod, stars;
+  const char *p = fmt;
+  while( (p = strchr(p, '%')) != NULL ) {
+    p = logParseSpec(p + 1, &conv, &lenMod, &stars);
+    if( conv == '%' ) continue;
+    while( stars-- > 0 ) LOG_PACK(int);
+    switch( conv ) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      if( lenMod == 2 ) LOG_PACK(long long)
+      else if( lenMod == 1 ) LOG_PACK(long)
+      else LOG_PACK(int)
+      break;
+
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      LOG_PACK(double)
+      break;
+
+      case 'p':
+      LOG_PACK(void *)
+      break;
+
+      case 's':
+      {
+        const char *_str = va_arg(args, const char *);
+        if( !_str ) _str = "(null)";
+        int _copy = strlen(_str);
+        if( nLen + _copy + 1 > size ) return -1;
+        memcpy(out + nLen, _str, _copy);
+        nLen += _copy;
+        out[nLen++] = '\0';
+        break;
+      }
+
+      default:
+      return -1;
+    }
+  }
+  return nLen;
+}
+
+#define LOG_UNPACK(type, var)  type var; memcpy(&var, pArg, sizeof(type)); pArg += sizeof(type);
+#define LOG_FORMAT(value)  ( stars == 0 ? snprintf(buf + nPos, len - nPos, spec, value) : \
+    ( stars == 1 ? snprintf(buf + nPos, len - nPos, spec, star[0], value) : \
+      snprintf(buf + nPos, len - nPos, spec, star[0], star[1], value) ) )
+
+// Format the record in the same way as WriteLog()
+int LoggerClass::FormatRecord(const LogRecord_t *pRecord, char *buf, int len, int *pPrefix)
+{
+  int nPos = snprintf(buf, len, "%02d:%02d:%02d %d %s ",
+      Time.hour(pRecord->time), Time.minute(pRecord->time), Time.second(pRecord->time),
+      pRecord->level, pRecord->tag);
+  *pPrefix = nPos;
+
+  const UC *pArg = pRecord->args;
+  const char *p = pRecord->fmt;
+  char spec[16];
+  char conv;
+  UC lenMod, stars;
+  int star[2];
+  while( *p && nPos < len - 1 ) {
+    if( *p != '%' ) {
+      buf[nPos++] = *p++;
+      continue;
+    }
+    const char *pStart = p;
+    p = logParseSpec(p + 1, &conv, &lenMod, &stars);
+    if( conv == '%' ) {
+      buf[nPos++] = '%';
+      continue;
+    }
+    int _specLen = p - pStart;
+    if( _specLen >= (int)sizeof(spec) ) break;
+    memcpy(spec, pStart, _specLen);
+    spec[_specLen] = '\0';
+    for( UC i = 0; i < stars; i++ ) {
+      memcpy(&star[i], pArg, sizeof(int)); pArg += sizeof(int);
+    }
+
+    int nSize = 0;
+    switch( conv ) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      if( lenMod == 2 ) { LOG_UNPACK(long long, _v); nSize = LOG_FORMAT(_v); }
+      else if( lenMod == 1 ) { LOG_UNPACK(long, _v); nSize = LOG_FORMAT(_v); }
+      else { LOG_UNPACK(int, _v); nSize = LOG_FORMAT(_v); }
+      break;
+
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      { LOG_UNPACK(double, _v); nSize = LOG_FORMAT(_v); }
+      break;
+
+      case 'p':
+      { LOG_UNPACK(void *, _v); nSize = LOG_FORMAT(_v); }
+      break;
+
+      case 's':
+      {
+        const char *_v = (const char *)pArg;
+        pArg += strlen(_v) + 1;
+        nSize = LOG_FORMAT(_v);
+        break;
+      }
+    }
+    if( nSize > 0 ) nPos += nSize;
+    if( nPos > len - 1 ) nPos = len - 1;
+  }
+  buf[nPos] = '\0';
+  return nPos;
+}
+
+// Reserve a record and store the call, can be called from ISR
+/// Returns 1 if stored, 0 if dropped, or -1 if the arguments can't be deferred
+int LoggerClass::PushLog(UC level, const char *tag, const char *msg, va_list args)
+{
+  UC lv_args[LOG_ASYNC_ARGS_LEN];
+  int nLen = logPackArgs(lv_args, LOG_ASYNC_ARGS_LEN, msg, args);
+  if( nLen < 0 ) return -1;
+
+  UC lv_head, lv_next;
+  do {
+    lv_head = m_head;
+    lv_next = (lv_head + 1) & (LOG_ASYNC_RECORDS - 1);
+    if( lv_next == m_tail ) {
+      m_nDropped++;
+      return 0;
+    }
+  } while( !__sync_bool_compare_and_swap(&m_head, lv_head, lv_next) );
+
+  LogRecord_t *pRecord = &m_records[lv_head];
+  pRecord->level = level;
+  pRecord->argLen = nLen;
+  pRecord->time = Time.now();
+  pRecord->tag = tag;
+  pRecord->fmt = msg;
+  memcpy(pRecord->args, lv_args, nLen);
+  pRecord->ready = 1;
+  return 1;
+}
+
+// Format and output pending async records
+void LoggerClass::DrainAsync()
+{
+  if( m_draining ) return;
+  m_draining = true;
+  char buf[MAX_MESSAGE_LEN];
+  int nPrefix;
+  while( m_records[m_tail].ready ) {
+    LogRecord_t *pRecord = &m_records[m_tail];
+    FormatRecord(pRecord, buf, MAX_MESSAGE_LEN, &nPrefix);
+    UC lv_level = pRecord->level;
+    const char *lv_tag = pRecord->tag;
+    UL lv_time = pRecord->time;
+    pRecord->ready = 0;
+    m_tail = (m_tail + 1) & (LOG_ASYNC_RECORDS - 1);
+    OutputLog(lv_level, lv_tag, lv_time, buf, nPrefix);
+  }
+  m_draining = false;
+}
+
+// Called in idle time, the first call also enables deferring
+void LoggerClass::Process()
+{
+  m_looping = true;
+  DrainAsync();
+
+  // Program partial flash block if urgent or idle for a while
+  if( m_flashFill > m_flashFlushed ) {
+    if( m_flashUrgent || millis() - m_flashTick >= FLASHLOG_FLUSH_INTERVAL ) FlushFlash();
+  }
+
+  // Erase the next sector ahead, it drops the oldest records a little earlier
+  if( m_flash && !m_flashAhead ) {
+    if( m_flash->erasePage(m_flashBase + FlashNextSector(m_flashAddr)) ) {
+      m_flashAhead = true;
+      m_nFlashErases++;
+    }
+  }
 }
 
 bool LoggerClass::ChangeLogLevel(String &strMsg)
@@ -130,12 +628,28 @@ bool LoggerClass::ChangeLogLevel(String &strMsg)
     lv_sLevel = strMsg;
   }
 
+  // Switch async logging
+  if( lv_sDest.equals("async") ) {
+    if( lv_sLevel.equals("on") || lv_sLevel.equals("1") ) SetAsync(true);
+    else if( lv_sLevel.equals("off") || lv_sLevel.equals("0") ) SetAsync(false);
+    else return false;
+    return true;
+  }
+
   // Parse Log Level
   for( lv_Level = LEVEL_EMERGENCY; lv_Level <= LEVEL_DEBUG; lv_Level++ ) {
     if( lv_sLevel.equals(strLevelNames[lv_Level]) ) break;
   }
   if( lv_Level > LEVEL_DEBUG ) return false;
 
+  // Parse Log Tag
+  for( UC lv_Tag = LOGTAG_ID_STATUS; lv_Tag < LOGTAG_ID_DUMMY; lv_Tag++ ) {
+    if( lv_sDest.equalsIgnoreCase(strTagNames[lv_Tag]) ) {
+      SetTagLevel(lv_Tag, lv_Level);
+      return true;
+    }
+  }
+
   // Parse Log Destination
   for( lv_Dest = LOGDEST_SERIAL; lv_Dest <= LOGDEST_DUMMY; lv_Dest++ ) {
     if( lv_sDest.equals(strDestNames[lv_Dest]) ) break;
@@ -167,6 +681,18 @@ String LoggerClass::PrintDestInfo()
     strShortDesc += "@";
     strShortDesc += strDestNames[lv_Dest];
   }
+  String strTags = "";
+  for( UC lv_Tag = LOGTAG_ID_STATUS; lv_Tag < LOGTAG_ID_DUMMY; lv_Tag++ ) {
+    strTags += String::format(" %s:%s", strTagNames[lv_Tag], strLevelNames[m_tagLevel[lv_Tag]]);
+  }
+  SERIAL_LN("LOG tags:%s, compiled up to: %s", strTags.c_str(), strLevelNames[LOG_COMPILE_LEVEL]);
+  if( m_flash ) {
+    SERIAL_LN("LOG flash: next seq: %lu, records: %lu, bytes: %lu, programmed: %lu, erases: %lu, dropped: %lu",
+        m_flashSeq, m_nFlashRecords, m_nFlashBytes, m_nFlashProgBytes, m_nFlashErases, m_nFlashDropped);
+  }
+  SERIAL_LN("LOG async: %s, deferred: %lu (avg %luus), dropped: %lu, direct: %lu (avg %luus)",
+      m_async ? "on" : "off", m_nAsync, (m_nAsync ? m_usAsync / m_nAsync : 0), m_nDropped,
+      m_nSync, (m_nSync ? m_usSync / m_nSync : 0));
   SERIAL_LN("");
 
   return strShortDesc;
@@ -4,9 +4,14 @@
 #define xlxLogger_h
 
 #include "xliCommon.h"
+#include "flashee-eeprom.h"
 
 #define MAX_MESSAGE_LEN     480
 
+// Async log ring: deferred formatting in idle time
+#define LOG_ASYNC_RECORDS   16          // Number of records, must be power of 2
+#define LOG_ASYNC_ARGS_LEN  48          // Bytes of raw arguments per record
+
 // Log Destination
 enum {
     LOGDEST_SERIAL = 0,
@@ -28,13 +33,64 @@ enum {
     LEVEL_DEBUG,
 };
 
-// Log tags: 3 bytes
+// Log tags: 3 bytes, the first letters must be different
 #define LOGTAG_STATUS         "STA"
 #define LOGTAG_EVENT          "EVT"
 #define LOGTAG_ACTION         "ACT"
 #define LOGTAG_DATA           "DAT"
 #define LOGTAG_MSG            "MSG"
 
+enum {
+    LOGTAG_ID_STATUS = 0,
+    LOGTAG_ID_EVENT,
+    LOGTAG_ID_ACTION,
+    LOGTAG_ID_DATA,
+    LOGTAG_ID_MSG,
+    LOGTAG_ID_DUMMY
+};
+
+// Log calls above this level are removed at compile time
+#ifndef LOG_COMPILE_LEVEL
+#ifdef SYS_RELEASE
+#define LOG_COMPILE_LEVEL     LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL     LEVEL_DEBUG
+#endif
+#endif
+
+// Tag index by the first letter, unknown tags share MSG
+inline UC logTagID(const char *tag)
+{
+  switch( tag[0] ) {
+    case 'S': return LOGTAG_ID_STATUS;
+    case 'E': return LOGTAG_ID_EVENT;
+    case 'A': return LOGTAG_ID_ACTION;
+    case 'D': return LOGTAG_ID_DATA;
+    default: return LOGTAG_ID_MSG;
+  }
+}
+
+// Flash log ring: records never cross a block, blocks are programmed at once
+/// Record: magic(1) len(1) level(1) crc(1) seq(4) time(4) tag(3) text(len-15)
+#define FLASHLOG_BLOCK          256         // Program page of the SPI flash
+#define FLASHLOG_HEAD_LEN       15
+#define FLASHLOG_MAX_TEXT       96
+#define FLASHLOG_MAGIC          0x5A
+#define FLASHLOG_FLUSH_INTERVAL 10000       // Flush a partial block after (ms)
+
+// Compact log record, formatted later by LoggerClass::Process()
+typedef struct
+{
+  volatile UC ready;                // Record is complete
+  UC level;
+  UC argLen;
+  UC reserved;
+  UL time;                          // Time.now() of the call
+  const char *tag;                  // Must be a literal, e.g. LOGTAG_MSG
+  const char *fmt;                  // Must be a literal
+  UC args[LOG_ASYNC_ARGS_LEN];      // Raw arguments, strings are copied
+} LogRecord_t;
+
 //------------------------------------------------------------------
 // Xlight Logger Class
 //------------------------------------------------------------------
@@ -42,19 +98,82 @@ class LoggerClass
 {
 private:
   UC m_level[LOGDEST_DUMMY];
+  UC m_tagLevel[LOGTAG_ID_DUMMY];
+  UC m_maxLevel;                    // Highest level wanted by any destination
   String m_SysID;
 
+  // Async log ring, multiple producers and one consumer
+  BOOL m_async;
+  BOOL m_looping;                   // Process() is being called, records can be deferred
+  BOOL m_draining;
+  LogRecord_t m_records[LOG_ASYNC_RECORDS];
+  volatile UC m_head;               // Next record to reserve
+  UC m_tail;                        // Next record to output
+
+  // Statistics
+  UL m_nAsync;
+  UL m_nSync;
+  UL m_nDropped;
+  UL m_usAsync;                     // Total time spent by callers in micro-seconds
+  UL m_usSync;
+
+  // Flash log ring
+  Flashee::FlashDevice *m_flash;
+  UL m_flashBase;
+  UL m_flashSize;
+  UL m_flashSector;                 // Erase unit, a logical page of whole blocks
+  UL m_flashAddr;                   // Offset of current block
+  BOOL m_flashAhead;                // Next sector is erased
+  UL m_flashSeq;                    // Sequence number of next record
+  UC m_flashBuf[FLASHLOG_BLOCK];    // Current block
+  US m_flashFill;
+  US m_flashFlushed;
+  UL m_flashTick;                   // Last flush
+  BOOL m_flashUrgent;
+  UL m_nFlashRecords;
+  UL m_nFlashBytes;                 // Record bytes
+  UL m_nFlashProgBytes;             // Programmed bytes
+  UL m_nFlashErases;
+  UL m_nFlashDropped;               // Records lost while the next sector was not erased
+
+  void UpdateMaxLevel();
+  void OutputLog(UC level, const char *tag, UL time, const char *buf, int nPrefix);
+  void WriteFlash(UC level, const char *tag, UL time, const char *text);
+  UL FlashNextBlock(UL _offset);
+  UL FlashNextSector(UL _offset);
+  void NextFlashBlock();
+  void DrainAsync();
+  int PushLog(UC level, const char *tag, const char *msg, va_list args);
+  int FormatRecord(const LogRecord_t *pRecord, char *buf, int len, int *pPrefix);
+
 public:
   LoggerClass();
   void Init(String sysid);
 
   BOOL InitFlash(UL addr, UL size);
+  BOOL InitFlash(Flashee::FlashDevice *pDevice, UL addr, UL size);
+  BOOL FlushFlash();
+  UL DumpFlash(UL count);
+  UL GetFlashSeq() { return m_flashSeq; }
+  UL GetFlashErases() { return m_nFlashErases; }
+  UL GetFlashDropped() { return m_nFlashDropped; }
+  UL GetFlashRecordBytes() { return m_nFlashBytes; }
+  UL GetFlashProgBytes() { return m_nFlashProgBytes; }
   BOOL InitSysLog(String host, US port);
   BOOL InitCloud(String url, String uid, String key);
 
   UC GetLevel(UC logDest);
   void SetLevel(UC logDest, UC logLevel);
+  UC GetTagLevel(UC tagID);
+  void SetTagLevel(UC tagID, UC logLevel);
+  // Checked before the arguments are evaluated
+  inline BOOL IsEnabled(UC level, const char *tag) {
+    return( level <= m_maxLevel && level <= m_tagLevel[logTagID(tag)] );
+  }
   void WriteLog(UC level, const char *tag, const char *msg, ...);
+  void Process();
+  void SetAsync(BOOL _async) { m_async = _async; }
+  BOOL GetAsync() { return m_async; }
   bool ChangeLogLevel(String &strMsg);
   String PrintDestInfo();
 };
@@ -63,12 +182,16 @@ public:
 // Function & Class Helper
 //------------------------------------------------------------------
 extern LoggerClass theLog;
-#define LOGA(tag, fmt, ...)       theLog.WriteLog(LEVEL_ALERT, tag, fmt, ##__VA_ARGS__)
-#define LOGC(tag, fmt, ...)       theLog.WriteLog(LEVEL_CRITICAL, tag, fmt, ##__VA_ARGS__)
-#define LOGE(tag, fmt, ...)       theLog.WriteLog(LEVEL_ERROR, tag, fmt, ##__VA_ARGS__)
-#define LOGW(tag, fmt, ...)       theLog.WriteLog(LEVEL_WARNING, tag, fmt, ##__VA_ARGS__)
-#define LOGN(tag, fmt, ...)       theLog.WriteLog(LEVEL_NOTICE, tag, fmt, ##__VA_ARGS__)
-#define LOGI(tag, fmt, ...)       theLog.WriteLog(LEVEL_INFO, tag, fmt, ##__VA_ARGS__)
-#define LOGD(tag, fmt, ...)       theLog.WriteLog(LEVEL_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define LOG_WRITE(level, tag, fmt, ...)  do { \
+    if( (level) <= LOG_COMPILE_LEVEL && theLog.IsEnabled(level, tag) ) theLog.WriteLog(level, tag, fmt, ##__VA_ARGS__); \
+  } while(0)
+
+#define LOGA(tag, fmt, ...)       LOG_WRITE(LEVEL_ALERT, tag, fmt, ##__VA_ARGS__)
+#define LOGC(tag, fmt, ...)       LOG_WRITE(LEVEL_CRITICAL, tag, fmt, ##__VA_ARGS__)
+#define LOGE(tag, fmt, ...)       LOG_WRITE(LEVEL_ERROR, tag, fmt, ##__VA_ARGS__)
+#define LOGW(tag, fmt, ...)       LOG_WRITE(LEVEL_WARNING, tag, fmt, ##__VA_ARGS__)
+#define LOGN(tag, fmt, ...)       LOG_WRITE(LEVEL_NOTICE, tag, fmt, ##__VA_ARGS__)
+#define LOGI(tag, fmt, ...)       LOG_WRITE(LEVEL_INFO, tag, fmt, ##__VA_ARGS__)
+#define LOGD(tag, fmt, ...)       LOG_WRITE(LEVEL_DEBUG, tag, fmt, ##__VA_ARGS__)
 
 #endif /* xlxLogger_h */
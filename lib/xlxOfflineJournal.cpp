@@ -0,0 +1,364 @@
+/**
+ * xlxOfflineJournal.cpp - Xlight store-and-forward journal of cloud events while offline
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * While the cloud is not reachable, sensor readings and device events are
+ * appended to a ring of flash pages (MEM_OFFLINE_DATA) instead of being lost.
+ * 1. Sensor readings are kept in binary, node + (key, float) pairs, about
+ *    9 bytes per reading. Other events keep their JSON text
+ * 2. Every record carries the time it was recorded. The magic byte is
+ *    programmed last, and cleared to 0 once the record has been replayed
+ * 3. Records never straddle pages. Pages are the whole logical pages of the
+ *    device inside the region, so erasing one never touches the neighbours.
+ *    Each page starts with a sequence number, head and tail are found again
+ *    at boot by scanning the page heads
+ * 4. When the ring is full, the oldest page is dropped
+ * 5. NextBatch() packs replayed records of one topic into one cloud event,
+ *    each object gets a 'ts' key with the original time
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxOfflineJournal.h"
+#include "xliMemoryMap.h"
+#include "xlxCloudObj.h"
+#include "xlxLogger.h"
+
+// JSON keys of sensor readings, the index is stored
+static const char *jnlSensorKeys[] = {"DHTt", "DHTh", "ALS", "PIR", "IRK", "GAS",
+    "PM25", "PM10", "TVOC", "CH2O", "CO2", "SMK", "MIC", "NOS"};
+
+//------------------------------------------------------------------
+// Xlight Offline Journal Class
+//------------------------------------------------------------------
+OfflineJournalClass::OfflineJournalClass()
+{
+  m_pDevice = NULL;
+  m_base = 0;
+  m_size = 0;
+  m_pageSize = 0;
+  m_head = 0;
+  m_tail = 0;
+  m_seq = 0;
+  m_pending = 0;
+  m_batchItems = 0;
+  m_nRecords = 0;
+  m_nProgBytes = 0;
+  m_nErases = 0;
+  m_nReplayed = 0;
+  m_nDropped = 0;
+  m_nCorrupt = 0;
+}
+
+UC OfflineJournalClass::GetKeyIndex(const char *_key, const US _len)
+{
+  for( UC i = 0; i < sizeof(jnlSensorKeys) / sizeof(jnlSensorKeys[0]); i++ ) {
+    if( strlen(jnlSensorKeys[i]) == _len && strncmp(jnlSensorKeys[i], _key, _len) == 0 ) return i;
+  }
+  return JNL_KEY_NONE;
+}
+
+const char *OfflineJournalClass::GetKeyName(const UC _key)
+{
+  if( _key >= sizeof(jnlSensorKeys) / sizeof(jnlSensorKeys[0]) ) return NULL;
+  return jnlSensorKeys[_key];
+}
+
+// Find head and tail from the page heads, pDevice is NULL to disable the journal
+BOOL OfflineJournalClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  JournalPage_t _page;
+  JournalHead_t _head;
+
+  m_pDevice = NULL;
+  m_head = m_tail = 0;
+  m_seq = 0;
+  m_pending = 0;
+  m_batchItems = 0;
+  if( !pDevice ) return false;
+  m_pageSize = pDevice->pageSize();
+  m_base = FLASH_PAGE_CEIL(_addr, m_pageSize);
+  if( _addr + _size < m_base + 2 * m_pageSize ) return false;
+  m_size = FLASH_PAGE_FLOOR(_addr + _size, m_pageSize) - m_base;
+
+  // Newest and oldest page by sequence number
+  UL _newest = 0, _oldest = 0, _minSeq = 0;
+  BOOL _found = false;
+  for( UL _offset = 0; _offset < m_size; _offset += m_pageSize ) {
+    if( !pDevice->read(&_page, m_base + _offset, sizeof(_page)) ) return false;
+    if( _page.magic != JNL_PAGE_MAGIC ) continue;
+    if( !_found || _page.seq > m_seq ) {
+      _newest = _offset;
+      m_seq = _page.seq;
+    }
+    if( !_found || _page.seq < _minSeq ) {
+      _oldest = _offset;
+      _minSeq = _page.seq;
+    }
+    _found = true;
+  }
+  m_pDevice = pDevice;
+  if( !_found ) return true;
+
+  // Append behind the last record of the newest page
+  UL _pos = _newest + sizeof(JournalPage_t);
+  while( _pos + sizeof(JournalHead_t) <= _newest + m_pageSize ) {
+    if( !m_pDevice->read(&_head, m_base + _pos, sizeof(_head)) ) return false;
+    if( _head.magic == 0xFF ) {
+      // A blank head is the end, otherwise the last append was cut off
+      const UC *pByte = (const UC *)&_head;
+      for( UC i = 1; i < sizeof(_head); i++ ) {
+        if( pByte[i] != 0xFF ) {
+          _pos = _newest + m_pageSize;
+          break;
+        }
+      }
+      break;
+    }
+    _pos += sizeof(_head) + _head.len;
+  }
+  if( _pos + sizeof(JournalHead_t) > _newest + m_pageSize ) {
+    // Page is full, the next append opens a new one
+    _pos = _newest + m_pageSize;
+    if( _pos >= m_size ) _pos = 0;
+  }
+  m_head = _pos;
+
+  // Count the records not replayed yet, from the oldest page on
+  m_tail = _oldest + sizeof(JournalPage_t);
+  _pos = m_tail;
+  if( SeekRecord(_pos, _head) ) {
+    m_tail = _pos;
+    do {
+      m_pending++;
+      _pos += sizeof(_head) + _head.len;
+    } while( SeekRecord(_pos, _head) );
+  } else {
+    m_tail = m_head;
+  }
+  LOGI(LOGTAG_MSG, "Offline journal seq %lu, %lu records pending", m_seq, m_pending);
+  return true;
+}
+
+// Move _pos to the next record not replayed, false when the head is reached
+BOOL OfflineJournalClass::SeekRecord(UL &_pos, JournalHead_t &_head)
+{
+  while( _pos != m_head ) {
+    UL _inPage = _pos % m_pageSize;
+    if( _inPage == 0 ) {
+      _pos += sizeof(JournalPage_t);
+      continue;
+    }
+    if( _inPage + sizeof(JournalHead_t) <= m_pageSize ) {
+      if( !m_pDevice->read(&_head, m_base + _pos, sizeof(_head)) ) return false;
+      if( (_head.magic == JNL_REC_MAGIC || _head.magic == JNL_REC_DONE)
+          && _inPage + sizeof(_head) + _head.len <= m_pageSize ) {
+        if( _head.magic == JNL_REC_MAGIC ) return true;
+        _pos += sizeof(_head) + _head.len;
+        continue;
+      }
+    }
+    // Rest of the page is blank or torn, go on with the next page
+    UL _next = _pos - _inPage + m_pageSize;
+    if( _next >= m_size ) _next = 0;
+    if( _next == m_head ) {
+      _pos = m_head;
+      break;
+    }
+    _pos = _next + sizeof(JournalPage_t);
+  }
+  return false;
+}
+
+// Erase the page after the head and start appending to it, the oldest page may be dropped
+BOOL OfflineJournalClass::OpenPage()
+{
+  JournalHead_t _head;
+  UL _page = m_head - m_head % m_pageSize;
+  if( m_head % m_pageSize ) _page += m_pageSize;
+  if( _page >= m_size ) _page = 0;
+
+  if( m_pending > 0 && m_tail - m_tail % m_pageSize == _page ) {
+    // Ring is full, drop what is left of the oldest page
+    UL _pos = m_tail;
+    while( SeekRecord(_pos, _head) && _pos - _pos % m_pageSize == _page ) {
+      m_pending--;
+      m_nDropped++;
+      _pos += sizeof(_head) + _head.len;
+    }
+    m_tail = _pos;
+    m_batchItems = 0;
+  }
+
+  m_nErases++;
+  if( !m_pDevice->erasePage(m_base + _page) ) return false;
+  JournalPage_t _pageHead;
+  _pageHead.magic = JNL_PAGE_MAGIC;
+  _pageHead.seq = m_seq + 1;
+  m_nProgBytes += sizeof(_pageHead);
+  if( !m_pDevice->writePage(&_pageHead, m_base + _page, sizeof(_pageHead)) ) return false;
+  m_seq++;
+  m_head = _page + sizeof(JournalPage_t);
+  if( m_pending == 0 ) m_tail = m_head;
+  return true;
+}
+
+// Never append behind a torn record, the next append opens a new page
+void OfflineJournalClass::ClosePage()
+{
+  m_head = m_head - m_head % m_pageSize + m_pageSize;
+  if( m_head >= m_size ) m_head = 0;
+  if( m_pending == 0 ) m_tail = m_head;
+}
+
+BOOL OfflineJournalClass::Append(const UL _time, const UC _type, const UC _node, const void *_data, const UC _len)
+{
+  UC _buf[sizeof(JournalHead_t) + JNL_MAX_PAYLOAD];
+  JournalHead_t *pHead = (JournalHead_t *)_buf;
+  US _total = sizeof(JournalHead_t) + _len;
+
+  if( !m_pDevice || _len > JNL_MAX_PAYLOAD ) return false;
+  if( m_head % m_pageSize == 0 || m_head % m_pageSize + _total > m_pageSize ) {
+    if( !OpenPage() ) {
+      ClosePage();
+      return false;
+    }
+  }
+
+  pHead->magic = 0xFF;
+  pHead->type = _type;
+  pHead->node = _node;
+  pHead->len = _len;
+  pHead->time = _time;
+  memcpy(_buf + sizeof(JournalHead_t), _data, _len);
+
+  // Program head and payload, then the magic byte to commit
+  UL _addr = m_base + m_head;
+  UC _magic = JNL_REC_MAGIC;
+  m_head += _total;
+  m_nProgBytes += _total;
+  if( !m_pDevice->writePage(_buf + 1, _addr + 1, _total - 1) || !m_pDevice->writePage(&_magic, _addr, 1) ) {
+    ClosePage();
+    return false;
+  }
+  m_pending++;
+  m_nRecords++;
+  return true;
+}
+
+// Write one record as a JSON object with its time, returns the length or 0 if unreadable
+US OfflineJournalClass::FormatRecord(const UL _pos, const JournalHead_t &_head, char *_buf, const US _size)
+{
+  UC _data[JNL_MAX_PAYLOAD];
+  int _used;
+
+  if( _head.len > JNL_MAX_PAYLOAD ) return 0;
+  if( !m_pDevice->read(_data, m_base + _pos + sizeof(JournalHead_t), _head.len) ) return 0;
+
+  if( _head.type == JNL_TYPE_READING ) {
+    const JournalReading_t *pReading = (const JournalReading_t *)_data;
+    _used = snprintf(_buf, _size, "{'nd':%d", _head.node);
+    for( UC i = 0; i < _head.len / sizeof(JournalReading_t) && _used < _size; i++, pReading++ ) {
+      const char *_key = GetKeyName(pReading->key);
+      if( !_key ) continue;
+      if( pReading->value == (long)pReading->value ) {
+        _used += snprintf(_buf + _used, _size - _used, ",'%s':%ld", _key, (long)pReading->value);
+      } else {
+        _used += snprintf(_buf + _used, _size - _used, ",'%s':%.2f", _key, pReading->value);
+      }
+    }
+  } else if( _head.len > 1 && _data[0] == '{' && _data[_head.len - 1] == '}' ) {
+    // Object, insert the time before the closing bracket
+    if( _head.len >= _size ) return 0;
+    memcpy(_buf, _data, _head.len - 1);
+    _used = _head.len - 1;
+  } else {
+    if( _head.len >= _size ) return 0;
+    memcpy(_buf, _data, _head.len);
+    _buf[_head.len] = '\0';
+    return _head.len;
+  }
+  if( _used < _size ) _used += snprintf(_buf + _used, _size - _used, ",'ts':%lu}", _head.time);
+  return(_used < _size ? _used : 0);
+}
+
+// Pack the oldest records of one topic, separated by ','. Returns the number of
+// records taken, _len is 0 if they could not be read and should be skipped
+UC OfflineJournalClass::NextBatch(UC &_topic, char *_buf, const US _size, US &_len)
+{
+  JournalHead_t _head;
+  char _obj[JNL_MAX_PAYLOAD + 16 + JNL_MAX_READINGS * 20];
+  UL _pos = m_tail;
+
+  _len = 0;
+  m_batchItems = 0;
+  if( !m_pDevice ) return 0;
+  while( m_batchItems < 255 && SeekRecord(_pos, _head) ) {
+    UC _recTopic = (_head.type == JNL_TYPE_READING ? CLT_ID_SensorData : _head.type);
+    if( m_batchItems > 0 && (_recTopic != _topic || _topic == CLT_ID_Alarm) ) break;
+    US _objLen = FormatRecord(_pos, _head, _obj, sizeof(_obj));
+    if( _objLen == 0 || _objLen > _size ) {
+      if( m_batchItems > 0 ) break;
+      // Unreadable, let it be consumed alone
+      m_nCorrupt++;
+      m_batchItems = 1;
+      _topic = _recTopic;
+      break;
+    }
+    if( m_batchItems > 0 && _len + 1 + _objLen > _size ) break;
+    if( m_batchItems > 0 ) _buf[_len++] = ',';
+    memcpy(_buf + _len, _obj, _objLen);
+    _len += _objLen;
+    _buf[_len] = '\0';
+    _topic = _recTopic;
+    m_batchItems++;
+    _pos += sizeof(_head) + _head.len;
+  }
+  return m_batchItems;
+}
+
+// Mark the records of the last batch replayed
+void OfflineJournalClass::Consume()
+{
+  JournalHead_t _head;
+  UC _done = JNL_REC_DONE;
+  UL _pos = m_tail;
+
+  for( ; m_batchItems > 0 && SeekRecord(_pos, _head); m_batchItems-- ) {
+    m_pDevice->writePage(&_done, m_base + _pos, 1);
+    m_nProgBytes++;
+    _pos += sizeof(_head) + _head.len;
+    m_pending--;
+    m_nReplayed++;
+  }
+  m_batchItems = 0;
+  m_tail = (m_pending > 0 ? _pos : m_head);
+}
+
+void OfflineJournalClass::showStatus()
+{
+  if( !m_pDevice ) {
+    SERIAL_LN("Offline journal: not available");
+    return;
+  }
+  SERIAL_LN("Offline journal: %lu pending, head %lu, tail %lu of %lu bytes, seq %lu", m_pending, m_head, m_tail, m_size, m_seq);
+  SERIAL_LN("  %lu records, %lu bytes programmed, %lu erases, %lu replayed, %lu dropped, %lu corrupt",
+      m_nRecords, m_nProgBytes, m_nErases, m_nReplayed, m_nDropped, m_nCorrupt);
+}
@@ -0,0 +1,96 @@
+//  xlxOfflineJournal.h - Xlight store-and-forward journal of cloud events while offline
+
+#ifndef xlxOfflineJournal_h
+#define xlxOfflineJournal_h
+
+#include "xliCommon.h"
+#include "flashee-eeprom.h"
+
+#define JNL_PAGE_MAGIC            0x4C4E4A58  // "XJNL"
+#define JNL_REC_MAGIC             0xA9
+#define JNL_REC_DONE              0x00        // Replayed
+
+// Record types: sensor readings of one node in binary, or the text of a CLT_ID_* event
+#define JNL_TYPE_READING          0x80
+
+#define JNL_MAX_PAYLOAD           200         // Longest event text
+#define JNL_MAX_READINGS          8           // Readings per record
+#define JNL_KEY_NONE              0xFF
+
+// Record head, the magic byte is programmed last to commit it
+typedef struct
+	__attribute__((packed))
+{
+  UC magic;
+  UC type;                          // JNL_TYPE_READING or CLT_ID_*
+  UC node;                          // Node of readings
+  UC len;                           // Length of payload
+  UL time;                          // Time.now() when recorded
+} JournalHead_t;
+
+// One sensor reading, key is the index of the JSON key
+typedef struct
+	__attribute__((packed))
+{
+  UC key;
+  float value;
+} JournalReading_t;
+
+// Page head, written right after the page is erased
+typedef struct
+	__attribute__((packed))
+{
+  UL magic;
+  UL seq;                           // Highest is the page being appended
+} JournalPage_t;
+
+//------------------------------------------------------------------
+// Xlight Offline Journal Class
+//------------------------------------------------------------------
+class OfflineJournalClass
+{
+public:
+  OfflineJournalClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL IsReady() { return(m_pDevice != NULL); }
+  BOOL Append(const UL _time, const UC _type, const UC _node, const void *_data, const UC _len);
+  UC NextBatch(UC &_topic, char *_buf, const US _size, US &_len);
+  void Consume();
+
+  static UC GetKeyIndex(const char *_key, const US _len);
+  static const char *GetKeyName(const UC _key);
+
+  UL GetPending() { return m_pending; }
+  UL GetRecords() { return m_nRecords; }
+  UL GetProgBytes() { return m_nProgBytes; }
+  UL GetErases() { return m_nErases; }
+  UL GetReplayed() { return m_nReplayed; }
+  UL GetDropped() { return m_nDropped; }
+  void showStatus();
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_base;
+  UL m_size;
+  UL m_pageSize;
+  UL m_head;                        // Append offset, at a page start if no page is open
+  UL m_tail;                        // Oldest record not replayed
+  UL m_seq;
+  UL m_pending;
+  UC m_batchItems;                  // Records of the last NextBatch()
+
+  UL m_nRecords;
+  UL m_nProgBytes;
+  UL m_nErases;
+  UL m_nReplayed;
+  UL m_nDropped;
+  UL m_nCorrupt;
+
+  BOOL SeekRecord(UL &_pos, JournalHead_t &_head);
+  BOOL OpenPage();
+  void ClosePage();
+  US FormatRecord(const UL _pos, const JournalHead_t &_head, char *_buf, const US _size);
+};
+
+#endif /* xlxOfflineJournal_h */
@@ -43,6 +43,9 @@
 #include "xlxLogger.h"
 #include "xlxPanel.h"
 #include "xlxBLEInterface.h"
+#include "xlxStatusPoller.h"
+#include "xlxFirmwareOTA.h"
+#include "xlxRFCapture.h"
 
 #include "MyParserSerial.h"
 
@@ -60,6 +63,19 @@ RF24ServerClass::RF24ServerClass(uint8_t ce, uint8_t cs, uint8_t paLevel)
 	_times = 0;
 	_succ = 0;
 	_received = 0;
+	InitHandlers();
+	memset(m_queries, 0x00, sizeof(m_queries));
+	m_nQrySent = 0;
+	m_nQryReplied = 0;
+	m_nQrySuppressed = 0;
+	m_nQryTimeout = 0;
+	m_nAckStatus = 0;
+	memset(m_recent, 0x00, sizeof(m_recent));
+	m_nDuplicates = 0;
+	m_lane = RF_LANE_CONTROL;
+	memset(m_nLaneSent, 0x00, sizeof(m_nLaneSent));
+	m_nLaneFull = 0;
+	m_nLaneSuperseded = 0;
 }
 
 bool RF24ServerClass::ServerBegin(uint8_t channel, uint8_t paLevel, uint8_t dataRate)
@@ -397,11 +413,35 @@ bool RF24ServerClass::ProcessSend(MyMessage *pMsg)
 		ConvertRepeatMsg(pMsg);
 	}
 
-	// Add message to sending MQ. Right now tag has no actual purpose (just for debug)
+	// Skip the query if the same one is still waiting for reply
+	if( !TrackQuery(*pMsg, millis()) ) {
+		LOGD(LOGTAG_MSG, "Query %d-%d to %d in flight, skipped", pMsg->getCommand(), pMsg->getType(), pMsg->getDestination());
+		return true;
+	}
+
+	// Keep the last slots for user commands and scenarios
+	UC lv_lane = GetLane(*pMsg);
+	if( lv_lane > RF_LANE_SCENE && GetMQLength() + RF_MQ_RESERVED >= GetMQMaxLength() ) {
+		m_nLaneFull++;
+		LOGW(LOGTAG_MSG, "sendMQ full for lane %d", lv_lane);
+		return false;
+	}
+
+	// Add message to sending MQ, tag is the lane
 	uint32_t flag = 0;
 	flag = ((uint32_t)pMsg->getSensor()<<24) | ((uint32_t)pMsg->getCommand()<<16) | ((uint32_t)pMsg->getType()<<8) | (pMsg->getDestination());
+
+	// A user command supersedes rule actions still waiting for the same destination,
+	/// which would go after it and overwrite it. Broadcast supersedes all of them
+	if( lv_lane == RF_LANE_CONTROL && pMsg->getCommand() == C_SET ) {
+		UC lv_drop = RemoveMessages(RF_LANE_SCENE, flag, (pMsg->getDestination() == BROADCAST_ADDRESS ? 0x00FF0000 : 0x00FF00FF));
+		if( lv_drop > 0 ) {
+			m_nLaneSuperseded += lv_drop;
+			LOGD(LOGTAG_MSG, "%d scene commands to %d superseded", lv_drop, pMsg->getDestination());
+		}
+	}
 	//LOGD(LOGTAG_MSG, "flag=%d,d=%d,cmd=%d,type=%d,sensor=%d",flag,pMsg->getDestination(),pMsg->getCommand(),pMsg->getType(),pMsg->getSensor());
-	if( AddMessage((UC *)&(pMsg->msg), MAX_MESSAGE_LENGTH, GetMQLength(), flag) > 0 ) {
+	if( AddMessage((UC *)&(pMsg->msg), MAX_MESSAGE_LENGTH, lv_lane, flag) > 0 ) {
 		_times++;
 		//LOGD(LOGTAG_MSG, "Add sendMQ len:%d", GetMQLength());
 		return true;
@@ -411,6 +451,25 @@ bool RF24ServerClass::ProcessSend(MyMessage *pMsg)
 	return false;
 }
 
+// Lane of C_SET messages, returns the previous one
+UC RF24ServerClass::SetLane(const UC _lane)
+{
+	UC lv_lane = m_lane;
+	m_lane = min(_lane, RF_LANES - 1);
+	return lv_lane;
+}
+
+UC RF24ServerClass::GetLane(MyMessage &_msg)
+{
+	UC lv_cmd = _msg.getCommand();
+	if( lv_cmd == C_INTERNAL || lv_cmd == C_PRESENTATION ) return RF_LANE_CONFIG;
+	// Forwarded status and other acks
+	if( _msg.isAck() ) return RF_LANE_BACKGROUND;
+	if( lv_cmd == C_SET ) return m_lane;
+	if( lv_cmd == C_REQ ) return RF_LANE_QUERY;
+	return RF_LANE_BACKGROUND;
+}
+
 void RF24ServerClass::ConvertRepeatMsg(MyMessage *pMsg)
 {
 	// Note: change relative value to absolute value
@@ -511,6 +570,11 @@ bool RF24ServerClass::PeekMessage()
 	  }
 
 	  _received++;
+	  theCapture.Record(RFCAP_DIR_RX, lv_pData, len, millis());
+	  if( IsDuplicate(lv_msg, millis()) ) {
+	    LOGD(LOGTAG_MSG, "Dropped repeated msg %d-%d from:%d", lv_msg.getCommand(), lv_msg.getType(), lv_msg.getSender());
+	    continue;
+	  }
 	  LOGD(LOGTAG_MSG, "Received from pipe %d msg-len=%d, from:%d to:%d dest:%d cmd:%d type:%d sensor:%d payl-len:%d",
 	        pipe, len, lv_msg.getSender(), to, lv_msg.getDestination(), lv_msg.getCommand(),
 	        lv_msg.getType(), lv_msg.getSensor(), lv_msg.getLength());
@@ -519,369 +583,652 @@ bool RF24ServerClass::PeekMessage()
 	return true;
 }
 
-// Parse and process message in MQ
-bool RF24ServerClass::ProcessReceiveMQ()
+//------------------------------------------------------------------
+// Handlers of received messages, registered by (command, type)
+//------------------------------------------------------------------
+// On ID Request message: allocate NodeID and send response
+static bool OnIDRequest(MyMessage &_msg, const UC _sender)
 {
-	bool msgReady;
-	UC len, payl_len;
-	UC replyTo, _sensor, msgType, transTo;
-	bool _bIsAck, _needAck;
-	UC *payload;
-	UC _bValue;
-	US _iValue;
 	char strDisplay[SENSORDATA_JSON_SIZE];
-	String strTemp;
+	char cNodeType = (char)_msg.getSensor();
+	uint64_t nIdentity = _msg.getUInt64();
+	UC newID = theConfig.lstNodes.requestNodeID(_sender, cNodeType, nIdentity);
+
+	/// Send response message
+	_msg.build(theRadio.getAddress(), _sender, newID, C_INTERNAL, I_ID_RESPONSE, false, true);
+	if( newID > 0 ) {
+		_msg.set(theRadio.getMyNetworkID(), nIdentity);
+		LOGN(LOGTAG_EVENT, "Allocated NodeID:%d type:%c to %s", newID, cNodeType, PrintUint64(strDisplay, nIdentity));
+	} else {
+		LOGW(LOGTAG_MSG, "Failed to allocate NodeID type:%c to %s", cNodeType, PrintUint64(strDisplay, nIdentity));
+	}
+	return true;
+}
 
-  while (Length() > 0) {
+static bool OnNodeConfig(MyMessage &_msg, const UC _sender)
+{
+	if( _msg.isAck() && _msg.getSensor() == NCF_QUERY ) {
+		theSys.GotNodeConfigAck(_sender, (UC *)_msg.getCustom());
+	}
+	return false;
+}
 
-		msgReady = false;
-	  len = Remove(MAX_MESSAGE_LENGTH, msgData);
-		payl_len = msg.getLength();
-		_sensor = msg.getSensor();
-		msgType = msg.getType();
-		replyTo = msg.getSender();
-		_bIsAck = msg.isAck();
-		_needAck = msg.isReqAck();
-		payload = (uint8_t *)msg.getCustom();
-
-		/*
-	  memset(strDisplay, 0x00, sizeof(strDisplay));
-	  msg.getJsonString(strDisplay);
-	  SERIAL_LN("  JSON: %s, len: %d", strDisplay, strlen(strDisplay));
-	  memset(strDisplay, 0x00, sizeof(strDisplay));
-	  SERIAL_LN("  Serial: %s, len: %d", msg.getSerialString(strDisplay), strlen(strDisplay));
-		*/
-		LOGD(LOGTAG_MSG, "Will process cmd:%d from:%d type:%d sensor:%d",
-					msg.getCommand(), replyTo, msgType, _sensor);
+// Reboot node
+static bool OnReboot(MyMessage &_msg, const UC _sender)
+{
+	UC transTo = _msg.getDestination();
+	ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(transTo);
+	if( DevStatusRowPtr ) {
+		_msg.build(_sender, transTo, _msg.getSensor(), C_INTERNAL, I_REBOOT, false);
+		_msg.set((unsigned int)DevStatusRowPtr->data.token);
+		return true;
+	}
+	return false;
+}
 
-	  switch( msg.getCommand() )
-	  {
-	    case C_INTERNAL:
-	      if( msgType == I_ID_REQUEST ) {
-	        // On ID Request message:
-	        /// Get new ID
-					char cNodeType = (char)_sensor;
-					uint64_t nIdentity = msg.getUInt64();
-	        UC newID = theConfig.lstNodes.requestNodeID(replyTo, cNodeType, nIdentity);
-
-	        /// Send response message
-	        msg.build(getAddress(), replyTo, newID, C_INTERNAL, I_ID_RESPONSE, false, true);
-					if( newID > 0 ) {
-		        msg.set(getMyNetworkID(), nIdentity);
-		        LOGN(LOGTAG_EVENT, "Allocated NodeID:%d type:%c to %s", newID, cNodeType, PrintUint64(strDisplay, nIdentity));
-					} else {
-						LOGW(LOGTAG_MSG, "Failed to allocate NodeID type:%c to %s", cNodeType, PrintUint64(strDisplay, nIdentity));
-					}
-					msgReady = true;
-	      } else if( msgType == I_CONFIG ) {
-					if( _bIsAck ) {
-						if( _sensor == NCF_QUERY ) {
-							theSys.GotNodeConfigAck(replyTo, payload);
-						}
-					}
-				} else if( msgType == I_REBOOT ) {
-					// Reboot node
-					transTo = msg.getDestination();
-					ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(transTo);
-					if( DevStatusRowPtr ) {
-						msg.build(replyTo, transTo, _sensor, C_INTERNAL, I_REBOOT, false);
-						msg.set((unsigned int)DevStatusRowPtr->data.token);
-						msgReady = true;
-					}
+// Ack of firmware chunks
+static bool OnFirmwareRequest(MyMessage &_msg, const UC _sender)
+{
+	if( _msg.getLength() < sizeof(OTAAck_t) ) return false;
+	OTAAck_t lv_ack;
+	memcpy(&lv_ack, _msg.getCustom(), sizeof(lv_ack));
+	theOTA.GotAck(_sender, lv_ack, millis());
+	return false;
+}
+
+// RF Scanner Probe
+static bool OnScanner(MyMessage &_msg, const UC _sender)
+{
+	UC payl_len = _msg.getLength();
+	UC *payload = (UC *)_msg.getCustom();
+	if( _sender == NODEID_RF_SCANNER ) {
+		if( payload[0] == SCANNER_PROBE ) {
+			theRadio.MsgScanner_ProbeAck();
+		} else if( payload[0] == SCANNER_SETUP_RF ) {
+			if( _msg.getDestination() == NODEID_GATEWAY )
+				theRadio.Process_SetupRF(payload + 1, payl_len - 1);
+		} else if( payload[0] == SCANNER_SETUPDEV_RF ) {
+			uint8_t mac[6] = {0};
+			theSys.GetMac(mac);
+			if( isIdentityEqual(payload + 1, mac, sizeof(mac)) )
+				theRadio.Process_SetupRF(payload + 1 + LEN_NODE_IDENTITY, payl_len - 1 - LEN_NODE_IDENTITY);
+		}
+	}
+	return false;
+}
+
+// Sensor data reported by presentation messages
+static void OnSensorData(MyMessage &_msg, const UC _sender)
+{
+	UC _sensor = _msg.getSensor();
+	UC msgType = _msg.getType();
+	UC payl_len = _msg.getLength();
+	UC *payload = (UC *)_msg.getCustom();
+	US _iValue;
+
+	ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(_sender);
+	if (DevStatusRowPtr) theSys.ConfirmLampPresent(DevStatusRowPtr, true);
+	if( _sensor == S_MOTION || _sensor == S_IR ) {
+		if( msgType == V_STATUS) { // PIR
+			theSys.UpdateMotion(_sender, _sensor, _msg.getByte());
+		}
+	} else if( _sensor == S_LIGHT_LEVEL ) {
+		if( msgType == V_LIGHT_LEVEL) { // ALS
+			theSys.UpdateBrightness(_sender, _msg.getByte());
+		}
+	} else if( _sensor == S_SOUND ) {
+		if( msgType == V_STATUS ) { // MIC
+			theSys.UpdateSound(_sender, payload[0]);
+		} else if( msgType == V_LEVEL ) {
+			_iValue = payload[1] * 256 + payload[0];
+			theSys.UpdateNoise(_sender, _iValue);
+		}
+	} else if( _sensor == S_TEMP || _sensor == S_HUM ) {
+		float lv_flt1 = 255, lv_flt2 = 255;
+		if( msgType == V_LEVEL && payl_len >= 4 ) {
+			lv_flt1 = payload[0] + payload[1] / 100.0;
+			lv_flt2 = payload[2] + payload[3] / 100.0;
+		} else if( _sensor == S_TEMP && msgType == V_TEMP ) {
+			lv_flt1 = payload[0] + payload[1] / 100.0;
+		} else if( _sensor == S_HUM && msgType == V_HUM ) {
+			lv_flt2 = payload[0] + payload[1] / 100.0;
+		}
+		theSys.UpdateDHT(_sender, lv_flt1, lv_flt2);
+	} else if( _sensor == S_DUST || _sensor == S_AIR_QUALITY || _sensor == S_SMOKE ) {
+		if( msgType == V_LEVEL ) { // Dust, Gas or Smoke
+			_iValue = payload[1] * 256 + payload[0];
+			if( _sensor == S_DUST ) {
+				theSys.UpdateDust(_sender, _iValue);
+			} else if( _sensor == S_AIR_QUALITY ) {
+				if(payl_len >= 10)
+				{
+					US pm10 = payload[3] * 256 + payload[2];
+					float tvoc = (payload[5] * 256 + payload[4])/10.0;
+					float ch2o = (payload[7] * 256 + payload[6])/10.0;
+					US co2 = payload[9] * 256 + payload[8];
+					theSys.UpdateAirQuality(_sender, _iValue,pm10,tvoc,ch2o,co2);
 				}
-				else if( msgType == I_GET_NONCE ) {
-      // RF Scanner Probe
-        if( replyTo == NODEID_RF_SCANNER ) {
-          if( payload[0] == SCANNER_PROBE ) {
-            MsgScanner_ProbeAck();
-          } else if( payload[0] == SCANNER_SETUP_RF ) {
-						transTo = msg.getDestination();
-						if(transTo == NODEID_GATEWAY)
-              Process_SetupRF(payload + 1,payl_len-1);
-          }
-					else if( payload[0] == SCANNER_SETUPDEV_RF ) {
-						uint8_t mac[6] = {0};
-						//WiFi.macAddress(mac);
-						theSys.GetMac(mac);
-						if(isIdentityEqual(payload + 1,mac,sizeof(mac)))
-						  Process_SetupRF(payload + 1 + LEN_NODE_IDENTITY, payl_len - 1 - LEN_NODE_IDENTITY);
-          }
-        }
-      }
-	      break;
-
-			case C_PRESENTATION:
-				if( _sensor == S_LIGHT || _sensor == S_DIMMER || _sensor == S_ZENSENSOR || _sensor == S_ZENREMOTE ) {
-					US token;
-					if( _needAck ) {
-						// Presentation message: appear of Smart Lamp
-						// Verify credential, return token if true, and change device status
-						UC lv_nNodeID = msg.getSender();
-						UC lv_assoDev;
-						uint64_t nIdentity = msg.getUInt64();
-						if( IS_GROUP_NODEID(lv_nNodeID) || IS_SPECIAL_NODEID(lv_nNodeID) || _sensor == S_ZENSENSOR || _sensor == S_ZENREMOTE ) {
-							token = 6666;
-						} else {
-							token = theSys.VerifyDevicePresence(&lv_assoDev, lv_nNodeID, msgType, nIdentity);
-						}
-						if( token ) {
-							// return token
-							// Notes: lampType & S_LIGHT (msgType) are not necessary, use for associated device
-			        msg.build(getAddress(), replyTo, _sensor, C_PRESENTATION, lv_assoDev, false, true);
-							msg.set((unsigned int)token);
-							msgReady = true;
-							// ToDo: send status req to this lamp
-						} else {
-							LOGW(LOGTAG_MSG, "Unqualitied device connect attemp received");
-						}
-					}
+				else
+				{
+					theSys.UpdateGas(_sender, _iValue);
+				}
+			} else if( _sensor == S_SMOKE ) {
+				theSys.UpdateSmoke(_sender, _iValue);
+			}
+		}
+	}
+}
+
+// Presentation of lamps and remotes, or sensor data
+static bool OnPresentation(MyMessage &_msg, const UC _sender)
+{
+	UC _sensor = _msg.getSensor();
+	if( _sensor == S_LIGHT || _sensor == S_DIMMER || _sensor == S_ZENSENSOR || _sensor == S_ZENREMOTE ) {
+		US token;
+		if( _msg.isReqAck() ) {
+			// Presentation message: appear of Smart Lamp
+			// Verify credential, return token if true, and change device status
+			UC lv_assoDev;
+			uint64_t nIdentity = _msg.getUInt64();
+			if( IS_GROUP_NODEID(_sender) || IS_SPECIAL_NODEID(_sender) || _sensor == S_ZENSENSOR || _sensor == S_ZENREMOTE ) {
+				token = 6666;
+			} else {
+				token = theSys.VerifyDevicePresence(&lv_assoDev, _sender, _msg.getType(), nIdentity);
+			}
+			if( token ) {
+				// return token
+				// Notes: lampType & S_LIGHT (msgType) are not necessary, use for associated device
+				_msg.build(theRadio.getAddress(), _sender, _sensor, C_PRESENTATION, lv_assoDev, false, true);
+				_msg.set((unsigned int)token);
+				return true;
+				// ToDo: send status req to this lamp
+			} else {
+				LOGW(LOGTAG_MSG, "Unqualitied device connect attemp received");
+			}
+		}
+	} else {
+		OnSensorData(_msg, _sender);
+	}
+	return false;
+}
+
+// Device status request or ack, registered for each supported type
+static bool OnDeviceStatus(MyMessage &_msg, const UC _sender)
+{
+	UC _sensor = _msg.getSensor();
+	UC msgType = _msg.getType();
+	UC payl_len = _msg.getLength();
+	UC *payload = (UC *)_msg.getCustom();
+	bool _bIsAck = _msg.isAck();
+	String strTemp;
+
+	//transTo = (msg.getDestination() == getAddress() ? _sensor : msg.getDestination());
+	UC transTo = _msg.getDestination();
+	BOOL bDataChanged = false;
+	if( _bIsAck ) {
+		if( msgType == V_STATUS ||  msgType == V_PERCENTAGE ) {
+			if( IS_SPECIAL_NODEID(_sender) ) {
+				// Publish Special Node Status
+				if( msgType == V_STATUS ) {
+					strTemp = String::format("{'nd':%d,'State':%d}", _sender, payload[0]);
 				} else {
-					ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(replyTo);
-					if (DevStatusRowPtr) theSys.ConfirmLampPresent(DevStatusRowPtr, true);
-					if( _sensor == S_MOTION || _sensor == S_IR ) {
-						if( msgType == V_STATUS) { // PIR
-							theSys.UpdateMotion(replyTo, _sensor, msg.getByte());
-						}
-					} else if( _sensor == S_LIGHT_LEVEL ) {
-						if( msgType == V_LIGHT_LEVEL) { // ALS
-							theSys.UpdateBrightness(replyTo, msg.getByte());
-						}
-					} else if( _sensor == S_SOUND ) {
-						if( msgType == V_STATUS ) { // MIC
-							theSys.UpdateSound(replyTo, payload[0]);
-						} else if( msgType == V_LEVEL ) {
-							_iValue = payload[1] * 256 + payload[0];
-							theSys.UpdateNoise(replyTo, _iValue);
-						}
-					} else if( _sensor == S_TEMP || _sensor == S_HUM ) {
-						float lv_flt1 = 255, lv_flt2 = 255;
-						if( msgType == V_LEVEL && payl_len >= 4 ) {
-							lv_flt1 = payload[0] + payload[1] / 100.0;
-							lv_flt2 = payload[2] + payload[3] / 100.0;
-						} else if( _sensor == S_TEMP && msgType == V_TEMP ) {
-							lv_flt1 = payload[0] + payload[1] / 100.0;
-						} else if( _sensor == S_HUM && msgType == V_HUM ) {
-							lv_flt2 = payload[0] + payload[1] / 100.0;
-						}
-						theSys.UpdateDHT(replyTo, lv_flt1, lv_flt2);
-					} else if( _sensor == S_DUST || _sensor == S_AIR_QUALITY || _sensor == S_SMOKE ) {
-						if( msgType == V_LEVEL ) { // Dust, Gas or Smoke
-							_iValue = payload[1] * 256 + payload[0];
-							if( _sensor == S_DUST ) {
-								theSys.UpdateDust(replyTo, _iValue);
-							} else if( _sensor == S_AIR_QUALITY ) {
-								if(payl_len >= 10)
-								{
-								  US pm10 = payload[3] * 256 + payload[2];
-									float tvoc = (payload[5] * 256 + payload[4])/10.0;
-									float ch2o = (payload[7] * 256 + payload[6])/10.0;
-									US co2 = payload[9] * 256 + payload[8];
-									theSys.UpdateAirQuality(replyTo, _iValue,pm10,tvoc,ch2o,co2);
-								}
-								else
-								{
-									theSys.UpdateGas(replyTo, _iValue);
-								}
-							} else if( _sensor == S_SMOKE ) {
-								theSys.UpdateSmoke(replyTo, _iValue);
-							}
-						}
-					}
+					strTemp = String::format("{'nd':%d,'State':%d,'BR':%d}", _sender, payload[0], payload[1]);
 				}
-				break;
-
-			case C_REQ:
-				if( msgType == V_STATUS || msgType == V_PERCENTAGE || msgType == V_LEVEL
-					  || msgType == V_RGBW || msgType == V_DISTANCE || msgType == V_VAR1
-					  || msgType == V_RELAY_ON || msgType == V_RELAY_OFF || msgType == V_RELAY_MAP ) {
-					//transTo = (msg.getDestination() == getAddress() ? _sensor : msg.getDestination());
-					transTo = msg.getDestination();
-					BOOL bDataChanged = false;
-					if( _bIsAck ) {
-						//SERIAL_LN("REQ ack:%d to: %d 0x%x-0x%x-0x%x-0x%x-0x%x-0x%x-0x%x", msgType, transTo, payload[0],payload[1], payload[2], payload[3], payload[4],payload[5],payload[6]);
-						if( msgType == V_STATUS ||  msgType == V_PERCENTAGE ) {
-							if( IS_SPECIAL_NODEID(replyTo) ) {
-								// Publish Special Node Status
-								if( msgType == V_STATUS ) {
-									strTemp = String::format("{'nd':%d,'State':%d}", replyTo, payload[0]);
-								} else {
-									strTemp = String::format("{'nd':%d,'State':%d,'BR':%d}", replyTo, payload[0], payload[1]);
-								}
-								theSys.PublishDeviceStatus(strTemp.c_str());
-								bDataChanged = true;
-							} else {
-								bDataChanged |= theSys.ConfirmLampBrightness(replyTo, payload[0], payload[1]);
-							}
-						} else if( msgType == V_LEVEL ) {
-							bDataChanged |= theSys.ConfirmLampCCT(replyTo, (US)msg.getUInt());
-						} else if( msgType == V_RGBW ) {
-							if( payload[0] ) {	// Succeed or not
-								static bool bFirstRGBW = true;		// Make sure the first message will be sent anyway
-								UC _devType = payload[1];	// payload[2] is present status
-								UC _ringID = payload[3];
-								if( IS_SUNNY(_devType) ) {
-									// Sunny
-									US _CCTValue = payload[7] * 256 + payload[6];
-									bDataChanged |= theSys.ConfirmLampCCT(replyTo, _CCTValue, _ringID);
-									bDataChanged |= theSys.ConfirmLampBrightness(replyTo, payload[4], payload[5], _ringID);
-									bDataChanged |= bFirstRGBW;
-									bFirstRGBW = false;
-								} else if( IS_RAINBOW(_devType) || IS_MIRAGE(_devType) ) {
-									// Rainbow or Mirage, set RBGW
-									bDataChanged |= theSys.ConfirmLampHue(replyTo, payload[6], payload[7], payload[8], payload[9], _ringID);
-									bDataChanged |= theSys.ConfirmLampBrightness(replyTo, payload[4], payload[5], _ringID);
-									bDataChanged |= bFirstRGBW;
-									bFirstRGBW = false;
-								}
-							}
-						} else if( msgType == V_VAR1 ) { // Change special effect ack
-							bDataChanged |= theSys.ConfirmLampFilter(replyTo, payload[0]);
-						} else if( msgType == V_DISTANCE && payload[0] ) {
-							UC _devType = payload[1];	// payload[2] is present status
-							if( IS_MIRAGE(_devType) ) {
-								bDataChanged |= theSys.ConfirmLampTop(replyTo, payload, payl_len);
-							}
-						} else if( msgType == V_RELAY_ON || msgType == V_RELAY_OFF ) {
-							// Publish Relay Status
-							strTemp = String::format("{'nd':%d,'k_%s':'%c'}", replyTo, msgType == V_RELAY_ON ? "on" : "off", payload[0]);
-							theSys.PublishDeviceStatus(strTemp.c_str());
-							//bDataChanged = true;
-						} else if( msgType == V_RELAY_MAP ) {
-							// Publish Relay Status
-							strTemp = String::format("{'nd':%d,'subid':%d,'km':%d}", replyTo, _sensor,payload[0]);
-							theSys.PublishDeviceStatus(strTemp.c_str());
-							//bDataChanged = true;
-						}
-
-						// If data changed, new status must broadcast to all end points
-						if( bDataChanged ) {
-							transTo = BROADCAST_ADDRESS;
-						}
-					} /* else { // Request
-						// ToDo: verify token
-					} */
-
-					// ToDo: if lamp is not present, return error
-					if( transTo > 0 ) {
-						// Transfer message
-						msg.build(replyTo, transTo, _sensor, C_REQ, msgType, _needAck, _bIsAck, true);
-						// Keep payload unchanged
-						msgReady = true;
-					}
+				theSys.PublishDeviceStatus(strTemp.c_str());
+				bDataChanged = true;
+			} else {
+				bDataChanged |= theSys.ConfirmLampBrightness(_sender, payload[0], payload[1]);
+			}
+		} else if( msgType == V_LEVEL ) {
+			bDataChanged |= theSys.ConfirmLampCCT(_sender, (US)_msg.getUInt());
+		} else if( msgType == V_RGBW ) {
+			thePoller.GotReply(_sender, millis());
+			if( payload[0] ) {	// Succeed or not
+				static bool bFirstRGBW = true;		// Make sure the first message will be sent anyway
+				UC _devType = payload[1];	// payload[2] is present status
+				UC _ringID = payload[3];
+				if( IS_SUNNY(_devType) ) {
+					// Sunny
+					US _CCTValue = payload[7] * 256 + payload[6];
+					bDataChanged |= theSys.ConfirmLampCCT(_sender, _CCTValue, _ringID);
+					bDataChanged |= theSys.ConfirmLampBrightness(_sender, payload[4], payload[5], _ringID);
+					bDataChanged |= bFirstRGBW;
+					bFirstRGBW = false;
+				} else if( IS_RAINBOW(_devType) || IS_MIRAGE(_devType) ) {
+					// Rainbow or Mirage, set RBGW
+					bDataChanged |= theSys.ConfirmLampHue(_sender, payload[6], payload[7], payload[8], payload[9], _ringID);
+					bDataChanged |= theSys.ConfirmLampBrightness(_sender, payload[4], payload[5], _ringID);
+					bDataChanged |= bFirstRGBW;
+					bFirstRGBW = false;
 				}
-				break;
-
-			case C_SET:
-				// ToDo: verify token
-				// ToDo: if lamp is not present, return error
-				transTo = msg.getDestination();
-				if( transTo == NODEID_PROJECTOR ) {
-					// PPT control
-					if( msgType == V_STATUS ) {
+			}
+		} else if( msgType == V_VAR1 ) { // Change special effect ack
+			bDataChanged |= theSys.ConfirmLampFilter(_sender, payload[0]);
+		} else if( msgType == V_DISTANCE && payload[0] ) {
+			UC _devType = payload[1];	// payload[2] is present status
+			if( IS_MIRAGE(_devType) ) {
+				bDataChanged |= theSys.ConfirmLampTop(_sender, payload, payl_len);
+			}
+		} else if( msgType == V_RELAY_ON || msgType == V_RELAY_OFF ) {
+			// Publish Relay Status
+			strTemp = String::format("{'nd':%d,'k_%s':'%c'}", _sender, msgType == V_RELAY_ON ? "on" : "off", payload[0]);
+			theSys.PublishDeviceStatus(strTemp.c_str());
+			//bDataChanged = true;
+		} else if( msgType == V_RELAY_MAP ) {
+			// Publish Relay Status
+			strTemp = String::format("{'nd':%d,'subid':%d,'km':%d}", _sender, _sensor,payload[0]);
+			theSys.PublishDeviceStatus(strTemp.c_str());
+			//bDataChanged = true;
+		}
+
+		// If data changed, new status must broadcast to all end points
+		if( bDataChanged ) {
+			transTo = BROADCAST_ADDRESS;
+		}
+	} /* else { // Request
+		// ToDo: verify token
+	} */
+
+	// ToDo: if lamp is not present, return error
+	if( transTo > 0 ) {
+		// Transfer message
+		_msg.build(_sender, transTo, _sensor, C_REQ, msgType, _msg.isReqAck(), _bIsAck, true);
+		// Keep payload unchanged
+		return true;
+	}
+	return false;
+}
+
+static bool OnSetCommand(MyMessage &_msg, const UC _sender)
+{
+	UC _sensor = _msg.getSensor();
+	UC msgType = _msg.getType();
+	UC *payload = (UC *)_msg.getCustom();
+	bool _bIsAck = _msg.isAck();
+	bool _needAck = _msg.isReqAck();
+	UC _bValue;
+
+	// ToDo: verify token
+	// ToDo: if lamp is not present, return error
+	UC transTo = _msg.getDestination();
+	if( transTo == NODEID_PROJECTOR ) {
+		// PPT control
+		if( msgType == V_STATUS ) {
 #ifndef DISABLE_BLE
-						// Keep payload unchanged
-						msg.build(replyTo, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
-						// Convert to serial format
-						memset(strDisplay, 0x00, sizeof(strDisplay));
-						msg.getSerialString(strDisplay);
-						if( theBLE.isGood() ) theBLE.sendCommand(strDisplay);
+			char strDisplay[SENSORDATA_JSON_SIZE];
+			// Keep payload unchanged
+			_msg.build(_sender, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
+			// Convert to serial format
+			memset(strDisplay, 0x00, sizeof(strDisplay));
+			_msg.getSerialString(strDisplay);
+			if( theBLE.isGood() ) theBLE.sendCommand(strDisplay);
 #endif
+		}
+	} else if( transTo == NODEID_KEYSIMULATOR ) {
+		// Transfer message to Key Simuluator, use _sensor to identify subID
+		_msg.build(_sender, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
+		// Keep payload unchanged
+		return true;
+	} else {
+		//transTo = (msg.getDestination() == getAddress() ? _sensor : msg.getDestination());
+		if( transTo > 0 ) {
+			bool lv_skip = false;
+			// Remote turns on or set scene: make sure hardswitch is on
+			if( msgType == V_STATUS ) { //&& !IS_NOT_REMOTE_NODEID(replyTo) ) {
+				if( theConfig.GetHardwareSwitch() ) {
+					_bValue = payload[0];
+					if( _bValue == DEVICE_SW_TOGGLE ) _bValue = 1 - theSys.GetDevOnOff(transTo);
+					if( _bValue == DEVICE_SW_OFF ) {
+						lv_skip = theSys.DeviceSwitch(DEVICE_SW_OFF, 1, transTo, _sensor);
+					} else {
+						lv_skip = theSys.DevSoftSwitch(DEVICE_SW_ON, transTo, _sensor);
+						if( lv_skip ) theSys.HardConfirmOnOff(transTo, _sensor, DEVICE_SW_ON);
 					}
-				} else if( transTo == NODEID_KEYSIMULATOR ) {
-					// Transfer message to Key Simuluator, use _sensor to identify subID
-					msg.build(replyTo, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
-					// Keep payload unchanged
-					msgReady = true;
 				} else {
-					//transTo = (msg.getDestination() == getAddress() ? _sensor : msg.getDestination());
-					if( transTo > 0 ) {
-						bool lv_skip = false;
-						// Remote turns on or set scene: make sure hardswitch is on
-						if( msgType == V_STATUS ) { //&& !IS_NOT_REMOTE_NODEID(replyTo) ) {
-							if( theConfig.GetHardwareSwitch() ) {
-								_bValue = payload[0];
-								if( _bValue == DEVICE_SW_TOGGLE ) _bValue = 1 - theSys.GetDevOnOff(transTo);
-								if( _bValue == DEVICE_SW_OFF ) {
-									lv_skip = theSys.DeviceSwitch(DEVICE_SW_OFF, 1, transTo, _sensor);
-								} else {
-									lv_skip = theSys.DevSoftSwitch(DEVICE_SW_ON, transTo, _sensor);
-									if( lv_skip ) theSys.HardConfirmOnOff(transTo, _sensor, DEVICE_SW_ON);
-								}
-							} else {
-								theSys.MakeSureHardSwitchOn(transTo, _sensor);
-							}
-						}
-
-						if( msgType == V_SCENE_ON ) {
-							theSys.ChangeLampScenario(transTo, payload[0], replyTo, _sensor);
-						}	else if(!lv_skip) {
-							// Transfer message
-							msg.build(replyTo, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
-							// Keep payload unchanged
-							msgReady = true;
-						}
-					}
+					theSys.MakeSureHardSwitchOn(transTo, _sensor);
 				}
-				break;
+			}
 
-	    default:
-	      break;
-	  }
+			if( msgType == V_SCENE_ON ) {
+				theSys.ChangeLampScenario(transTo, payload[0], _sender, _sensor);
+			}	else if(!lv_skip) {
+				// Transfer message
+				_msg.build(_sender, transTo, _sensor, C_SET, msgType, _needAck, _bIsAck, true);
+				// Keep payload unchanged
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void RF24ServerClass::InitHandlers()
+{
+	memset(m_handlers, 0x00, sizeof(m_handlers));
+	memset(m_hdlIndex, 0x00, sizeof(m_hdlIndex));
+	memset(m_hdlAny, 0x00, sizeof(m_hdlAny));
+	m_nHandlers = 0;
+	m_nUnhandled = 0;
+
+	// Most frequent frames first, the order only matters for showHandlers()
+	RegisterHandler(C_PRESENTATION, RF_TYPE_ANY, OnPresentation, "present");
+	RegisterHandler(C_REQ, V_STATUS, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_PERCENTAGE, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_LEVEL, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_RGBW, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_DISTANCE, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_VAR1, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_RELAY_ON, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_RELAY_OFF, OnDeviceStatus, "status");
+	RegisterHandler(C_REQ, V_RELAY_MAP, OnDeviceStatus, "status");
+	RegisterHandler(C_SET, RF_TYPE_ANY, OnSetCommand, "set");
+	RegisterHandler(C_INTERNAL, I_ID_REQUEST, OnIDRequest, "idreq");
+	RegisterHandler(C_INTERNAL, I_CONFIG, OnNodeConfig, "config");
+	RegisterHandler(C_INTERNAL, I_REBOOT, OnReboot, "reboot");
+	RegisterHandler(C_INTERNAL, I_GET_NONCE, OnScanner, "scanner");
+	RegisterHandler(C_STREAM, ST_FIRMWARE_REQUEST, OnFirmwareRequest, "ota");
+}
+
+// Register or replace the handler of (command, type), RF_TYPE_ANY for all other types of the command
+bool RF24ServerClass::RegisterHandler(const UC _cmd, const UC _type, RFHandler_t _handler, const char *_name)
+{
+	if( _cmd > C_STREAM || !_handler ) return false;
+	if( _type != RF_TYPE_ANY && _type >= RF_MAX_TYPES ) return false;
+
+	UC lv_idx = (_type == RF_TYPE_ANY ? m_hdlAny[_cmd] : m_hdlIndex[_cmd][_type]);
+	if( !lv_idx ) {
+		if( m_nHandlers >= RF_MAX_HANDLERS ) {
+			LOGE(LOGTAG_MSG, "Too many RF handlers, %d-%d not registered", _cmd, _type);
+			return false;
+		}
+		lv_idx = ++m_nHandlers;
+		if( _type == RF_TYPE_ANY ) {
+			m_hdlAny[_cmd] = lv_idx;
+		} else {
+			m_hdlIndex[_cmd][_type] = lv_idx;
+		}
+	}
+
+	RFHandlerEntry_t *lv_entry = m_handlers + lv_idx - 1;
+	lv_entry->cmd = _cmd;
+	lv_entry->type = _type;
+	lv_entry->handler = _handler;
+	lv_entry->name = _name;
+	lv_entry->hits = 0;
+	lv_entry->us = 0;
+	return true;
+}
+
+// Exact (command, type) first, then RF_TYPE_ANY of the command
+RFHandlerEntry_t *RF24ServerClass::GetHandler(const UC _cmd, const UC _type)
+{
+	if( _cmd > C_STREAM ) return NULL;
+	UC lv_idx = (_type < RF_MAX_TYPES ? m_hdlIndex[_cmd][_type] : 0);
+	if( !lv_idx ) lv_idx = m_hdlAny[_cmd];
+	return(lv_idx ? m_handlers + lv_idx - 1 : NULL);
+}
+
+void RF24ServerClass::showHandlers()
+{
+	SERIAL_LN("RF handlers: %d registered, %lu unhandled, %lu duplicates dropped", m_nHandlers, m_nUnhandled, m_nDuplicates);
+	for( UC i = 0; i < m_nHandlers; i++ ) {
+		RFHandlerEntry_t *lv_entry = m_handlers + i;
+		if( lv_entry->type == RF_TYPE_ANY ) {
+			SERIAL_LN("  %d-*\t%s\thits:%lu, %lu us", lv_entry->cmd, lv_entry->name, lv_entry->hits, lv_entry->us);
+		} else {
+			SERIAL_LN("  %d-%d\t%s\thits:%lu, %lu us", lv_entry->cmd, lv_entry->type, lv_entry->name, lv_entry->hits, lv_entry->us);
+		}
+	}
+}
 
+//------------------------------------------------------------------
+// Duplicate suppression of received frames, keyed by sender and frame hash
+//------------------------------------------------------------------
+UL RF24ServerClass::FrameHash(MyMessage &_msg)
+{
+	UC lv_key[4] = {_msg.getCommand(), _msg.getType(), _msg.getSensor(), _msg.isAck()};
+	UC *lv_payl = (UC *)_msg.getCustom();
+	UC lv_len = min(_msg.getLength(), MAX_PAYLOAD);
+	UL lv_hash = 2166136261UL;
+	for( UC i = 0; i < sizeof(lv_key); i++ ) {
+		lv_hash = (lv_hash ^ lv_key[i]) * 16777619UL;
+	}
+	for( UC i = 0; i < lv_len; i++ ) {
+		lv_hash = (lv_hash ^ lv_payl[i]) * 16777619UL;
+	}
+	return lv_hash;
+}
+
+// A frame equal to one the sender sent within RTE_TM_RF_DUP is a retransmission after
+// our auto-ack was lost. Otherwise it replaces the older way in the set of the sender,
+// node IDs are allocated in sequence so their low bits select the set
+bool RF24ServerClass::IsDuplicate(MyMessage &_msg, const UL _now)
+{
+	UC lv_node = _msg.getSender();
+	UL lv_hash = FrameHash(_msg);
+	RFRecent_t *lv_set = m_recent[lv_node & (RF_DUP_SETS - 1)];
+	RFRecent_t *lv_old = lv_set;
+	for( UC i = 0; i < RF_DUP_WAYS; i++ ) {
+		if( lv_set[i].node == lv_node && lv_set[i].hash == lv_hash && _now - lv_set[i].time < RTE_TM_RF_DUP ) {
+			m_nDuplicates++;
+			return true;
+		}
+		if( (long)(lv_set[i].time - lv_old->time) < 0 ) lv_old = lv_set + i;
+	}
+	lv_old->node = lv_node;
+	lv_old->hash = lv_hash;
+	lv_old->time = _now;
+	return false;
+}
+
+//------------------------------------------------------------------
+// Correlation of queries and replies, keyed by node, command, type and sensor
+//------------------------------------------------------------------
+// Find the outstanding query, expired ones are released
+RFQuery_t *RF24ServerClass::FindQuery(const UC _node, const UC _cmd, const UC _type, const UC _sensor, const UL _now)
+{
+	RFQuery_t *lv_found = NULL;
+	for( UC i = 0; i < MQ_MAX_RF_QUERY; i++ ) {
+		RFQuery_t *lv_query = m_queries + i;
+		if( !lv_query->node ) continue;
+		if( (long)(_now - lv_query->deadline) >= 0 ) {
+			lv_query->node = 0;
+			m_nQryTimeout++;
+		} else if( lv_query->node == _node && lv_query->cmd == _cmd && lv_query->type == _type && lv_query->sensor == _sensor ) {
+			lv_found = lv_query;
+		}
+	}
+	return lv_found;
+}
+
+// Status requests and node config queries to one node expect a reply.
+// Returns false if the same query is in flight and shouldn't be sent again
+bool RF24ServerClass::TrackQuery(MyMessage &_msg, const UL _now)
+{
+	UC lv_node = _msg.getDestination();
+	UC lv_cmd = _msg.getCommand();
+	UC lv_type = _msg.getType();
+	UC lv_sensor = _msg.getSensor();
+
+	if( _msg.isAck() || lv_node == NODEID_GATEWAY || lv_node == BROADCAST_ADDRESS || IS_GROUP_NODEID(lv_node) ) return true;
+	if( lv_cmd == C_INTERNAL ) {
+		if( lv_type != I_CONFIG || lv_sensor != NCF_QUERY ) return true;
+	} else if( lv_cmd != C_REQ ) {
+		return true;
+	}
+
+	if( FindQuery(lv_node, lv_cmd, lv_type, lv_sensor, _now) ) {
+		m_nQrySuppressed++;
+		return false;
+	}
+
+	// Take a free slot, or the one closest to its deadline
+	RFQuery_t *lv_slot = m_queries;
+	for( UC i = 0; i < MQ_MAX_RF_QUERY; i++ ) {
+		if( !m_queries[i].node ) {
+			lv_slot = m_queries + i;
+			break;
+		}
+		if( (long)(m_queries[i].deadline - lv_slot->deadline) < 0 ) lv_slot = m_queries + i;
+	}
+	lv_slot->node = lv_node;
+	lv_slot->cmd = lv_cmd;
+	lv_slot->type = lv_type;
+	lv_slot->sensor = lv_sensor;
+	lv_slot->deadline = _now + RTE_TM_RF_QUERY;
+	m_nQrySent++;
+	return true;
+}
+
+// Release the query answered by this ack
+bool RF24ServerClass::CompleteQuery(MyMessage &_msg, const UL _now)
+{
+	if( _msg.getCommand() == C_INTERNAL && _msg.getSensor() != NCF_QUERY ) return false;
+	RFQuery_t *lv_query = FindQuery(_msg.getSender(), _msg.getCommand(), _msg.getType(), _msg.getSensor(), _now);
+	if( lv_query ) {
+		lv_query->node = 0;
+		m_nQryReplied++;
+		return true;
+	}
+	return false;
+}
+
+UC RF24ServerClass::GetPendingQueries(const UL _now)
+{
+	UC lv_count = 0;
+	FindQuery(0, 0, 0, 0, _now);
+	for( UC i = 0; i < MQ_MAX_RF_QUERY; i++ ) {
+		if( m_queries[i].node ) lv_count++;
+	}
+	return lv_count;
+}
+
+void RF24ServerClass::showQueries()
+{
+	SERIAL_LN("RF queries: %d pending, %lu sent, %lu replied, %lu timeout, %lu suppressed",
+			GetPendingQueries(millis()), m_nQrySent, m_nQryReplied, m_nQryTimeout, m_nQrySuppressed);
+	SERIAL_LN("  %lu status in ack payload", m_nAckStatus);
+	SERIAL_LN("sendMQ: %d of %d, sent by lane %lu/%lu/%lu/%lu/%lu, %lu refused, %lu superseded", GetMQLength(), GetMQMaxLength(),
+			m_nLaneSent[RF_LANE_CONTROL], m_nLaneSent[RF_LANE_SCENE], m_nLaneSent[RF_LANE_QUERY],
+			m_nLaneSent[RF_LANE_CONFIG], m_nLaneSent[RF_LANE_BACKGROUND], m_nLaneFull, m_nLaneSuperseded);
+}
+
+// Status a device returned in the payload of auto-ack has the same layout as
+// its V_RGBW status reply, so it is queued and handled as that reply
+bool RF24ServerClass::ProcessAckPayload(const UC _node, const UC *_data, const UC _len)
+{
+	if( IS_NOT_DEVICE_NODEID(_node) || _len < RF_ACK_STATUS_LEN || _len > MAX_PAYLOAD ) return false;
+
+	MyMessage lv_msg;
+	lv_msg.build(_node, NODEID_GATEWAY, 0, C_REQ, V_RGBW, false, true);
+	lv_msg.set((void *)_data, _len);
+	theCapture.Record(RFCAP_DIR_RX, (UC *)&(lv_msg.msg), HEADER_SIZE + _len, millis());
+	if( Append((UC *)&(lv_msg.msg), MAX_MESSAGE_LENGTH) <= 0 ) return false;
+	m_nAckStatus++;
+	return true;
+}
+
+// Parse and process message in MQ
+bool RF24ServerClass::ProcessReceiveMQ()
+{
+	RFHandlerEntry_t *lv_entry;
+	UC replyTo;
+	UL lv_start;
+
+  while (Length() > 0) {
+
+	  Remove(MAX_MESSAGE_LENGTH, msgData);
+		replyTo = msg.getSender();
+		LOGD(LOGTAG_MSG, "Will process cmd:%d from:%d type:%d sensor:%d",
+					msg.getCommand(), replyTo, msg.getType(), msg.getSensor());
+
+		if( msg.isAck() ) CompleteQuery(msg, millis());
+
+		lv_entry = GetHandler(msg.getCommand(), msg.getType());
+		if( !lv_entry ) {
+			m_nUnhandled++;
+			continue;
+		}
+
+		lv_start = micros();
 		// Send reply message
-		if( msgReady ) {
+		if( lv_entry->handler(msg, replyTo) ) {
 			ProcessSend(&msg);
 		}
+		lv_entry->hits++;
+		lv_entry->us += micros() - lv_start;
 	}
 
   return true;
 }
 
-// Scan sendMQ and send messages, repeat if necessary
+// Send the most urgent messages in sendMQ, repeat if necessary. Messages go while
+// RF_SEND_BUDGET ms last, each one picked by lane, so a user command queued meanwhile
+// goes next. Called from SelfCheck() as well, see there
 bool RF24ServerClass::ProcessSendMQ()
 {
 	MyMessage lv_msg;
 	UC *pData = (UC *)&(lv_msg.msg);
-	CFastMessageNode *pNode = NULL, *pOld;
+	CFastMessageNode *pOld;
 	UC pipe, _repeat;
 	UC _tag = 0;
 	uint32_t _flag = 0;
 	bool _remove = false;
+	UC lv_ack[MAX_MESSAGE_LENGTH];
+	UC lv_ackLen;
+	UL lv_start = millis();
+
+	while( GetMQLength() > 0 && millis() - lv_start < RF_SEND_BUDGET ) {
+		// Lowest lane first, see GetUrgentMessage() for aging
+		pOld = GetUrgentMessage(RTE_TM_RF_AGING, RF_TM_RESEND);
+		if( !pOld ) break;
+		// Get message data
+		if( pOld->ReadMessage(pData, &_repeat, &_tag, &_flag, RF_TM_RESEND) > 0 )
+		{
+			// Determine pipe
+			if( lv_msg.getCommand() == C_INTERNAL && lv_msg.getType() == I_ID_RESPONSE && lv_msg.isAck() ) {
+				pipe = CURRENT_NODE_PIPE;
+			} else if(lv_msg.getType() == I_GET_NONCE_RESPONSE && lv_msg.getDestination() == NODEID_RF_SCANNER)	{
+				pipe = CURRENT_NODE_PIPE;
+			} else {
+				pipe = PRIVATE_NET_PIPE;
+			}
 
-	if( GetMQLength() > 0 ) {
-		while( pNode = GetMessage(pNode) ) {
-			pOld = pNode;
-			// Next node
-			pNode = pOld->m_pNext;
-			// Get message data
-			if( pOld->ReadMessage(pData, &_repeat, &_tag, &_flag,15) > 0 )
-			{
-				// Determine pipe
-				if( lv_msg.getCommand() == C_INTERNAL && lv_msg.getType() == I_ID_RESPONSE && lv_msg.isAck() ) {
-					pipe = CURRENT_NODE_PIPE;
-				} else if(lv_msg.getType() == I_GET_NONCE_RESPONSE && lv_msg.getDestination() == NODEID_RF_SCANNER)	{
-					pipe = CURRENT_NODE_PIPE;
-				} else {
-					pipe = PRIVATE_NET_PIPE;
-				}
+			// Move received frames to receive MQ first, stopListening() in send() flushes the RX FIFO.
+			/// Frames arriving between here and stopListening() are still lost
+			PeekMessage();
+			// Send message
+			_remove = send(lv_msg.getDestination(), lv_msg, pipe);
+			theCapture.Record(RFCAP_DIR_TX, pData, HEADER_SIZE + lv_msg.getLength(), millis());
+			lv_ackLen = getAckPayload(lv_ack);
+			if( lv_ackLen > 0 && lv_msg.getCommand() != C_SET ) {
+				ProcessAckPayload(lv_msg.getDestination(), lv_ack, lv_ackLen);
+			}
+#ifdef RF24_ACK_PAYLOAD
+			// Ack of a command carries the status from before it, query to confirm.
+			/// Nodes answer this query in auto-ack only, see RF24_ACK_PAYLOAD
+			if( _remove && lv_msg.getCommand() == C_SET && !IS_NOT_DEVICE_NODEID(lv_msg.getDestination()) ) {
+				MyMessage lv_req;
+				lv_req.build(NODEID_GATEWAY, lv_msg.getDestination(), 0, C_REQ, V_RGBW, false);
+				ProcessSend(&lv_req);
+			}
+#endif
+			LOGD(LOGTAG_MSG, "RF-send msg %d-%d lane %d to %d pipe %d tried %d %s", lv_msg.getCommand(), lv_msg.getType(), _tag, lv_msg.getDestination(), pipe, _repeat, _remove ? "OK" : "Failed");
 
-				// Send message
-				_remove = send(lv_msg.getDestination(), lv_msg, pipe);
-				LOGD(LOGTAG_MSG, "RF-send msg %d-%d tag %d to %d pipe %d tried %d %s", lv_msg.getCommand(), lv_msg.getType(), _tag, lv_msg.getDestination(), pipe, _repeat, _remove ? "OK" : "Failed");
+			// Determine whether requires retry
+			if( lv_msg.getDestination() == BROADCAST_ADDRESS || IS_GROUP_NODEID(lv_msg.getDestination()) ) {
+				if( _remove && _repeat == 1 ) _succ++;
+				_remove = (_repeat > theConfig.GetBcMsgRptTimes());
+			} else {
+				if( _remove ) _succ++;
+				if( _repeat > theConfig.GetNdMsgRptTimes() ) 	_remove = true;
+			}
 
-				// Determine whether requires retry
-				if( lv_msg.getDestination() == BROADCAST_ADDRESS || IS_GROUP_NODEID(lv_msg.getDestination()) ) {
-					if( _remove && _repeat == 1 ) _succ++;
-					_remove = (_repeat > theConfig.GetBcMsgRptTimes());
-				} else {
-					if( _remove ) _succ++;
-					if( _repeat > theConfig.GetNdMsgRptTimes() ) 	_remove = true;
-				}
+			if( _tag < RF_LANES ) m_nLaneSent[_tag]++;
 
-				// Remove message if succeeded or retried enough times
-				if( _remove ) {
-					RemoveMessage(pOld);
-				}
+			// Remove message if succeeded or retried enough times
+			if( _remove ) {
+				RemoveMessage(pOld);
 			}
 		}
 	}
@@ -889,7 +1236,6 @@ bool RF24ServerClass::ProcessSendMQ()
 	return true;
 }
 
-
 //////////////////rfscanner//////////////////////////
 bool RF24ServerClass::MsgScanner_ProbeAck()
 {
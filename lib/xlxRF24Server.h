@@ -7,6 +7,53 @@
 #include "MessageQ.h"
 #include "MyTransportNRF24.h"
 
+#define RF_MAX_HANDLERS           24
+#define RF_MAX_TYPES              64          // Higher types only match RF_TYPE_ANY
+#define RF_TYPE_ANY               0xFF
+#define RF_ACK_STATUS_LEN         8           // Shortest device status in ack payload
+
+// Lanes of sendMQ, lower lane first
+#define RF_LANE_CONTROL           0           // User commands
+#define RF_LANE_SCENE             1           // Rule actions, scenarios asked by users are control
+#define RF_LANE_QUERY             2           // Status and config queries
+#define RF_LANE_CONFIG            3           // Node config and other internal messages
+#define RF_LANE_BACKGROUND        4           // Status forwarding, firmware chunks, etc.
+#define RF_LANES                  5
+#define RF_MQ_RESERVED            2           // sendMQ slots only control and scene messages take
+#define RF_SEND_BUDGET            4           // ms of sending per ProcessSendMQ(), lanes are checked for each message
+#define RF_TM_RESEND              15          // 10ms before a message is sent again
+
+// Handler of a received message from _sender, returns true if _msg has been rebuilt to be sent
+typedef bool (*RFHandler_t)(MyMessage &_msg, const UC _sender);
+
+typedef struct
+{
+  UC cmd;
+  UC type;                          // RF_TYPE_ANY for all other types of cmd
+  RFHandler_t handler;
+  const char *name;
+  UL hits;
+  UL us;                            // Cumulative processing time
+} RFHandlerEntry_t;
+
+// Outstanding query waiting for its reply
+typedef struct
+{
+  UC node;                          // 0 for free slot
+  UC cmd;
+  UC type;
+  UC sensor;                        // Ring or sensor asked for
+  UL deadline;                      // millis()
+} RFQuery_t;
+
+// Recent frame of a sender
+typedef struct
+{
+  UC node;
+  UL hash;                          // FNV-1a over command, type, sensor and payload
+  UL time;                          // millis() of the first copy
+} RFRecent_t;
+
 // RF24 Server class
 class RF24ServerClass : public MyTransportNRF24, public CDataQueue, public CFastMessageQ
 {
@@ -29,10 +76,30 @@ public:
   void Process_SetupRF(const UC *rfData,uint8_t rflen);
   /////////////////rfscanner//////////////////////////
 
+  UC SetLane(const UC _lane);
+  UC GetLane(MyMessage &_msg);
   bool ProcessMQ();
   bool ProcessSendMQ();
   bool ProcessReceiveMQ();
 
+  bool RegisterHandler(const UC _cmd, const UC _type, RFHandler_t _handler, const char *_name);
+  RFHandlerEntry_t *GetHandler(const UC _cmd, const UC _type);
+  UL GetUnhandled() { return m_nUnhandled; }
+  void showHandlers();
+
+  bool TrackQuery(MyMessage &_msg, const UL _now);
+  bool CompleteQuery(MyMessage &_msg, const UL _now);
+  UC GetPendingQueries(const UL _now);
+  UL GetSuppressedQueries() { return m_nQrySuppressed; }
+  void showQueries();
+
+  bool ProcessAckPayload(const UC _node, const UC *_data, const UC _len);
+  UL GetAckStatus() { return m_nAckStatus; }
+
+  bool IsDuplicate(MyMessage &_msg, const UL _now);
+  UL GetDuplicates() { return m_nDuplicates; }
+  static UL FrameHash(MyMessage &_msg);
+
   bool PeekMessage();
 
   unsigned long _times;
@@ -40,6 +107,30 @@ public:
   unsigned long _received;
 
 private:
+  RFHandlerEntry_t m_handlers[RF_MAX_HANDLERS];
+  UC m_nHandlers;
+  UC m_hdlIndex[C_STREAM + 1][RF_MAX_TYPES]; // Handler index + 1 of (cmd, type), 0 for none
+  UC m_hdlAny[C_STREAM + 1];
+  UL m_nUnhandled;
+
+  RFQuery_t m_queries[MQ_MAX_RF_QUERY];
+  UL m_nQrySent;
+  UL m_nQryReplied;
+  UL m_nQrySuppressed;
+  UL m_nQryTimeout;
+  UL m_nAckStatus;
+
+  UC m_lane;                        // Lane of C_SET messages
+  UL m_nLaneSent[RF_LANES];
+  UL m_nLaneFull;
+  UL m_nLaneSuperseded;             // Scene commands dropped for a user command to the same node
+
+  RFRecent_t m_recent[RF_DUP_SETS][RF_DUP_WAYS];
+  UL m_nDuplicates;
+
+  RFQuery_t *FindQuery(const UC _node, const UC _cmd, const UC _type, const UC _sensor, const UL _now);
+
+  void InitHandlers();
   void ConvertRepeatMsg(MyMessage *pMsg);
 };
 
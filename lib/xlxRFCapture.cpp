@@ -0,0 +1,269 @@
+/**
+ * xlxRFCapture.cpp - Xlight capture and replay of RF frames
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Frames received in PeekMessage() and sent in ProcessSendMQ() are kept
+ * in a ring of RFCAP_BUF_SIZE bytes, to reproduce field traffic offline.
+ * 1. A record is a 3 bytes head (ms since the previous record, direction
+ *    and length) and the raw frame, oldest records are dropped when full
+ * 2. The ring is dumped to serial in hex, or saved to P1 flash with a
+ *    head and CRC32 and loaded back after reboot. Saving rewrites the
+ *    pages, so the neighbours of the area are kept
+ * 3. Replay feeds received frames to ProcessReceiveMQ() at their original
+ *    pace, or some times faster. Capture is paused during replay
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxRFCapture.h"
+#include "xlxLogger.h"
+#include "xlxRF24Server.h"
+
+//------------------------------------------------------------------
+// the one and only instance of RFCaptureClass
+RFCaptureClass theCapture;
+
+RFCaptureClass::RFCaptureClass()
+{
+  m_pDevice = NULL;
+  m_addr = 0;
+  m_size = 0;
+  m_isOn = false;
+  m_isReplaying = false;
+  m_wasOn = false;
+  m_nRecorded = 0;
+  m_nDropped = 0;
+  m_nReplayed = 0;
+  Clear();
+}
+
+void RFCaptureClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  m_pDevice = pDevice;
+  m_addr = _addr;
+  m_size = _size;
+}
+
+void RFCaptureClass::Clear()
+{
+  m_head = 0;
+  m_len = 0;
+  m_count = 0;
+  m_tmFirst = 0;
+  m_tmLast = 0;
+}
+
+void RFCaptureClass::Put(const void *_data, const US _len)
+{
+  US lv_pos = (m_head + m_len) % RFCAP_BUF_SIZE;
+  US lv_part = min(_len, RFCAP_BUF_SIZE - lv_pos);
+  memcpy(m_buf + lv_pos, _data, lv_part);
+  if( lv_part < _len ) memcpy(m_buf, (const UC *)_data + lv_part, _len - lv_part);
+  m_len += _len;
+}
+
+void RFCaptureClass::Get(const US _pos, void *_data, const US _len)
+{
+  US lv_pos = (m_head + _pos) % RFCAP_BUF_SIZE;
+  US lv_part = min(_len, RFCAP_BUF_SIZE - lv_pos);
+  memcpy(_data, m_buf + lv_pos, lv_part);
+  if( lv_part < _len ) memcpy((UC *)_data + lv_part, m_buf, _len - lv_part);
+}
+
+void RFCaptureClass::DropOldest()
+{
+  RFCapHead_t lv_head;
+  Get(0, &lv_head, sizeof(lv_head));
+  US lv_size = sizeof(lv_head) + (lv_head.info & 0x7F);
+  m_head = (m_head + lv_size) % RFCAP_BUF_SIZE;
+  m_len -= lv_size;
+  m_count--;
+  m_nDropped++;
+  if( m_count > 0 ) {
+    // The next record becomes the first one
+    Get(0, &lv_head, sizeof(lv_head));
+    m_tmFirst += lv_head.delta;
+  }
+}
+
+void RFCaptureClass::Record(const UC _dir, const UC *_frame, const UC _len, const UL _now)
+{
+  if( !m_isOn ) return;
+
+  RFCapHead_t lv_head;
+  UC lv_len = min(_len, MAX_MESSAGE_LENGTH);
+  while( m_count > 0 && RFCAP_BUF_SIZE - m_len < sizeof(lv_head) + lv_len ) {
+    DropOldest();
+  }
+  if( m_count == 0 ) {
+    m_tmFirst = _now;
+    lv_head.delta = 0;
+  } else {
+    lv_head.delta = min(_now - m_tmLast, RFCAP_MAX_DELTA);
+  }
+  lv_head.info = (_dir == RFCAP_DIR_TX ? 0x80 : 0x00) | lv_len;
+  Put(&lv_head, sizeof(lv_head));
+  Put(_frame, lv_len);
+  m_count++;
+  m_tmLast = _now;
+  m_nRecorded++;
+}
+
+// Read the record at _pos and move _pos to the next one, _time is the time of
+// the previous record unless _pos is 0. _frame takes up to MAX_MESSAGE_LENGTH bytes
+BOOL RFCaptureClass::GetRecord(US &_pos, UL &_time, UC &_dir, UC *_frame, UC &_len)
+{
+  if( _pos >= m_len ) return false;
+
+  RFCapHead_t lv_head;
+  Get(_pos, &lv_head, sizeof(lv_head));
+  _time = (_pos == 0 ? m_tmFirst : _time + lv_head.delta);
+  _dir = (lv_head.info & 0x80 ? RFCAP_DIR_TX : RFCAP_DIR_RX);
+  _len = (lv_head.info & 0x7F);
+  Get(_pos + sizeof(lv_head), _frame, _len);
+  _pos += sizeof(lv_head) + _len;
+  return true;
+}
+
+BOOL RFCaptureClass::Save()
+{
+  if( !m_pDevice || sizeof(RFCapDump_t) + m_len > m_size ) return false;
+
+  RFCapDump_t lv_dump;
+  US lv_part = min(m_len, RFCAP_BUF_SIZE - m_head);
+  lv_dump.magic = RFCAP_MAGIC;
+  lv_dump.tmFirst = m_tmFirst;
+  lv_dump.len = m_len;
+  lv_dump.count = m_count;
+  lv_dump.crc = CRC32(m_buf + m_head, lv_part);
+  if( lv_part < m_len ) lv_dump.crc = CRC32(m_buf, m_len - lv_part, lv_dump.crc);
+
+  // The area shares logical pages with its neighbours, so it is only rewritten,
+  // never erased. Invalidate the old dump, write records, then commit with the head
+  UL lv_magic = 0;
+  if( !m_pDevice->write(lv_magic, m_addr) ) return false;
+  UL lv_addr = m_addr + sizeof(lv_dump);
+  if( lv_part > 0 && !m_pDevice->write(m_buf + m_head, lv_addr, lv_part) ) return false;
+  if( lv_part < m_len && !m_pDevice->write(m_buf, lv_addr + lv_part, m_len - lv_part) ) return false;
+  if( !m_pDevice->write(lv_dump, m_addr) ) return false;
+  LOGI(LOGTAG_MSG, "RF capture saved, %d records", m_count);
+  return true;
+}
+
+BOOL RFCaptureClass::Load()
+{
+  if( !m_pDevice || m_isReplaying ) return false;
+
+  RFCapDump_t lv_dump;
+  if( !m_pDevice->read(&lv_dump, m_addr, sizeof(lv_dump)) ) return false;
+  if( lv_dump.magic != RFCAP_MAGIC || lv_dump.len > RFCAP_BUF_SIZE || sizeof(lv_dump) + lv_dump.len > m_size ) return false;
+
+  Clear();
+  if( !m_pDevice->read(m_buf, m_addr + sizeof(lv_dump), lv_dump.len) ) return false;
+  if( CRC32(m_buf, lv_dump.len) != lv_dump.crc ) {
+    LOGW(LOGTAG_MSG, "RF capture corrupt");
+    return false;
+  }
+  m_len = lv_dump.len;
+  m_count = lv_dump.count;
+  m_tmFirst = lv_dump.tmFirst;
+
+  // Time of the last record to continue capture
+  US lv_pos = 0;
+  UC lv_frame[MAX_MESSAGE_LENGTH];
+  UC lv_dir, lv_len;
+  m_tmLast = m_tmFirst;
+  while( GetRecord(lv_pos, m_tmLast, lv_dir, lv_frame, lv_len) );
+  return true;
+}
+
+BOOL RFCaptureClass::StartReplay(const UC _speed, const UL _now)
+{
+  if( m_isReplaying || m_count == 0 ) return false;
+  m_wasOn = m_isOn;
+  m_isOn = false;
+  m_isReplaying = true;
+  m_rpSpeed = _speed;
+  m_rpPos = 0;
+  m_rpTime = m_tmFirst;
+  m_rpStart = _now;
+  LOGI(LOGTAG_MSG, "RF replay %d records, speed %d", m_count, _speed);
+  return true;
+}
+
+// Feed the received frames that are due, returns number of frames fed
+UC RFCaptureClass::Replay(const UL _now)
+{
+  if( !m_isReplaying ) return 0;
+
+  UC lv_frame[MAX_MESSAGE_LENGTH];
+  UC lv_dir, lv_len;
+  UC lv_fed = 0;
+  US lv_pos;
+  UL lv_time;
+  while( lv_fed < RFCAP_REPLAY_BURST ) {
+    lv_pos = m_rpPos;
+    lv_time = m_rpTime;
+    if( !GetRecord(lv_pos, lv_time, lv_dir, lv_frame, lv_len) ) {
+      m_isReplaying = false;
+      m_isOn = m_wasOn;
+      LOGI(LOGTAG_MSG, "RF replay done in %lums", _now - m_rpStart);
+      break;
+    }
+    if( m_rpSpeed > 0 && (lv_time - m_tmFirst) / m_rpSpeed > _now - m_rpStart ) break;
+    m_rpPos = lv_pos;
+    m_rpTime = lv_time;
+    if( lv_dir != RFCAP_DIR_RX ) continue;
+
+    memset(lv_frame + lv_len, 0x00, MAX_MESSAGE_LENGTH - lv_len);
+    if( theRadio.Append(lv_frame, MAX_MESSAGE_LENGTH) <= 0 ) break;
+    theRadio.ProcessReceiveMQ();
+    lv_fed++;
+    m_nReplayed++;
+  }
+  return lv_fed;
+}
+
+void RFCaptureClass::showStatus()
+{
+  SERIAL_LN("RF capture: %s, %d records, %d bytes, recorded:%lu, dropped:%lu", m_isOn ? "on" : "off",
+      m_count, m_len, m_nRecorded, m_nDropped);
+  if( m_isReplaying ) {
+    SERIAL_LN("  replaying at %d, %d of %d bytes", m_rpSpeed, m_rpPos, m_len);
+  }
+  SERIAL_LN("  replayed:%lu", m_nReplayed);
+}
+
+// One record per line: ms since the first record, direction and frame in hex
+void RFCaptureClass::Dump()
+{
+  UC lv_frame[MAX_MESSAGE_LENGTH];
+  char strHex[MAX_MESSAGE_LENGTH * 2 + 1];
+  UC lv_dir, lv_len;
+  US lv_pos = 0;
+  UL lv_time = 0;
+  while( GetRecord(lv_pos, lv_time, lv_dir, lv_frame, lv_len) ) {
+    for( UC i = 0; i < lv_len; i++ ) {
+      sprintf(strHex + i * 2, "%02X", lv_frame[i]);
+    }
+    strHex[lv_len * 2] = 0;
+    SERIAL_LN("%lu %s %s", lv_time - m_tmFirst, lv_dir == RFCAP_DIR_TX ? "tx" : "rx", strHex);
+  }
+}
@@ -0,0 +1,107 @@
+//  xlxRFCapture.h - Xlight capture and replay of RF frames
+
+#ifndef xlxRFCapture_h
+#define xlxRFCapture_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+#include "flashee-eeprom.h"
+
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define RFCAP_BUF_SIZE            1024
+#else
+#define RFCAP_BUF_SIZE            2048
+#endif
+
+#define RFCAP_MAGIC               0x50414358  // "XCAP"
+#define RFCAP_MAX_DELTA           0xFFFF      // Longer gaps are recorded as this
+#define RFCAP_REPLAY_BURST        16          // Frames fed per Replay()
+
+// Direction of frame
+#define RFCAP_DIR_RX              0
+#define RFCAP_DIR_TX              1
+
+// Record head, the frame follows
+typedef struct
+	__attribute__((packed))
+{
+  US delta;                         // ms since the previous record
+  UC info;                          // Bit 7: direction, bit 0-6: frame length
+} RFCapHead_t;
+
+// Flash dump head, the records follow. The head is written last
+typedef struct
+	__attribute__((packed))
+{
+  UL magic;
+  UL tmFirst;                       // millis() of the first record
+  US len;                           // Bytes of records
+  US count;
+  UL crc;                           // CRC32 over records
+} RFCapDump_t;
+
+//------------------------------------------------------------------
+// Xlight RF Capture Class
+//------------------------------------------------------------------
+class RFCaptureClass
+{
+public:
+  RFCaptureClass();
+
+  void Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  void Start() { m_isOn = true; }
+  void Stop() { m_isOn = false; }
+  void Clear();
+  BOOL IsOn() { return m_isOn; }
+  void Record(const UC _dir, const UC *_frame, const UC _len, const UL _now);
+  BOOL GetRecord(US &_pos, UL &_time, UC &_dir, UC *_frame, UC &_len);
+
+  BOOL Save();
+  BOOL Load();
+
+  BOOL StartReplay(const UC _speed, const UL _now);
+  UC Replay(const UL _now);
+  BOOL IsReplaying() { return m_isReplaying; }
+
+  US GetCount() { return m_count; }
+  US GetBytes() { return m_len; }
+  UL GetRecorded() { return m_nRecorded; }
+  UL GetDropped() { return m_nDropped; }
+  UL GetReplayed() { return m_nReplayed; }
+  void showStatus();
+  void Dump();
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_addr;
+  UL m_size;
+  UC m_buf[RFCAP_BUF_SIZE];
+  US m_head;                        // Offset of the oldest record
+  US m_len;
+  US m_count;
+  UL m_tmFirst;                     // millis() of the oldest record
+  UL m_tmLast;
+  BOOL m_isOn;
+
+  BOOL m_isReplaying;
+  BOOL m_wasOn;                     // Capture is paused during replay
+  UC m_rpSpeed;                     // Times faster, 0 for no delay
+  US m_rpPos;                       // Next record to feed
+  UL m_rpTime;                      // Capture time of the last record fed
+  UL m_rpStart;
+
+  UL m_nRecorded;
+  UL m_nDropped;
+  UL m_nReplayed;
+
+  void Put(const void *_data, const US _len);
+  void Get(const US _pos, void *_data, const US _len);
+  void DropOldest();
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern RFCaptureClass theCapture;
+
+#endif /* xlxRFCapture_h */
@@ -0,0 +1,319 @@
+/**
+ * xlxRecordLog.cpp - Xlight append-only record log for rules, scenarios and schedules
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Table rows are appended as records instead of being rewritten in place,
+ * so an update only programs blank bytes and never erases a page.
+ * 1. The whole logical pages inside the region are split into two areas,
+ *    one active and one spare, so erasing never touches the neighbours
+ * 2. Each record carries a head (type, uid, len, seq, CRC32). The magic byte
+ *    is programmed last, a record torn by power loss is never taken
+ * 3. An in-RAM index (type, uid) -> offset is rebuilt by scanning the
+ *    active area in chunks at boot, the latest record of a row wins
+ * 4. When the active area is 3/4 full, compaction copies the latest record
+ *    of every row into the spare area and then programs the area head with
+ *    the next generation. Until then the old area stays valid
+ * 5. The spare area is checked and erased page by page in Process(), so
+ *    compaction normally finds it blank
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxRecordLog.h"
+#include "xliMemoryMap.h"
+#include "xlxTableReader.h"
+#include "xlxLogger.h"
+
+//------------------------------------------------------------------
+// Xlight Record Log Class
+//------------------------------------------------------------------
+RecordLogClass::RecordLogClass()
+{
+  m_pDevice = NULL;
+  m_base = 0;
+  m_areaSize = 0;
+  m_active = 0;
+  m_generation = 0;
+  m_pos = 0;
+  m_seq = 0;
+  memset(m_index, 0xFF, sizeof(m_index));
+  m_spareChecked = 0;
+  m_needCompact = false;
+  m_nAppends = 0;
+  m_nProgBytes = 0;
+  m_nErases = 0;
+  m_nCompactions = 0;
+  m_nTorn = 0;
+  m_nCorrupt = 0;
+  m_usRebuild = 0;
+}
+
+// Find the newest area and rebuild the index, the log may be unformatted
+BOOL RecordLogClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  RecordArea_t _area;
+
+  UL _page = pDevice->pageSize();
+  m_pDevice = pDevice;
+  m_base = FLASH_PAGE_CEIL(_addr, _page);
+  m_areaSize = (_addr + _size > m_base ? (FLASH_PAGE_FLOOR(_addr + _size, _page) - m_base) / 2 / _page * _page : 0);
+  // Offsets in the index are 16 bits
+  if( m_areaSize > 0x10000 ) m_areaSize = 0x10000 / _page * _page;
+  if( m_areaSize == 0 ) return false;
+  m_active = 0;
+  m_generation = 0;
+  m_pos = 0;
+  m_seq = 0;
+  m_spareChecked = 0;
+  m_needCompact = false;
+  memset(m_index, 0xFF, sizeof(m_index));
+
+  for( UC i = 0; i < 2; i++ ) {
+    if( !m_pDevice->read(&_area, AreaAddr(i), sizeof(_area)) ) return false;
+    if( _area.magic == RECLOG_AREA_MAGIC && _area.check == ~_area.generation && _area.generation > m_generation ) {
+      m_active = i;
+      m_generation = _area.generation;
+    }
+  }
+  if( !IsFormatted() ) return true;
+  return ScanArea();
+}
+
+// Start an empty log in the first area
+BOOL RecordLogClass::Format()
+{
+  if( !m_pDevice ) return false;
+
+  for( UL _offset = 0; _offset < m_areaSize; _offset += m_pDevice->pageSize() ) {
+    if( !m_pDevice->erasePage(AreaAddr(0) + _offset) ) return false;
+    m_nErases++;
+  }
+  RecordArea_t _area;
+  _area.magic = RECLOG_AREA_MAGIC;
+  _area.generation = 1;
+  _area.check = ~_area.generation;
+  if( !m_pDevice->writePage(&_area, AreaAddr(0), sizeof(_area)) ) return false;
+  m_nProgBytes += sizeof(_area);
+
+  m_active = 0;
+  m_generation = _area.generation;
+  m_pos = sizeof(RecordArea_t);
+  m_seq = 0;
+  m_spareChecked = 0;
+  m_needCompact = false;
+  memset(m_index, 0xFF, sizeof(m_index));
+  LOGI(LOGTAG_MSG, "Record log formatted.");
+  return true;
+}
+
+BOOL RecordLogClass::ScanArea()
+{
+  RecordHead_t _head;
+  UC _row[RECLOG_MAX_PAYLOAD];
+  UL _start = micros();
+  TableReaderClass _reader(m_pDevice, AreaAddr(m_active), m_areaSize);
+
+  m_pos = sizeof(RecordArea_t);
+  _reader.Skip(m_pos);
+  while( m_pos + sizeof(RecordHead_t) <= m_areaSize ) {
+    if( !_reader.Read(_head) ) return false;
+    if( _head.magic != RECLOG_REC_MAGIC ) {
+      // A blank head is the end, otherwise the last append was cut off.
+      /// Don't append behind it, compaction starts a clean area
+      const UC *pByte = (const UC *)&_head;
+      for( UC i = 0; i < sizeof(_head); i++ ) {
+        if( pByte[i] != 0xFF ) {
+          m_nTorn++;
+          m_needCompact = true;
+          m_pos = m_areaSize;
+          break;
+        }
+      }
+      break;
+    }
+    if( _head.len > RECLOG_MAX_PAYLOAD || m_pos + sizeof(_head) + _head.len > m_areaSize ) {
+      m_nCorrupt++;
+      m_needCompact = true;
+      m_pos = m_areaSize;
+      break;
+    }
+    if( !_reader.Read(_row, _head.len) ) return false;
+    if( CRC32(_row, _head.len, CRC32(&_head.type, 7)) == _head.crc
+        && _head.type < RECLOG_TYPES && _head.uid < RECLOG_MAX_UID ) {
+      m_index[_head.type][_head.uid] = m_pos;
+      if( _head.seq >= m_seq ) m_seq = _head.seq + 1;
+    } else {
+      m_nCorrupt++;
+    }
+    m_pos += sizeof(_head) + _head.len;
+  }
+
+  m_usRebuild = micros() - _start;
+  LOGI(LOGTAG_MSG, "Record log area %d gen %lu, %lu bytes scanned in %lu us", m_active, m_generation, m_pos, m_usRebuild);
+  return true;
+}
+
+BOOL RecordLogClass::WriteRecord(const UL _addr, const UC _type, const UC _uid, const void *_data, const UC _len, const UL _seq)
+{
+  UC _buf[sizeof(RecordHead_t) + RECLOG_MAX_PAYLOAD];
+  RecordHead_t *pHead = (RecordHead_t *)_buf;
+  US _total = sizeof(RecordHead_t) + _len;
+
+  pHead->magic = 0xFF;
+  pHead->type = _type;
+  pHead->uid = _uid;
+  pHead->len = _len;
+  pHead->seq = _seq;
+  memcpy(_buf + sizeof(RecordHead_t), _data, _len);
+  pHead->crc = CRC32(_data, _len, CRC32(&pHead->type, 7));
+
+  // Program head and row, then the magic byte to commit
+  m_nProgBytes += _total;
+  if( !m_pDevice->writePage(_buf + 1, _addr + 1, _total - 1) ) return false;
+  UC _magic = RECLOG_REC_MAGIC;
+  return m_pDevice->writePage(&_magic, _addr, 1);
+}
+
+BOOL RecordLogClass::Append(const UC _type, const UC _uid, const void *_data, const UC _len)
+{
+  if( !IsFormatted() || _type >= RECLOG_TYPES || _uid >= RECLOG_MAX_UID || _len > RECLOG_MAX_PAYLOAD ) return false;
+
+  UL _total = sizeof(RecordHead_t) + _len;
+  if( m_pos + _total > m_areaSize ) {
+    if( !Compact() || m_pos + _total > m_areaSize ) return false;
+  }
+  if( !WriteRecord(AreaAddr(m_active) + m_pos, _type, _uid, _data, _len, m_seq) ) {
+    // Never append behind a partly programmed record
+    m_pos = m_areaSize;
+    m_needCompact = true;
+    return false;
+  }
+  m_index[_type][_uid] = m_pos;
+  m_pos += _total;
+  m_seq++;
+  m_nAppends++;
+  return true;
+}
+
+BOOL RecordLogClass::Read(const UC _type, const UC _uid, void *_data, const UC _len)
+{
+  if( !IsFormatted() || _type >= RECLOG_TYPES || _uid >= RECLOG_MAX_UID ) return false;
+  if( m_index[_type][_uid] == RECLOG_NONE ) return false;
+
+  RecordHead_t _head;
+  UL _addr = AreaAddr(m_active) + m_index[_type][_uid];
+  if( !m_pDevice->read(&_head, _addr, sizeof(_head)) ) return false;
+  // Row size changed with firmware, treat as not saved
+  if( _head.len != _len ) return false;
+  return m_pDevice->read(_data, _addr + sizeof(_head), _len);
+}
+
+// Check the next page of the spare area, erase it if not blank
+BOOL RecordLogClass::EraseSpareStep()
+{
+  UC _buf[64];
+  UL _page = m_pDevice->pageSize();
+  UL _addr = AreaAddr(1 - m_active) + m_spareChecked;
+
+  for( UL i = 0; i < _page; i += sizeof(_buf) ) {
+    if( !m_pDevice->read(_buf, _addr + i, sizeof(_buf)) ) return false;
+    for( UC j = 0; j < sizeof(_buf); j++ ) {
+      if( _buf[j] != 0xFF ) {
+        if( !m_pDevice->erasePage(_addr) ) return false;
+        m_nErases++;
+        m_spareChecked += _page;
+        return true;
+      }
+    }
+  }
+  m_spareChecked += _page;
+  return true;
+}
+
+// Copy the latest record of every row into the spare area and switch to it
+BOOL RecordLogClass::Compact()
+{
+  if( !IsFormatted() ) return false;
+
+  while( m_spareChecked < m_areaSize ) {
+    if( !EraseSpareStep() ) return false;
+  }
+  // Spare area is dirty from now on
+  m_spareChecked = 0;
+
+  // New index, kept off the stack
+  static US _index[RECLOG_TYPES][RECLOG_MAX_UID];
+  UC _row[RECLOG_MAX_PAYLOAD];
+  RecordHead_t _head;
+  UC _spare = 1 - m_active;
+  UL _pos = sizeof(RecordArea_t);
+  memset(_index, 0xFF, sizeof(_index));
+
+  for( UC _type = 0; _type < RECLOG_TYPES; _type++ ) {
+    for( UC _uid = 0; _uid < RECLOG_MAX_UID; _uid++ ) {
+      if( m_index[_type][_uid] == RECLOG_NONE ) continue;
+      UL _addr = AreaAddr(m_active) + m_index[_type][_uid];
+      if( !m_pDevice->read(&_head, _addr, sizeof(_head)) ) return false;
+      if( !m_pDevice->read(_row, _addr + sizeof(_head), _head.len) ) return false;
+      if( !WriteRecord(AreaAddr(_spare) + _pos, _type, _uid, _row, _head.len, _head.seq) ) return false;
+      _index[_type][_uid] = _pos;
+      _pos += sizeof(_head) + _head.len;
+    }
+  }
+
+  // Commit the new area
+  RecordArea_t _area;
+  _area.magic = RECLOG_AREA_MAGIC;
+  _area.generation = m_generation + 1;
+  _area.check = ~_area.generation;
+  m_nProgBytes += sizeof(_area);
+  if( !m_pDevice->writePage(&_area, AreaAddr(_spare), sizeof(_area)) ) return false;
+
+  m_active = _spare;
+  m_generation = _area.generation;
+  m_pos = _pos;
+  memcpy(m_index, _index, sizeof(m_index));
+  m_needCompact = false;
+  m_nCompactions++;
+  return true;
+}
+
+// Background work: prepare the spare area and compact when 3/4 full
+void RecordLogClass::Process()
+{
+  if( !IsFormatted() ) return;
+
+  if( m_spareChecked < m_areaSize ) {
+    EraseSpareStep();
+  } else if( m_needCompact || m_pos > m_areaSize * 3 / 4 ) {
+    if( Compact() ) {
+      LOGI(LOGTAG_MSG, "Record log compacted, %lu bytes in use", m_pos);
+    } else {
+      LOGW(LOGTAG_MSG, "Failed to compact record log");
+    }
+  }
+}
+
+void RecordLogClass::showStatus()
+{
+  SERIAL_LN("Record log: area %d gen %lu, %lu of %lu bytes used, seq %lu", m_active, m_generation, m_pos, m_areaSize, m_seq);
+  SERIAL_LN("  %lu appends, %lu bytes programmed, %lu erases, %lu compactions", m_nAppends, m_nProgBytes, m_nErases, m_nCompactions);
+  SERIAL_LN("  %lu torn, %lu corrupt, index rebuilt in %lu us", m_nTorn, m_nCorrupt, m_usRebuild);
+}
@@ -0,0 +1,94 @@
+//  xlxRecordLog.h - Xlight append-only record log for rules, scenarios and schedules
+
+#ifndef xlxRecordLog_h
+#define xlxRecordLog_h
+
+#include "xliCommon.h"
+#include "flashee-eeprom.h"
+
+// Record types, one row of the table each
+#define RECLOG_TYPE_SCHEDULE      0
+#define RECLOG_TYPE_RULE          1
+#define RECLOG_TYPE_SCENARIO      2
+#define RECLOG_TYPES              3
+
+#define RECLOG_MAX_UID            64          // Rows per type
+#define RECLOG_MAX_PAYLOAD        48          // Largest row
+#define RECLOG_NONE               0xFFFF      // Row not in log
+
+#define RECLOG_REC_MAGIC          0xA7
+#define RECLOG_AREA_MAGIC         0x474C5258  // "XRLG"
+
+// Record: head + row, the magic byte is programmed last to commit it
+typedef struct
+	__attribute__((packed))
+{
+  UC magic;
+  UC type;
+  UC uid;
+  UC len;                           // Length of row
+  UL seq;
+  UL crc;                           // CRC32 over type, uid, len, seq and row
+} RecordHead_t;
+
+// Area head, programmed after compaction has copied all live records
+typedef struct
+	__attribute__((packed))
+{
+  UL magic;
+  UL generation;
+  UL check;                         // ~generation, catches a torn area head
+} RecordArea_t;
+
+//------------------------------------------------------------------
+// Xlight Record Log Class
+//------------------------------------------------------------------
+class RecordLogClass
+{
+public:
+  RecordLogClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL IsFormatted() { return(m_generation > 0); }
+  BOOL Format();
+  BOOL Append(const UC _type, const UC _uid, const void *_data, const UC _len);
+  BOOL Read(const UC _type, const UC _uid, void *_data, const UC _len);
+  BOOL Compact();
+  void Process();
+
+  UL GetAppends() { return m_nAppends; }
+  UL GetProgBytes() { return m_nProgBytes; }
+  UL GetErases() { return m_nErases; }
+  UL GetCompactions() { return m_nCompactions; }
+  UL GetTorn() { return m_nTorn; }
+  UL GetRebuildTime() { return m_usRebuild; }
+  UL GetUsed() { return m_pos; }
+  void showStatus();
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_base;
+  UL m_areaSize;
+  UC m_active;                      // Area being appended
+  UL m_generation;                  // 0 for unformatted
+  UL m_pos;                         // Append position in active area
+  UL m_seq;
+  US m_index[RECLOG_TYPES][RECLOG_MAX_UID];   // Record offset in active area
+  UL m_spareChecked;                // Bytes of spare area known to be erased
+  BOOL m_needCompact;
+
+  UL m_nAppends;
+  UL m_nProgBytes;
+  UL m_nErases;
+  UL m_nCompactions;
+  UL m_nTorn;
+  UL m_nCorrupt;
+  UL m_usRebuild;
+
+  UL AreaAddr(const UC _area) { return(m_base + _area * m_areaSize); }
+  BOOL ScanArea();
+  BOOL EraseSpareStep();
+  BOOL WriteRecord(const UL _addr, const UC _type, const UC _uid, const void *_data, const UC _len, const UL _seq);
+};
+
+#endif /* xlxRecordLog_h */
@@ -0,0 +1,298 @@
+/**
+ * xlxSensorState.cpp - Xlight latest sensor data of every node
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Every (node, sensor) pair keeps its own latest value and last report,
+ * so readings from one node no longer overwrite those of another.
+ * 1. Fixed size open addressing table, SENSOR_STATE_SLOTS slots, sized for
+ *    every node reporting SENSOR_STATE_TYPES sensor types. Keys are kept
+ *    apart from the values, 14 bytes per slot, about 9KB for the classroom
+ *    edition, 2KB for home. A filter state lost means every reading of the
+ *    item is reported again, so the table is sized for the worst case
+ * 2. Hashed by (node_id, sensor) and linear probing, O(1) lookup
+ * 3. Filled up to 3/4 to keep probe sequences short
+ * 4. If more items show up than planned, the one reported longest ago is
+ *    evicted (backward shift, no tombstones) and counted, a new item is
+ *    always stored. Call Clear() to start over
+ * 5. Items referred by aggregated rule conditions also keep a history ring
+ *    of 1-minute buckets (min/max/avg) over the last hour. Each sample only
+ *    updates the current bucket, so avg/max/min over N minutes read at most
+ *    N buckets instead of raw samples
+ * 6. History rings are limited to SENSOR_HISTORY_RINGS and given to the
+ *    items set by SetHistoryItems() only, so other nodes reporting the same
+ *    sensor type can't take them
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxSensorState.h"
+#include "xlxLogger.h"
+
+//------------------------------------------------------------------
+// Xlight Sensor State Class
+//------------------------------------------------------------------
+SensorStateClass::SensorStateClass()
+{
+  for( UC i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    m_history[i].sensor = SENSOR_STATE_FREE;
+  }
+  Clear();
+}
+
+void SensorStateClass::Clear()
+{
+  memset(m_slots, 0x00, sizeof(m_slots));
+  for( US i = 0; i < SENSOR_STATE_SLOTS; i++ ) {
+    m_keys[i] = SENSOR_STATE_NO_KEY;
+  }
+  // Rings stay with their items, only the data is gone
+  for( UC i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    if( m_history[i].sensor != SENSOR_STATE_FREE ) ResetHistory(&m_history[i], m_history[i].node_id, m_history[i].sensor);
+  }
+  m_count = 0;
+  m_nOverflow = 0;
+}
+
+// Fibonacci hashing on the 13-bit key: node_id(8) + sensor(5), scaled to the table
+US SensorStateClass::Hash(const US _key)
+{
+  return (US)((((_key * 40503U) & 0xFFFF) * (UL)SENSOR_STATE_SLOTS) >> 16);
+}
+
+// Slot of the key, or the free slot where it would go
+US SensorStateClass::Probe(const US _key)
+{
+  US _index = Hash(_key);
+  while( m_keys[_index] != SENSOR_STATE_NO_KEY && m_keys[_index] != _key ) {
+    if( ++_index >= SENSOR_STATE_SLOTS ) _index = 0;
+  }
+  return _index;
+}
+
+SensorState_t *SensorStateClass::Find(const UC _nd, const UC _sr)
+{
+  US _key = SENSOR_STATE_KEY(_nd, _sr);
+  US _index = Probe(_key);
+  return (m_keys[_index] == _key ? &m_slots[_index] : NULL);
+}
+
+// Remove the item reported longest ago, move the items after it back in their probe sequence
+void SensorStateClass::Evict()
+{
+  US _hole = SENSOR_STATE_SLOTS;
+  for( US i = 0; i < SENSOR_STATE_SLOTS; i++ ) {
+    if( m_keys[i] == SENSOR_STATE_NO_KEY ) continue;
+    if( _hole == SENSOR_STATE_SLOTS || (long)(m_slots[i].tick - m_slots[_hole].tick) < 0 ) _hole = i;
+  }
+
+  US _next = _hole;
+  while( true ) {
+    if( ++_next >= SENSOR_STATE_SLOTS ) _next = 0;
+    if( m_keys[_next] == SENSOR_STATE_NO_KEY ) break;
+    // Stays if its home is cyclically in (_hole, _next]
+    US _home = Hash(m_keys[_next]);
+    if( _hole <= _next ? (_home > _hole && _home <= _next) : (_home > _hole || _home <= _next) ) continue;
+    m_keys[_hole] = m_keys[_next];
+    m_slots[_hole] = m_slots[_next];
+    _hole = _next;
+  }
+  m_keys[_hole] = SENSOR_STATE_NO_KEY;
+  m_count--;
+  m_nOverflow++;
+}
+
+// Store the latest value, create the item if not exists
+SensorState_t *SensorStateClass::Update(const UC _nd, const UC _sr, const float _value)
+{
+  US _key = SENSOR_STATE_KEY(_nd, _sr);
+  US _index = Probe(_key);
+  SensorState_t *pState = &m_slots[_index];
+  if( m_keys[_index] == SENSOR_STATE_NO_KEY ) {
+    if( m_count >= SENSOR_STATE_MAX_ITEMS ) {
+      Evict();
+      _index = Probe(_key);
+      pState = &m_slots[_index];
+    }
+    m_keys[_index] = _key;
+    pState->reported = _value;
+    pState->tick = 0;
+    m_count++;
+  }
+
+  pState->data = _value;
+  SensorHistory_t *pRing = GetHistory(_nd, _sr);
+  if( pRing ) AddHistory(pRing, _value);
+  return pState;
+}
+
+BOOL SensorStateClass::GetValue(const UC _nd, const UC _sr, float *_value)
+{
+  SensorState_t *pState = Find(_nd, _sr);
+  if( pState ) {
+    *_value = pState->data;
+    return true;
+  }
+  return false;
+}
+
+// Get the history ring of the item, NULL if it has none
+SensorHistory_t *SensorStateClass::GetHistory(const UC _nd, const UC _sr)
+{
+  SensorHistory_t *pRing;
+  for( UC i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    pRing = &m_history[i];
+    if( pRing->node_id == _nd && pRing->sensor == _sr ) return pRing;
+  }
+  return NULL;
+}
+
+void SensorStateClass::ResetHistory(SensorHistory_t *pRing, const UC _nd, const UC _sr)
+{
+  pRing->node_id = _nd;
+  pRing->sensor = _sr;
+  pRing->head = 0;
+  pRing->filled = 1;
+  pRing->tick = GetTick();
+  pRing->sum = 0;
+  pRing->count = 0;
+  pRing->buckets[0].min = 1;
+  pRing->buckets[0].max = 0;
+}
+
+// Keep history rings for these items (SENSOR_STATE_KEY) only, rings of other items are freed
+/// Items already in a ring keep their data. Return the number of items left without a ring
+UC SensorStateClass::SetHistoryItems(const US *_keys, const UC _num)
+{
+  UC i, j;
+  for( i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    if( m_history[i].sensor == SENSOR_STATE_FREE ) continue;
+    US _key = SENSOR_STATE_KEY(m_history[i].node_id, m_history[i].sensor);
+    for( j = 0; j < _num && _keys[j] != _key; j++ );
+    if( j >= _num ) m_history[i].sensor = SENSOR_STATE_FREE;
+  }
+
+  UC _left = 0;
+  for( j = 0; j < _num; j++ ) {
+    if( GetHistory(_keys[j] >> 5, _keys[j] & 0x1F) ) continue;
+    for( i = 0; i < SENSOR_HISTORY_RINGS && m_history[i].sensor != SENSOR_STATE_FREE; i++ );
+    if( i < SENSOR_HISTORY_RINGS ) ResetHistory(&m_history[i], _keys[j] >> 5, _keys[j] & 0x1F);
+    else _left++;
+  }
+  return _left;
+}
+
+UC SensorStateClass::GetHistoryCount()
+{
+  UC _count = 0;
+  for( UC i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    if( m_history[i].sensor != SENSOR_STATE_FREE ) _count++;
+  }
+  return _count;
+}
+
+// Close the current bucket if one minute or more passed
+void SensorStateClass::AdvanceHistory(SensorHistory_t *pRing, const UL _now)
+{
+  UL _elapsed = (_now - pRing->tick) / 60000;
+  if( _elapsed == 0 ) return;
+
+  pRing->tick += _elapsed * 60000;
+  if( _elapsed > SENSOR_HISTORY_BUCKETS ) _elapsed = SENSOR_HISTORY_BUCKETS;
+  while( _elapsed-- > 0 ) {
+    pRing->head = (pRing->head + 1) % SENSOR_HISTORY_BUCKETS;
+    pRing->buckets[pRing->head].min = 1;
+    pRing->buckets[pRing->head].max = 0;
+    if( pRing->filled < SENSOR_HISTORY_BUCKETS ) pRing->filled++;
+  }
+  pRing->sum = 0;
+  pRing->count = 0;
+}
+
+void SensorStateClass::AddHistory(SensorHistory_t *pRing, const float _value)
+{
+  AdvanceHistory(pRing, GetTick());
+
+  SensorBucket_t *pBucket = &pRing->buckets[pRing->head];
+  SHORT _data = (SHORT)(_value >= 0 ? _value + 0.5 : _value - 0.5);
+  if( pRing->count == 0 ) {
+    pBucket->min = _data;
+    pBucket->max = _data;
+  } else {
+    if( _data < pBucket->min ) pBucket->min = _data;
+    if( _data > pBucket->max ) pBucket->max = _data;
+  }
+  pRing->sum += _value;
+  pRing->count++;
+  float _avg = pRing->sum / pRing->count;
+  pBucket->avg = (SHORT)(_avg >= 0 ? _avg + 0.5 : _avg - 0.5);
+}
+
+// Average, maximum or minimum over the last _minutes minutes
+/// Return false if there is no history of the item
+BOOL SensorStateClass::GetAggregate(const UC _nd, const UC _sr, const UC _aggr, const UC _minutes, float *_value)
+{
+  SensorState_t *pState = Find(_nd, _sr);
+  if( !pState ) return false;
+  if( _aggr == SR_AGGR_NONE ) {
+    *_value = pState->data;
+    return true;
+  }
+
+  SensorHistory_t *pRing = GetHistory(_nd, _sr);
+  if( !pRing ) return false;
+  AdvanceHistory(pRing, GetTick());
+
+  UC _num = (_minutes < pRing->filled ? _minutes : pRing->filled);
+  UC _index = pRing->head;
+  UC _count = 0;
+  long _sum = 0;
+  SHORT _max = 0, _min = 0;
+  while( _num-- > 0 ) {
+    SensorBucket_t *pBucket = &pRing->buckets[_index];
+    if( pBucket->min <= pBucket->max ) {
+      if( _count == 0 || pBucket->max > _max ) _max = pBucket->max;
+      if( _count == 0 || pBucket->min < _min ) _min = pBucket->min;
+      _sum += pBucket->avg;
+      _count++;
+    }
+    _index = (_index + SENSOR_HISTORY_BUCKETS - 1) % SENSOR_HISTORY_BUCKETS;
+  }
+  if( _count == 0 ) return false;
+
+  if( _aggr == SR_AGGR_MAX ) *_value = _max;
+  else if( _aggr == SR_AGGR_MIN ) *_value = _min;
+  else *_value = (float)_sum / _count;
+  return true;
+}
+
+void SensorStateClass::showState()
+{
+  SERIAL_LN("\n\r**Sensor State** items:%d of %d, evicted:%lu, history:%d of %d", m_count, SENSOR_STATE_MAX_ITEMS, m_nOverflow, GetHistoryCount(), SENSOR_HISTORY_RINGS);
+  for( US i = 0; i < SENSOR_STATE_SLOTS; i++ ) {
+    if( m_keys[i] == SENSOR_STATE_NO_KEY ) continue;
+    SERIAL_LN("  nd:%d sr:%d data:%.2f reported:%.2f age:%lus", m_keys[i] >> 5, m_keys[i] & 0x1F,
+        m_slots[i].data, m_slots[i].reported, (m_slots[i].tick ? (millis() - m_slots[i].tick) / 1000 : 0));
+  }
+  for( UC i = 0; i < SENSOR_HISTORY_RINGS; i++ ) {
+    if( m_history[i].sensor == SENSOR_STATE_FREE ) continue;
+    SERIAL_LN("  history%d nd:%d sr:%d minutes:%d", i, m_history[i].node_id, m_history[i].sensor, m_history[i].filled);
+  }
+  SERIAL_LN("");
+}
@@ -0,0 +1,83 @@
+//  xlxSensorState.h - Xlight latest sensor data of every node
+
+#ifndef xlxSensorState_h
+#define xlxSensorState_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+
+// Filled up to 3/4: 48 nodes x 10 types in 640 slots of 14 bytes, 8960 bytes
+#define SENSOR_STATE_MAX_ITEMS  (MAX_NODE_PER_CONTROLLER * SENSOR_STATE_TYPES)
+#define SENSOR_STATE_SLOTS      (SENSOR_STATE_MAX_ITEMS * 4 / 3)
+#define SENSOR_STATE_FREE       0xFF
+#define SENSOR_STATE_NO_KEY     0xFFFF
+#define SENSOR_STATE_KEY(nd, sr)  (((US)(nd) << 5) | ((sr) & 0x1F))
+
+typedef struct
+{
+  float data;                       // Latest value
+  float reported;                   // Last reported value
+  UL tick;                          // Time of last report in ms, 0 for never
+} SensorState_t;
+
+// One minute of sensor data, empty if min > max
+typedef struct
+{
+  SHORT min;
+  SHORT max;
+  SHORT avg;
+} SensorBucket_t;
+
+typedef struct
+{
+  UC node_id;                       // RF nodeID
+  UC sensor;                        // sensors_t, SENSOR_STATE_FREE means free ring
+  UC head;                          // Current bucket
+  UC filled;                        // Number of buckets in use, including current
+  UL tick;                          // Start time of current bucket in ms
+  float sum;                        // Sum of samples in current bucket
+  US count;                         // Number of samples in current bucket
+  SensorBucket_t buckets[SENSOR_HISTORY_BUCKETS];
+} SensorHistory_t;
+
+//------------------------------------------------------------------
+// Xlight Sensor State Class
+//------------------------------------------------------------------
+class SensorStateClass
+{
+public:
+  SensorStateClass();
+
+  void Clear();
+  SensorState_t *Find(const UC _nd, const UC _sr);
+  SensorState_t *Update(const UC _nd, const UC _sr, const float _value);
+  BOOL GetValue(const UC _nd, const UC _sr, float *_value);
+  BOOL GetAggregate(const UC _nd, const UC _sr, const UC _aggr, const UC _minutes, float *_value);
+  UC SetHistoryItems(const US *_keys, const UC _num);
+  UC GetHistoryCount();
+
+  US GetCount() { return m_count; }
+  UL GetOverflow() { return m_nOverflow; }
+  void showState();
+
+protected:
+  // Clock of the history buckets
+  virtual UL GetTick() { return millis(); }
+
+private:
+  US m_keys[SENSOR_STATE_SLOTS];    // node_id(8) + sensor(5), SENSOR_STATE_NO_KEY means free slot
+  SensorState_t m_slots[SENSOR_STATE_SLOTS];
+  US m_count;
+  UL m_nOverflow;                   // Items evicted to make room
+  SensorHistory_t m_history[SENSOR_HISTORY_RINGS];
+
+  US Hash(const US _key);
+  US Probe(const US _key);
+  void Evict();
+  SensorHistory_t *GetHistory(const UC _nd, const UC _sr);
+  void ResetHistory(SensorHistory_t *pRing, const UC _nd, const UC _sr);
+  void AdvanceHistory(SensorHistory_t *pRing, const UL _now);
+  void AddHistory(SensorHistory_t *pRing, const float _value);
+};
+
+#endif /* xlxSensorState_h */
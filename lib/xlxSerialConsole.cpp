@@ -50,6 +50,12 @@
 #include "xlxRF24Server.h"
 #include "xlxASRInterface.h"
 #include "xlxBLEInterface.h"
+#include "xlxCloudPublisher.h"
+#include "xlxUsageStats.h"
+#include "xlxStatusPoller.h"
+#include "xlxGroupTable.h"
+#include "xlxFirmwareOTA.h"
+#include "xlxRFCapture.h"
 
 //------------------------------------------------------------------
 // the one and only instance of SerialConsoleClass
@@ -220,13 +226,17 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
     SERIAL_LN("--- Command: show <object> ---");
     SERIAL_LN("To show value or summary information, where <object> could be:");
     SERIAL_LN("   ble:     show BLE summary");
-    SERIAL_LN("   debug:   show debug channel and level");
+    SERIAL_LN("   debug:   show debug channel and level, no debug logs in release builds");
     SERIAL_LN("   flag:    show system flags");
+    SERIAL_LN("   flog:    show flash log, e.g. show flog [last_n]");
     SERIAL_LN("   net:     show network summary");
     SERIAL_LN("   node:    show node summary");
     SERIAL_LN("   button:  show button (knob) status");
     SERIAL_LN("   nlist:   show NodeID list");
+    SERIAL_LN("   pub:     show cloud publish statistics");
     SERIAL_LN("   rf:      print RF details");
+    SERIAL_LN("   sensor:  show latest sensor data of nodes");
+    SERIAL_LN("   sfilter: show sensor report filters");
     SERIAL_LN("   time:    show current time and time zone");
     SERIAL_LN("   var:     show system variables");
     SERIAL_LN("   table:   show working memory tables");
@@ -235,6 +245,11 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
     SERIAL_LN("   asrsnt:  show ASR command scenario table");
     SERIAL_LN("   keymap:  show hardware key map table");
     SERIAL_LN("   extbtn:  show extended button table");
+    SERIAL_LN("   usage:   show lamp usage, usage <node> [hour|day|month] [count]");
+    SERIAL_LN("   poll:    show status poller");
+    SERIAL_LN("   group:   show group members");
+    SERIAL_LN("   ota:     show firmware distribution to nodes");
+    SERIAL_LN("   capture: show RF capture, capture dump");
     SERIAL_LN("   version: show firmware version");
     SERIAL_LN("e.g. show rf\n\r");
     //CloudOutput("show ble|debug|dev|flag|net|node|rf|time|var|table|version");
@@ -359,9 +374,22 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
       SERIAL_LN("     , to set keymap item");
       SERIAL_LN("e.g. set extbtn <button operation action keymap>");
       SERIAL_LN("     , to define extbtn action");
+      SERIAL_LN("e.g. set sfilter <sensor deadband relative interval heartbeat>");
+      SERIAL_LN("     , to set sensor report filter, deadband in 0.1 unit or 0.1%%");
+      SERIAL_LN("e.g. set group <group nodeid [0|1]>");
+      SERIAL_LN("     , to remove device from or add it to group (%d..%d)", NODEID_MIN_GROUP, NODEID_MAX_GROUP);
+      SERIAL_LN("e.g. set ota <nodeid [0|1]>");
+      SERIAL_LN("     , to stop or start firmware distribution to node");
+      SERIAL_LN("e.g. set capture [0|1|clear|save|load]");
+      SERIAL_LN("     , to control RF capture, save or load it in flash");
+      SERIAL_LN("e.g. set capture replay [speed]");
+      SERIAL_LN("     , to replay received frames, speed times faster, 0 for no delay");
       SERIAL_LN("e.g. set debug [log:level]");
-      SERIAL_LN("     , where log is [serial|flash|syslog|cloud|all");
-      SERIAL_LN("     and level is [none|alter|critical|error|warn|notice|info|debug]\n\r");
+      SERIAL_LN("     , where log is [serial|flash|syslog|cloud|all|sta|evt|act|dat|msg");
+      SERIAL_LN("     and level is [none|alter|critical|error|warn|notice|info|debug]");
+      SERIAL_LN("     , debug level logs are compiled out of release builds");
+      SERIAL_LN("e.g. set debug async:[on|off]");
+      SERIAL_LN("     , to defer formatting of notice/info/debug logs\n\r");
       //CloudOutput("set tz|dst|nodeid|base|spkr|flag|var|cloud|maindev|subid|debug|blename|blepin");
     }
   } else if(strTopic.equals("sys")) {
@@ -536,9 +564,25 @@ bool SerialConsoleClass::doShow(const char *cmd)
       theConfig.showKeyMap();
     } else if (wal_strnicmp(sTopic, "extbtn", 6) == 0) {
       theConfig.showButtonActions();
+    } else if (wal_strnicmp(sTopic, "pub", 3) == 0) {
+      SERIAL_LN("**Cloud publish pending:%d, queued:%lu, published:%lu", thePublisher.GetPending(), thePublisher.GetQueued(), thePublisher.GetPublished());
+      SERIAL_LN("  merged:%lu, dropped:%lu, failed:%lu, replayed:%lu\n\r", thePublisher.GetMerged(), thePublisher.GetDropped(),
+          thePublisher.GetFailed(), thePublisher.GetReplayed());
+      thePublisher.GetJournal().showStatus();
+      CloudOutput("s_pub:%d-%lu-%lu-%lu-%lu", thePublisher.GetPending(), thePublisher.GetPublished(),
+          thePublisher.GetMerged(), thePublisher.GetDropped(), thePublisher.GetFailed());
+    } else if (wal_strnicmp(sTopic, "sensor", 6) == 0) {
+      theSys.m_srState.showState();
+      CloudOutput("s_sensor:%d-%lu", theSys.m_srState.GetCount(), theSys.m_srState.GetOverflow());
+    } else if (wal_strnicmp(sTopic, "sfilter", 7) == 0) {
+      theConfig.showSensorFilters();
+      SERIAL_LN("  reported:%lu, filtered:%lu\n\r", theSys.m_nSensorReported, theSys.m_nSensorFiltered);
+      CloudOutput("s_sfilter:%lu-%lu", theSys.m_nSensorReported, theSys.m_nSensorFiltered);
   	} else if (wal_strnicmp(sTopic, "rf", 2) == 0) {
       theRadio.PrintRFDetails();
       SERIAL_LN("");
+      theRadio.showHandlers();
+      theRadio.showQueries();
     } else if (wal_strnicmp(sTopic, "ble", 3) == 0) {
 #ifndef DISABLE_BLE
       SERIAL_LN("** BLE Module is %s **", theBLE.isGood() ? "good" : "error");
@@ -600,6 +644,7 @@ bool SerialConsoleClass::doShow(const char *cmd)
       SERIAL_LN("");
   		SERIAL_LN("m_isLoaded = \t\t\t%d", theConfig.IsConfigLoaded());
   		SERIAL_LN("m_isChanged = \t\t\t%d", theConfig.IsConfigChanged());
+      theConfig.showConfigSlots();
   		SERIAL_LN("m_isDSTChanged = \t\t%d", theConfig.IsDSTChanged());
   		SERIAL_LN("m_isSCTChanged = \t\t%d", theConfig.IsSCTChanged());
   		SERIAL_LN("m_isRTChanged = \t\t%d", theConfig.IsRTChanged());
@@ -612,6 +657,9 @@ bool SerialConsoleClass::doShow(const char *cmd)
   		SERIAL_LN("SCT_ROW_SIZE: \t\t\t\t%u", SCT_ROW_SIZE);
   		SERIAL_LN("MAX_SCT_ROWS: \t\t\t\t%d", MAX_SCT_ROWS);
   		SERIAL_LN("SNT_ROW_SIZE: \t\t\t\t%u", SNT_ROW_SIZE);
+      theConfig.showTableCache();
+      theSys.Schedule_table.showStatus("Schedule");
+      theSys.Scenario_table.showStatus("Scenario");
 
   		SERIAL_LN("");
       SERIAL_LN("DevStatus_table %d items:", theSys.DevStatus_table.size());
@@ -646,8 +694,65 @@ bool SerialConsoleClass::doShow(const char *cmd)
       SERIAL_LN("System  Version: %s", System.version().c_str());
       SERIAL_LN("Product Version: %d\n\r", theConfig.GetVersion());
       CloudOutput("s_version:%s-%d", System.version().c_str(), theConfig.GetVersion());
+    } else if (wal_strnicmp(sTopic, "poll", 4) == 0) {
+      thePoller.showStatus();
+      CloudOutput("s_poll:%d-%lu-%lu-%lu", thePoller.GetWindow(), thePoller.GetSent(), thePoller.GetLost(), thePoller.GetDuration());
+    } else if (wal_strnicmp(sTopic, "group", 5) == 0) {
+      theGroups.showStatus();
+      CloudOutput("s_group:%lu", theGroups.GetProvisioned());
+    } else if (wal_strnicmp(sTopic, "capture", 7) == 0) {
+      char *sParam1 = next();
+      if( sParam1 && wal_strnicmp(sParam1, "dump", 4) == 0 ) {
+        theCapture.Dump();
+      } else {
+        theCapture.showStatus();
+      }
+      CloudOutput("s_capture:%d-%d-%lu-%lu", theCapture.IsOn(), theCapture.GetCount(), theCapture.GetDropped(), theCapture.GetReplayed());
+    } else if (wal_strnicmp(sTopic, "ota", 3) == 0) {
+      theOTA.showStatus();
+      CloudOutput("s_ota:%d-%lu-%lu-%lu", theOTA.GetBlocks(), theOTA.GetChunks(), theOTA.GetDone(), theOTA.GetFailed());
+    } else if (wal_strnicmp(sTopic, "usage", 5) == 0) {
+      char *sParam1 = next();
+      if( !sParam1 ) {
+        theUsage.showStatus();
+      } else {
+        UC lv_node = (UC)atoi(sParam1);
+        char *sParam2 = next();
+        char *sParam3 = next();
+        UC lv_level = USAGE_LEVEL_DAY;
+        if( sParam2 && wal_strnicmp(sParam2, "h", 1) == 0 ) lv_level = USAGE_LEVEL_HOUR;
+        if( sParam2 && wal_strnicmp(sParam2, "m", 1) == 0 ) lv_level = USAGE_LEVEL_MONTH;
+        UC lv_count = (sParam3 ? atoi(sParam3) : 7);
+        if( lv_count == 0 || lv_count > 24 ) lv_count = 24;
+        // Latest closed periods
+        UL lv_to = UsageStatsClass::GetPeriod(lv_level, Time.local());
+        UL lv_from = (lv_to > lv_count ? lv_to - lv_count : 0);
+        UsageEntry_t lv_entries[24];
+        UC lv_found = theUsage.Query(lv_level, lv_node, lv_from, lv_to, lv_entries, lv_count);
+        String strCloud = String::format("s_usage:%d", lv_node);
+        for( UC i = 0; i < lv_found; i++ ) {
+          if( lv_level == USAGE_LEVEL_MONTH ) {
+            strcpy(strDisplay, String::format("%lu-%02lu", lv_entries[i].period / 12, lv_entries[i].period % 12 + 1).c_str());
+          } else {
+            // Period is in local time already
+            time_t lv_time = lv_entries[i].period * (lv_level == USAGE_LEVEL_HOUR ? 3600 : 86400) - (Time.local() - Time.now());
+            strcpy(strDisplay, Time.format(lv_time, lv_level == USAGE_LEVEL_HOUR ? "%Y-%m-%d %H:00" : "%Y-%m-%d").c_str());
+          }
+          SERIAL_LN("  %s on:%lu min, br:%d, cct:%d, cmds:%d", strDisplay, lv_entries[i].onMinutes,
+              lv_entries[i].br, lv_entries[i].cct, lv_entries[i].cmds);
+          strCloud += String::format("-%lu", lv_entries[i].onMinutes);
+        }
+        SERIAL_LN("%d buckets\n\r", lv_found);
+        CloudOutput("%s", strCloud.c_str());
+      }
+    } else if (wal_strnicmp(sTopic, "flog", 4) == 0) {
+      char *sParam1 = next();
+      UL lv_count = theLog.DumpFlash(sParam1 ? (UL)atol(sParam1) : 0);
+      SERIAL_LN("%lu records\n\r", lv_count);
+      CloudOutput("s_flog:%lu", lv_count);
   	} else if (wal_strnicmp(sTopic, "debug", 5) == 0) {
       CloudOutput(theLog.PrintDestInfo());
+      if( LOG_COMPILE_LEVEL < LEVEL_DEBUG ) SERIAL_LN("Release build, debug logs are compiled out\n\r");
   	} else {
       retVal = false;
     }
@@ -1132,6 +1237,83 @@ bool SerialConsoleClass::doSet(const char *cmd)
         SERIAL_LN("Require a valid button id (0 to %d)\n\r", MAX_NUM_BUTTONS - 1);
         retVal = true;
       }
+    } else if (wal_strnicmp(sTopic, "sfilter", 7) == 0) {
+      // Sensor report filter
+      sParam1 = next();     // Get sensor type
+      if( sParam1 && (UC)atoi(sParam1) < MAX_SENSOR_TYPES ) {
+        sParam2 = next();   // Get deadband
+        sParam3 = next();   // Get relative flag
+        sParam4 = next();   // Get min interval
+        char *sParam5 = next();   // Get heartbeat
+        if( sParam2 && sParam3 && sParam4 && sParam5 ) {
+          theConfig.SetSensorFilter((UC)atoi(sParam1), (US)atoi(sParam2), atoi(sParam3) > 0, (UC)atoi(sParam4), (UC)atoi(sParam5));
+          SERIAL_LN("sfilter%s set to %s-%s-%s-%s\n\r", sParam1, sParam2, sParam3, sParam4, sParam5);
+          CloudOutput("sfilter%s:%s-%s-%s-%s", sParam1, sParam2, sParam3, sParam4, sParam5);
+        } else {
+          SERIAL_LN("Require deadband, relative, interval and heartbeat\n\r");
+        }
+      } else {
+        SERIAL_LN("Require a valid sensor type (0 to %d)\n\r", MAX_SENSOR_TYPES - 1);
+      }
+      retVal = true;
+    } else if (wal_strnicmp(sTopic, "group", 5) == 0) {
+      // Group membership
+      sParam1 = next();     // Get group
+      sParam2 = next();     // Get device nodeid
+      if( sParam1 && sParam2 && IS_GROUP_NODEID((UC)atoi(sParam1)) ) {
+        sParam3 = next();   // Get add or remove
+        BOOL lv_add = (sParam3 ? atoi(sParam3) > 0 : true);
+        BOOL rc = (lv_add ? theGroups.AddMember((UC)atoi(sParam1), (UC)atoi(sParam2)) :
+                    theGroups.RemoveMember((UC)atoi(sParam1), (UC)atoi(sParam2)));
+        SERIAL_LN("Device %s %s group %s %s\n\r", sParam2, lv_add ? "joined" : "left", sParam1, rc ? "OK" : "failed");
+        CloudOutput("group%s:%s-%d-%d", sParam1, sParam2, lv_add, rc);
+      } else {
+        SERIAL_LN("Require a valid group (%d to %d) and device nodeid\n\r", NODEID_MIN_GROUP, NODEID_MAX_GROUP);
+      }
+      retVal = true;
+    } else if (wal_strnicmp(sTopic, "capture", 7) == 0) {
+      // RF capture and replay
+      sParam1 = next();
+      BOOL rc = true;
+      if( !sParam1 ) {
+        SERIAL_LN("Require 0, 1, clear, save, load or replay\n\r");
+      } else if (wal_strnicmp(sParam1, "clear", 5) == 0) {
+        theCapture.Clear();
+      } else if (wal_strnicmp(sParam1, "save", 4) == 0) {
+        rc = theCapture.Save();
+      } else if (wal_strnicmp(sParam1, "load", 4) == 0) {
+        rc = theCapture.Load();
+      } else if (wal_strnicmp(sParam1, "replay", 6) == 0) {
+        sParam2 = next();   // Get speed
+        rc = theCapture.StartReplay(sParam2 ? (UC)atoi(sParam2) : 1, millis());
+      } else if( atoi(sParam1) > 0 ) {
+        theCapture.Start();
+      } else {
+        theCapture.Stop();
+      }
+      if( sParam1 ) {
+        SERIAL_LN("capture %s %s\n\r", sParam1, rc ? "OK" : "failed");
+        CloudOutput("capture:%s-%d", sParam1, rc);
+      }
+      retVal = true;
+    } else if (wal_strnicmp(sTopic, "ota", 3) == 0) {
+      // Firmware distribution
+      sParam1 = next();     // Get nodeid
+      if( sParam1 ) {
+        sParam2 = next();   // Get start or stop
+        BOOL lv_start = (sParam2 ? atoi(sParam2) > 0 : true);
+        BOOL rc = true;
+        if( lv_start ) {
+          rc = theOTA.Start((UC)atoi(sParam1), millis());
+        } else {
+          theOTA.Stop((UC)atoi(sParam1));
+        }
+        SERIAL_LN("OTA to node %s %s %s\n\r", sParam1, lv_start ? "start" : "stop", rc ? "OK" : "failed");
+        CloudOutput("ota%s:%d-%d", sParam1, lv_start, rc);
+      } else {
+        SERIAL_LN("Require a nodeid\n\r");
+      }
+      retVal = true;
     } else if (wal_strnicmp(sTopic, "debug", 5) == 0) {
       sParam1 = next();
       if( sParam1) {
@@ -1139,6 +1321,7 @@ bool SerialConsoleClass::doSet(const char *cmd)
         retVal = theLog.ChangeLogLevel(strMsg);
         if( retVal ) {
           SERIAL_LN("Set Debug Level to %s\n\r", sParam1);
+          if( LOG_COMPILE_LEVEL < LEVEL_DEBUG ) SERIAL_LN("Release build, debug logs are compiled out\n\r");
           CloudOutput("debug:%s", sParam1);
         }
       }
@@ -0,0 +1,201 @@
+/**
+ * xlxStatusPoller.cpp - Xlight paced status queries to all devices
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Status of all devices is queried after boot or on the cloud command
+ * {'cmd':6,'nd':255}. Replies to queries sent back-to-back collide on air.
+ * 1. Only a window of nodes are queried at the same time, each query is
+ *    sent after a random delay of up to POLL_JITTER ms. Queries queued in
+ *    the same loop go on air back-to-back, so at most POLL_MAX_BURST are
+ *    sent per Process()
+ * 2. A node leaves the window on reply, or is queried again after
+ *    RTE_TM_RF_QUERY ms without reply, up to POLL_MAX_TRIES times
+ * 3. The window grows by one after a window of replies, and is halved on
+ *    each missing reply
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxStatusPoller.h"
+#include "xlxLogger.h"
+#include "xlSmartController.h"
+
+//------------------------------------------------------------------
+// the one and only instance of StatusPollerClass
+StatusPollerClass thePoller;
+
+static bool RequestStatus(const UC _node)
+{
+  return theSys.RequestDeviceStatus(_node);
+}
+
+StatusPollerClass::StatusPollerClass()
+{
+  m_send = RequestStatus;
+  m_winInit = POLL_WINDOW_INIT;
+  m_winMax = POLL_WINDOW_MAX;
+  m_nSent = 0;
+  m_nReplied = 0;
+  m_nLost = 0;
+  Reset();
+}
+
+void StatusPollerClass::SetSender(PollSend_t _send)
+{
+  m_send = (_send ? _send : RequestStatus);
+}
+
+void StatusPollerClass::SetWindow(const UC _init, const UC _max)
+{
+  m_winMax = (_max > 0 ? _max : 1);
+  m_winInit = constrain(_init, 1, m_winMax);
+  m_window = constrain(m_window, 1, m_winMax);
+}
+
+void StatusPollerClass::Reset()
+{
+  m_count = 0;
+  m_nPending = 0;
+  m_next = 0;
+  m_window = m_winInit;
+  m_nAcked = 0;
+  m_tmStart = 0;
+  m_tmDone = 0;
+}
+
+BOOL StatusPollerClass::AddNode(const UC _node)
+{
+  for( UC i = 0; i < m_count; i++ ) {
+    if( m_nodes[i].node == _node ) return true;
+  }
+  if( m_count >= POLL_MAX_NODES ) return false;
+  m_nodes[m_count].node = _node;
+  m_nodes[m_count].state = POLL_ST_IDLE;
+  m_count++;
+  return true;
+}
+
+void StatusPollerClass::Start(const UL _now)
+{
+  for( UC i = 0; i < m_count; i++ ) {
+    m_nodes[i].state = POLL_ST_IDLE;
+    m_nodes[i].tries = 0;
+  }
+  m_nPending = m_count;
+  m_next = 0;
+  m_window = m_winInit;
+  m_nAcked = 0;
+  m_tmStart = _now;
+  m_tmDone = 0;
+}
+
+// Query all devices in the status table
+UC StatusPollerClass::PollAllDevices(const UL _now)
+{
+  Reset();
+  ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.DevStatus_table.getRoot();
+  while( DevStatusRowPtr ) {
+    if( !IS_NOT_DEVICE_NODEID(DevStatusRowPtr->data.node_id) ) AddNode(DevStatusRowPtr->data.node_id);
+    DevStatusRowPtr = DevStatusRowPtr->next;
+  }
+  Start(_now);
+  LOGI(LOGTAG_MSG, "Polling status of %d devices", m_count);
+  return m_count;
+}
+
+void StatusPollerClass::Process(const UL _now)
+{
+  if( !m_nPending ) return;
+
+  // Missing replies shrink the window
+  UC lv_inFlight = 0;
+  PollNode_t *lv_pNode;
+  for( UC i = 0; i < m_next; i++ ) {
+    lv_pNode = m_nodes + i;
+    if( lv_pNode->state == POLL_ST_SENT && (long)(_now - lv_pNode->due) >= 0 ) {
+      m_window = max(m_window / 2, 1);
+      m_nAcked = 0;
+      if( lv_pNode->tries >= POLL_MAX_TRIES ) {
+        m_nLost++;
+        LOGW(LOGTAG_MSG, "No status from node:%d", lv_pNode->node);
+        Finish(lv_pNode, POLL_ST_LOST, _now);
+        continue;
+      }
+      lv_pNode->state = POLL_ST_WAIT;
+      lv_pNode->due = _now + random(POLL_JITTER);
+    }
+    if( lv_pNode->state == POLL_ST_WAIT || lv_pNode->state == POLL_ST_SENT ) lv_inFlight++;
+  }
+
+  // Let more nodes into the window
+  while( lv_inFlight < m_window && m_next < m_count ) {
+    lv_pNode = m_nodes + m_next++;
+    lv_pNode->state = POLL_ST_WAIT;
+    lv_pNode->due = _now + random(POLL_JITTER);
+    lv_inFlight++;
+  }
+
+  // Send queries whose jitter has passed
+  UC lv_burst = 0;
+  for( UC i = 0; i < m_next && lv_burst < POLL_MAX_BURST; i++ ) {
+    lv_pNode = m_nodes + i;
+    if( lv_pNode->state == POLL_ST_WAIT && (long)(_now - lv_pNode->due) >= 0 ) {
+      lv_pNode->state = POLL_ST_SENT;
+      lv_pNode->tries++;
+      lv_pNode->due = _now + RTE_TM_RF_QUERY;
+      m_nSent++;
+      lv_burst++;
+      m_send(lv_pNode->node);
+    }
+  }
+}
+
+void StatusPollerClass::GotReply(const UC _node, const UL _now)
+{
+  for( UC i = 0; i < m_next; i++ ) {
+    PollNode_t *lv_pNode = m_nodes + i;
+    if( lv_pNode->node != _node ) continue;
+    if( lv_pNode->state == POLL_ST_WAIT || lv_pNode->state == POLL_ST_SENT ) {
+      m_nReplied++;
+      if( ++m_nAcked >= m_window && m_window < m_winMax ) {
+        m_window++;
+        m_nAcked = 0;
+      }
+      Finish(lv_pNode, POLL_ST_DONE, _now);
+    }
+    break;
+  }
+}
+
+void StatusPollerClass::Finish(PollNode_t *_pNode, const UC _state, const UL _now)
+{
+  _pNode->state = _state;
+  if( m_nPending > 0 && --m_nPending == 0 ) {
+    m_tmDone = _now;
+    LOGI(LOGTAG_MSG, "Polled %d devices in %lu ms", m_count, m_tmDone - m_tmStart);
+  }
+}
+
+void StatusPollerClass::showStatus()
+{
+  SERIAL_LN("Status poller: %d of %d pending, window %d (%d-%d), last poll %lu ms",
+      m_nPending, m_count, m_window, m_winInit, m_winMax, m_tmDone - m_tmStart);
+  SERIAL_LN("  %lu sent, %lu replied, %lu lost", m_nSent, m_nReplied, m_nLost);
+}
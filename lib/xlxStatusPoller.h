@@ -0,0 +1,83 @@
+//  xlxStatusPoller.h - Xlight paced status queries to all devices
+
+#ifndef xlxStatusPoller_h
+#define xlxStatusPoller_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+
+#define POLL_MAX_NODES            MAX_NODE_PER_CONTROLLER
+#define POLL_WINDOW_INIT          4           // Queries in flight at start
+#define POLL_WINDOW_MAX           8
+#define POLL_JITTER               200         // ms, random delay of each query after it enters the window
+#define POLL_MAX_TRIES            3
+#define POLL_MAX_BURST            1           // Queries per Process(), they go on air back-to-back
+
+// Node states
+#define POLL_ST_IDLE              0           // Not polled yet
+#define POLL_ST_WAIT              1           // In window, waiting for its jitter
+#define POLL_ST_SENT              2           // Waiting for reply
+#define POLL_ST_DONE              3
+#define POLL_ST_LOST              4           // No reply after POLL_MAX_TRIES
+
+// Send status query to a node
+typedef bool (*PollSend_t)(const UC _node);
+
+typedef struct
+{
+  UC node;
+  UC state;
+  UC tries;
+  UL due;                           // millis() to send in WAIT, deadline in SENT
+} PollNode_t;
+
+//------------------------------------------------------------------
+// Xlight Status Poller Class
+//------------------------------------------------------------------
+class StatusPollerClass
+{
+public:
+  StatusPollerClass();
+
+  void SetSender(PollSend_t _send);
+  void SetWindow(const UC _init, const UC _max);
+  void Reset();
+  BOOL AddNode(const UC _node);
+  void Start(const UL _now);
+  UC PollAllDevices(const UL _now);
+  void Process(const UL _now);
+  void GotReply(const UC _node, const UL _now);
+
+  BOOL IsBusy() { return m_nPending > 0; }
+  UC GetWindow() { return m_window; }
+  UL GetDuration() { return m_tmDone - m_tmStart; }
+  UL GetSent() { return m_nSent; }
+  UL GetLost() { return m_nLost; }
+  void showStatus();
+
+private:
+  PollSend_t m_send;
+  PollNode_t m_nodes[POLL_MAX_NODES];
+  UC m_count;
+  UC m_nPending;                    // Nodes not done or lost
+  UC m_next;                        // Next idle node to enter the window
+  UC m_window;
+  UC m_winInit;
+  UC m_winMax;
+  UC m_nAcked;                      // Replies since last window change
+  UL m_tmStart;
+  UL m_tmDone;
+
+  UL m_nSent;
+  UL m_nReplied;
+  UL m_nLost;
+
+  void Finish(PollNode_t *_pNode, const UC _state, const UL _now);
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern StatusPollerClass thePoller;
+
+#endif /* xlxStatusPoller_h */
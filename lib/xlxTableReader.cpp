@@ -0,0 +1,85 @@
+/**
+ * xlxTableReader.cpp - Xlight streaming reader of tables on flash
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * Like Flashee::FlashReader, but reads the flash in TABLE_READER_CHUNK
+ * pieces, so loaders can take one row at a time without an array of the
+ * whole table on the stack, and small rows don't cost a flash read each.
+ * 1. Rows may cross chunk borders
+ * 2. Reading past the end of the table fails
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxTableReader.h"
+
+//------------------------------------------------------------------
+// Xlight Table Reader Class
+//------------------------------------------------------------------
+TableReaderClass::TableReaderClass(Flashee::FlashDevice *pDevice, const UL _addr, const UL _len)
+{
+  m_pDevice = pDevice;
+  m_addr = _addr;
+  m_len = _len;
+  m_offset = 0;
+  m_bufStart = 0;
+  m_bufLen = 0;
+  m_nChunks = 0;
+}
+
+// Load the chunk starting at current offset
+BOOL TableReaderClass::Fill()
+{
+  if( IsEnd() ) return false;
+  m_bufStart = m_offset;
+  m_bufLen = min(m_len - m_offset, TABLE_READER_CHUNK);
+  if( !m_pDevice->read(m_buf, m_addr + m_bufStart, m_bufLen) ) {
+    m_bufLen = 0;
+    return false;
+  }
+  m_nChunks++;
+  return true;
+}
+
+BOOL TableReaderClass::Read(void *_data, const US _len)
+{
+  UC *pData = (UC *)_data;
+  US _left = _len;
+
+  if( m_offset + _len > m_len ) return false;
+  while( _left > 0 ) {
+    if( m_offset >= m_bufStart + m_bufLen ) {
+      if( !Fill() ) return false;
+    }
+    US _size = min(_left, m_bufStart + m_bufLen - m_offset);
+    memcpy(pData, m_buf + m_offset - m_bufStart, _size);
+    pData += _size;
+    m_offset += _size;
+    _left -= _size;
+  }
+  return true;
+}
+
+BOOL TableReaderClass::Skip(const US _len)
+{
+  if( m_offset + _len > m_len ) return false;
+  m_offset += _len;
+  return true;
+}
@@ -0,0 +1,40 @@
+//  xlxTableReader.h - Xlight streaming reader of tables on flash
+
+#ifndef xlxTableReader_h
+#define xlxTableReader_h
+
+#include "xliCommon.h"
+#include "flashee-eeprom.h"
+
+// Bytes read from flash at a time
+#define TABLE_READER_CHUNK        64
+
+//------------------------------------------------------------------
+// Xlight Table Reader Class
+//------------------------------------------------------------------
+class TableReaderClass
+{
+public:
+  TableReaderClass(Flashee::FlashDevice *pDevice, const UL _addr, const UL _len);
+
+  BOOL Read(void *_data, const US _len);
+  template<typename T> inline BOOL Read(T &_data) { return Read(&_data, sizeof(T)); }
+  BOOL Skip(const US _len);
+  UL GetOffset() { return m_offset; }
+  BOOL IsEnd() { return(m_offset >= m_len); }
+  US GetChunkReads() { return m_nChunks; }
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_addr;
+  UL m_len;
+  UL m_offset;                      // Bytes consumed
+  UL m_bufStart;                    // Offset of the chunk in buffer
+  US m_bufLen;
+  US m_nChunks;
+  UC m_buf[TABLE_READER_CHUNK];
+
+  BOOL Fill();
+};
+
+#endif /* xlxTableReader_h */
@@ -0,0 +1,368 @@
+/**
+ * xlxUsageStats.cpp - Xlight per-device usage statistics in hourly, daily and monthly buckets
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2016 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * DESCRIPTION
+ * On time, average brightness and CCT, and number of commands of every lamp
+ * are aggregated on the controller and kept in MEM_REPORT.
+ * 1. Confirmed lamp state is fed in by ConfirmLampOnOff/Brightness/CCT(),
+ *    Tick() adds the elapsed time to the counters of the current hour
+ * 2. When the hour ends, its buckets are written as one record and added to
+ *    the counters of the day, the day is added to the month likewise
+ * 3. Each level has a ring of fixed-size record slots in the whole logical
+ *    pages inside the region: hours and days get 1/4 of them each, months
+ *    the rest. A page is erased when the first slot in it is written
+ * 4. At boot the newest record of each ring is found, and the counters of
+ *    the current day and month are rebuilt from the records. Only the
+ *    current hour is lost on power loss
+ * 5. Periods are counted in local time
+ *
+ * ToDo:
+ * 1.
+**/
+
+#include "xlxUsageStats.h"
+#include "xliMemoryMap.h"
+#include "xlxLogger.h"
+
+//------------------------------------------------------------------
+// the one and only instance of UsageStatsClass
+UsageStatsClass theUsage;
+
+// On time unit of each level in minutes, so that a bucket fits in one byte
+static const US usageOnUnit[USAGE_LEVELS] = {1, 6, 240};
+
+// Read buffer of one record
+static UsageBucket_t usageBuckets[USAGE_MAX_DEVICES];
+
+//------------------------------------------------------------------
+// Xlight Usage Statistics Class
+//------------------------------------------------------------------
+UsageStatsClass::UsageStatsClass()
+{
+  m_pDevice = NULL;
+  m_pageSize = 0;
+  m_slotSize = sizeof(UsageHead_t) + sizeof(UsageBucket_t) * USAGE_MAX_DEVICES;
+  memset(m_rings, 0x00, sizeof(m_rings));
+  memset(m_period, 0x00, sizeof(m_period));
+  m_tmLast = 0;
+  memset(m_devices, 0x00, sizeof(m_devices));
+  memset(m_accum, 0x00, sizeof(m_accum));
+  m_nRecords = 0;
+  m_nProgBytes = 0;
+  m_nErases = 0;
+  m_nCorrupt = 0;
+}
+
+// Months since year 0 of days since 1970-01-01
+UL UsageStatsClass::GetMonth(const UL _day)
+{
+  UL z = _day + 719468;
+  UL era = z / 146097;
+  UL doe = z - era * 146097;
+  UL yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  UL doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  UL mp = (5 * doy + 2) / 153;
+  UL month = (mp < 10 ? mp + 3 : mp - 9);
+  UL year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+  return(year * 12 + month - 1);
+}
+
+UL UsageStatsClass::GetPeriod(const UC _level, const UL _time)
+{
+  switch( _level ) {
+  case USAGE_LEVEL_HOUR:    return(_time / 3600);
+  case USAGE_LEVEL_DAY:     return(_time / 86400);
+  default:                  return GetMonth(_time / 86400);
+  }
+}
+
+UL UsageStatsClass::SlotAddr(const UC _level, const US _slot)
+{
+  US _perPage = m_pageSize / m_slotSize;
+  return(m_rings[_level].base + (_slot / _perPage) * m_pageSize + (_slot % _perPage) * m_slotSize);
+}
+
+// Split the region into rings, find the newest records and rebuild the counters
+BOOL UsageStatsClass::Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size)
+{
+  UsageHead_t _head;
+
+  m_pDevice = NULL;
+  memset(m_period, 0x00, sizeof(m_period));
+  m_tmLast = 0;
+  memset(m_devices, 0x00, sizeof(m_devices));
+  memset(m_accum, 0x00, sizeof(m_accum));
+  if( !pDevice ) return false;
+  m_pageSize = pDevice->pageSize();
+  US _perPage = m_pageSize / m_slotSize;
+  UL _base = FLASH_PAGE_CEIL(_addr, m_pageSize);
+  UL _pages = (_addr + _size > _base ? (FLASH_PAGE_FLOOR(_addr + _size, m_pageSize) - _base) / m_pageSize : 0);
+  if( _perPage == 0 || _pages < 6 ) return false;
+
+  UL _ringPages[USAGE_LEVELS];
+  _ringPages[USAGE_LEVEL_HOUR] = _ringPages[USAGE_LEVEL_DAY] = (_pages / 4 < 2 ? 2 : _pages / 4);
+  _ringPages[USAGE_LEVEL_MONTH] = _pages - 2 * _ringPages[USAGE_LEVEL_HOUR];
+  for( UC _level = 0; _level < USAGE_LEVELS; _level++ ) {
+    m_rings[_level].base = _base;
+    m_rings[_level].slots = _ringPages[_level] * _perPage;
+    m_rings[_level].next = 0;
+    _base += _ringPages[_level] * m_pageSize;
+  }
+  m_pDevice = pDevice;
+
+  // Newest record of each ring
+  for( UC _level = 0; _level < USAGE_LEVELS; _level++ ) {
+    UsageRing_t *pRing = &m_rings[_level];
+    BOOL _found = false;
+    for( US _slot = 0; _slot < pRing->slots; _slot++ ) {
+      if( !ReadRecord(_level, _slot, _head, usageBuckets) ) continue;
+      if( !_found || _head.period > m_period[_level] ) {
+        m_period[_level] = _head.period;
+        pRing->next = (_slot + 1) % pRing->slots;
+        _found = true;
+      }
+    }
+    // Don't program over a record cut off by power loss, start with the next page
+    if( pRing->next % _perPage ) {
+      if( !m_pDevice->read(&_head, SlotAddr(_level, pRing->next), sizeof(_head)) ) return false;
+      if( _head.level != 0xFF ) pRing->next = (pRing->next / _perPage + 1) * _perPage % pRing->slots;
+    }
+  }
+
+  // Counters of the day and month the newest hour belongs to, unless they are closed already
+  UL _closed[USAGE_LEVELS];
+  memcpy(_closed, m_period, sizeof(_closed));
+  if( m_period[USAGE_LEVEL_HOUR] ) {
+    m_period[USAGE_LEVEL_DAY] = m_period[USAGE_LEVEL_HOUR] / 24;
+    m_period[USAGE_LEVEL_MONTH] = GetMonth(m_period[USAGE_LEVEL_DAY]);
+    for( UC _level = USAGE_LEVEL_DAY; _level < USAGE_LEVELS; _level++ ) {
+      if( _closed[_level] == m_period[_level] ) continue;
+      for( US _slot = 0; _slot < m_rings[_level - 1].slots; _slot++ ) {
+        if( !ReadRecord(_level - 1, _slot, _head, usageBuckets) ) continue;
+        UL _period = (_level == USAGE_LEVEL_DAY ? _head.period / 24 : GetMonth(_head.period));
+        if( _period == m_period[_level] ) AddRecord(_level, _head, usageBuckets);
+      }
+    }
+  } else {
+    memset(m_period, 0x00, sizeof(m_period));
+  }
+  LOGI(LOGTAG_MSG, "Usage stats: hour %lu, day %lu, month %lu", m_period[USAGE_LEVEL_HOUR], m_period[USAGE_LEVEL_DAY], m_period[USAGE_LEVEL_MONTH]);
+  return true;
+}
+
+BOOL UsageStatsClass::ReadRecord(const UC _level, const US _slot, UsageHead_t &_head, UsageBucket_t *_buckets)
+{
+  UL _addr = SlotAddr(_level, _slot);
+  if( !m_pDevice->read(&_head, _addr, sizeof(_head)) ) return false;
+  if( _head.magic != USAGE_REC_MAGIC ) return false;
+  if( _head.level != _level || _head.count > USAGE_MAX_DEVICES
+      || !m_pDevice->read(_buckets, _addr + sizeof(_head), _head.count * sizeof(UsageBucket_t))
+      || CRC32(_buckets, _head.count * sizeof(UsageBucket_t), CRC32(&_head.level, 7)) != _head.crc ) {
+    m_nCorrupt++;
+    return false;
+  }
+  return true;
+}
+
+// Add the buckets of a record to the counters of a level
+void UsageStatsClass::AddRecord(const UC _level, const UsageHead_t &_head, const UsageBucket_t *_buckets)
+{
+  for( UC i = 0; i < _head.count; i++ ) {
+    UsageDevice_t *pDev = GetDevice(_buckets[i].node);
+    if( !pDev ) continue;
+    UsageAccum_t *pAcc = &m_accum[_level][pDev - m_devices];
+    UL _onSec = (UL)_buckets[i].on * usageOnUnit[_head.level] * 60;
+    pAcc->onSec += _onSec;
+    pAcc->brSec += _buckets[i].br * _onSec;
+    pAcc->cctSec += _buckets[i].cct * _onSec;
+    pAcc->cmds += _buckets[i].cmds;
+  }
+}
+
+// Write the counters of a level as one record, idle devices are left out
+BOOL UsageStatsClass::WriteRecord(const UC _level, const UL _period)
+{
+  UC _buf[sizeof(UsageHead_t) + sizeof(UsageBucket_t) * USAGE_MAX_DEVICES];
+  UsageHead_t *pHead = (UsageHead_t *)_buf;
+  UsageBucket_t *pBucket = (UsageBucket_t *)(_buf + sizeof(UsageHead_t));
+  UL _unit = usageOnUnit[_level] * 60;
+
+  pHead->count = 0;
+  for( UC i = 0; i < USAGE_MAX_DEVICES; i++ ) {
+    UsageAccum_t *pAcc = &m_accum[_level][i];
+    if( !m_devices[i].node || (pAcc->onSec == 0 && pAcc->cmds == 0) ) continue;
+    pBucket->node = m_devices[i].node;
+    pBucket->on = (pAcc->onSec + _unit / 2) / _unit;
+    pBucket->br = (pAcc->onSec ? pAcc->brSec / pAcc->onSec : 0);
+    pBucket->cct = (pAcc->onSec ? pAcc->cctSec / pAcc->onSec : 0);
+    pBucket->cmds = (pAcc->cmds > 255 ? 255 : pAcc->cmds);
+    pBucket++;
+    pHead->count++;
+  }
+  if( pHead->count == 0 ) return true;
+
+  UsageRing_t *pRing = &m_rings[_level];
+  UL _addr = SlotAddr(_level, pRing->next);
+  US _total = sizeof(UsageHead_t) + pHead->count * sizeof(UsageBucket_t);
+  pHead->magic = 0xFF;
+  pHead->level = _level;
+  pHead->reserved = 0xFF;
+  pHead->period = _period;
+  pHead->crc = CRC32(_buf + sizeof(UsageHead_t), _total - sizeof(UsageHead_t), CRC32(&pHead->level, 7));
+
+  // A page is erased when its first slot is taken, dropping the oldest records
+  BOOL rc = true;
+  if( pRing->next % (m_pageSize / m_slotSize) == 0 ) {
+    m_nErases++;
+    rc = m_pDevice->erasePage(_addr);
+  }
+  pRing->next = (pRing->next + 1) % pRing->slots;
+  if( rc ) {
+    // Program head and buckets, then the magic byte to commit
+    m_nProgBytes += _total;
+    UC _magic = USAGE_REC_MAGIC;
+    rc = m_pDevice->writePage(_buf + 1, _addr + 1, _total - 1) && m_pDevice->writePage(&_magic, _addr, 1);
+  }
+  if( rc ) m_nRecords++;
+  return rc;
+}
+
+// Close the hour, and the day and month if they are over as well
+void UsageStatsClass::Rollover(const UL _hour)
+{
+  for( UC _level = USAGE_LEVEL_HOUR; _level < USAGE_LEVELS; _level++ ) {
+    UL _period = GetPeriod(_level, _hour * 3600);
+    if( _period == m_period[_level] ) break;
+    if( m_period[_level] ) {
+      if( !WriteRecord(_level, m_period[_level]) ) {
+        LOGW(LOGTAG_MSG, "Failed to write usage level %d", _level);
+      }
+      // Add up to the next level
+      if( _level + 1 < USAGE_LEVELS ) {
+        for( UC i = 0; i < USAGE_MAX_DEVICES; i++ ) {
+          UsageAccum_t *pAcc = &m_accum[_level][i];
+          UsageAccum_t *pUpper = &m_accum[_level + 1][i];
+          pUpper->onSec += pAcc->onSec;
+          pUpper->brSec += pAcc->brSec;
+          pUpper->cctSec += pAcc->cctSec;
+          pUpper->cmds += pAcc->cmds;
+        }
+      }
+    }
+    memset(m_accum[_level], 0x00, sizeof(m_accum[_level]));
+    m_period[_level] = _period;
+  }
+}
+
+// Count the time since the last tick, _now is local time
+void UsageStatsClass::Tick(const UL _now)
+{
+  if( !m_pDevice || _now < USAGE_MIN_TIME ) return;
+
+  if( m_tmLast && _now > m_tmLast && _now - m_tmLast <= USAGE_MAX_GAP ) {
+    UL _elapsed = _now - m_tmLast;
+    for( UC i = 0; i < USAGE_MAX_DEVICES; i++ ) {
+      if( !m_devices[i].node || !m_devices[i].on ) continue;
+      UsageAccum_t *pAcc = &m_accum[USAGE_LEVEL_HOUR][i];
+      pAcc->onSec += _elapsed;
+      pAcc->brSec += m_devices[i].br * _elapsed;
+      pAcc->cctSec += m_devices[i].cct * _elapsed;
+    }
+  }
+  m_tmLast = _now;
+
+  UL _hour = _now / 3600;
+  if( _hour != m_period[USAGE_LEVEL_HOUR] ) Rollover(_hour);
+}
+
+UsageDevice_t *UsageStatsClass::GetDevice(const UC _node)
+{
+  UsageDevice_t *pFree = NULL;
+  for( UC i = 0; i < USAGE_MAX_DEVICES; i++ ) {
+    if( m_devices[i].node == _node ) return &m_devices[i];
+    if( !pFree && m_devices[i].node == 0 ) pFree = &m_devices[i];
+  }
+  if( pFree ) {
+    memset(pFree, 0x00, sizeof(UsageDevice_t));
+    pFree->node = _node;
+  }
+  return pFree;
+}
+
+void UsageStatsClass::SetState(const UC _node, const UC _on)
+{
+  UsageDevice_t *pDev = GetDevice(_node);
+  if( !pDev || pDev->on == (_on ? 1 : 0) ) return;
+  pDev->on = (_on ? 1 : 0);
+  m_accum[USAGE_LEVEL_HOUR][pDev - m_devices].cmds++;
+}
+
+void UsageStatsClass::SetBrightness(const UC _node, const UC _on, const UC _br)
+{
+  UsageDevice_t *pDev = GetDevice(_node);
+  if( !pDev || (pDev->on == (_on ? 1 : 0) && pDev->br == _br) ) return;
+  pDev->on = (_on ? 1 : 0);
+  pDev->br = _br;
+  m_accum[USAGE_LEVEL_HOUR][pDev - m_devices].cmds++;
+}
+
+void UsageStatsClass::SetCCT(const UC _node, const US _cct)
+{
+  UsageDevice_t *pDev = GetDevice(_node);
+  if( !pDev || pDev->cct == _cct / 50 ) return;
+  pDev->cct = _cct / 50;
+  m_accum[USAGE_LEVEL_HOUR][pDev - m_devices].cmds++;
+}
+
+// Buckets of a node from period _from to _to in time order, returns the number of entries
+UC UsageStatsClass::Query(const UC _level, const UC _node, const UL _from, const UL _to, UsageEntry_t *_entries, const UC _max)
+{
+  UsageHead_t _head;
+  UC _count = 0;
+
+  if( !m_pDevice || _level >= USAGE_LEVELS ) return 0;
+  // Oldest slot first
+  UsageRing_t *pRing = &m_rings[_level];
+  for( US n = 0; n < pRing->slots && _count < _max; n++ ) {
+    US _slot = (pRing->next + n) % pRing->slots;
+    if( !ReadRecord(_level, _slot, _head, usageBuckets) ) continue;
+    if( _head.period < _from || _head.period > _to ) continue;
+    for( UC i = 0; i < _head.count; i++ ) {
+      if( usageBuckets[i].node != _node ) continue;
+      UsageEntry_t *pEntry = &_entries[_count++];
+      pEntry->period = _head.period;
+      pEntry->onMinutes = (UL)usageBuckets[i].on * usageOnUnit[_level];
+      pEntry->br = usageBuckets[i].br;
+      pEntry->cct = usageBuckets[i].cct * 50;
+      pEntry->cmds = usageBuckets[i].cmds;
+      break;
+    }
+  }
+  return _count;
+}
+
+void UsageStatsClass::showStatus()
+{
+  if( !m_pDevice ) {
+    SERIAL_LN("Usage stats: not available");
+    return;
+  }
+  SERIAL_LN("Usage stats: hour %lu, day %lu, month %lu", m_period[USAGE_LEVEL_HOUR], m_period[USAGE_LEVEL_DAY], m_period[USAGE_LEVEL_MONTH]);
+  SERIAL_LN("  %lu records, %lu bytes programmed, %lu erases, %lu corrupt", m_nRecords, m_nProgBytes, m_nErases, m_nCorrupt);
+}
@@ -0,0 +1,134 @@
+//  xlxUsageStats.h - Xlight per-device usage statistics in hourly, daily and monthly buckets
+
+#ifndef xlxUsageStats_h
+#define xlxUsageStats_h
+
+#include "xliCommon.h"
+#include "xliConfig.h"
+#include "flashee-eeprom.h"
+
+#define USAGE_MAX_DEVICES         MAX_NODE_PER_CONTROLLER
+#define USAGE_MIN_TIME            1483228800  // 2017-01-01, time is not synchronized before
+#define USAGE_MAX_GAP             900         // Longer gaps between ticks are not counted
+
+// Levels of buckets, each has its own ring of records
+#define USAGE_LEVEL_HOUR          0
+#define USAGE_LEVEL_DAY           1
+#define USAGE_LEVEL_MONTH         2
+#define USAGE_LEVELS              3
+
+#define USAGE_REC_MAGIC           0xB5
+
+// One device in one period, on time is counted in units of the level
+typedef struct
+	__attribute__((packed))
+{
+  UC node;
+  UC on;                            // Minutes, 6 minutes or 4 hours on
+  UC br;                            // Average brightness while on
+  UC cct;                           // Average CCT / 50 while on
+  UC cmds;                          // Changes of state, brightness or CCT, up to 255
+} UsageBucket_t;
+
+// Record head, the buckets of active devices follow. The magic byte is programmed last
+typedef struct
+	__attribute__((packed))
+{
+  UC magic;
+  UC level;
+  UC count;                         // Number of buckets
+  UC reserved;
+  UL period;                        // Hours, days or months since 1970
+  UL crc;                           // CRC32 over level, count, reserved, period and buckets
+} UsageHead_t;
+
+// Query result
+typedef struct
+{
+  UL period;
+  UL onMinutes;
+  UC br;
+  US cct;
+  US cmds;
+} UsageEntry_t;
+
+// Counters of the period being accumulated
+typedef struct
+{
+  UL onSec;
+  UL brSec;                         // Brightness x seconds on
+  UL cctSec;                        // CCT / 50 x seconds on
+  US cmds;
+} UsageAccum_t;
+
+// Current state of a device
+typedef struct
+{
+  UC node;                          // 0 for free slot
+  UC on;
+  UC br;
+  UC cct;                           // CCT / 50
+} UsageDevice_t;
+
+// Fixed-size record slots of one level, in whole pages
+typedef struct
+{
+  UL base;
+  US slots;
+  US next;                          // Slot to write next
+} UsageRing_t;
+
+//------------------------------------------------------------------
+// Xlight Usage Statistics Class
+//------------------------------------------------------------------
+class UsageStatsClass
+{
+public:
+  UsageStatsClass();
+
+  BOOL Init(Flashee::FlashDevice *pDevice, const UL _addr, const UL _size);
+  BOOL IsReady() { return(m_pDevice != NULL); }
+  void Tick(const UL _now);
+
+  void SetState(const UC _node, const UC _on);
+  void SetBrightness(const UC _node, const UC _on, const UC _br);
+  void SetCCT(const UC _node, const US _cct);
+
+  UC Query(const UC _level, const UC _node, const UL _from, const UL _to, UsageEntry_t *_entries, const UC _max);
+  static UL GetPeriod(const UC _level, const UL _time);
+  static UL GetMonth(const UL _day);
+
+  UL GetRecords() { return m_nRecords; }
+  UL GetProgBytes() { return m_nProgBytes; }
+  UL GetErases() { return m_nErases; }
+  void showStatus();
+
+private:
+  Flashee::FlashDevice *m_pDevice;
+  UL m_pageSize;
+  US m_slotSize;
+  UsageRing_t m_rings[USAGE_LEVELS];
+  UL m_period[USAGE_LEVELS];        // Period being accumulated
+  UL m_tmLast;
+  UsageDevice_t m_devices[USAGE_MAX_DEVICES];
+  UsageAccum_t m_accum[USAGE_LEVELS][USAGE_MAX_DEVICES];
+
+  UL m_nRecords;
+  UL m_nProgBytes;
+  UL m_nErases;
+  UL m_nCorrupt;
+
+  UL SlotAddr(const UC _level, const US _slot);
+  BOOL ReadRecord(const UC _level, const US _slot, UsageHead_t &_head, UsageBucket_t *_buckets);
+  BOOL WriteRecord(const UC _level, const UL _period);
+  void AddRecord(const UC _level, const UsageHead_t &_head, const UsageBucket_t *_buckets);
+  void Rollover(const UL _hour);
+  UsageDevice_t *GetDevice(const UC _node);
+};
+
+//------------------------------------------------------------------
+// Function & Class Helper
+//------------------------------------------------------------------
+extern UsageStatsClass theUsage;
+
+#endif /* xlxUsageStats_h */
@@ -21,6 +21,8 @@
  * Dependancy
  *
  * DESCRIPTION
+ * 1. Nodes are allocated once and kept in a ring
+ * 2. Tag of message is its priority for GetUrgentMessage(), lower first
  *
  * ToDo:
  *
@@ -49,6 +51,7 @@ CFastMessageNode::CFastMessageNode(uint8_t f_iSize)
 	m_pNext = NULL;
 	m_Tag = 0;
 	m_iFlag = 0;
+  m_tickAdded = 0;
   m_iRepeatTimes = 0;
   m_tickLastRead = 0;
 }
@@ -98,6 +101,12 @@ uint8_t CFastMessageNode::CompareMessage(const uint8_t *f_data, uint8_t f_len, u
   //return(memcmp(f_data, m_pData, m_nLen) == 0);
 }
 
+// return true if the message can be read again
+bool CFastMessageNode::IsReady(uint32_t f_now, uint8_t f_10ms)
+{
+  return(f_now - m_tickLastRead > f_10ms * 10);
+}
+
 void CFastMessageNode::ClearMessage()
 {
   m_nLen = 0;
@@ -108,7 +117,8 @@ CFastMessageQ::CFastMessageQ(uint8_t f_iMaxLen, uint8_t f_iNodeSize)
 	  m_pQHead(NULL),
 	  m_pQTail(NULL),
     m_bDupMsg(false),
-    m_bLock(false)
+    m_bLock(false),
+    m_bAgedLast(false)
 {
 	// Get maxium length
 	m_iMaxQLength = f_iMaxLen;
@@ -204,6 +214,7 @@ uint8_t CFastMessageQ::AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t
 	{
 		// Set Data
 		m_pQTail->WriteMessage(f_data, f_len, f_Tag,f_flag);
+		m_pQTail->m_tickAdded = GetTick();
 		m_pQTail = m_pQTail->m_pNext;
 		m_iQLength++;
 		lv_retVal = m_iQLength;
@@ -233,6 +244,32 @@ CFastMessageNode *CFastMessageQ::GetMessage(CFastMessageNode *pNode)
 	return pNode;
 }
 
+// Ready member with the lowest tag, the first one among equals. A member waiting
+// for f_aging ms or longer is taken ahead of them, but not twice in a row
+CFastMessageNode *CFastMessageQ::GetUrgentMessage(uint32_t f_aging, uint8_t f_10ms)
+{
+  uint32_t ticknow = GetTick();
+  CFastMessageNode *lv_pBest = NULL, *lv_pAged = NULL;
+  CFastMessageNode *lv_pNode = NULL;
+
+  while( lv_pNode = GetMessage(lv_pNode) )
+  {
+    if( lv_pNode->IsReady(ticknow, f_10ms) )
+    {
+      if( !lv_pBest || lv_pNode->m_Tag < lv_pBest->m_Tag ) lv_pBest = lv_pNode;
+      if( !lv_pAged && ticknow - lv_pNode->m_tickAdded >= f_aging ) lv_pAged = lv_pNode;
+    }
+    lv_pNode = lv_pNode->m_pNext;
+  }
+
+  if( lv_pAged && lv_pAged != lv_pBest && !m_bAgedLast ) {
+    m_bAgedLast = true;
+    return lv_pAged;
+  }
+  m_bAgedLast = false;
+  return lv_pBest;
+}
+
 // Remove member
 bool CFastMessageQ::RemoveMessage(CFastMessageNode *pNode)
 {
@@ -244,7 +281,22 @@ bool CFastMessageQ::RemoveMessage(CFastMessageNode *pNode)
 	LockQueue();
 
 	if( pNode == NULL ) pNode = m_pQHead;
-  if( pNode != m_pQTail && m_iQLength > 0 ) {
+  if( m_iQLength > 0 && m_iQLength == m_iMaxQLength ) {
+    // Full ring, tail is at head: the member becomes the free node right before head
+    pNode->ClearMessage();
+    if( pNode == m_pQHead ) {
+      m_pQHead = pNode->m_pNext;
+    } else {
+      pNode->m_pPrev->m_pNext = pNode->m_pNext;
+      pNode->m_pNext->m_pPrev = pNode->m_pPrev;
+      pNode->m_pNext = m_pQHead;
+      pNode->m_pPrev = m_pQHead->m_pPrev;
+      m_pQHead->m_pPrev->m_pNext = pNode;
+      m_pQHead->m_pPrev = pNode;
+    }
+    m_pQTail = pNode;
+    m_iQLength--;
+  } else if( pNode != m_pQTail && m_iQLength > 0 ) {
     pNode->ClearMessage();
 	if(pNode == m_pQHead)
 	{
@@ -266,6 +318,25 @@ bool CFastMessageQ::RemoveMessage(CFastMessageNode *pNode)
 	return lv_retVal;
 }
 
+// Remove members of this tag whose flag matches f_flag in f_mask bits, returns the number removed
+uint8_t CFastMessageQ::RemoveMessages(uint8_t f_Tag, uint32_t f_flag, uint32_t f_mask)
+{
+  uint8_t lv_count = 0;
+  CFastMessageNode *lv_pNext;
+  CFastMessageNode *lv_pNode = (m_iQLength > 0 ? GetMessage() : NULL);
+  while( lv_pNode )
+  {
+    // Take the next one first, a removed member is moved after the tail
+    lv_pNext = GetMessage(lv_pNode->m_pNext);
+    if( lv_pNode->m_Tag == f_Tag && (lv_pNode->m_iFlag & f_mask) == (f_flag & f_mask) ) {
+      RemoveMessage(lv_pNode);
+      lv_count++;
+    }
+    lv_pNode = lv_pNext;
+  }
+  return lv_count;
+}
+
 // Remove all messages from queue
 void CFastMessageQ::RemoveAllMessage()
 {
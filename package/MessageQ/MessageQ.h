@@ -15,10 +15,12 @@ public:
   CFastMessageNode *m_pPrev;
   uint8_t m_Tag;
   uint32_t m_iFlag;           // Message flag
+  uint32_t m_tickAdded;       // Tick when the message was added
 
   void WriteMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0);
   uint8_t ReadMessage(uint8_t *f_data, uint8_t *f_repeat, uint8_t *f_Tag = NULL, uint32_t *f_flag = NULL, uint8_t f_10ms = 0);
   uint8_t CompareMessage(const uint8_t *f_data, uint8_t f_len, uint32_t f_flag = 0);
+  bool IsReady(uint32_t f_now, uint8_t f_10ms = 0);
   void ClearMessage();
 
 private:
@@ -34,7 +36,9 @@ class CFastMessageQ
 public:
 	void RemoveAllMessage();
 	bool RemoveMessage(CFastMessageNode *pNode = NULL);
+	uint8_t RemoveMessages(uint8_t f_Tag, uint32_t f_flag, uint32_t f_mask = 0xFFFFFFFF);
 	CFastMessageNode *GetMessage(CFastMessageNode *pNode = NULL);
+	CFastMessageNode *GetUrgentMessage(uint32_t f_aging, uint8_t f_10ms = 0);
 	uint8_t AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0);
 	uint8_t GetMQLength();
 	uint8_t GetMQMaxLength();
@@ -51,6 +55,8 @@ public:
   bool GetDuplicateMsg();
   void SetDuplicateMsg(const bool f_sw = true);
 
+  virtual uint32_t GetTick() { return millis(); }
+
 protected:
 	CFastMessageNode *m_pQHead;
 	CFastMessageNode *m_pQTail;
@@ -61,6 +67,7 @@ protected:
 private:
 	bool m_bLock;
   bool m_bDupMsg;
+  bool m_bAgedLast;           // Last urgent message was taken for its age
 };
 
 #endif
@@ -59,5 +59,11 @@
 #define RF24_DATARATE 	   	RF24_250KBPS
 // This is also act as base value for sensor nodeId addresses.
 #define RF24_BASE_RADIO_ID ((uint64_t)0x4454495400LL)
+// Nodes return their status in the payload of auto-ack. It turns on dynamic payloads,
+// so all nodes in the network must be built with the same setting. The gateway queries
+// the status after each command, so nodes must reload the ack payload once a command
+// is applied and send no status reply frame to C_SET or C_REQ V_RGBW. Node firmware
+// that still replies with frames costs a query and a reply more per command
+//#define RF24_ACK_PAYLOAD
 
 #endif
@@ -25,83 +25,86 @@ MyParserSerial serialMsgParser;
 
 MyParserSerial::MyParserSerial() : MyParser() {}
 
+// Integer value of a token span, same as atoi() but stops at the end of the span
+static int spanToInt(const char *str, const char *end) {
+	int value = 0;
+	bool neg = false;
+	while (str < end && (*str == ' ' || (*str >= '\t' && *str <= '\r'))) str++;
+	if (str < end && (*str == '-' || *str == '+')) neg = (*str++ == '-');
+	while (str < end && *str >= '0' && *str <= '9') value = value * 10 + (*str++ - '0');
+	return neg ? -value : value;
+}
+
+// Next token separated by semicolons, empty tokens are skipped like strtok_r() does.
+// The separator after the token is replaced by 0, so the buffer is parsed in place
+static char *nextToken(char *&p, char *&end) {
+	while (*p == ';') p++;
+	if (*p == 0) return NULL;
+	char *str = p;
+	while (*p && *p != ';') p++;
+	end = p;
+	if (*p) *p++ = 0;
+	return str;
+}
+
+// Parse in place on the caller's buffer without any heap allocation
 bool MyParserSerial::parse(MyMessage &message, char *inputString) {
-	char *str, *p, *value=NULL;
+	char *str, *end, *p = inputString, *value=NULL;
 	uint8_t bvalue[MAX_PAYLOAD];
 	uint8_t blen = 0;
 	int i = 0;
 	uint8_t command = 0;
 	uint8_t ack = 0;
-	String sNodeid = "";
-	int nPos = 0;
 	message.setSender( GATEWAY_ADDRESS );
 	message.setLast( GATEWAY_ADDRESS );
 	message.setSensor(0);
 
 	// Extract command data coming on serial line
-	/// Contains subID?
-	bool _hasSubID = false;
-	/*str = strtok_r(inputString, "-", &p);
-	if( str ) {
-		_hasSubID = true;
-		message.setDestination((uint8_t)atoi(str));
-		str = strtok_r(NULL, "-", &p);
-		if( str ) {
-			message.setSensor((uint8_t)atoi(str));
-		}
-	}*/
-	for (str = strtok_r(inputString, ";", &p); // split using semicolon
+	for (str = nextToken(p, end); // split using semicolon
 		str && i < 6; // loop while str is not null an max 5 times
-		str = strtok_r(NULL, ";", &p) // get subsequent tokens
+		str = nextToken(p, end) // get subsequent tokens
 			) {
 		switch (i) {
-			case 0: // Radioid (destination)
-			  sNodeid = str;
-				nPos = sNodeid.indexOf('-');
-				if (nPos > 0) {
-					// contain subID
-					_hasSubID = true;
-					/*SERIAL("nodeid ");
-					Serial.println((uint8_t)(sNodeid.substring(0, nPos).toInt()));
-					SERIAL("subid ");
-					Serial.println((uint8_t)(sNodeid.substring(nPos + 1).toInt()));*/
-					message.setDestination((uint8_t)(sNodeid.substring(0, nPos).toInt()));
-					message.setSensor((uint8_t)(sNodeid.substring(nPos + 1).toInt()));
-				}
-				if( !_hasSubID )
-				{
-					message.setDestination((uint8_t)atoi(str));
+			case 0: // Radioid (destination), may contain subID as nodeid-subid
+			{
+				char *dash = str;
+				while (dash < end && *dash != '-') dash++;
+				if (dash > str && dash < end) {
+					message.setDestination((uint8_t)spanToInt(str, dash));
+					message.setSensor((uint8_t)spanToInt(dash + 1, end));
+				} else {
+					message.setDestination((uint8_t)spanToInt(str, end));
 				}
 				break;
+			}
 			case 1: // Sender
-				message.setSender((uint8_t)atoi(str));
+				message.setSender((uint8_t)spanToInt(str, end));
 				break;
 			case 2: // Command (message type)
-				command = atoi(str);
+				command = spanToInt(str, end);
 				mSetCommand(message.msg, command);
 				break;
 			case 3: // Should we request ack from destination?
-				ack = atoi(str);
+				ack = spanToInt(str, end);
 				break;
 			case 4: // Sub-type
-				message.setType((uint8_t)atoi(str));
+				message.setType((uint8_t)spanToInt(str, end));
 				break;
 			case 5: // Variable value
 				if (command == C_STREAM) {
 					blen = 0;
 					uint8_t val;
-					while (*str) {
+					while (str < end && blen < MAX_PAYLOAD) {
 						val = h2i(*str++) << 4;
-						val += h2i(*str++);
+						if (str < end) val += h2i(*str++);
 						bvalue[blen] = val;
 						blen++;
 					}
 				} else {
 					value = str;
 					// Remove ending carriage return character (if it exists)
-					uint8_t lastCharacter = strlen(value)-1;
-					if (value[lastCharacter] == '\r' || value[lastCharacter] == '\n')
-						value[lastCharacter] = 0;
+					if (end[-1] == '\r' || end[-1] == '\n')
+						end[-1] = 0;
 				}
 				break;
 		}
@@ -121,7 +124,7 @@ bool MyParserSerial::parse(MyMessage &message, char *inputString) {
 	if (command == C_STREAM)
 		message.set(bvalue, blen);
 	else
-		message.set(value);
+		message.set(value ? value : "");
 	return true;
 }
 
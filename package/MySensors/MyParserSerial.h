@@ -26,6 +26,7 @@ class MyParserSerial : public MyParser
 {
 public:
 	MyParserSerial();
+	// Parses in place, the separators in inputString are overwritten
 	bool parse(MyMessage &message, char *inputString);
 	char* getSerialString(MyMessage &message, char *buffer) const;
 };
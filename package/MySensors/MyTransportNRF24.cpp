@@ -31,6 +31,7 @@ MyTransportNRF24::MyTransportNRF24(uint8_t ce, uint8_t cs, uint8_t channel, uint
 	_myNetworkID = 0;
 	_currentNetworkID = 0;
 	_bValid = false;
+	_ackLen = 0;
 	enableBaseNetwork();
 }
 
@@ -52,7 +53,13 @@ bool MyTransportNRF24::init() {
 	rf24.setDataRate((rf24_datarate_e)_dataRate);
 	rf24.setRetries(5,15);
 	rf24.setCRCLength(RF24_CRC_16);
+#ifdef RF24_ACK_PAYLOAD
+	rf24.enableDynamicPayloads();
+	rf24.enableAckPayload();
+#else
 	rf24.enableDynamicPayloads(false);
+#endif
+	_ackLen = 0;
 
 	// All nodes listen to broadcast pipe (for FIND_PARENT_RESPONSE messages)
 	for( uint8_t i=0; i<6; i++) {
@@ -175,11 +182,26 @@ bool MyTransportNRF24::send(uint8_t to, const void* data, uint8_t len, uint8_t p
 	} else {
 		rf24.openWritingPipe(TO_ADDR(_currentNetworkID, to));
 	}
+	// stopListening() flushed the RX FIFO, so the only frame in it after write() is the ack payload
 	bool ok = rf24.write(data, len, to == BROADCAST_ADDRESS);
+	// Take ack payload before startListening() flushes it
+	_ackLen = 0;
+	if( rf24.isAckPayloadAvailable() && ok && rf24.available() ) {
+		_ackLen = rf24.getDynamicPayloadSize();
+		if( _ackLen > 0 ) rf24.read(_ackPayload, _ackLen);
+		if( rf24.available() ) _ackLen = 0;
+	}
 	rf24.startListening();
 	return ok;
 }
 
+uint8_t MyTransportNRF24::getAckPayload(void* data) {
+	uint8_t len = _ackLen;
+	if( len > 0 ) memcpy(data, _ackPayload, len);
+	_ackLen = 0;
+	return len;
+}
+
 bool MyTransportNRF24::send(uint8_t to, MyMessage &message, uint8_t pipe) {
 	message.setVersion(PROTOCOL_VERSION);
 	message.setLast(_address);
@@ -48,6 +48,7 @@ public:
 	bool send(uint8_t to, MyMessage &message, uint8_t pipe = 255);
 	bool available(uint8_t *to, uint8_t *pipe = NULL);
 	uint8_t receive(void* data);
+	uint8_t getAckPayload(void* data);
 	void powerDown();
 
 	uint8_t getChannel(bool read = true);
@@ -86,6 +87,10 @@ private:
 	// SBS added 2016-07-22
 	bool _bBaseNetworkEnabled;
 	uint32_t _baseStartTick;
+
+	// Ack payload of the last send
+	uint8_t _ackPayload[MAX_MESSAGE_LENGTH];
+	uint8_t _ackLen;
 };
 
 #endif
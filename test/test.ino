@@ -12,9 +12,21 @@
 #include "xliConfig.h"
 
 #include "xlxCloudObj.h"
+#include "xlxCloudPublisher.h"
 #include "xlxConfig.h"
+#include "xlxConfigSlot.h"
+#include "xlxFirmwareOTA.h"
+#include "xlxGroupTable.h"
 #include "xlxLogger.h"
+#include "xlxOfflineJournal.h"
+#include "xlxRecordLog.h"
+#include "xlxRF24Server.h"
+#include "xlxRFCapture.h"
 #include "xlxSerialConsole.h"
+#include "xlxStatusPoller.h"
+#include "xlxTableReader.h"
+#include "xlxUsageStats.h"
+#include "MyParserSerial.h"
 
 //><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
 // Intergration Tests
@@ -217,6 +229,1910 @@ test(alarm_all_red)
   theSys.CldJSONConfig("\"nd\":1, \"SCT_uid\":1, \"SNT_uid\":0, \"notif_uid\":0}");
 }
 
+// Publish sink stub: count events instead of sending them to the cloud,
+// the topic and ttl of the first ones are kept
+#define PUB_STUB_KEEP   8
+UL gPubEvents = 0;
+const char *gPubTopic[PUB_STUB_KEEP];
+int gPubTTL[PUB_STUB_KEEP];
+bool stubPublish(const char *topic, const char *data, int ttl)
+{
+  if( gPubEvents < PUB_STUB_KEEP ) {
+    gPubTopic[gPubEvents] = topic;
+    gPubTTL[gPubEvents] = ttl;
+  }
+  gPubEvents++;
+  return true;
+}
+
+test(cloudpub_storm)
+{
+  // 48 nodes report status twice within one second
+  thePublisher.Clear();
+  thePublisher.SetSink(stubPublish);
+  UL lv_merged = thePublisher.GetMerged();
+  UL lv_dropped = thePublisher.GetDropped();
+  gPubEvents = 0;
+  for( UC rnd = 0; rnd < 2; rnd++ ) {
+    for( UC nd = 1; nd <= 48; nd++ ) {
+      String strTemp = String::format("{'nd':%d,'State':1,'BR':%d}", nd, 50 + rnd);
+      theSys.PublishDeviceStatus(strTemp.c_str());
+    }
+  }
+  // One alarm must go first
+  theSys.PublishAlarm("{'notif':1,'rule':1,'nd':1,'snt':1}");
+  thePublisher.Process();
+  assertEqual(gPubEvents, 1);
+
+  // Drain the queue
+  while( thePublisher.GetPending() > 0 ) {
+    thePublisher.Process();
+    delay(100);
+  }
+  SERIAL_LN("Storm: %lu events, merged %lu, dropped %lu", gPubEvents,
+      thePublisher.GetMerged() - lv_merged, thePublisher.GetDropped() - lv_dropped);
+  assertMoreOrEqual(thePublisher.GetMerged() - lv_merged, 48);
+  assertLess(gPubEvents, 48);
+  thePublisher.SetSink(NULL);
+}
+
+// Queued in reverse order, published by priority; ttl is kept per event
+test(cloudpub_priority)
+{
+  thePublisher.Clear();
+  thePublisher.SetSink(stubPublish);
+  gPubEvents = 0;
+  thePublisher.Enqueue(CLT_ID_LOGMSG, "log line", CLT_TTL_LOGMSG);
+  // Short-lived motion objects fill the first sensor event, the second gets a reading
+  UC nd = NODEID_MIN_REMOTE;
+  while( thePublisher.GetPending() < 3 ) {
+    String strTemp = String::format("{'nd':%d,'motion':1}", nd++);
+    assertEqual(thePublisher.Enqueue(CLT_ID_SensorData, strTemp.c_str(), CLT_TTL_MotionData), true);
+  }
+  String strTemp = String::format("{'nd':%d,'ALS':50,'DHTt':20}", nd);
+  assertEqual(thePublisher.Enqueue(CLT_ID_SensorData, strTemp.c_str(), CLT_TTL_SensorData), true);
+  assertEqual(thePublisher.Enqueue(CLT_ID_DeviceStatus, "{'nd':1,'State':1,'BR':50}", CLT_TTL_DeviceStatus), true);
+  assertEqual(thePublisher.Enqueue(CLT_ID_Alarm, "{'notif':1,'rule':1,'nd':1,'snt':1}", CLT_TTL_Alarm), true);
+  assertEqual(thePublisher.GetPending(), 5);
+
+  UL lv_start = millis();
+  while( thePublisher.GetPending() > 0 && millis() - lv_start < 10000 ) {
+    thePublisher.Process();
+    delay(100);
+  }
+  assertEqual(gPubEvents, 5UL);
+  assertEqual(strcmp(gPubTopic[0], CLT_NAME_Alarm), 0);
+  assertEqual(strcmp(gPubTopic[1], CLT_NAME_DeviceStatus), 0);
+  assertEqual(strcmp(gPubTopic[2], CLT_NAME_SensorData), 0);
+  assertEqual(strcmp(gPubTopic[3], CLT_NAME_SensorData), 0);
+  assertEqual(strcmp(gPubTopic[4], CLT_NAME_LOGMSG), 0);
+  assertEqual(gPubTTL[2], CLT_TTL_MotionData);
+  assertEqual(gPubTTL[3], CLT_TTL_SensorData);
+  thePublisher.SetSink(NULL);
+}
+
+test(sensor_deadband)
+{
+  // Jittering noise level (+/-1dB) within the deadband should not be reported
+  thePublisher.SetSink(stubPublish);
+  UL lv_reported = theSys.m_nSensorReported;
+  UL lv_filtered = theSys.m_nSensorFiltered;
+  for( int i = 0; i < 50; i++ ) {
+    theSys.UpdateNoise(NODEID_SUPERSENSOR, 60 + (i % 3) - 1);
+  }
+  assertLess(theSys.m_nSensorReported - lv_reported, 2);
+  assertMoreOrEqual(theSys.m_nSensorFiltered - lv_filtered, 49);
+  thePublisher.Clear();
+  thePublisher.SetSink(NULL);
+}
+
+test(sensor_state_nodes)
+{
+  // Readings of all super-sensors (48 for classroom), 10 types each, must not overwrite each other
+  thePublisher.SetSink(stubPublish);
+  theSys.m_srState.Clear();
+  for( UC i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+    theSys.UpdateBrightness(NODEID_MIN_REMOTE + i, i);
+    theSys.UpdateGas(NODEID_MIN_REMOTE + i, 100 + i);
+    theSys.UpdateDHT(NODEID_MIN_REMOTE + i, 20 + i / 10.0, 40 + i);
+    theSys.UpdateNoise(NODEID_MIN_REMOTE + i, 30 + i);
+    theSys.UpdateAirQuality(NODEID_MIN_REMOTE + i, 10 + i, 20 + i, 0.1, 0.02, 400 + i);
+  }
+  assertEqual(theSys.m_srState.GetOverflow(), 0);
+  assertEqual(theSys.m_srState.GetCount(), MAX_NODE_PER_CONTROLLER * SENSOR_STATE_TYPES);
+  float lv_value;
+  for( UC i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+    assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, sensorALS, &lv_value), true);
+    assertEqual((int)lv_value, i);
+    assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, sensorGAS, &lv_value), true);
+    assertEqual((int)lv_value, 100 + i);
+    assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, sensorDHT_h, &lv_value), true);
+    assertEqual((int)lv_value, 40 + i);
+    assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, sensorMIC, &lv_value), true);
+    assertEqual((int)lv_value, 30 + i);
+    assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, sensorCO2, &lv_value), true);
+    assertEqual((int)lv_value, 400 + i);
+  }
+  assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + MAX_NODE_PER_CONTROLLER, sensorALS, &lv_value), false);
+
+  // One more item: the one reported longest ago makes room, the rest are still found
+  delay(2);
+  assertTrue(theSys.m_srState.Update(NODEID_MIN_REMOTE + MAX_NODE_PER_CONTROLLER, sensorALS, 5) != NULL);
+  assertEqual(theSys.m_srState.GetOverflow(), 1);
+  assertEqual(theSys.m_srState.GetValue(NODEID_MIN_REMOTE + MAX_NODE_PER_CONTROLLER, sensorALS, &lv_value), true);
+  assertEqual((int)lv_value, 5);
+  const UC lv_types[SENSOR_STATE_TYPES] = {sensorALS, sensorGAS, sensorDHT, sensorDHT_h, sensorMIC,
+      sensorPM25, sensorPM10, sensorTVOC, sensorCH2O, sensorCO2};
+  US lv_found = 0;
+  for( UC i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+    for( UC t = 0; t < SENSOR_STATE_TYPES; t++ ) {
+      if( theSys.m_srState.GetValue(NODEID_MIN_REMOTE + i, lv_types[t], &lv_value) ) lv_found++;
+    }
+  }
+  assertEqual(lv_found, MAX_NODE_PER_CONTROLLER * SENSOR_STATE_TYPES - 1);
+  thePublisher.Clear();
+  thePublisher.SetSink(NULL);
+}
+
+test(sensor_history)
+{
+  // Aggregates within the current minute bucket
+  float lv_value;
+  US lv_key = SENSOR_STATE_KEY(NODEID_MIN_REMOTE, sensorALS);
+  theSys.m_srState.Clear();
+  assertEqual(theSys.m_srState.SetHistoryItems(&lv_key, 1), 0);
+  theSys.m_srState.Update(NODEID_MIN_REMOTE, sensorALS, 10);
+  theSys.m_srState.Update(NODEID_MIN_REMOTE, sensorALS, 50);
+  theSys.m_srState.Update(NODEID_MIN_REMOTE, sensorALS, 30);
+  theSys.m_srState.Update(NODEID_MIN_REMOTE, sensorGAS, 30);
+  assertEqual(theSys.m_srState.GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_AVG, 5, &lv_value), true);
+  assertEqual((int)lv_value, 30);
+  assertEqual(theSys.m_srState.GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MAX, 5, &lv_value), true);
+  assertEqual((int)lv_value, 50);
+  assertEqual(theSys.m_srState.GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MIN, 5, &lv_value), true);
+  assertEqual((int)lv_value, 10);
+  // No history for items not set
+  assertEqual(theSys.m_srState.GetAggregate(NODEID_MIN_REMOTE, sensorGAS, SR_AGGR_AVG, 5, &lv_value), false);
+  theSys.UpdateSensorHistory();
+  theSys.m_srState.Clear();
+}
+
+// Rings go to the node of the rule, however many other nodes report the same sensor first
+test(sensor_history_rule_node)
+{
+  float lv_value;
+  RuleRow_t lv_row;
+  UC lv_node = NODEID_MIN_REMOTE + SENSOR_HISTORY_RINGS;
+
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  lv_row.op_flag = POST;
+  lv_row.uid = 250;
+  lv_row.node_id = lv_node;
+  lv_row.actCond[0].enabled = 1;
+  lv_row.actCond[0].sr_scope = SR_SCOPE_NODE;
+  lv_row.actCond[0].symbol = SR_SYM_GT;
+  lv_row.actCond[0].sr_aggr = SR_AGGR_AVG;
+  SetConditionSensor(lv_row.actCond[0], sensorALS);
+  assertTrue(theSys.Rule_table.unshift(lv_row));
+  theSys.UpdateSensorHistory();
+  theSys.m_srState.Clear();
+
+  for( UC i = 0; i <= SENSOR_HISTORY_RINGS; i++ ) {
+    theSys.m_srState.Update(NODEID_MIN_REMOTE + i, sensorALS, 10 + i);
+  }
+  assertEqual(theSys.m_srState.GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_AVG, 5, &lv_value), false);
+  assertEqual(theSys.m_srState.GetAggregate(lv_node, sensorALS, SR_AGGR_AVG, 5, &lv_value), true);
+  assertEqual((int)lv_value, 10 + SENSOR_HISTORY_RINGS);
+
+  // The ring is freed with the rule
+  theSys.Rule_table.remove(0);
+  theSys.UpdateSensorHistory();
+  assertEqual(theSys.m_srState.GetAggregate(lv_node, sensorALS, SR_AGGR_AVG, 5, &lv_value), false);
+  theSys.m_srState.Clear();
+}
+
+// Sensor state with a clock of its own
+class SensorStateClock : public SensorStateClass
+{
+public:
+  UL now;
+  SensorStateClock() { now = 1000; }
+protected:
+  UL GetTick() { return now; }
+};
+
+test(sensor_history_window)
+{
+  SensorStateClock *pState = new SensorStateClock();
+  float lv_value;
+  US lv_key = SENSOR_STATE_KEY(NODEID_MIN_REMOTE, sensorALS);
+  pState->SetHistoryItems(&lv_key, 1);
+  // Minute 0: 10 and 20, minute 1: 40, minute 4: 100
+  pState->Update(NODEID_MIN_REMOTE, sensorALS, 10);
+  pState->Update(NODEID_MIN_REMOTE, sensorALS, 20);
+  pState->now += 60000;
+  pState->Update(NODEID_MIN_REMOTE, sensorALS, 40);
+  pState->now += 3 * 60000 + 500;
+  pState->Update(NODEID_MIN_REMOTE, sensorALS, 100);
+
+  // Empty minutes don't count, the average is over the minute buckets
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_AVG, 5, &lv_value), true);
+  assertEqual((int)lv_value, (15 + 40 + 100) / 3);
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MIN, 5, &lv_value), true);
+  assertEqual((int)lv_value, 10);
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MAX, 5, &lv_value), true);
+  assertEqual((int)lv_value, 100);
+  // Window of the last 2 minutes: minute 4 only
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MIN, 2, &lv_value), true);
+  assertEqual((int)lv_value, 100);
+
+  // Minute 0 falls out of a 5-minute window one minute later
+  pState->now += 60000;
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MIN, 5, &lv_value), true);
+  assertEqual((int)lv_value, 40);
+
+  // The ring goes round: nothing left after an hour without data
+  pState->now += SENSOR_HISTORY_BUCKETS * 60000UL;
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MAX, 60, &lv_value), false);
+  pState->Update(NODEID_MIN_REMOTE, sensorALS, 7);
+  assertEqual(pState->GetAggregate(NODEID_MIN_REMOTE, sensorALS, SR_AGGR_MAX, 60, &lv_value), true);
+  assertEqual((int)lv_value, 7);
+  delete pState;
+}
+
+// RAM flash: PAGES x 1KB, 4 pages by default, NOR semantics
+template<UC PAGES = 4>
+class FakeFlashDeviceT : public Flashee::FlashDevice
+{
+public:
+  UC data[PAGES * 1024];
+  UL erases;
+  UL programmed;
+  UL rewrites;
+  UL budget;          // Bytes programmed before power is cut
+  mutable UL reads;
+
+  FakeFlashDeviceT() { memset(data, 0xFF, sizeof(data)); erases = programmed = rewrites = reads = 0; budget = 0xFFFFFFFF; }
+  Flashee::page_size_t pageSize() const { return 1024; }
+  Flashee::page_count_t pageCount() const { return PAGES; }
+  bool erasePage(Flashee::flash_addr_t address) {
+    if( budget == 0 ) return false;
+    memset(data + address - address % 1024, 0xFF, 1024); erases++; return true;
+  }
+  bool writePage(const void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) {
+    UL lv_len = min(length, budget);
+    for( UL i = 0; i < lv_len; i++ ) data[address + i] &= ((const UC *)buf)[i];
+    if( budget != 0xFFFFFFFF ) budget -= lv_len;
+    programmed += lv_len; return(lv_len == length);
+  }
+  bool readPage(void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) const {
+    memcpy(buf, data + address, length); reads++; return true;
+  }
+  // Read-modify-erase-write of every page touched, as the wear-levelling layer does
+  bool writeErasePage(const void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) {
+    static UC lv_page[1024];
+    while( length > 0 ) {
+      UL lv_page_addr = address - address % 1024;
+      UL lv_len = min(length, lv_page_addr + 1024 - address);
+      memcpy(lv_page, data + lv_page_addr, 1024);
+      memcpy(lv_page + address - lv_page_addr, buf, lv_len);
+      erasePage(lv_page_addr);
+      writePage(lv_page, lv_page_addr, 1024);
+      rewrites++;
+      buf = (const UC *)buf + lv_len; address += lv_len; length -= lv_len;
+    }
+    return true;
+  }
+  bool copyPage(Flashee::flash_addr_t address, Flashee::TransferHandler handler, void* buf, uint8_t* tmp, Flashee::page_size_t bufSize) { return false; }
+};
+typedef FakeFlashDeviceT<> FakeFlashDevice;
+
+#define P1_FLASH_GUARD  0xA5      // Data of the neighbours
+
+// Window of the P1 flash as seen through theConfig.getP1Flash(): 4094-byte logical pages
+/// at the real addresses, erasePage() clears the whole page holding the address.
+/// Only the pages touching the region are kept in RAM, their bytes outside it are guards
+class P1FlashWindow : public Flashee::FakeFlashDevice
+{
+public:
+  UL origin;          // Address of the first page in RAM
+  UL addr;
+  UL len;
+  UL erases;
+  UL programmed;
+  UL rewrites;
+  UL budget;          // Bytes programmed before power is cut
+  mutable UL reads;
+
+  P1FlashWindow(UL _addr, UL _len)
+    : Flashee::FakeFlashDevice(FLASH_PAGE_CEIL(_addr + _len, MEM_EXT_FLASH_PAGE) / MEM_EXT_FLASH_PAGE - _addr / MEM_EXT_FLASH_PAGE,
+        MEM_EXT_FLASH_PAGE, true) {
+    origin = FLASH_PAGE_FLOOR(_addr, MEM_EXT_FLASH_PAGE);
+    addr = _addr; len = _len;
+    eraseAll();
+    UC lv_guard[64];
+    memset(lv_guard, P1_FLASH_GUARD, sizeof(lv_guard));
+    for( UL i = origin; i < addr; i += sizeof(lv_guard) ) {
+      Flashee::FakeFlashDevice::writePage(lv_guard, i - origin, min(sizeof(lv_guard), addr - i));
+    }
+    UL lv_end = origin + length();
+    for( UL i = addr + len; i < lv_end; i += sizeof(lv_guard) ) {
+      Flashee::FakeFlashDevice::writePage(lv_guard, i - origin, min(sizeof(lv_guard), lv_end - i));
+    }
+    erases = programmed = rewrites = reads = 0; budget = 0xFFFFFFFF;
+  }
+  // Bytes of the neighbours are still there
+  bool IsIntact() const {
+    UC lv_byte;
+    UL lv_end = origin + length();
+    for( UL i = origin; i < lv_end; i++ ) {
+      if( i >= addr && i < addr + len ) continue;
+      Flashee::FakeFlashDevice::readPage(&lv_byte, i - origin, 1);
+      if( lv_byte != P1_FLASH_GUARD ) return false;
+    }
+    return true;
+  }
+  bool erasePage(Flashee::flash_addr_t address) {
+    if( budget == 0 || address < origin ) return false;
+    if( !Flashee::FakeFlashDevice::erasePage(FLASH_PAGE_FLOOR(address - origin, MEM_EXT_FLASH_PAGE)) ) return false;
+    erases++; return true;
+  }
+  bool writePage(const void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) {
+    if( address < origin ) return false;
+    UL lv_len = min(length, budget);
+    if( !Flashee::FakeFlashDevice::writePage(buf, address - origin, lv_len) ) return false;
+    if( budget != 0xFFFFFFFF ) budget -= lv_len;
+    programmed += lv_len; return(lv_len == length);
+  }
+  bool readPage(void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) const {
+    if( address < origin ) return false;
+    reads++; return Flashee::FakeFlashDevice::readPage(buf, address - origin, length);
+  }
+  // Read-modify-erase-write of every page touched, as the wear-levelling layer does
+  bool writeErasePage(const void* buf, Flashee::flash_addr_t address, Flashee::page_size_t length) {
+    if( address < origin || length == 0 ) return false;
+    UL lv_pages = (address + length - 1) / MEM_EXT_FLASH_PAGE - address / MEM_EXT_FLASH_PAGE + 1;
+    if( !Flashee::FakeFlashDevice::writeErasePage(buf, address - origin, length) ) return false;
+    erases += lv_pages; rewrites += lv_pages; return true;
+  }
+};
+
+test(flashlog_wear)
+{
+  // The region starts inside a logical page, as on the device
+  const UL lv_size = 4 * MEM_EXT_FLASH_PAGE;
+  P1FlashWindow lv_flash(MEM_FLASHLOG_OFFSET, lv_size);
+  static LoggerClass lv_log;
+  lv_log.SetLevel(LOGDEST_SERIAL, LEVEL_EMERGENCY);
+  lv_log.SetLevel(LOGDEST_CLOUD, LEVEL_EMERGENCY);
+  lv_log.SetLevel(LOGDEST_FLASH, LEVEL_WARNING);
+  assertEqual(lv_log.InitFlash(&lv_flash, MEM_FLASHLOG_OFFSET, lv_size), true);
+  for( int i = 0; i < 10000; i++ ) {
+    lv_log.WriteLog(LEVEL_WARNING, LOGTAG_MSG, "line %d", i);
+    // Main loop erases the next sector ahead
+    if( i % 20 == 0 ) lv_log.Process();
+  }
+  lv_log.FlushFlash();
+  assertEqual(lv_log.GetFlashDropped(), 0);
+  // Each block is programmed once, a page is erased once per 15 blocks, neighbours untouched
+  const UL lv_sector = MEM_EXT_FLASH_PAGE / FLASHLOG_BLOCK * FLASHLOG_BLOCK;
+  assertEqual(lv_flash.programmed, lv_log.GetFlashRecordBytes());
+  assertLess(lv_flash.erases * lv_sector, lv_log.GetFlashRecordBytes() * 11 / 10 + 2 * lv_sector);
+  assertTrue(lv_flash.IsIntact());
+  // Reboot: continue after the newest record, recent records still read back after many wraps
+  UL lv_seq = lv_log.GetFlashSeq();
+  static LoggerClass lv_log2;
+  assertEqual(lv_log2.InitFlash(&lv_flash, MEM_FLASHLOG_OFFSET, lv_size), true);
+  assertEqual(lv_log2.GetFlashSeq(), lv_seq);
+  assertEqual(lv_log2.DumpFlash(100), 100);
+  assertTrue(lv_flash.IsIntact());
+}
+
+// Update 64 rules: one write per row vs. write-back per page
+test(table_writeback)
+{
+  static FakeFlashDevice lv_direct;
+  static FakeFlashDevice lv_flash;
+  static RowWriteBackClass lv_cache;
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+
+  for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+    lv_row.uid = i;
+    lv_direct.write<RuleRow_t>(lv_row, i * RT_ROW_SIZE);
+  }
+
+  lv_cache.Init(&lv_flash, 0, RT_ROW_SIZE, MAX_RT_ROWS);
+  for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+    assertEqual(lv_cache.MarkDirty(i), true);
+  }
+  assertEqual(lv_cache.GetDirtyCount(), MAX_RT_ROWS);
+  assertEqual(lv_cache.IsDue(), false);
+  assertEqual(lv_cache.IsDue(true), true);
+  while( lv_cache.LoadNextPage() ) {
+    for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+      if( !lv_cache.InPage(i) ) continue;
+      lv_row.uid = i;
+      lv_cache.PutRow(i, &lv_row);
+    }
+    assertEqual(lv_cache.CommitPage(), true);
+  }
+  SERIAL_LN("%d rules: direct %lu erases %lu bytes, write-back %lu erases %lu bytes",
+      MAX_RT_ROWS, lv_direct.erases, lv_direct.programmed, lv_flash.erases, lv_flash.programmed);
+
+  // Same content, one rewrite per page touched
+  assertEqual(memcmp(lv_direct.data, lv_flash.data, sizeof(lv_flash.data)), 0);
+  assertEqual(lv_cache.GetDirtyCount(), 0);
+  assertEqual(lv_cache.GetRowWrites(), (UL)MAX_RT_ROWS);
+  assertEqual(lv_flash.rewrites, (RT_ROW_SIZE * MAX_RT_ROWS + 1023) / 1024);
+  assertEqual(lv_flash.rewrites, lv_cache.GetPageWrites());
+  assertLess(lv_flash.erases * 8, lv_direct.erases);
+}
+
+// Record log: one append per update, survives power cut at any byte
+test(reclog_power_cut)
+{
+  // Two pages per area at the real offset, which is inside a logical page
+  const UL lv_size = 5 * MEM_EXT_FLASH_PAGE;
+  P1FlashWindow lv_flash(MEM_RECLOG_OFFSET, lv_size);
+  static RecordLogClass lv_log;
+  static RecordLogClass lv_boot;
+  const UC lv_rows = 8;
+  UL lv_value[lv_rows];
+  UL lv_data;
+
+  assertEqual(lv_log.Init(&lv_flash, MEM_RECLOG_OFFSET, lv_size), true);
+  assertEqual(lv_log.Format(), true);
+  for( UC i = 0; i < lv_rows; i++ ) {
+    lv_value[i] = i;
+    assertEqual(lv_log.Append(RECLOG_TYPE_RULE, i, &lv_value[i], sizeof(UL)), true);
+  }
+
+  // Cost of updates, compaction included
+  UL lv_prog = lv_flash.programmed;
+  UL lv_erases = lv_flash.erases;
+  for( int n = 0; n < 1000; n++ ) {
+    lv_data = 1000 + n;
+    assertEqual(lv_log.Append(RECLOG_TYPE_RULE, n % lv_rows, &lv_data, sizeof(UL)), true);
+    lv_value[n % lv_rows] = lv_data;
+    lv_log.Process();
+  }
+  lv_prog = lv_flash.programmed - lv_prog;
+  lv_erases = lv_flash.erases - lv_erases;
+  SERIAL_LN("1000 updates: %lu bytes programmed, %lu erases, %lu compactions",
+      lv_prog, lv_erases, lv_log.GetCompactions());
+  assertLess(lv_prog, 1000 * (sizeof(RecordHead_t) + sizeof(UL)) * 3 / 2);
+  assertLess(lv_erases, 1000 / 10);
+
+  // Cut power after every few bytes, then boot and check every row
+  for( UL lv_cut = 0; lv_cut < 600; lv_cut += 7 ) {
+    lv_flash.budget = lv_cut;
+    for( int n = 0; n < 60; n++ ) {
+      lv_data = lv_cut * 100 + n;
+      if( !lv_log.Append(RECLOG_TYPE_RULE, n % lv_rows, &lv_data, sizeof(UL)) ) break;
+      lv_value[n % lv_rows] = lv_data;
+      lv_log.Process();
+    }
+    lv_flash.budget = 0xFFFFFFFF;
+
+    assertEqual(lv_boot.Init(&lv_flash, MEM_RECLOG_OFFSET, lv_size), true);
+    for( UC i = 0; i < lv_rows; i++ ) {
+      assertEqual(lv_boot.Read(RECLOG_TYPE_RULE, i, &lv_data, sizeof(UL)), true);
+      assertEqual(lv_data, lv_value[i]);
+    }
+    lv_log = lv_boot;
+  }
+  SERIAL_LN("Index rebuilt in %lu us, %lu torn records", lv_log.GetRebuildTime(), lv_boot.GetTorn());
+  // Flash log and config slots around it untouched
+  assertTrue(lv_flash.IsIntact());
+}
+
+// Rules saved before aggregation: random spare bits are cleared once, other fields kept
+test(rule_legacy_bits)
+{
+  P1FlashWindow lv_flash(MEM_RECLOG_OFFSET, 5 * MEM_EXT_FLASH_PAGE);
+  static RecordLogClass lv_log;
+  RuleRow_t lv_row;
+
+  assertEqual(lv_log.Init(&lv_flash, MEM_RECLOG_OFFSET, 5 * MEM_EXT_FLASH_PAGE), true);
+  assertEqual(lv_log.Format(), true);
+  memset(&lv_row, 0xFF, sizeof(lv_row));
+  lv_row.op_flag = POST;
+  lv_row.flash_flag = SAVED;
+  lv_row.run_flag = EXECUTED;
+  lv_row.uid = 3;
+  lv_row.node_id = NODEID_MAINDEVICE;
+  lv_row.tmr_span = 10;
+  lv_row.actCond[0].sr_value1 = 500;
+  assertEqual(lv_log.Append(RECLOG_TYPE_RULE, 3, &lv_row, sizeof(lv_row)), true);
+  // Written by this version, nothing to clear
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  lv_row.uid = 4;
+  assertEqual(lv_log.Append(RECLOG_TYPE_RULE, 4, &lv_row, sizeof(lv_row)), true);
+
+  assertEqual(theConfig.ClearLegacyRuleBits(lv_log, VERSION_RULE_AGGR - 1), 1);
+  assertEqual(lv_log.Read(RECLOG_TYPE_RULE, 3, &lv_row, sizeof(lv_row)), true);
+  assertEqual(lv_row.sr_window, SR_WIN_5MIN);
+  for( UC i = 0; i < MAX_CONDITION_PER_RULE; i++ ) {
+    assertEqual(lv_row.actCond[i].sr_aggr, SR_AGGR_NONE);
+    assertEqual(GetConditionSensor(lv_row.actCond[i]), 0x0F);
+  }
+  assertEqual(lv_row.uid, 3);
+  assertEqual(lv_row.node_id, NODEID_MAINDEVICE);
+  assertEqual(lv_row.tmr_span, 10);
+  assertEqual(lv_row.actCond[0].sr_value1, 500);
+  assertEqual(lv_row.actCond[0].enabled, 1);
+  // Done once
+  assertEqual(theConfig.ClearLegacyRuleBits(lv_log, VERSION_RULE_AGGR - 1), 0);
+
+  // Aggregation is kept from VERSION_RULE_AGGR on, the old top bit of sr_scope is not
+  lv_row.actCond[0].sr_aggr = SR_AGGR_AVG;
+  lv_row.actCond[0].sr_id_hi = 1;
+  assertEqual(lv_log.Append(RECLOG_TYPE_RULE, 3, &lv_row, sizeof(lv_row)), true);
+  assertEqual(theConfig.ClearLegacyRuleBits(lv_log, VERSION_RULE_SRID - 1), 1);
+  assertEqual(lv_log.Read(RECLOG_TYPE_RULE, 3, &lv_row, sizeof(lv_row)), true);
+  assertEqual(lv_row.actCond[0].sr_aggr, SR_AGGR_AVG);
+  assertEqual(lv_row.actCond[0].sr_id_hi, 0);
+
+  // All sensor IDs fit a condition now
+  SetConditionSensor(lv_row.actCond[0], sensorCO2);
+  assertEqual(GetConditionSensor(lv_row.actCond[0]), sensorCO2);
+  assertEqual(lv_row.actCond[0].sr_scope, SR_SCOPE_GROUP);
+  assertEqual(sizeof(Condition_t), 6);
+}
+
+// A day of 30 s save ticks: only real changes are written, a torn save keeps the last image
+test(config_slots_day)
+{
+  static FakeFlashDevice lv_flash;
+  static ConfigSlotClass lv_slots;
+  static ConfigSlotClass lv_boot;
+  static Config_t lv_config;
+  static Config_t lv_loaded;
+
+  memset(&lv_config, 0x00, sizeof(lv_config));
+  assertEqual(lv_slots.Init(&lv_flash, 0, 2048), true);
+  assertEqual(lv_slots.IsValid(), false);
+  assertEqual(lv_slots.Save(&lv_config, sizeof(Config_t)), true);
+
+  // Setters flag a change on every tick, a field really changes every 2 hours
+  UL lv_rewrites = lv_flash.rewrites;
+  for( US lv_tick = 1; lv_tick <= 2880; lv_tick++ ) {
+    if( lv_tick % 240 == 0 ) lv_config.indBrightness++;
+    assertEqual(lv_slots.Save(&lv_config, sizeof(Config_t)), true);
+  }
+  lv_rewrites = lv_flash.rewrites - lv_rewrites;
+  SERIAL_LN("2880 save ticks: %lu config writes, %lu skipped, %lu page rewrites",
+      lv_slots.GetWrites() - 1, lv_slots.GetSkips(), lv_rewrites);
+  assertEqual(lv_slots.GetWrites(), 1 + 12UL);
+  assertEqual(lv_slots.GetSkips(), 2880 - 12UL);
+  assertEqual(lv_rewrites, 12UL);
+
+  // Cut power while saving, boot takes the last image that was read back
+  for( UL lv_cut = 0; lv_cut < sizeof(ConfigSlotHead_t) + sizeof(Config_t) + 1024; lv_cut += 37 ) {
+    lv_config.indBrightness++;
+    lv_flash.budget = lv_cut;
+    BOOL lv_saved = lv_slots.Save(&lv_config, sizeof(Config_t));
+    lv_flash.budget = 0xFFFFFFFF;
+    if( !lv_saved ) lv_config.indBrightness--;
+
+    assertEqual(lv_boot.Init(&lv_flash, 0, 2048), true);
+    assertEqual(lv_boot.Load(&lv_loaded, sizeof(Config_t)), true);
+    assertEqual(memcmp(&lv_loaded, &lv_config, sizeof(Config_t)), 0);
+    assertEqual(lv_boot.IsChanged(&lv_config, sizeof(Config_t)), false);
+    lv_slots = lv_boot;
+  }
+}
+
+// Replay a Zipf trace over 40 scenarios: LRU against evicting the first saved row
+test(scenario_lru_zipf)
+{
+  const UC lv_scenarios = 40;
+  static LruChainClass<ScenarioRow_t> lv_lru(MAX_SNT_CACHE_SIZE);
+  static ChainClass<ScenarioRow_t> lv_first(MAX_SNT_CACHE_SIZE);
+  ScenarioRow_t lv_row;
+  UL lv_cdf[lv_scenarios];
+  UL lv_seed = 12345;
+  UL lv_firstMisses = 0;
+  UL lv_start, lv_usLru;
+
+  // Weight of the k-th most used scenario is 1/k
+  float lv_sum = 0;
+  for( UC k = 0; k < lv_scenarios; k++ ) lv_sum += 1.0 / (k + 1);
+  float lv_acc = 0;
+  for( UC k = 0; k < lv_scenarios; k++ ) {
+    lv_acc += 1.0 / (k + 1);
+    lv_cdf[k] = (UL)(lv_acc / lv_sum * 0xFFFF);
+  }
+
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  lv_row.op_flag = POST;
+  lv_row.flash_flag = SAVED;
+  lv_row.run_flag = EXECUTED;
+  lv_start = micros();
+  for( US n = 0; n < 5000; n++ ) {
+    lv_seed = lv_seed * 1103515245 + 12345;
+    UL lv_pick = (lv_seed >> 16) & 0xFFFF;
+    UC lv_uid = 0;
+    while( lv_uid < lv_scenarios - 1 && lv_cdf[lv_uid] < lv_pick ) lv_uid++;
+    // Scatter popular scenarios over the uid range
+    lv_row.uid = (lv_uid * 7) % MAX_SNT_ROWS;
+
+    if( !lv_lru.search(lv_row.uid) ) {
+      assertTrue(lv_lru.add_lru(lv_row) != NULL);
+    }
+    if( !lv_first.search(lv_row.uid) ) {
+      lv_firstMisses++;
+      if( lv_first.isFull() ) lv_first.delete_one_outdated_row();
+      lv_first.add(lv_row);
+    }
+  }
+  lv_usLru = micros() - lv_start;
+
+  SERIAL_LN("5000 Zipf lookups, %d rows: LRU %lu flash reads (%lu%% hit), first saved row %lu flash reads, %lu us",
+      MAX_SNT_CACHE_SIZE, lv_lru.getMisses(), lv_lru.getHits() * 100 / 5000, lv_firstMisses, lv_usLru);
+  assertEqual(lv_lru.getHits() + lv_lru.getMisses(), 5000UL);
+  assertEqual(lv_lru.size(), MAX_SNT_CACHE_SIZE);
+  assertLess(lv_lru.getMisses(), lv_firstMisses);
+
+  // Rows not saved yet are never evicted
+  lv_lru.clear();
+  lv_row.flash_flag = UNSAVED;
+  for( UC i = 0; i < MAX_SNT_CACHE_SIZE; i++ ) {
+    lv_row.uid = i;
+    assertTrue(lv_lru.add_lru(lv_row) != NULL);
+  }
+  lv_row.uid = MAX_SNT_CACHE_SIZE;
+  assertTrue(lv_lru.add_lru(lv_row) == NULL);
+  lv_lru.find(3)->data.flash_flag = SAVED;
+  lv_lru.find(5)->data.flash_flag = SAVED;
+  lv_lru.search(3);
+  assertTrue(lv_lru.add_lru(lv_row) == lv_lru.find(MAX_SNT_CACHE_SIZE));
+  assertTrue(lv_lru.find(5) == NULL);
+  assertTrue(lv_lru.find(3) != NULL);
+}
+
+// An hour of 48 chatty nodes: keep-alive every 10 s, a real change every 10 minutes
+test(nodelist_rows)
+{
+  const UC lv_nodes = 48;
+  static FakeFlashDevice lv_old;
+  static FakeFlashDevice lv_flash;
+  static RowWriteBackClass lv_cache;
+  static NodeListClass lv_list;
+  static NodeIdRow_t lv_saved[lv_nodes];
+  NodeIdRow_t lv_node;
+
+  memset(&lv_node, 0x00, sizeof(lv_node));
+  for( UC i = 0; i < lv_nodes; i++ ) {
+    lv_node.nid = NODEID_MIN_DEVCIE + i;
+    assertMoreOrEqual(lv_list.add(&lv_node), 0);
+  }
+  lv_cache.Init(&lv_flash, 0, sizeof(NodeIdRow_t), lv_nodes);
+  assertEqual(lv_list.markRows(lv_cache, true), lv_nodes);
+  lv_list.clearDirty(true);
+  assertEqual(lv_list.flushRows(lv_cache), true);
+
+  UL lv_rows = lv_cache.GetRowWrites();
+  UL lv_rewrites = lv_flash.rewrites;
+  UL lv_oldBytes = 0;
+  for( US lv_tick = 1; lv_tick <= 120; lv_tick++ ) {
+    for( UC n = 0; n < 3; n++ ) {
+      for( UC i = 0; i < lv_nodes; i++ ) {
+        lv_node.nid = NODEID_MIN_DEVCIE + i;
+        lv_list.get(&lv_node);
+        lv_node.recentActive = lv_tick * 30 + n * 10;
+        lv_list.update(&lv_node);
+      }
+    }
+    if( lv_tick % 20 == 10 ) {
+      lv_node.nid = NODEID_MIN_DEVCIE + lv_tick / 20;
+      lv_list.get(&lv_node);
+      lv_node.device++;
+      lv_list.update(&lv_node);
+    }
+    // Before: the whole list went to EEPROM and to the backup on every change
+    if( lv_list.m_isChanged ) {
+      lv_old.write(lv_list._pItems, 0, lv_nodes * sizeof(NodeIdRow_t));
+      lv_oldBytes += 2 * lv_nodes * sizeof(NodeIdRow_t);
+    }
+    // 30 s save tick, timestamps are due at the end of the hour
+    BOOL lv_active = (lv_tick % 120 == 0);
+    lv_list.markRows(lv_cache, lv_active);
+    lv_list.clearDirty(lv_active);
+    assertEqual(lv_list.flushRows(lv_cache), true);
+  }
+  lv_rows = lv_cache.GetRowWrites() - lv_rows;
+  lv_rewrites = lv_flash.rewrites - lv_rewrites;
+  SERIAL_LN("48 nodes, 1 hour: %lu bytes in %lu page rewrites, before %lu bytes in %lu page rewrites",
+      2 * lv_rows * sizeof(NodeIdRow_t), lv_rewrites, lv_oldBytes, lv_old.rewrites);
+  assertEqual(lv_rows, 6UL + lv_nodes);
+  assertEqual(lv_rewrites, 7UL);
+  assertEqual(lv_list.m_isChanged, false);
+
+  lv_flash.read(lv_saved, 0, sizeof(lv_saved));
+  assertEqual(memcmp(lv_saved, lv_list._pItems, sizeof(lv_saved)), 0);
+
+  // Removing a node moves the rows after it up and clears the old last row
+  lv_node.nid = NODEID_MIN_DEVCIE + 40;
+  assertEqual(lv_list.remove(&lv_node), true);
+  assertEqual(lv_list.markRows(lv_cache, false), lv_nodes - 40);
+  lv_list.clearDirty(false);
+  assertEqual(lv_list.flushRows(lv_cache), true);
+  lv_flash.read(lv_saved, 0, sizeof(lv_saved));
+  assertEqual(memcmp(lv_saved, lv_list._pItems, (lv_nodes - 1) * sizeof(NodeIdRow_t)), 0);
+  assertEqual(lv_saved[lv_nodes - 1].nid, 0);
+
+  // The change flag alone rewrites nothing, a full sync is asked for explicitly
+  lv_list.m_isChanged = true;
+  assertEqual(lv_list.markRows(lv_cache, true), 0);
+  lv_list.clearDirty(true);
+  lv_list.markAll();
+  assertEqual(lv_list.markRows(lv_cache, false), lv_nodes);
+  lv_list.clearDirty(false);
+  assertEqual(lv_list.flushRows(lv_cache), true);
+}
+
+// Offline sink stub: count replayed objects by their time key
+bool gPubOnline = true;
+UL gPubObjects = 0;
+bool stubOnline()
+{
+  return gPubOnline;
+}
+
+bool stubReplay(const char *topic, const char *data, int ttl)
+{
+  gPubEvents++;
+  for( const char *p = strstr(data, "'ts':"); p; p = strstr(p + 1, "'ts':") ) gPubObjects++;
+  return true;
+}
+
+// Store and forward: 6 hours offline, then replay at the allowed pace
+test(offline_journal)
+{
+  // Three pages at the real offset, which is inside a logical page
+  const UL lv_size = 4 * MEM_EXT_FLASH_PAGE;
+  P1FlashWindow lv_flash(MEM_OFFLINE_DATA_OFFSET, lv_size);
+  OfflineJournalClass &lv_journal = thePublisher.GetJournal();
+  thePublisher.Clear();
+  thePublisher.SetSink(stubReplay, stubOnline);
+  assertEqual(thePublisher.InitJournal(&lv_flash, MEM_OFFLINE_DATA_OFFSET, lv_size), true);
+
+  // 2 nodes report temperature and humidity every 10 minutes, device status every hour
+  gPubOnline = false;
+  gPubEvents = 0;
+  gPubObjects = 0;
+  for( US lv_min = 10; lv_min <= 360; lv_min += 10 ) {
+    for( UC nd = 1; nd <= 2; nd++ ) {
+      String strTemp = String::format("{'nd':%d,'DHTt':%.2f,'DHTh':%d}", NODEID_MIN_REMOTE + nd, 20 + lv_min / 60.0, 40 + nd);
+      assertEqual(thePublisher.Enqueue(CLT_ID_SensorData, strTemp.c_str(), CLT_TTL_SensorData), true);
+    }
+    if( lv_min % 60 == 0 ) {
+      assertEqual(thePublisher.Enqueue(CLT_ID_DeviceStatus, "{'nd':1,'State':1,'BR':50}", CLT_TTL_DeviceStatus), true);
+    }
+  }
+  thePublisher.Process();
+  assertEqual(gPubEvents, 0UL);
+  assertEqual(thePublisher.GetPending(), 0);
+  assertEqual(lv_journal.GetPending(), 78UL);
+  SERIAL_LN("6 hours offline: 144 readings and 6 events in %lu bytes, %lu bytes per reading",
+      lv_flash.programmed, (lv_flash.programmed - 6 * 34) / 144);
+  assertLess(lv_flash.programmed, 144UL * 12);
+
+  // Reboot while offline, nothing is lost
+  assertEqual(thePublisher.InitJournal(&lv_flash, MEM_OFFLINE_DATA_OFFSET, lv_size), true);
+  assertEqual(lv_journal.GetPending(), 78UL);
+
+  // Back online: a live alarm goes first, then the journal
+  gPubOnline = true;
+  delay(RTE_PUB_TOKEN_INTERVAL * RTE_PUB_TOKEN_BURST);
+  assertEqual(thePublisher.Enqueue(CLT_ID_Alarm, "{'notif':1,'rule':1,'nd':1,'snt':1}", CLT_TTL_Alarm), true);
+  thePublisher.Process();
+  assertEqual(gPubEvents, 1UL);
+  assertEqual(gPubObjects, 0UL);
+  UL lv_start = millis();
+  while( lv_journal.GetPending() > 0 && millis() - lv_start < 60000 ) {
+    thePublisher.Process();
+    delay(100);
+  }
+  UL lv_ms = millis() - lv_start;
+  SERIAL_LN("Replay: %lu objects in %lu events, %lu ms", gPubObjects, gPubEvents - 1, lv_ms);
+  assertEqual(lv_journal.GetPending(), 0UL);
+  assertEqual(gPubObjects, 78UL);
+  assertLess(gPubEvents - 1, 78UL / 2);
+
+  // Ring full: the oldest page is dropped, the rest survives a reboot
+  gPubOnline = false;
+  UL lv_dropped = lv_journal.GetDropped();
+  for( US i = 0; i < 1500; i++ ) {
+    String strTemp = String::format("{'nd':%d,'ALS':%d}", NODEID_MIN_REMOTE, i % 100);
+    thePublisher.Enqueue(CLT_ID_SensorData, strTemp.c_str(), CLT_TTL_SensorData);
+  }
+  lv_dropped = lv_journal.GetDropped() - lv_dropped;
+  assertMore(lv_dropped, 0UL);
+  assertEqual(lv_journal.GetPending() + lv_dropped, 1500UL);
+  UL lv_pending = lv_journal.GetPending();
+  assertEqual(thePublisher.InitJournal(&lv_flash, MEM_OFFLINE_DATA_OFFSET, lv_size), true);
+  assertEqual(lv_journal.GetPending(), lv_pending);
+  // MAC list and usage stats around it untouched
+  assertTrue(lv_flash.IsIntact());
+
+  thePublisher.InitJournal(NULL, 0, 0);
+  gPubOnline = true;
+  thePublisher.Clear();
+  thePublisher.SetSink(NULL);
+}
+
+// A year of classroom lamps: on 8:00-18:00 on weekdays, ticks every 10 minutes
+test(usage_stats_year)
+{
+  const UC lv_nodes = 48;
+  const UC lv_probe = NODEID_MIN_DEVCIE + 5;
+  // Six pages at the real offset, which is inside a logical page
+  const UL lv_size = 7 * MEM_EXT_FLASH_PAGE;
+  P1FlashWindow lv_flash(MEM_REPORT_OFFSET, lv_size);
+  static UsageStatsClass lv_usage;
+  UsageEntry_t lv_entries[16];
+  UL lv_onMin[12];
+
+  assertEqual(lv_usage.Init(&lv_flash, MEM_REPORT_OFFSET, lv_size), true);
+  memset(lv_onMin, 0x00, sizeof(lv_onMin));
+  UL lv_start = USAGE_MIN_TIME;             // 2017-01-01, Sunday
+  UL lv_us = 0;
+  for( UL lv_time = lv_start; lv_time <= lv_start + 365UL * 86400; lv_time += 600 ) {
+    UL lv_tick = micros();
+    lv_usage.Tick(lv_time);
+    lv_us += micros() - lv_tick;
+    // Reboot at midnight early in July, the small rings of the test still hold these days
+    if( lv_time == lv_start + 185UL * 86400 ) {
+      assertEqual(lv_usage.Init(&lv_flash, MEM_REPORT_OFFSET, lv_size), true);
+    }
+
+    UL lv_day = lv_time / 86400;
+    UL lv_sec = lv_time % 86400;
+    UC lv_dow = (lv_day + 4) % 7;
+    if( lv_dow >= 1 && lv_dow <= 5 ) {
+      if( lv_sec == 8 * 3600 ) {
+        for( UC i = 0; i < lv_nodes; i++ ) {
+          lv_usage.SetBrightness(NODEID_MIN_DEVCIE + i, 1, 40 + i);
+          lv_usage.SetCCT(NODEID_MIN_DEVCIE + i, 3000 + i * 50);
+        }
+      } else if( lv_sec == 18 * 3600 ) {
+        for( UC i = 0; i < lv_nodes; i++ ) lv_usage.SetState(NODEID_MIN_DEVCIE + i, 0);
+      }
+      if( lv_sec >= 8 * 3600 && lv_sec < 18 * 3600 ) lv_onMin[UsageStatsClass::GetMonth(lv_day) % 12] += 10;
+    }
+  }
+  SERIAL_LN("48 lamps, 1 year: %lu records, %lu bytes programmed, %lu erases, %lu us in Tick()",
+      lv_usage.GetRecords(), lv_flash.programmed, lv_flash.erases, lv_us);
+  // 10 hours on and the hour of switching off on each of 260 weekdays, the weekdays and 12 months
+  assertEqual(lv_usage.GetRecords(), 260UL * 11 + 260 + 12);
+  assertLess(lv_flash.erases, 1000UL);
+
+  // Every month of the year is kept, the one of the reboot too
+  UL lv_month = UsageStatsClass::GetMonth(lv_start / 86400);
+  lv_us = micros();
+  UC lv_found = lv_usage.Query(USAGE_LEVEL_MONTH, lv_probe, lv_month, lv_month + 11, lv_entries, 16);
+  lv_us = micros() - lv_us;
+  SERIAL_LN("Monthly query: %d buckets in %lu us", lv_found, lv_us);
+  assertEqual(lv_found, 12);
+  for( UC m = 0; m < 12; m++ ) {
+    assertEqual(lv_entries[m].period, lv_month + m);
+    assertLess(lv_entries[m].onMinutes, lv_onMin[m] + 121);
+    assertLess(lv_onMin[m], lv_entries[m].onMinutes + 121);
+    assertEqual(lv_entries[m].br, 45);
+    assertEqual(lv_entries[m].cct, 3250);
+  }
+
+  // Last days: 10 hours on, switched on and off
+  UL lv_lastDay = (lv_start + 365UL * 86400) / 86400 - 1;
+  lv_found = lv_usage.Query(USAGE_LEVEL_DAY, lv_probe, lv_lastDay - 7, lv_lastDay, lv_entries, 16);
+  assertMoreOrEqual(lv_found, 4);
+  assertEqual(lv_entries[lv_found - 1].onMinutes, 600UL);
+  assertEqual(lv_entries[lv_found - 1].cmds, 2);
+
+  // Last hours: 17:00 on, switched off at 18:00 of the last weekday
+  lv_found = lv_usage.Query(USAGE_LEVEL_HOUR, lv_probe, (lv_lastDay - 2) * 24, 0xFFFFFFFF, lv_entries, 16);
+  assertMoreOrEqual(lv_found, 4);
+  assertEqual(lv_entries[lv_found - 2].period % 24, 17UL);
+  assertEqual(lv_entries[lv_found - 2].onMinutes, 60UL);
+  assertEqual(lv_entries[lv_found - 1].onMinutes, 0UL);
+  assertEqual(lv_entries[lv_found - 1].cmds, 1);
+
+  // Offline journal and node config around it untouched
+  assertTrue(lv_flash.IsIntact());
+}
+
+// Load tables row by row in chunks, no array of the whole table
+test(table_reader_stream)
+{
+  static FakeFlashDevice lv_flash;
+  RuleRow_t lv_rule;
+  UL lv_value;
+  UL lv_start, lv_us64, lv_us1024;
+
+  memset(&lv_rule, 0x00, sizeof(lv_rule));
+  for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+    lv_rule.uid = i;
+    lv_flash.writePage(&lv_rule, i * RT_ROW_SIZE, RT_ROW_SIZE);
+  }
+  lv_flash.reads = 0;
+  lv_start = micros();
+  TableReaderClass lv_rules(&lv_flash, 0, RT_ROW_SIZE * MAX_RT_ROWS);
+  for( UC i = 0; i < MAX_RT_ROWS; i++ ) {
+    assertEqual(lv_rules.Read(lv_rule), true);
+    assertEqual(lv_rule.uid, i);
+  }
+  lv_us64 = micros() - lv_start;
+  assertEqual(lv_rules.Read(lv_rule), false);
+  assertEqual(lv_flash.reads, (RT_ROW_SIZE * MAX_RT_ROWS + TABLE_READER_CHUNK - 1) / TABLE_READER_CHUNK);
+
+  // 1024 rows of 4 bytes fill the whole device
+  for( UL lv_addr = 0; lv_addr < sizeof(lv_flash.data); lv_addr += lv_flash.pageSize() ) {
+    lv_flash.erasePage(lv_addr);
+  }
+  for( US i = 0; i < 1024; i++ ) {
+    lv_value = i;
+    lv_flash.writePage(&lv_value, i * sizeof(UL), sizeof(UL));
+  }
+  lv_flash.reads = 0;
+  lv_start = micros();
+  TableReaderClass lv_rows(&lv_flash, 0, 1024 * sizeof(UL));
+  for( US i = 0; i < 1024; i++ ) {
+    assertEqual(lv_rows.Read(lv_value), true);
+    assertEqual(lv_value, (UL)i);
+  }
+  lv_us1024 = micros() - lv_start;
+  assertEqual(lv_flash.reads, 1024 * sizeof(UL) / TABLE_READER_CHUNK);
+
+  SERIAL_LN("Loaded 64 rules in %lu us, 1024 rows in %lu us, %u bytes of stack instead of %u / %u",
+      lv_us64, lv_us1024, sizeof(TableReaderClass), RT_ROW_SIZE * MAX_RT_ROWS, 1024 * sizeof(UL));
+  assertLess(sizeof(TableReaderClass), RT_ROW_SIZE * MAX_RT_ROWS / 4);
+}
+
+// Cost of disabled logs in a RF receive loop
+/// LOGI, as release builds compile LOGD out and an empty loop measures nothing
+test(log_disabled_cost)
+{
+  const int lv_loops = 1000;
+  UC lv_serial = theLog.GetLevel(LOGDEST_SERIAL);
+  UC lv_flash = theLog.GetLevel(LOGDEST_FLASH);
+  UC lv_cloud = theLog.GetLevel(LOGDEST_CLOUD);
+  UL lv_start, lv_usLevel, lv_usTag;
+
+  assertTrue(LEVEL_INFO <= LOG_COMPILE_LEVEL);
+  // Filtered by destination level
+  theLog.SetLevel(LOGDEST_SERIAL, LEVEL_WARNING);
+  theLog.SetLevel(LOGDEST_FLASH, LEVEL_WARNING);
+  theLog.SetLevel(LOGDEST_CLOUD, LEVEL_WARNING);
+  lv_start = micros();
+  for( int i = 0; i < lv_loops; i++ ) {
+    LOGI(LOGTAG_MSG, "Received from pipe %d msg-len=%d, from:%d to:%d dest:%d cmd:%d type:%d sensor:%d payl-len:%d",
+        1, 9, i, 0, 0, 1, 2, 3, 4);
+  }
+  lv_usLevel = micros() - lv_start;
+
+  // Filtered by tag
+  theLog.SetLevel(LOGDEST_SERIAL, LEVEL_DEBUG);
+  theLog.SetTagLevel(LOGTAG_ID_MSG, LEVEL_WARNING);
+  lv_start = micros();
+  for( int i = 0; i < lv_loops; i++ ) {
+    LOGI(LOGTAG_MSG, "Received from pipe %d msg-len=%d, from:%d to:%d dest:%d cmd:%d type:%d sensor:%d payl-len:%d",
+        1, 9, i, 0, 0, 1, 2, 3, 4);
+  }
+  lv_usTag = micros() - lv_start;
+  theLog.SetTagLevel(LOGTAG_ID_MSG, LEVEL_DEBUG);
+  theLog.SetLevel(LOGDEST_SERIAL, lv_serial);
+  theLog.SetLevel(LOGDEST_FLASH, lv_flash);
+  theLog.SetLevel(LOGDEST_CLOUD, lv_cloud);
+
+  SERIAL_LN("%d disabled LOGI: %lu us by level, %lu us by tag (compiled up to %d)", lv_loops, lv_usLevel, lv_usTag, LOG_COMPILE_LEVEL);
+  // Neither should cost more than a few us per call
+  assertLess(lv_usLevel, lv_loops * 5);
+  assertLess(lv_usTag, lv_loops * 5);
+}
+
+// Parse console and BLE lines in place, heap must stay untouched
+test(serial_parser)
+{
+  const char *lv_lines[] = {
+    "1;23;1;1;24;1099528339456", "1;4;1;1;2;1\n", "12-3;0;1;2;3;50\r", "3;1;4;0;7;0A1bFF", "1;2;3" };
+  const int lv_loops = 10000;
+  char lv_buf[64];
+  MyMessage lv_msg;
+  UL lv_start, lv_us, lv_heap;
+
+  strcpy(lv_buf, lv_lines[0]);
+  assertEqual(serialMsgParser.parse(lv_msg, lv_buf), true);
+  assertEqual(lv_msg.getDestination(), 1);
+  assertEqual(lv_msg.getSender(), 23);
+  assertEqual(lv_msg.getCommand(), 1);
+  assertEqual(lv_msg.getType(), 24);
+  assertEqual(strcmp(lv_msg.getString(), "1099528339456"), 0);
+
+  strcpy(lv_buf, lv_lines[1]);
+  assertEqual(serialMsgParser.parse(lv_msg, lv_buf), true);
+  assertEqual(lv_msg.isReqAck(), true);
+  assertEqual(strcmp(lv_msg.getString(), "1"), 0);
+
+  strcpy(lv_buf, lv_lines[2]);
+  assertEqual(serialMsgParser.parse(lv_msg, lv_buf), true);
+  assertEqual(lv_msg.getDestination(), 12);
+  assertEqual(lv_msg.getSensor(), 3);
+  assertEqual(lv_msg.isAck(), true);
+  assertEqual(strcmp(lv_msg.getString(), "50"), 0);
+
+  strcpy(lv_buf, lv_lines[3]);
+  assertEqual(serialMsgParser.parse(lv_msg, lv_buf), true);
+  assertEqual(lv_msg.getLength(), 3);
+  assertEqual(((UC *)lv_msg.getCustom())[1], 0x1b);
+
+  strcpy(lv_buf, lv_lines[4]);
+  assertEqual(serialMsgParser.parse(lv_msg, lv_buf), false);
+
+  lv_heap = System.freeMemory();
+  lv_start = micros();
+  for( int i = 0; i < lv_loops; i++ ) {
+    strcpy(lv_buf, lv_lines[i % 4]);
+    serialMsgParser.parse(lv_msg, lv_buf);
+  }
+  lv_us = micros() - lv_start;
+  SERIAL_LN("Parsed %d lines, %lu ns/msg, heap %lu -> %lu", lv_loops, lv_us * 1000 / lv_loops, lv_heap, System.freeMemory());
+  assertEqual(System.freeMemory(), lv_heap);
+}
+
+// Stub handlers on stream types which are not registered by the controller
+UL g_nStreamSound = 0, g_nStreamOther = 0;
+bool stubStreamSound(MyMessage &_msg, const UC _sender) { g_nStreamSound++; return false; }
+bool stubStreamOther(MyMessage &_msg, const UC _sender) { g_nStreamOther++; return false; }
+
+// Dispatch a mixed trace of received frames by (command, type)
+test(rf_dispatch)
+{
+  const int lv_frames = 1000;
+  MyMessage lv_msg;
+  UC *lv_pData = (UC *)&(lv_msg.msg);
+  UL lv_unhandled = theRadio.GetUnhandled();
+  UL lv_start, lv_us;
+
+  assertEqual(theRadio.RegisterHandler(C_STREAM, ST_SOUND, stubStreamSound, "sound"), true);
+  assertEqual(theRadio.RegisterHandler(C_STREAM, RF_TYPE_ANY, stubStreamOther, "stream"), true);
+  assertEqual(theRadio.RegisterHandler(C_STREAM, RF_MAX_TYPES, stubStreamOther, "stream"), false);
+  assertEqual(theRadio.GetHandler(C_STREAM, ST_SOUND)->handler == stubStreamSound, true);
+  assertEqual(theRadio.GetHandler(C_STREAM, ST_IMAGE)->handler == stubStreamOther, true);
+  RFHandlerEntry_t *lv_config = theRadio.GetHandler(C_INTERNAL, I_CONFIG);
+  assertEqual(lv_config != NULL, true);
+  assertEqual(theRadio.GetHandler(C_INTERNAL, I_TIME) == NULL, true);
+  UL lv_configHits = lv_config->hits;
+
+  // 50% sound, 25% other stream, 15% config request, 10% unhandled
+  lv_start = micros();
+  for( int i = 0; i < lv_frames; i++ ) {
+    UC lv_mod = i % 20;
+    if( lv_mod < 10 ) {
+      lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_STREAM, ST_SOUND, false);
+    } else if( lv_mod < 15 ) {
+      lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_STREAM, ST_IMAGE, false);
+    } else if( lv_mod < 18 ) {
+      lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, NCF_QUERY, C_INTERNAL, I_CONFIG, false);
+    } else {
+      lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_INTERNAL, I_TIME, false);
+    }
+    lv_msg.set((UC)i);
+    theRadio.Append(lv_pData, MAX_MESSAGE_LENGTH);
+    if( theRadio.Length() >= MAX_MESSAGE_LENGTH * (MQ_MAX_RF_RCVMSG - 1) ) theRadio.ProcessReceiveMQ();
+  }
+  theRadio.ProcessReceiveMQ();
+  lv_us = micros() - lv_start;
+
+  assertEqual(g_nStreamSound, 500UL);
+  assertEqual(g_nStreamOther, 250UL);
+  assertEqual(lv_config->hits - lv_configHits, 150UL);
+  assertEqual(theRadio.GetUnhandled() - lv_unhandled, 100UL);
+  SERIAL_LN("Dispatched %d frames, %lu ns/frame", lv_frames, lv_us * 1000 / lv_frames);
+  theRadio.showHandlers();
+}
+
+// Keep-alive storm on slow and dead nodes, status is queried every 500ms for 20s
+test(rf_query_correlation)
+{
+  const UC lv_nodes = 12;
+  const UL lv_duration = 20000;
+  MyMessage lv_msg;
+  UL lv_replyAt[lv_nodes];
+  UL lv_start = millis() + 100000;      // Simulated time
+  UL lv_attempts = 0, lv_frames = 0, lv_replies = 0;
+  UL lv_suppressed = theRadio.GetSuppressedQueries();
+
+  memset(lv_replyAt, 0x00, sizeof(lv_replyAt));
+  for( UL t = 0; t <= lv_duration; t += 100 ) {
+    // Replies due, 8 nodes answer in 100ms, 2 slow ones in 1500ms, 2 are dead
+    for( UC i = 0; i < lv_nodes; i++ ) {
+      if( lv_replyAt[i] && lv_replyAt[i] <= t ) {
+        lv_replyAt[i] = 0;
+        lv_msg.build(NODEID_MIN_DEVCIE + i, NODEID_GATEWAY, 0, C_REQ, V_RGBW, false, true);
+        if( theRadio.CompleteQuery(lv_msg, lv_start + t) ) lv_replies++;
+      }
+    }
+    if( t % 500 ) continue;
+    for( UC i = 0; i < lv_nodes; i++ ) {
+      lv_attempts++;
+      lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE + i, 0, C_REQ, V_RGBW, true);
+      if( theRadio.TrackQuery(lv_msg, lv_start + t) ) {
+        lv_frames++;
+        if( i < 8 ) {
+          lv_replyAt[i] = t + 100;
+        } else if( i < 10 ) {
+          lv_replyAt[i] = t + 1500;
+        }
+      }
+    }
+  }
+  // Queries of two rings of one node are both sent, a reply only releases its own
+  const UL lv_end = lv_start + lv_duration + RTE_TM_RF_QUERY;
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 1, C_REQ, V_RGBW, true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_end), true);
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 2, C_REQ, V_RGBW, true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_end), true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_end), false);
+  lv_msg.build(NODEID_MIN_DEVCIE, NODEID_GATEWAY, 1, C_REQ, V_RGBW, false, true);
+  assertEqual(theRadio.CompleteQuery(lv_msg, lv_end), true);
+  assertEqual(theRadio.CompleteQuery(lv_msg, lv_end), false);
+  lv_msg.build(NODEID_MIN_DEVCIE, NODEID_GATEWAY, 2, C_REQ, V_RGBW, false, true);
+  assertEqual(theRadio.CompleteQuery(lv_msg, lv_end), true);
+  lv_suppressed++;
+
+  // Acks and queries to groups are never held back
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 0, C_REQ, V_RGBW, false, true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_start), true);
+  lv_msg.build(NODEID_GATEWAY, BROADCAST_ADDRESS, 0, C_REQ, V_RGBW, true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_start), true);
+  assertEqual(theRadio.TrackQuery(lv_msg, lv_start), true);
+
+  SERIAL_LN("%lu queries, %lu frames on air, %lu replies, %lu saved", lv_attempts, lv_frames, lv_replies, lv_attempts - lv_frames);
+  assertEqual(lv_attempts, 12UL * 41);
+  // Fast nodes every round, slow ones every 3 rounds, dead ones at each timeout
+  assertEqual(lv_frames, 8UL * 41 + 2 * 14 + 2 * 11);
+  assertEqual(lv_replies, 8UL * 40 + 2 * 13);
+  assertEqual(theRadio.GetSuppressedQueries() - lv_suppressed, lv_attempts - lv_frames);
+  assertEqual(theRadio.GetPendingQueries(lv_start + lv_duration + RTE_TM_RF_QUERY), 0);
+}
+
+// Collision model: queries of one pass go out 2ms apart, replies come 10-50ms later,
+// replies starting in the same 5ms slot are lost
+UL g_pollReplyAt[POLL_MAX_NODES];
+UL g_pollNow;
+UC g_pollPass;
+bool stubPollSend(const UC _node)
+{
+  g_pollReplyAt[_node - NODEID_MIN_DEVCIE] = g_pollNow + 2 * g_pollPass++ + 10 + random(40);
+  return true;
+}
+
+// Time in ms until all nodes have replied, queries are sent back-to-back without poller
+UL simPollAll(const UC _nodes, StatusPollerClass *_poller)
+{
+  bool lv_got[POLL_MAX_NODES];
+  UC lv_done = 0, lv_slot;
+  UL lv_nextRound = 0;
+
+  memset(lv_got, 0x00, sizeof(lv_got));
+  memset(g_pollReplyAt, 0x00, sizeof(g_pollReplyAt));
+  if( _poller ) {
+    _poller->SetSender(stubPollSend);
+    _poller->Reset();
+    for( UC i = 0; i < _nodes; i++ ) _poller->AddNode(NODEID_MIN_DEVCIE + i);
+    _poller->Start(0);
+  }
+  for( g_pollNow = 0; g_pollNow < 60000; g_pollNow += 5 ) {
+    if( g_pollNow % RTE_DELAY_SELFCHECK == 0 ) {
+      g_pollPass = 0;
+      if( _poller ) {
+        _poller->Process(g_pollNow);
+      } else if( g_pollNow >= lv_nextRound ) {
+        // Query nodes without status again after timeout
+        for( UC i = 0; i < _nodes; i++ ) {
+          if( !lv_got[i] ) stubPollSend(NODEID_MIN_DEVCIE + i);
+        }
+        lv_nextRound += RTE_TM_RF_QUERY;
+      }
+    }
+    lv_slot = 0;
+    for( UC i = 0; i < _nodes; i++ ) {
+      if( g_pollReplyAt[i] && g_pollReplyAt[i] < g_pollNow + 5 ) lv_slot++;
+    }
+    for( UC i = 0; i < _nodes; i++ ) {
+      if( g_pollReplyAt[i] && g_pollReplyAt[i] < g_pollNow + 5 ) {
+        g_pollReplyAt[i] = 0;
+        if( lv_slot == 1 && !lv_got[i] ) {
+          lv_got[i] = true;
+          lv_done++;
+          if( _poller ) _poller->GotReply(NODEID_MIN_DEVCIE + i, g_pollNow);
+        }
+      }
+    }
+    if( lv_done >= _nodes ) break;
+  }
+  return g_pollNow;
+}
+
+// Time to full status after boot, back-to-back queries against the windowed poller
+test(status_poller)
+{
+  StatusPollerClass lv_poller;
+  UC lv_sizes[2] = {12, POLL_MAX_NODES};
+  UL lv_burst, lv_paced, lv_sent;
+
+  randomSeed(1);
+  for( UC n = 0; n < 2; n++ ) {
+    lv_burst = simPollAll(lv_sizes[n], NULL);
+    lv_sent = lv_poller.GetSent();
+    lv_paced = simPollAll(lv_sizes[n], &lv_poller);
+    SERIAL_LN("%d nodes: full status in %lu ms back-to-back, %lu ms by poller (%lu sent, window %d)",
+        lv_sizes[n], lv_burst, lv_paced, lv_poller.GetSent() - lv_sent, lv_poller.GetWindow());
+    assertLess(lv_paced, 60000UL);
+    assertEqual(lv_poller.IsBusy(), false);
+    assertEqual(lv_poller.GetDuration(), lv_paced);
+    if( lv_sizes[n] > 12 ) assertLess(lv_paced, lv_burst);
+  }
+  assertEqual(lv_poller.GetLost(), 0UL);
+}
+
+test(group_fanout)
+{
+  // 4 groups of 12 devices change scenes, members are confirmed without a frame or event each
+  thePublisher.SetSink(stubPublish);
+  theSys.CldJSONConfig("{'op':1, 'fl':0, 'run':0, 'uid':'s9','ring0':[1,30,4000,0,0,0]}");
+  for( UC g = 0; g < 4; g++ ) {
+    for( UC i = 0; i < 12; i++ ) {
+      UC lv_node = NODEID_MIN_DEVCIE + g * 12 + i;
+      theConfig.InitDevStatus(lv_node);     // Until the table is full
+      assertEqual(theGroups.AddMember(NODEID_MIN_GROUP + g, lv_node), true);
+    }
+    assertEqual(theGroups.GetMembers(NODEID_MIN_GROUP + g, NULL, 64), 12);
+  }
+
+  UL lv_frames = theRadio._times;
+  UL lv_events = thePublisher.GetQueued();
+  for( UC g = 0; g < 4; g++ ) {
+    assertEqual(theSys.ChangeLampScenario(NODEID_MIN_GROUP + g, 9), true);
+  }
+  lv_frames = theRadio._times - lv_frames;
+  lv_events = thePublisher.GetQueued() - lv_events;
+  SERIAL_LN("Scenes on 4 groups of 12: %lu RF frames, %lu status events (48 each per device)", lv_frames, lv_events);
+  assertLessOrEqual(lv_frames, 4UL * MAX_RING_NUM);
+  assertLessOrEqual(lv_events, 4UL * 3);
+
+  // Every member in the status table took the scene
+  UC lv_rows = 0;
+  ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.DevStatus_table.getRoot();
+  while( DevStatusRowPtr ) {
+    UC lv_node = DevStatusRowPtr->data.node_id;
+    if( lv_node >= NODEID_MIN_DEVCIE && lv_node < NODEID_MIN_DEVCIE + 48 ) {
+      assertEqual(DevStatusRowPtr->data.ring[0].BR, 30);
+      assertEqual(DevStatusRowPtr->data.ring[2].CCT, 4000);
+      lv_rows++;
+    }
+    DevStatusRowPtr = DevStatusRowPtr->next;
+  }
+  assertMore(lv_rows, 0);
+
+  for( UC lv_node = NODEID_MIN_DEVCIE; lv_node < NODEID_MIN_DEVCIE + 48; lv_node++ ) {
+    theGroups.RemoveMember(NODEID_MIN_GROUP + (lv_node - NODEID_MIN_DEVCIE) / 12, lv_node);
+  }
+  thePublisher.Clear();
+  thePublisher.SetSink(NULL);
+}
+
+// Simulated radio: frames go on air one per ms in order, lossy links drop them
+#define SIM_AIR_LEN     16
+#define SIM_OTA_NODES   3
+#define SIM_OTA_SIZE    4000
+#define SIM_LOSS        10    // %
+MyMessage g_simAir[SIM_AIR_LEN];
+UL g_simQueued[SIM_AIR_LEN];    // Time a command was queued, 0 for other frames
+UC g_simAirLen = 0;
+UL g_simNow;
+
+bool simAirPush(MyMessage &_msg, const UL _queued)
+{
+  if( g_simAirLen >= SIM_AIR_LEN ) return false;
+  g_simAir[g_simAirLen] = _msg;
+  g_simQueued[g_simAirLen++] = _queued;
+  return true;
+}
+
+bool stubOTASend(MyMessage &_msg)
+{
+  if( g_simAirLen >= OTA_MAX_MQ ) return false;
+  return simAirPush(_msg, 0);
+}
+
+bool stubOTARead(const UL _offset, UC *_buf, const UC _len)
+{
+  for( UC i = 0; i < _len; i++ ) _buf[i] = (UC)((_offset + i) * 7 + ((_offset + i) >> 8));
+  return true;
+}
+
+// Receiving side of a node
+typedef struct {
+  UC node;
+  US blocks;
+  US base;
+  UL bitmap;
+  UC window[OTA_WINDOW][OTA_BLOCK_SIZE];
+  UL crc;
+  UC unacked;
+  UL tmLast;
+  BOOL announced;
+} SimOTANode_t;
+SimOTANode_t g_simNodes[SIM_OTA_NODES];
+
+void simNodeAck(SimOTANode_t &_node)
+{
+  MyMessage lv_msg;
+  OTAAck_t lv_ack;
+  lv_ack.base = _node.base;
+  lv_ack.bitmap = _node.bitmap;
+  lv_msg.build(_node.node, NODEID_GATEWAY, 0, C_STREAM, ST_FIRMWARE_REQUEST, false);
+  lv_msg.set((void *)&lv_ack, sizeof(lv_ack));
+  simAirPush(lv_msg, 0);
+  _node.unacked = 0;
+  _node.tmLast = g_simNow;
+}
+
+void simNodeReceive(SimOTANode_t &_node, MyMessage &_msg)
+{
+  if( _msg.getType() == ST_FIRMWARE_CONFIG_RESPONSE ) {
+    OTAAnnounce_t *lv_pAnnounce = (OTAAnnounce_t *)_msg.getCustom();
+    _node.blocks = lv_pAnnounce->blocks;
+    _node.announced = true;
+    simNodeAck(_node);
+    return;
+  }
+  OTAChunk_t *lv_pChunk = (OTAChunk_t *)_msg.getCustom();
+  if( FirmwareOTAClass::ChunkCRC(*lv_pChunk) != lv_pChunk->crc ) return;
+  US lv_block = lv_pChunk->block;
+  if( lv_block < _node.base || lv_block >= _node.base + OTA_WINDOW ) {
+    simNodeAck(_node);                  // Duplicate, our ack was lost
+    return;
+  }
+  memcpy(_node.window[lv_block % OTA_WINDOW], lv_pChunk->data, OTA_BLOCK_SIZE);
+  _node.bitmap |= (1UL << (lv_block - _node.base));
+  BOOL lv_gap = !(_node.bitmap & 0x01);
+  // Slide over received blocks
+  while( _node.bitmap & 0x01 ) {
+    UL lv_len = min(SIM_OTA_SIZE - (UL)_node.base * OTA_BLOCK_SIZE, OTA_BLOCK_SIZE);
+    _node.crc = CRC32(_node.window[_node.base % OTA_WINDOW], lv_len, _node.crc);
+    _node.base++;
+    _node.bitmap >>= 1;
+  }
+  _node.tmLast = g_simNow;
+  if( ++_node.unacked >= OTA_WINDOW / 2 || lv_gap || _node.base >= _node.blocks ) simNodeAck(_node);
+}
+
+// Run OTA to all simulated nodes with a command every 50ms, returns duration
+UL simOTARun(BOOL _ota, UL &_cmdMax, UL &_cmdAvg)
+{
+  UL lv_start = g_simNow;
+  UL lv_cmds = 0, lv_wait = 0;
+  MyMessage lv_msg;
+  _cmdMax = 0;
+  memset(g_simNodes, 0x00, sizeof(g_simNodes));
+  for( UC n = 0; n < SIM_OTA_NODES; n++ ) {
+    g_simNodes[n].node = NODEID_MIN_DEVCIE + n;
+    if( _ota ) theOTA.Start(g_simNodes[n].node, g_simNow);
+  }
+  while( g_simNow - lv_start < 60000 ) {
+    if( _ota ) {
+      theOTA.Process(g_simNow);
+      if( !theOTA.IsBusy() ) break;
+    } else if( g_simNow - lv_start >= 10000 ) {
+      break;
+    }
+    if( (g_simNow - lv_start) % 50 == 0 ) {
+      lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 0, C_SET, V_PERCENTAGE, true);
+      simAirPush(lv_msg, g_simNow);
+    }
+    // One frame on air
+    if( g_simAirLen > 0 ) {
+      lv_msg = g_simAir[0];
+      UL lv_queued = g_simQueued[0];
+      g_simAirLen--;
+      memmove(g_simAir, g_simAir + 1, g_simAirLen * sizeof(MyMessage));
+      memmove(g_simQueued, g_simQueued + 1, g_simAirLen * sizeof(UL));
+      if( lv_queued ) {
+        lv_cmds++;
+        lv_wait += g_simNow + 1 - lv_queued;
+        if( g_simNow + 1 - lv_queued > _cmdMax ) _cmdMax = g_simNow + 1 - lv_queued;
+      } else if( random(100) >= SIM_LOSS ) {
+        if( lv_msg.getDestination() == NODEID_GATEWAY ) {
+          OTAAck_t lv_ack;
+          memcpy(&lv_ack, lv_msg.getCustom(), sizeof(lv_ack));
+          theOTA.GotAck(lv_msg.getSender(), lv_ack, g_simNow);
+        } else {
+          simNodeReceive(g_simNodes[lv_msg.getDestination() - NODEID_MIN_DEVCIE], lv_msg);
+        }
+      }
+    }
+    // Ack what is left after a pause
+    for( UC n = 0; n < SIM_OTA_NODES; n++ ) {
+      if( g_simNodes[n].unacked && g_simNow - g_simNodes[n].tmLast >= 50 ) simNodeAck(g_simNodes[n]);
+    }
+    g_simNow++;
+  }
+  _cmdAvg = (lv_cmds ? lv_wait * 1000 / lv_cmds : 0);
+  return g_simNow - lv_start;
+}
+
+test(ota_lossy)
+{
+  UL lv_cmdMax, lv_cmdAvg, lv_duration;
+  UL lv_resent = theOTA.GetResent();
+  UL lv_done = theOTA.GetDone();
+  randomSeed(1);
+  g_simNow = millis() + 100000;
+  g_simAirLen = 0;
+  theOTA.SetSender(stubOTASend);
+  assertEqual(theOTA.SetImage(stubOTARead, devtypWRing3, 2, SIM_OTA_SIZE), true);
+  assertEqual(theOTA.GetBlocks(), (SIM_OTA_SIZE + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE);
+
+  simOTARun(false, lv_cmdMax, lv_cmdAvg);
+  SERIAL_LN("Commands alone: latency avg %lu us, max %lu ms", lv_cmdAvg, lv_cmdMax);
+  lv_duration = simOTARun(true, lv_cmdMax, lv_cmdAvg);
+  SERIAL_LN("OTA %d x %d bytes, %d%% loss: %lu ms, %lu bytes/s, %lu resent",
+      SIM_OTA_NODES, SIM_OTA_SIZE, SIM_LOSS, lv_duration, (UL)SIM_OTA_NODES * SIM_OTA_SIZE * 1000 / lv_duration,
+      theOTA.GetResent() - lv_resent);
+  SERIAL_LN("Commands with OTA: latency avg %lu us, max %lu ms", lv_cmdAvg, lv_cmdMax);
+
+  assertEqual(theOTA.GetDone() - lv_done, (UL)SIM_OTA_NODES);
+  for( UC n = 0; n < SIM_OTA_NODES; n++ ) {
+    assertEqual(theOTA.GetState(g_simNodes[n].node), OTA_ST_DONE);
+    assertEqual(g_simNodes[n].base, theOTA.GetBlocks());
+    assertEqual(g_simNodes[n].crc, theOTA.GetImageCRC());
+  }
+  assertMore(theOTA.GetResent() - lv_resent, 0UL);
+  assertLessOrEqual(lv_cmdMax, (UL)OTA_MAX_MQ + SIM_OTA_NODES + 1);
+  theOTA.SetSender(NULL);
+}
+
+// Stage an image in chunks as cloud sends it, and find it again after reboot
+test(ota_stage)
+{
+  const UL lv_size = 3 * MEM_EXT_FLASH_PAGE;
+  const UL lv_image = 5000;             // Spans two logical pages
+  P1FlashWindow lv_flash(MEM_FIRMWARE_OFFSET, lv_size);
+  static FirmwareOTAClass lv_ota;
+  static FirmwareOTAClass lv_boot;
+  UC lv_buf[OTA_STAGE_CHUNK];
+  UL lv_crc = 0, lv_chunkCRC, lv_offset;
+  US lv_len;
+
+  assertFalse(lv_ota.Init(&lv_flash, MEM_FIRMWARE_OFFSET, lv_size));
+  for( lv_offset = 0; lv_offset < lv_image; lv_offset += lv_len ) {
+    lv_len = min(lv_image - lv_offset, OTA_STAGE_CHUNK);
+    stubOTARead(lv_offset, lv_buf, lv_len);
+    lv_crc = CRC32(lv_buf, lv_len, lv_crc);
+  }
+  assertFalse(lv_ota.BeginImage(devtypWRing3, 3, lv_size, lv_crc));
+  assertTrue(lv_ota.BeginImage(devtypWRing3, 3, lv_image, lv_crc));
+  for( lv_offset = 0; lv_offset < lv_image; lv_offset += lv_len ) {
+    assertEqual(lv_ota.GetBlocks(), 0);
+    lv_len = min(lv_image - lv_offset, OTA_STAGE_CHUNK);
+    stubOTARead(lv_offset, lv_buf, lv_len);
+    lv_chunkCRC = CRC32(lv_buf, lv_len);
+    // Corrupted chunks and chunks out of order are refused
+    lv_buf[0] ^= 0x01;
+    assertFalse(lv_ota.WriteImage(lv_offset, lv_buf, lv_len, lv_chunkCRC));
+    lv_buf[0] ^= 0x01;
+    assertFalse(lv_ota.WriteImage(lv_offset + lv_len, lv_buf, lv_len, lv_chunkCRC));
+    assertTrue(lv_ota.WriteImage(lv_offset, lv_buf, lv_len, lv_chunkCRC));
+  }
+  assertFalse(lv_ota.IsStaging());
+  assertEqual(lv_ota.GetBlocks(), (lv_image + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE);
+  assertEqual(lv_ota.GetImageCRC(), lv_crc);
+  assertEqual(lv_flash.erases, 2UL);
+  assertTrue(lv_flash.IsIntact());
+
+  assertTrue(lv_boot.Init(&lv_flash, MEM_FIRMWARE_OFFSET, lv_size));
+  assertEqual(lv_boot.GetImageSize(), lv_image);
+  assertEqual(lv_boot.GetImageCRC(), lv_crc);
+
+  // A stopped session frees its slot
+  UL lv_now = millis();
+  for( UC n = 0; n < OTA_MAX_SESSIONS; n++ ) {
+    assertTrue(lv_ota.Start(NODEID_MIN_DEVCIE + n, lv_now));
+  }
+  assertFalse(lv_ota.Start(NODEID_MIN_DEVCIE + OTA_MAX_SESSIONS, lv_now));
+  lv_ota.Stop(NODEID_MIN_DEVCIE);
+  assertEqual(lv_ota.GetState(NODEID_MIN_DEVCIE), OTA_ST_IDLE);
+  assertTrue(lv_ota.Start(NODEID_MIN_DEVCIE + OTA_MAX_SESSIONS, lv_now));
+  for( UC n = 1; n <= OTA_MAX_SESSIONS; n++ ) lv_ota.Stop(NODEID_MIN_DEVCIE + n);
+
+  // An image that does not match its CRC is not taken
+  assertTrue(lv_ota.BeginImage(devtypWRing3, 4, lv_image, lv_crc ^ 0x01));
+  for( lv_offset = 0; lv_offset < lv_image; lv_offset += lv_len ) {
+    lv_len = min(lv_image - lv_offset, OTA_STAGE_CHUNK);
+    stubOTARead(lv_offset, lv_buf, lv_len);
+    assertEqual(lv_ota.WriteImage(lv_offset, lv_buf, lv_len, CRC32(lv_buf, lv_len)), lv_offset + lv_len < lv_image);
+  }
+  assertEqual(lv_ota.GetBlocks(), 0);
+  assertFalse(lv_boot.Init(&lv_flash, MEM_FIRMWARE_OFFSET, lv_size));
+  assertTrue(lv_flash.IsIntact());
+}
+
+UL g_nReplaySound = 0;
+bool stubReplaySound(MyMessage &_msg, const UC _sender) { g_nReplaySound++; return false; }
+
+// Capture a classroom trace, keep it in flash and replay it 10 times faster
+test(rf_capture_replay)
+{
+  // The area is smaller than a logical page and shares it with its neighbours
+  P1FlashWindow lv_flash(MEM_CAPTURE_OFFSET, MEM_CAPTURE_LEN);
+  MyMessage lv_msg;
+  UC *lv_pData = (UC *)&(lv_msg.msg);
+  UC lv_frame[MAX_MESSAGE_LENGTH];
+  UC lv_dir, lv_len;
+  UL lv_now = millis() + 100000;      // Simulated time
+  UL lv_time = 0, lv_first = 0, lv_rx = 0;
+  US lv_pos = 0;
+
+  theCapture.Init(&lv_flash, MEM_CAPTURE_OFFSET, MEM_CAPTURE_LEN);
+  theCapture.Clear();
+  theCapture.Start();
+  // 12 nodes report, every fourth report is answered
+  randomSeed(1);
+  for( int i = 0; i < 400; i++ ) {
+    lv_now += 20 + random(200);
+    lv_msg.build(NODEID_MIN_REMOTE + i % 12, NODEID_GATEWAY, 0, C_STREAM, ST_SOUND, false);
+    lv_msg.set((UC)i);
+    lv_len = HEADER_SIZE + lv_msg.getLength();
+    theCapture.Record(RFCAP_DIR_RX, lv_pData, lv_len, lv_now);
+    if( i % 4 == 0 ) theCapture.Record(RFCAP_DIR_TX, lv_pData, lv_len, lv_now + 1);
+  }
+  theCapture.Stop();
+  assertMore(theCapture.GetDropped(), 0UL);
+  assertLessOrEqual(theCapture.GetBytes(), RFCAP_BUF_SIZE);
+  while( theCapture.GetRecord(lv_pos, lv_time, lv_dir, lv_frame, lv_len) ) {
+    if( !lv_first ) lv_first = lv_time;
+    if( lv_dir == RFCAP_DIR_RX ) lv_rx++;
+  }
+  assertEqual(lv_time, lv_now);
+
+  // Keep it over reboot
+  US lv_count = theCapture.GetCount();
+  assertEqual(theCapture.Save(), true);
+  assertTrue(lv_flash.IsIntact());
+  theCapture.Clear();
+  assertEqual(theCapture.Load(), true);
+  assertEqual(theCapture.GetCount(), lv_count);
+
+  theRadio.RegisterHandler(C_STREAM, ST_SOUND, stubReplaySound, "sound");
+  g_nReplaySound = 0;
+  UL lv_replayed = theCapture.GetReplayed();
+  UL lv_start = lv_now;
+  assertEqual(theCapture.StartReplay(10, lv_start), true);
+  while( theCapture.IsReplaying() ) {
+    theCapture.Replay(lv_now++);
+  }
+  SERIAL_LN("Replayed %lu of %d records, %lu ms captured in %lu ms", lv_rx, lv_count, lv_time - lv_first, lv_now - 1 - lv_start);
+  assertEqual(g_nReplaySound, lv_rx);
+  assertEqual(theCapture.GetReplayed() - lv_replayed, lv_rx);
+  assertEqual(lv_now - 1 - lv_start, (lv_time - lv_first) / 10);
+  theCapture.Init(NULL, 0, 0);
+}
+
+// Air time at 250kbps: 32us a byte and 130us to settle before each frame. Frames and
+// auto-acks carry 9 bytes besides payload: preamble, address, control field and CRC
+#define SIM_RF_OVERHEAD   9
+#define SIM_RF_US_BYTE    32
+#define SIM_RF_US_SETTLE  130
+#define SIM_RF_STATIC     32                  // Frame length without dynamic payloads
+#define SIM_SCENE_LEN     (HEADER_SIZE + 5)   // Ring, state, BR and CCT to a Sunny lamp
+
+UL simExchange(const UC _frame, const UC _ack)
+{
+  return 2 * SIM_RF_US_SETTLE + (2 * SIM_RF_OVERHEAD + _frame + _ack) * SIM_RF_US_BYTE;
+}
+
+// Scene change on 48 lamps, confirmed by status reply frames or by status in ack payload
+test(rf_ack_status)
+{
+  const UC lv_lamps = 48;
+  MyMessage lv_msg;
+  UC *lv_pData = (UC *)&(lv_msg.msg);
+  UC lv_status[RF_ACK_STATUS_LEN] = {1, devtypWRing3, 1, RING_ID_ALL, 1, 40, 4000 % 256, 4000 / 256};
+  UL lv_air[2] = {0, 0};
+  UL lv_sum[2] = {0, 0};                // Sum of us until each lamp is confirmed
+  UL lv_acks = theRadio.GetAckStatus();
+  UC lv_pending = theRadio.GetPendingQueries(millis());
+
+  thePublisher.SetSink(stubPublish);
+  for( UC i = 0; i < lv_lamps; i++ ) theConfig.InitDevStatus(NODEID_MIN_DEVCIE + i);
+
+  // Static payload: command and status reply frame per lamp
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    lv_air[0] += simExchange(SIM_RF_STATIC, 0) * 2;
+    lv_sum[0] += lv_air[0];
+    lv_msg.build(NODEID_MIN_DEVCIE + i, NODEID_GATEWAY, 0, C_REQ, V_RGBW, false, true);
+    lv_msg.set(lv_status, sizeof(lv_status));
+    theRadio.Append(lv_pData, MAX_MESSAGE_LENGTH);
+    theRadio.ProcessReceiveMQ();
+  }
+
+  // Ack payload: commands first, lamps apply them meanwhile and answer the queries in auto-ack.
+  // The ack of a command carries the old status too. Nodes send no reply frames, see RF24_ACK_PAYLOAD
+  lv_status[5] = 60;
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    lv_air[1] += simExchange(SIM_SCENE_LEN, sizeof(lv_status));
+  }
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    lv_air[1] += simExchange(HEADER_SIZE, sizeof(lv_status));
+    lv_sum[1] += lv_air[1];
+    lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE + i, 0, C_REQ, V_RGBW, false);
+    assertEqual(theRadio.TrackQuery(lv_msg, millis()), true);
+    assertEqual(theRadio.ProcessAckPayload(NODEID_MIN_DEVCIE + i, lv_status, sizeof(lv_status)), true);
+    theRadio.ProcessReceiveMQ();
+  }
+  SERIAL_LN("Scene on %d lamps: air %lu us by reply frames, %lu us by ack payload", lv_lamps, lv_air[0], lv_air[1]);
+  SERIAL_LN("  status latency avg %lu/%lu us, max %lu/%lu us", lv_sum[0] / lv_lamps, lv_sum[1] / lv_lamps, lv_air[0], lv_air[1]);
+  assertLess(lv_air[1], lv_air[0]);
+  assertEqual(theRadio.GetAckStatus() - lv_acks, (UL)lv_lamps);
+  assertEqual(theRadio.GetPendingQueries(millis()), lv_pending);
+  assertEqual(theRadio.ProcessAckPayload(NODEID_MIN_DEVCIE, lv_status, RF_ACK_STATUS_LEN - 1), false);
+  assertEqual(theRadio.ProcessAckPayload(NODEID_GATEWAY, lv_status, sizeof(lv_status)), false);
+
+  // Status table took the ack payload
+  UC lv_rows = 0;
+  ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.DevStatus_table.getRoot();
+  while( DevStatusRowPtr ) {
+    UC lv_node = DevStatusRowPtr->data.node_id;
+    if( lv_node >= NODEID_MIN_DEVCIE && lv_node < NODEID_MIN_DEVCIE + lv_lamps ) {
+      assertEqual(DevStatusRowPtr->data.ring[0].BR, 60);
+      assertEqual(DevStatusRowPtr->data.ring[2].CCT, 4000);
+      lv_rows++;
+    }
+    DevStatusRowPtr = DevStatusRowPtr->next;
+  }
+  assertMore(lv_rows, 0);
+  thePublisher.Clear();
+  thePublisher.SetSink(NULL);
+}
+
+// 12 nodes report every 1-3s for 10 minutes, a quarter of the reports come again 5-100ms
+// later as our auto-ack was lost. Pairs of nodes share a set, readings repeat often
+test(rf_duplicates)
+{
+  const UC lv_nodes = 12;
+  MyMessage lv_msg, lv_copy[lv_nodes];
+  UL lv_now = millis() + 100000;      // Simulated time
+  UL lv_report[lv_nodes], lv_resend[lv_nodes];
+  UL lv_sent = 0, lv_resent = 0, lv_passed = 0;
+  UL lv_dropped = theRadio.GetDuplicates();
+  UL lv_start, lv_us = 0;
+
+  randomSeed(1);
+  for( UC i = 0; i < lv_nodes; i++ ) {
+    lv_report[i] = lv_now + random(1000);
+    lv_resend[i] = 0;
+  }
+  for( UL t = 0; t < 600000; t += 5, lv_now += 5 ) {
+    for( UC i = 0; i < lv_nodes; i++ ) {
+      if( lv_resend[i] && lv_resend[i] <= lv_now ) {
+        lv_resend[i] = 0;
+        lv_resent++;
+        lv_start = micros();
+        if( !theRadio.IsDuplicate(lv_copy[i], lv_now) ) lv_passed++;
+        lv_us += micros() - lv_start;
+      }
+      if( lv_report[i] > lv_now ) continue;
+      lv_report[i] = lv_now + 1000 + random(2000);
+      lv_msg.build(NODEID_MIN_DEVCIE + i % 6 + (i / 6) * RF_DUP_SETS, NODEID_GATEWAY, 1, C_SET, V_TEMP, false);
+      lv_msg.set((UC)(20 + random(3)));
+      lv_sent++;
+      lv_start = micros();
+      if( !theRadio.IsDuplicate(lv_msg, lv_now) ) lv_passed++;
+      lv_us += micros() - lv_start;
+      if( random(4) == 0 ) {
+        lv_copy[i] = lv_msg;
+        lv_resend[i] = lv_now + 5 + random(95);
+      }
+    }
+  }
+  SERIAL_LN("%lu reports, %lu retransmitted, %lu processed, %lu ns/lookup", lv_sent, lv_resent,
+      lv_passed, lv_us * 1000 / (lv_sent + lv_resent));
+  assertEqual(lv_passed, lv_sent);
+  assertEqual(theRadio.GetDuplicates() - lv_dropped, lv_resent);
+
+  // An event between report and its copy, then the same event after the window
+  lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_SET, V_STATUS, false);
+  lv_msg.set((UC)1);
+  lv_copy[0] = lv_msg;
+  lv_msg.build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_SET, V_PERCENTAGE, false);
+  lv_msg.set((UC)50);
+  assertEqual(theRadio.IsDuplicate(lv_copy[0], lv_now), false);
+  assertEqual(theRadio.IsDuplicate(lv_msg, lv_now + 10), false);
+  assertEqual(theRadio.IsDuplicate(lv_copy[0], lv_now + 20), true);
+  assertEqual(theRadio.IsDuplicate(lv_copy[0], lv_now + RTE_TM_RF_DUP), false);
+}
+
+// sendMQ on simulated time
+UL g_laneNow;
+class SimSendMQ : public CFastMessageQ
+{
+public:
+  SimSendMQ() : CFastMessageQ(MQ_MAX_RF_SNDMSG, MAX_MESSAGE_LENGTH) {}
+  uint32_t GetTick() { return g_laneNow; }
+};
+
+void simSortUS(US *_data, const US _len)
+{
+  for( US i = 1; i < _len; i++ ) {
+    US lv_value = _data[i];
+    US j = i;
+    for( ; j > 0 && _data[j - 1] > lv_value; j-- ) _data[j] = _data[j - 1];
+    _data[j] = lv_value;
+  }
+}
+
+// One minute of user commands every 200-400ms, while config (3 in 4) and background frames
+// fill sendMQ once per loop. A frame takes 3ms on air, or 40ms to a dead node (one in three)
+// after all retries. The main loop takes commands in ProcessCommands(), then SelfCheck()
+// serves sendMQ for RTE_DELAY_SELFCHECK ms. Returns the number of commands, their latency
+// from arrival sorted in _latency
+US simSendLanes(const bool _lanes, US *_latency, const US _size, UL &_sent, UL &_bgSent, UL &_bgWait)
+{
+  SimSendMQ lv_mq;
+  MyMessage lv_msg;
+  UC *lv_pData = (UC *)&(lv_msg.msg);
+  UL lv_added[256];                     // Time a user command came, by its number
+  UL lv_end, lv_nextCmd, lv_wait, lv_loop, lv_start;
+  US lv_count = 0, lv_seq = 0;
+  UC lv_lane;
+  CFastMessageNode *lv_pNode;
+
+  _sent = 0;
+  _bgSent = 0;
+  _bgWait = 0;
+  g_laneNow = millis() + 100000;
+  lv_end = g_laneNow + 60000;
+  lv_nextCmd = g_laneNow + 200 + random(200);
+  while( g_laneNow < lv_end ) {
+    // Config and background refill sendMQ up to the reserved slots
+    while( lv_mq.GetMQLength() + RF_MQ_RESERVED < lv_mq.GetMQMaxLength() ) {
+      lv_lane = (++lv_seq % 4 ? RF_LANE_CONFIG : RF_LANE_BACKGROUND);
+      lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE + lv_seq % 3, 0, C_INTERNAL, I_CONFIG, false);
+      lv_msg.set((unsigned int)lv_seq);
+      lv_mq.AddMessage(lv_pData, MAX_MESSAGE_LENGTH, _lanes ? lv_lane : 0, 0x10000 + lv_seq);
+    }
+    // ProcessCommands() takes the commands that came during the last loop
+    while( g_laneNow >= lv_nextCmd && lv_count < _size ) {
+      lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 0, C_SET, V_STATUS, false);
+      lv_msg.set((unsigned int)lv_count);
+      lv_added[lv_count % 256] = lv_nextCmd;
+      lv_nextCmd += 200 + random(200);
+      lv_mq.AddMessage(lv_pData, MAX_MESSAGE_LENGTH, RF_LANE_CONTROL, lv_count++);
+    }
+
+    // SelfCheck(): ProcessSendMQ() between alarm checks
+    lv_loop = g_laneNow;
+    do {
+      lv_start = g_laneNow;
+      while( lv_mq.GetMQLength() > 0 && g_laneNow - lv_start < RF_SEND_BUDGET ) {
+        lv_pNode = lv_mq.GetUrgentMessage(RTE_TM_RF_AGING, RF_TM_RESEND);
+        if( !lv_pNode ) break;
+        lv_wait = g_laneNow - lv_pNode->m_tickAdded;
+        if( lv_pNode->m_iFlag < 0x10000 ) {
+          g_laneNow += 3;
+          _latency[lv_pNode->m_iFlag] = min(g_laneNow - lv_added[lv_pNode->m_iFlag % 256], 0xFFFF);
+        } else {
+          g_laneNow += (lv_pNode->m_iFlag % 3 ? 3 : 40);
+          if( lv_pNode->m_iFlag % 4 == 0 ) {
+            _bgSent++;
+            _bgWait = max(_bgWait, lv_wait);
+          }
+        }
+        lv_mq.RemoveMessage(lv_pNode);
+        _sent++;
+      }
+      g_laneNow += 1;                   // Alarm.delay(0)
+    } while( g_laneNow - lv_loop < RTE_DELAY_SELFCHECK );
+    g_laneNow += 5;                     // Rest of the loop
+  }
+  simSortUS(_latency, lv_count);
+  return lv_count;
+}
+
+// User command latency in one queue against lanes, under saturating background load
+test(rf_send_lanes)
+{
+  static US lv_latency[2][256];
+  US lv_count[2];
+  UL lv_sent[2], lv_bgSent[2], lv_bgWait[2];
+
+  // Lanes of messages
+  MyMessage lv_msg;
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 0, C_SET, V_STATUS, false);
+  assertEqual(theRadio.GetLane(lv_msg), RF_LANE_CONTROL);
+  UC lv_lane = theRadio.SetLane(RF_LANE_SCENE);
+  assertEqual(theRadio.GetLane(lv_msg), RF_LANE_SCENE);
+  theRadio.SetLane(lv_lane);
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, 0, C_REQ, V_RGBW, false);
+  assertEqual(theRadio.GetLane(lv_msg), RF_LANE_QUERY);
+  lv_msg.build(NODEID_GATEWAY, NODEID_MIN_DEVCIE, NCF_QUERY, C_INTERNAL, I_CONFIG, false);
+  assertEqual(theRadio.GetLane(lv_msg), RF_LANE_CONFIG);
+  lv_msg.build(NODEID_MIN_DEVCIE, BROADCAST_ADDRESS, 0, C_REQ, V_RGBW, false, true);
+  assertEqual(theRadio.GetLane(lv_msg), RF_LANE_BACKGROUND);
+
+  // Messages waiting RTE_TM_RF_AGING go ahead, one in two
+  {
+    SimSendMQ lv_mq;
+    UL lv_order[4] = {1, 3, 2, 4};
+    UC lv_lanes[4] = {RF_LANE_BACKGROUND, RF_LANE_BACKGROUND, RF_LANE_CONTROL, RF_LANE_CONTROL};
+    g_laneNow = millis() + 100000;
+    for( UC i = 0; i < 4; i++ ) {
+      if( i == 2 ) g_laneNow += RTE_TM_RF_AGING;
+      lv_msg.set((unsigned int)i);
+      lv_mq.AddMessage((UC *)&(lv_msg.msg), MAX_MESSAGE_LENGTH, lv_lanes[i], i + 1);
+    }
+    for( UC i = 0; i < 4; i++ ) {
+      CFastMessageNode *lv_pNode = lv_mq.GetUrgentMessage(RTE_TM_RF_AGING, RF_TM_RESEND);
+      assertEqual(lv_pNode != NULL, true);
+      if( !lv_pNode ) break;
+      assertEqual(lv_pNode->m_iFlag, lv_order[i]);
+      lv_mq.RemoveMessage(lv_pNode);
+    }
+  }
+
+  // A user command supersedes rule actions still waiting for the same node, and only those
+  {
+    UC lv_node = NODEID_MIN_DEVCIE;
+    UC lv_found[2][2] = {{0, 0}, {0, 0}};       // By node, by lane
+    CFastMessageNode *lv_pNode = NULL;
+    lv_lane = theRadio.SetLane(RF_LANE_SCENE);
+    for( UC i = 0; i < 2; i++ ) {
+      lv_msg.build(NODEID_GATEWAY, lv_node + i, 0, C_SET, V_PERCENTAGE, false);
+      lv_msg.set((UC)30);
+      assertTrue(theRadio.ProcessSend(&lv_msg));
+    }
+    theRadio.SetLane(RF_LANE_CONTROL);
+    lv_msg.build(NODEID_GATEWAY, lv_node, 0, C_SET, V_STATUS, false);
+    lv_msg.set((UC)0);
+    assertTrue(theRadio.ProcessSend(&lv_msg));
+    theRadio.SetLane(lv_lane);
+
+    while( (lv_pNode = theRadio.GetMessage(lv_pNode)) ) {
+      UC lv_dest = (lv_pNode->m_iFlag & 0xFF);
+      if( ((lv_pNode->m_iFlag >> 16) & 0xFF) == C_SET && lv_dest >= lv_node && lv_dest <= lv_node + 1
+          && lv_pNode->m_Tag <= RF_LANE_SCENE ) {
+        lv_found[lv_dest - lv_node][lv_pNode->m_Tag]++;
+      }
+      lv_pNode = lv_pNode->m_pNext;
+    }
+    assertEqual(lv_found[0][RF_LANE_SCENE], 0);
+    assertEqual(lv_found[0][RF_LANE_CONTROL], 1);
+    assertEqual(lv_found[1][RF_LANE_SCENE], 1);
+    theRadio.RemoveMessages(RF_LANE_CONTROL, ((UL)C_SET << 16) | lv_node, 0x00FF00FF);
+    theRadio.RemoveMessages(RF_LANE_SCENE, ((UL)C_SET << 16) | (lv_node + 1), 0x00FF00FF);
+  }
+
+  for( UC n = 0; n < 2; n++ ) {
+    randomSeed(1);
+    lv_count[n] = simSendLanes(n > 0, lv_latency[n], 256, lv_sent[n], lv_bgSent[n], lv_bgWait[n]);
+    SERIAL_LN("%s: %d commands, latency p50 %d ms, p99 %d ms, %lu frames/s, %lu background sent, waited up to %lu ms",
+        n ? "Lanes" : "FIFO", lv_count[n], lv_latency[n][lv_count[n] / 2], lv_latency[n][lv_count[n] * 99 / 100],
+        lv_sent[n] / 60, lv_bgSent[n], lv_bgWait[n]);
+    assertMore(lv_count[n], 150);
+  }
+  assertLess(lv_latency[1][lv_count[1] * 99 / 100], lv_latency[0][lv_count[0] / 2]);
+  // More than one frame a loop
+  assertMore(lv_sent[1] / 60, 1000UL / RTE_DELAY_SELFCHECK);
+  // Background is not starved
+  assertMore(lv_bgSent[1], 0UL);
+  assertLess(lv_bgWait[1], RTE_TM_RF_AGING * 2UL);
+}
+
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 // Call Start Func to Init Tests
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
@@ -32,6 +32,12 @@
 #include "xlxSerialConsole.h"
 #include "xlxASRInterface.h"
 #include "xlxBLEInterface.h"
+#include "xlxCloudPublisher.h"
+#include "xlxUsageStats.h"
+#include "xlxStatusPoller.h"
+#include "xlxGroupTable.h"
+#include "xlxFirmwareOTA.h"
+#include "xlxRFCapture.h"
 
 #include "Adafruit_DHT.h"
 #include "ArduinoJson.h"
@@ -129,7 +135,19 @@ void SmartControllerClass::Init()
 
 	// Initialize Logger
 	theLog.Init(m_SysID);
-	theLog.InitFlash(MEM_OFFLINE_DATA_OFFSET, MEM_OFFLINE_DATA_LEN);
+	theLog.InitFlash(MEM_FLASHLOG_OFFSET, MEM_FLASHLOG_LEN);
+#ifdef MCU_TYPE_P1
+	// Keep cloud events while offline
+	thePublisher.InitJournal(MEM_OFFLINE_DATA_OFFSET, MEM_OFFLINE_DATA_LEN);
+	// Usage statistics of lamps
+	theUsage.Init(theConfig.getP1Flash(), MEM_REPORT_OFFSET, MEM_REPORT_LEN);
+	// Group membership of devices
+	theGroups.Init(theConfig.getP1Flash(), MEM_GROUPS_OFFSET, MEM_GROUPS_LEN);
+	// Firmware image of nodes
+	theOTA.Init(theConfig.getP1Flash(), MEM_FIRMWARE_OFFSET, MEM_FIRMWARE_LEN);
+	// Dump of RF capture
+	theCapture.Init(theConfig.getP1Flash(), MEM_CAPTURE_OFFSET, MEM_CAPTURE_LEN);
+#endif
 
 #ifndef DISABLE_ASR
 	// Open ASR Interface
@@ -350,18 +368,21 @@ BOOL SmartControllerClass::Start()
 	}
 	//QueryDeviceStatus(CURRENT_DEVICE);
 
-	// Request the main device to report status
-	RequestDeviceStatus(CURRENT_DEVICE);
+	// Request all devices to report status, paced by the poller
+	thePoller.PollAllDevices(millis());
 
 	// Acts on the Rules rules newly loaded from flash
 	ReadNewRules(true);
 
+	// Output boot logs and defer the next ones to SelfCheck()
+	theLog.Process();
+
 	return true;
 }
 
 void SmartControllerClass::Restart()
 {
-	theConfig.SaveConfig();
+	theConfig.SaveConfig(true);
 	SetStatus(STATUS_RST);
 	delay(1000);
 	System.reset();
@@ -502,7 +523,12 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 	static UC tickWiFiOff = 0;
 
 	// Check all alarms. This triggers them.
-	Alarm.delay(ms);
+	/// sendMQ is served meanwhile, or it would send only once per loop
+	UL lv_start = millis();
+	do {
+		Alarm.delay(0);
+		theRadio.ProcessSendMQ();
+	} while( millis() - lv_start < ms );
 
 	// Save config if it was changed
 	if (++tickSaveConfig > 30000 / ms) {	// once per 30 seconds
@@ -513,6 +539,11 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 	// Scan device list and check keepalive timeout
 	if( tickSaveConfig % (2000 / ms) == 0 ) { // every 2 second
 		CheckDevTimeout();
+		// Write back table rows that reached their deadline
+		theConfig.FlushTables();
+		theGroups.Save();
+		// Count lamp usage, buckets are in local time
+		theUsage.Tick(Time.local());
 	}
 
 	// Publish relay key status if changed
@@ -520,6 +551,12 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 		if( Particle.connected() ) PublishRelayKeyFlag();
 	}
 
+	// Publish buffered cloud events at the allowed pace
+	thePublisher.Process();
+
+	// Output deferred logs
+	theLog.Process();
+
   // Slow Checking: once per 60 seconds
   if (++tickCheckRadio > 60000 / ms) {
 		// Check RF module
@@ -636,6 +673,13 @@ void SmartControllerClass::ProcessLocalCommands() {
 	//SERIAL_LN("PeekMessage...");
 	theRadio.PeekMessage();
 	//SERIAL_LN("PeekMessage end");
+	// Feed captured frames in replay
+	theCapture.Replay(millis());
+
+	// Queue status queries of the poll in progress
+	thePoller.Process(millis());
+	// Queue firmware chunks while sendMQ is idle
+	theOTA.Process(millis());
 
 	// Process RF2.4 messages
 	//SERIAL_LN("ProcessMQ...");
@@ -1325,7 +1369,10 @@ int SmartControllerClass::ExeJSONCommand(String jsonCmd)
 		else if (_cmd == CMD_QUERY) {
 			if ((*m_jpCldCmd).containsKey("nd")) {
 				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				if( (*m_jpCldCmd).containsKey("reset") ) {
+				if( node_id == NODEID_DUMMY ) {
+					// Query all devices
+					return(thePoller.PollAllDevices(millis()) > 0);
+				} else if( (*m_jpCldCmd).containsKey("reset") ) {
 					if( (*m_jpCldCmd)["reset"].as<int>() == 1 ) {
 						return RebootNode((uint8_t)node_id);
 					}
@@ -1480,6 +1527,7 @@ bool SmartControllerClass::ParseCmdRow(JsonObject& data)
 		case CLS_RULE:				//rule
 		{
 			RuleRow_t row;
+			memset(&row, 0x00, sizeof(row));
 			row.op_flag = op_flag;
 			row.flash_flag = flash_flag;
 			row.run_flag = run_flag;
@@ -1501,6 +1549,9 @@ bool SmartControllerClass::ParseCmdRow(JsonObject& data)
 				row.tmr_span = data["tmr_span"];
 			else row.tmr_span = 0;
 			row.tmr_started = 0;
+			if( data.containsKey("sr_win") )
+				row.sr_window = data["sr_win"];
+			else row.sr_window = SR_WIN_5MIN;
 
 			// Get conditions
 			for( _cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
@@ -1510,9 +1561,11 @@ bool SmartControllerClass::ParseCmdRow(JsonObject& data)
 					row.actCond[_cond].sr_scope = data[sTemp][1];
 					row.actCond[_cond].symbol = data[sTemp][2];
 					row.actCond[_cond].connector = data[sTemp][3];
-					row.actCond[_cond].sr_id = data[sTemp][4];
+					SetConditionSensor(row.actCond[_cond], data[sTemp][4]);
 					row.actCond[_cond].sr_value1 = data[sTemp][5];
 					row.actCond[_cond].sr_value2 = data[sTemp][6];
+					// Optional aggregation: [..., aggr]
+					row.actCond[_cond].sr_aggr = data[sTemp][7];
 				} else {
 					row.actCond[_cond].enabled = false;
 				}
@@ -1666,6 +1719,26 @@ bool SmartControllerClass::ParseCmdRow(JsonObject& data)
 					theConfig.SetKeyMapItem((UC)data["km"], (UC)data["nd"], (UC)(data.containsKey("sid") ? data["sid"].as<int>() : 0));
 				} else if( data.containsKey("btn") && data.containsKey("op") && data.containsKey("act") && data.containsKey("km")) {
 					theConfig.SetExtBtnAction((UC)data["btn"], (UC)data["op"], (UC)data["act"], (UC)data["km"]);
+				} else if( data.containsKey("sflt") ) {
+					// [sensor, deadband, relative, interval, heartbeat]
+					theConfig.SetSensorFilter((UC)data["sflt"][0], (US)data["sflt"][1], data["sflt"][2] > 0, (UC)data["sflt"][3], (UC)data["sflt"][4]);
+				} else if( data.containsKey("ota") && data["crc"].is<const char *>() ) {
+					// Stage node firmware: [type, version, size], crc is CRC32 of the image in hex
+					return theOTA.BeginImage((US)data["ota"][0], (US)data["ota"][1], (UL)data["ota"][2].as<long>(), strtoul(data["crc"].asString(), NULL, 16));
+				} else if( data.containsKey("otaw") && data["hex"].is<const char *>() && data["crc"].is<const char *>() ) {
+					// Image bytes at offset otaw in hex, crc is CRC32 of the bytes in hex
+					const char *strHex = data["hex"];
+					UC lv_data[OTA_STAGE_CHUNK];
+					US lv_len = strlen(strHex) / 2;
+					if( lv_len > OTA_STAGE_CHUNK ) return 0;
+					for( US i = 0; i < lv_len; i++ ) {
+						lv_data[i] = (h2i(strHex[2 * i]) << 4) + h2i(strHex[2 * i + 1]);
+					}
+					if( !theOTA.WriteImage((UL)data["otaw"].as<long>(), lv_data, lv_len, strtoul(data["crc"].asString(), NULL, 16)) ) {
+						LOGW(LOGTAG_MSG, "OTA image write at %ld failed", data["otaw"].as<long>());
+						return 0;
+					}
+					return 1;
 				} else if( data.containsKey("nd") ) {
 					UC node_id = (UC)data["nd"];
 					if( data.containsKey("new_id") ) {
@@ -1772,9 +1845,47 @@ bool SmartControllerClass::Change_Rule(RuleRow_t row)
 			break;
 	}
 	theConfig.SetRTChanged(true);
+	UpdateSensorHistory();
 	return true;
 }
 
+// Node whose sensor a condition refers to: the controller itself or the node of the rule
+static UC GetConditionNode(const UC _thisNd, const UC _scope)
+{
+	return (_scope == SR_SCOPE_CONTROLLER ? NODEID_GATEWAY : _thisNd);
+}
+
+// Keep history only for the (node, sensor) pairs referred by aggregated rule conditions
+void SmartControllerClass::UpdateSensorHistory()
+{
+	US lv_keys[SENSOR_HISTORY_RINGS];
+	UC lv_num = 0, lv_left = 0;
+	ListNode<RuleRow_t> *ruleRowPtr = Rule_table.getRoot();
+	while (ruleRowPtr != NULL)
+	{
+		if( ruleRowPtr->data.op_flag != DELETE ) {
+			for( UC _cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
+				Condition_t *pCond = &ruleRowPtr->data.actCond[_cond];
+				if( !pCond->enabled ) break;
+				if( pCond->sr_aggr == SR_AGGR_NONE ) continue;
+				if( pCond->sr_scope != SR_SCOPE_CONTROLLER && pCond->sr_scope != SR_SCOPE_NODE ) continue;
+				UC _sr = GetConditionSensor(*pCond);
+				US _key = SENSOR_STATE_KEY(GetConditionNode(ruleRowPtr->data.node_id, pCond->sr_scope), (_sr == sensorDUST ? sensorPM25 : _sr));
+				UC i;
+				for( i = 0; i < lv_num && lv_keys[i] != _key; i++ );
+				if( i < lv_num ) continue;
+				if( lv_num < SENSOR_HISTORY_RINGS ) lv_keys[lv_num++] = _key;
+				else lv_left++;
+			}
+		}
+		ruleRowPtr = ruleRowPtr->next;
+	}
+	lv_left += m_srState.SetHistoryItems(lv_keys, lv_num);
+	if( lv_left > 0 ) {
+		LOGW(LOGTAG_MSG, "No history for %d aggregated conditions, %d rings", lv_left, SENSOR_HISTORY_RINGS);
+	}
+}
+
 bool SmartControllerClass::Change_Schedule(ScheduleRow_t row)
 {
 	int index;
@@ -1785,20 +1896,10 @@ bool SmartControllerClass::Change_Schedule(ScheduleRow_t row)
 			index = Schedule_table.search_uid(row.uid);
 			if (index == -1) //uid not found
 			{
-				//make room for new row
-				if (Schedule_table.isFull())
+				//add row, reusing the least recently used row if full
+				if (!Schedule_table.add_lru(row))
 				{
-					if (!Schedule_table.delete_one_outdated_row())
-					{
-						LOGW(LOGTAG_MSG, "Schedule_t full, cannot process command");
-						return false;
-					}
-				}
-
-				//add row
-				if (!Schedule_table.add(row))
-				{
-					LOGE(LOGTAG_MSG, "Error occured while adding Schedule UID:%c%d", CLS_SCHEDULE, row.uid);
+					LOGW(LOGTAG_MSG, "Schedule_t full, cannot add UID:%c%d", CLS_SCHEDULE, row.uid);
 					return false;
 				}
 
@@ -1831,20 +1932,10 @@ bool SmartControllerClass::Change_Schedule(ScheduleRow_t row)
 			index = Schedule_table.search_uid(row.uid);
 			if (index == -1) //uid not found
 			{
-				//make room for new row
-				if (Schedule_table.isFull())
-				{
-					if (!Schedule_table.delete_one_outdated_row())
-					{
-						LOGW(LOGTAG_MSG, "Schedule_t full, cannot process command");
-						return false;
-					}
-				}
-
-				//add row
-				if (!Schedule_table.add(row))
+				//add row, reusing the least recently used row if full
+				if (!Schedule_table.add_lru(row))
 				{
-					LOGE(LOGTAG_MSG, "Error occured while adding Schedule UID:%c%d", CLS_SCHEDULE, row.uid);
+					LOGW(LOGTAG_MSG, "Schedule_t full, cannot add UID:%c%d", CLS_SCHEDULE, row.uid);
 					return false;
 				}
 
@@ -1894,20 +1985,10 @@ bool SmartControllerClass::Change_Scenario(ScenarioRow_t row)
 			index = Scenario_table.search_uid(row.uid);
 			if (index == -1) //uid not found
 			{
-				//make room for new row
-				if (Scenario_table.isFull())
-				{
-					if (!Scenario_table.delete_one_outdated_row())
-					{
-						LOGW(LOGTAG_MSG, "Scenario_t full, cannot process command");
-						return false;
-					}
-				}
-
-				//add row
-				if (!Scenario_table.add(row))
+				//add row, reusing the least recently used row if full
+				if (!Scenario_table.add_lru(row))
 				{
-					LOGE(LOGTAG_MSG, "Error occured while adding Scenario UID:%c%d", CLS_SCENARIO, row.uid);
+					LOGW(LOGTAG_MSG, "Scenario_t full, cannot add UID:%c%d", CLS_SCENARIO, row.uid);
 					return false;
 				}
 			}
@@ -1928,20 +2009,10 @@ bool SmartControllerClass::Change_Scenario(ScenarioRow_t row)
 			index = Scenario_table.search_uid(row.uid);
 			if (index == -1) //uid not found
 			{
-				//make room for new row
-				if (Scenario_table.isFull())
+				//add row, reusing the least recently used row if full
+				if (!Scenario_table.add_lru(row))
 				{
-					if (!Scenario_table.delete_one_outdated_row())
-					{
-						LOGW(LOGTAG_MSG, "Scenario_t full, cannot process command");
-						return false;
-					}
-				}
-
-				//add row
-				if (!Scenario_table.add(row))
-				{
-					LOGE(LOGTAG_MSG, "Error occured while adding Scenario UID:%c%d", CLS_SCENARIO, row.uid);
+					LOGW(LOGTAG_MSG, "Scenario_t full, cannot add UID:%c%d", CLS_SCENARIO, row.uid);
 					return false;
 				}
 
@@ -2113,30 +2184,32 @@ bool SmartControllerClass::ExecuteLightCommand(String mySerialStr)
 */
 
 // Match sensor data to condition
-bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _nd, UC _symbol, US _val1, US _val2)
+bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _symbol, US _val1, US _val2, UC _aggr, UC _window)
 {
+	static const UC lv_winMinutes[] = {5, 15, 30, 60};
+
 	// Retrieve sensor data
-	US senData = 255;
+	US senData = 0;
+	bool bGotData = false;
+	float _value;
+	UC _nd = GetConditionNode(_thisNd, _scope);
 	switch( _scope ) {
 		case SR_SCOPE_CONTROLLER:
 		case SR_SCOPE_NODE:
-		// ToDo: should distinguish node and more sensors
-		if( _sr == sensorDHT ) {
-			if( _nd == 0 && m_sysTemp.IsDataReady() ) senData = (US)(m_sysTemp.GetValue() + 0.5);
-			else if( _nd == m_temperature.node_id ) senData = (US)(m_temperature.data + 0.5);
-		} else if( _sr == sensorDHT_h ) {
-			if( _nd == 0 && m_sysHumi.IsDataReady() ) senData = (US)(m_sysHumi.GetValue() + 0.5);
-			else if( _nd == m_humidity.node_id ) senData = (US)(m_humidity.data + 0.5);
-		} else if( _sr == sensorALS && _nd == m_brightness.node_id ) {
-			senData = m_brightness.data;
-		} else if( _sr == sensorPIR && _nd == m_motion.node_id ) {
-			senData = m_motion.data;
-		} else if( _sr == sensorSMOKE && _nd == m_smoke.node_id ) {
-			senData = m_smoke.data;
-		} else if( _sr == sensorGAS && _nd == m_gas.node_id ) {
-			senData = m_gas.data;
-		} else if( _sr == sensorDUST && _nd == m_pm25.node_id ) {
-			senData = m_pm25.data;
+		if( _aggr != SR_AGGR_NONE ) {
+			// Aggregation over the rule window
+			if( m_srState.GetAggregate(_nd, (_sr == sensorDUST ? sensorPM25 : _sr), _aggr, lv_winMinutes[_window & 0x03], &_value) ) {
+				senData = (US)(_value + 0.5);
+				bGotData = true;
+			}
+		} else if( _nd == 0 && _sr == sensorDHT ) {
+			if( m_sysTemp.IsDataReady() ) { senData = (US)(m_sysTemp.GetValue() + 0.5); bGotData = true; }
+		} else if( _nd == 0 && _sr == sensorDHT_h ) {
+			if( m_sysHumi.IsDataReady() ) { senData = (US)(m_sysHumi.GetValue() + 0.5); bGotData = true; }
+		} else if( m_srState.GetValue(_nd, (_sr == sensorDUST ? sensorPM25 : _sr), &_value) ) {
+			// Latest data of this node
+			senData = (US)(_value + 0.5);
+			bGotData = true;
 		}
 		break;
 
@@ -2153,7 +2226,7 @@ bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _n
 	}
 
 	bool rc = false;
-	if( senData < 255 ) {
+	if( bGotData ) {
 		// Assert value
 		switch( _symbol ) {
 			case SR_SYM_EQ:
@@ -2220,11 +2293,12 @@ bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init
 
 	UC _cond;
 	bool bTrigger = false;
-	// Whether conditions contain this sensor
+	// Whether conditions contain this sensor of this node
 	if( _sr < 255 ) {
 		for(_cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
 			if( !rulePtr->data.actCond[_cond].enabled ) return false;
-			if( rulePtr->data.actCond[_cond].sr_id == _sr ) {
+			if( GetConditionSensor(rulePtr->data.actCond[_cond]) == _sr
+					&& GetConditionNode(rulePtr->data.node_id, rulePtr->data.actCond[_cond].sr_scope) == _nd ) {
 				// Go on check conditions
 				bTrigger = true;
 				break;
@@ -2244,8 +2318,9 @@ bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init
 
 		//if( _sr < 255 && _sr != rulePtr->data.actCond[_cond].sr_id ) continue;
 
-		bTest = Check_SensorData(rulePtr->data.node_id, rulePtr->data.actCond[_cond].sr_scope, rulePtr->data.actCond[_cond].sr_id, _nd,
-				rulePtr->data.actCond[_cond].symbol, rulePtr->data.actCond[_cond].sr_value1, rulePtr->data.actCond[_cond].sr_value2);
+		bTest = Check_SensorData(rulePtr->data.node_id, rulePtr->data.actCond[_cond].sr_scope, GetConditionSensor(rulePtr->data.actCond[_cond]),
+				rulePtr->data.actCond[_cond].symbol, rulePtr->data.actCond[_cond].sr_value1, rulePtr->data.actCond[_cond].sr_value2,
+				rulePtr->data.actCond[_cond].sr_aggr, rulePtr->data.sr_window);
 
 		if( _connector != COND_SYM_NOT ) {
 			if( _connector == COND_SYM_OR ) {
@@ -2265,7 +2340,10 @@ bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init
 	// Switch to desired scenario
 	if( bTrigger ) {
 		LOGI(LOGTAG_EVENT, "Rule %d triggered by sensor %d", rulePtr->data.uid, _sr);
+		// Rule actions give way to user commands
+		UC lv_lane = theRadio.SetLane(RF_LANE_SCENE);
 		ChangeLampScenario(rulePtr->data.node_id, rulePtr->data.SNT_uid);
+		theRadio.SetLane(lv_lane);
 
 		// Send Notification
 		if( rulePtr->data.notif_uid < 255 ) {
@@ -2485,10 +2563,8 @@ ListNode<ScheduleRow_t> *SmartControllerClass::SearchSchedule(UC uid)
 	{
 		// Search Flash and validate data entry
 		ScheduleRow_t row;
-		if (uid < MAX_SCT_ROWS)
+		if (uid < MAX_SCT_ROWS && theConfig.MemReadScheduleRow(row, uid))
 		{
-			// Find it
-			EEPROM.get(MEM_SCHEDULE_OFFSET + uid*SCT_ROW_SIZE, row);
 
 			// flags should be 111
 			if(row.uid == uid && row.op_flag == (OP_FLAG)1
@@ -2501,8 +2577,7 @@ ListNode<ScheduleRow_t> *SmartControllerClass::SearchSchedule(UC uid)
 				row.flash_flag = SAVED;			// We know it has a copy in flash
 				if (Change_Schedule(row))
 				{
-					//pObj = Schedule_table.search(uid);
-					pObj = Schedule_table.getLast();		// Faster
+					pObj = Schedule_table.find(uid);
 					LOGN(LOGTAG_MSG, "UID:%c%d copy Flash to Schedule_t OK", CLS_SCHEDULE, uid);
 				}
 				else
@@ -2524,10 +2599,8 @@ ListNode<ScenarioRow_t>* SmartControllerClass::SearchScenario(UC uid)
 	{
 		//search Flash and validate data entry
 		ScenarioRow_t row;
-		if (uid < MAX_SNT_ROWS)
+		if (uid < MAX_SNT_ROWS && theConfig.MemReadScenarioRow(row, uid))
 		{
-			//find it
-			theConfig.MemReadScenarioRow(row, MEM_SCENARIOS_OFFSET + uid*SNT_ROW_SIZE);
 
 			//flags should be 111
 			if (row.uid == uid && row.op_flag == (OP_FLAG)1
@@ -2540,7 +2613,7 @@ ListNode<ScenarioRow_t>* SmartControllerClass::SearchScenario(UC uid)
 				row.flash_flag = SAVED;			//we know it has a copy in flash
 				if (Change_Scenario(row))
 				{
-					pObj = Scenario_table.getLast();
+					pObj = Scenario_table.find(uid);
 					LOGN(LOGTAG_MSG, "UID:%c%d copy Flash to Scenario_t OK", CLS_SCENARIO, uid);
 				}
 				else
@@ -2693,10 +2766,9 @@ US SmartControllerClass::VerifyDevicePresence(UC *_assoDev, UC _nodeID, UC _devT
 		LOGN(LOGTAG_MSG, "Failed to verify identity for device:%d", _nodeID);
 		return 0;
 	}
-	// Update timestamp
+	// Update timestamp, the row is marked for the hourly save
 	lv_Node.recentActive = Time.now();
 	theConfig.lstNodes.update(&lv_Node);
-	theConfig.SetNIDChanged(true);
 	*_assoDev = lv_Node.device;
 
 	US token = random(65535); // Random number
@@ -2840,6 +2912,15 @@ BOOL SmartControllerClass::ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _re
 					}
 				}
 			}
+			// Members don't ack a group message, confirm them in one pass
+			if( IS_GROUP_NODEID(_nodeID) ) {
+				if( rowptr->data.sw != DEVICE_SW_DUMMY ) {
+					ConfirmLampOnOff(_nodeID, rowptr->data.sw);
+				} else {
+					ConfirmLampBrightness(_nodeID, rowptr->data.ring[0].State, rowptr->data.ring[0].BR);
+					ConfirmLampCCT(_nodeID, rowptr->data.ring[0].CCT);
+				}
+			}
 			rowptr->data.run_flag = EXECUTED;
 			theConfig.SetSNTChanged(true);
 		}
@@ -2867,124 +2948,185 @@ BOOL SmartControllerClass::RequestDeviceStatus(UC _nodeID, const UC subID)
 BOOL SmartControllerClass::ConfirmLampOnOff(UC _nodeID, UC _st)
 {
 	BOOL rc = false;
-	//m_pMainDev->data.ring[0].State = _st;
-	ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
-	if (DevStatusRowPtr) {
-		DevStatusRowPtr->data.present = 1;
-		DevStatusRowPtr->data.ring[0].State = _st;
-		DevStatusRowPtr->data.ring[1].State = _st;
-		DevStatusRowPtr->data.ring[2].State = _st;
-		DevStatusRowPtr->data.run_flag = EXECUTED;
-		DevStatusRowPtr->data.flash_flag = UNSAVED;
-		DevStatusRowPtr->data.op_flag = POST;
-		theConfig.SetDSTChanged(true);
-
-		// Set panel ring on or off
-		if( IS_CURRENT_DEVICE(_nodeID) ) {
-			thePanel.SetRingOnOff(_st);
+	if( IS_GROUP_NODEID(_nodeID) ) {
+		// Apply to all members in one pass
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = DevStatus_table.getRoot();
+		while( DevStatusRowPtr ) {
+			if( theGroups.IsMember(_nodeID, DevStatusRowPtr->data.node_id) ) {
+				UpdateLampOnOff(DevStatusRowPtr, _st);
+				rc = true;
+			}
+			DevStatusRowPtr = DevStatusRowPtr->next;
 		}
+	} else {
+		//m_pMainDev->data.ring[0].State = _st;
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
+		if (DevStatusRowPtr) {
+			UpdateLampOnOff(DevStatusRowPtr, _st);
+			rc = true;
+		}
+	}
 
-		// Publish device status event
+	if( rc ) {
+		// Publish device status event, one for the whole group
 		String strTemp = String::format("{'nd':%d,'State':%d}", _nodeID, _st);
 		PublishDeviceStatus(strTemp.c_str());
-		rc = true;
 	}
 	return rc;
 }
 
+void SmartControllerClass::UpdateLampOnOff(ListNode<DevStatusRow_t> *pDev, UC _st)
+{
+	pDev->data.present = 1;
+	pDev->data.ring[0].State = _st;
+	pDev->data.ring[1].State = _st;
+	pDev->data.ring[2].State = _st;
+	pDev->data.run_flag = EXECUTED;
+	pDev->data.flash_flag = UNSAVED;
+	pDev->data.op_flag = POST;
+	theConfig.SetDSTChanged(true);
+	theUsage.SetState(pDev->data.node_id, _st);
+
+	// Set panel ring on or off
+	if( IS_CURRENT_DEVICE(pDev->data.node_id) ) {
+		thePanel.SetRingOnOff(_st);
+	}
+}
+
 BOOL SmartControllerClass::ConfirmLampBrightness(UC _nodeID, UC _st, UC _percentage, UC _ringID)
 {
 	//LOGW(LOGTAG_MSG, "ConfirmLampBrightness node:%d st:%d,br:%d", _nodeID, _st,_percentage);
 	BOOL rc = false;
-	UC r_index = (_ringID == RING_ID_ALL ? 0 : _ringID - 1);
-	//m_pMainDev->data.ring[0].BR = _percentage;
-	ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
-	if (DevStatusRowPtr) {
-		//LOGW(LOGTAG_MSG, "find node ptr", _nodeID, _st,_percentage);
-		ConfirmLampPresent(DevStatusRowPtr, true);
-		if( DevStatusRowPtr->data.ring[r_index].State != _st || DevStatusRowPtr->data.ring[r_index].BR != _percentage ) {
-			//LOGW(LOGTAG_MSG, "set node:%d st:%d,br:%d", _nodeID, _st,_percentage);
-			DevStatusRowPtr->data.present = 1;
-			DevStatusRowPtr->data.ring[r_index].State = _st;
-			DevStatusRowPtr->data.ring[r_index].BR = _percentage;
-			if( _ringID == RING_ID_ALL ) {
-				DevStatusRowPtr->data.ring[1].State = _st;
-				DevStatusRowPtr->data.ring[1].BR = _percentage;
-				DevStatusRowPtr->data.ring[2].State = _st;
-				DevStatusRowPtr->data.ring[2].BR = _percentage;
-			}
-			DevStatusRowPtr->data.run_flag = EXECUTED;
-			DevStatusRowPtr->data.flash_flag = UNSAVED;
-			DevStatusRowPtr->data.op_flag = POST;
-			theConfig.SetDSTChanged(true);
-
-			if( IS_CURRENT_DEVICE(_nodeID) ) {
-				if( r_index == 0 ) {
-					// Set panel ring to new position
-					thePanel.UpdateDimmerValue(_percentage);
-					// Set panel ring off
-					thePanel.SetRingOnOff(_st);
-				}
+	BOOL lv_changed = false;
+	if( IS_GROUP_NODEID(_nodeID) ) {
+		// Apply to all members in one pass
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = DevStatus_table.getRoot();
+		while( DevStatusRowPtr ) {
+			if( theGroups.IsMember(_nodeID, DevStatusRowPtr->data.node_id) ) {
+				lv_changed |= UpdateLampBrightness(DevStatusRowPtr, _st, _percentage, _ringID);
+				rc = true;
 			}
+			DevStatusRowPtr = DevStatusRowPtr->next;
+		}
+	} else {
+		//m_pMainDev->data.ring[0].BR = _percentage;
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
+		if (DevStatusRowPtr) {
+			lv_changed = UpdateLampBrightness(DevStatusRowPtr, _st, _percentage, _ringID);
+			rc = true;
+		}
+	}
 
-			// Publish device status event
-			String strTemp;
-			if( _ringID != RING_ID_ALL ) {
-				strTemp = String::format("{'nd':%d,'Ring':%d,'State':%d,'BR':%d}",
-					_nodeID, _ringID, _st, _percentage);
-			} else {
-			 	strTemp = String::format("{'nd':%d,'State':%d,'BR':%d}",
-					_nodeID, _st, _percentage);
-			}
-			PublishDeviceStatus(strTemp.c_str());
+	if( lv_changed ) {
+		// Publish device status event, one for the whole group
+		String strTemp;
+		if( _ringID != RING_ID_ALL ) {
+			strTemp = String::format("{'nd':%d,'Ring':%d,'State':%d,'BR':%d}",
+				_nodeID, _ringID, _st, _percentage);
+		} else {
+			strTemp = String::format("{'nd':%d,'State':%d,'BR':%d}",
+				_nodeID, _st, _percentage);
 		}
-		rc = true;
+		PublishDeviceStatus(strTemp.c_str());
 	}
 	return rc;
 }
 
-BOOL SmartControllerClass::ConfirmLampCCT(UC _nodeID, US _cct, UC _ringID)
+BOOL SmartControllerClass::UpdateLampBrightness(ListNode<DevStatusRow_t> *pDev, UC _st, UC _percentage, UC _ringID)
 {
-	BOOL rc = false;
 	UC r_index = (_ringID == RING_ID_ALL ? 0 : _ringID - 1);
-	//m_pMainDev->data.ring[0].CCT = _cct;
-	ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
-	if (DevStatusRowPtr) {
-		ConfirmLampPresent(DevStatusRowPtr, true);
-		if( DevStatusRowPtr->data.ring[r_index].CCT != _cct ) {
-			DevStatusRowPtr->data.present = 1;
-			DevStatusRowPtr->data.ring[r_index].CCT = _cct;
-			if( _ringID == RING_ID_ALL ) {
-				DevStatusRowPtr->data.ring[1].CCT = _cct;
-				DevStatusRowPtr->data.ring[2].CCT = _cct;
-			}
-			DevStatusRowPtr->data.run_flag = EXECUTED;
-			DevStatusRowPtr->data.flash_flag = UNSAVED;
-			DevStatusRowPtr->data.op_flag = POST;
-			theConfig.SetDSTChanged(true);
+	//LOGW(LOGTAG_MSG, "find node ptr", _nodeID, _st,_percentage);
+	ConfirmLampPresent(pDev, true);
+	if( pDev->data.ring[r_index].State == _st && pDev->data.ring[r_index].BR == _percentage ) return false;
+
+	//LOGW(LOGTAG_MSG, "set node:%d st:%d,br:%d", _nodeID, _st,_percentage);
+	pDev->data.present = 1;
+	pDev->data.ring[r_index].State = _st;
+	pDev->data.ring[r_index].BR = _percentage;
+	if( _ringID == RING_ID_ALL ) {
+		pDev->data.ring[1].State = _st;
+		pDev->data.ring[1].BR = _percentage;
+		pDev->data.ring[2].State = _st;
+		pDev->data.ring[2].BR = _percentage;
+	}
+	pDev->data.run_flag = EXECUTED;
+	pDev->data.flash_flag = UNSAVED;
+	pDev->data.op_flag = POST;
+	theConfig.SetDSTChanged(true);
+	if( r_index == 0 ) theUsage.SetBrightness(pDev->data.node_id, _st, _percentage);
 
-			if( IS_CURRENT_DEVICE(_nodeID) ) {
-				if( r_index == 0 ) {
-					// Update cooresponding panel CCT value
-					thePanel.UpdateCCTValue(_cct);
-					thePanel.SetRingOnOff(DevStatusRowPtr->data.ring[0].State);
-				}
-			}
+	if( IS_CURRENT_DEVICE(pDev->data.node_id) ) {
+		if( r_index == 0 ) {
+			// Set panel ring to new position
+			thePanel.UpdateDimmerValue(_percentage);
+			// Set panel ring off
+			thePanel.SetRingOnOff(_st);
+		}
+	}
+	return true;
+}
 
-			// Publish device status event
-			String strTemp;
-			if( _ringID != RING_ID_ALL ) {
-				strTemp = String::format("{'nd':%d,'Ring':%d,'CCT':%d}", _nodeID, _ringID, _cct);
-			} else {
-			 	strTemp = String::format("{'nd':%d,'CCT':%d}", _nodeID, _cct);
+BOOL SmartControllerClass::ConfirmLampCCT(UC _nodeID, US _cct, UC _ringID)
+{
+	BOOL rc = false;
+	if( IS_GROUP_NODEID(_nodeID) ) {
+		// Apply to all members in one pass
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = DevStatus_table.getRoot();
+		while( DevStatusRowPtr ) {
+			if( theGroups.IsMember(_nodeID, DevStatusRowPtr->data.node_id) ) {
+				rc |= UpdateLampCCT(DevStatusRowPtr, _cct, _ringID);
 			}
-			PublishDeviceStatus(strTemp.c_str());
-			rc = true;
+			DevStatusRowPtr = DevStatusRowPtr->next;
+		}
+	} else {
+		//m_pMainDev->data.ring[0].CCT = _cct;
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
+		if (DevStatusRowPtr) {
+			rc = UpdateLampCCT(DevStatusRowPtr, _cct, _ringID);
 		}
 	}
+
+	if( rc ) {
+		// Publish device status event, one for the whole group
+		String strTemp;
+		if( _ringID != RING_ID_ALL ) {
+			strTemp = String::format("{'nd':%d,'Ring':%d,'CCT':%d}", _nodeID, _ringID, _cct);
+		} else {
+			strTemp = String::format("{'nd':%d,'CCT':%d}", _nodeID, _cct);
+		}
+		PublishDeviceStatus(strTemp.c_str());
+	}
 	return rc;
 }
 
+BOOL SmartControllerClass::UpdateLampCCT(ListNode<DevStatusRow_t> *pDev, US _cct, UC _ringID)
+{
+	UC r_index = (_ringID == RING_ID_ALL ? 0 : _ringID - 1);
+	ConfirmLampPresent(pDev, true);
+	if( pDev->data.ring[r_index].CCT == _cct ) return false;
+
+	pDev->data.present = 1;
+	pDev->data.ring[r_index].CCT = _cct;
+	if( _ringID == RING_ID_ALL ) {
+		pDev->data.ring[1].CCT = _cct;
+		pDev->data.ring[2].CCT = _cct;
+	}
+	pDev->data.run_flag = EXECUTED;
+	pDev->data.flash_flag = UNSAVED;
+	pDev->data.op_flag = POST;
+	theConfig.SetDSTChanged(true);
+	if( r_index == 0 ) theUsage.SetCCT(pDev->data.node_id, _cct);
+
+	if( IS_CURRENT_DEVICE(pDev->data.node_id) ) {
+		if( r_index == 0 ) {
+			// Update cooresponding panel CCT value
+			thePanel.UpdateCCTValue(_cct);
+			thePanel.SetRingOnOff(pDev->data.ring[0].State);
+		}
+	}
+	return true;
+}
+
 BOOL SmartControllerClass::ConfirmLampHue(UC _nodeID, UC _white, UC _red, UC _green, UC _blue, UC _ringID)
 {
 	BOOL rc = false;
@@ -3144,7 +3286,6 @@ BOOL SmartControllerClass::ConfirmLampPresent(ListNode<DevStatusRow_t> *pDev, bo
 			pDev->data.run_flag = EXECUTED;
 			pDev->data.flash_flag = UNSAVED;
 			pDev->data.op_flag = POST;
-			theConfig.SetNIDChanged(true);
 			theConfig.SetDSTChanged(true);
 
 			// Publish device status event
@@ -3390,6 +3531,7 @@ void SmartControllerClass::print_rule_table(int row)
 	SERIAL_LN("tmr_int = %d", Rule_table.get(row).tmr_int);
 	SERIAL_LN("tmr_started = %d", Rule_table.get(row).tmr_started);
 	SERIAL_LN("tmr_span = %d m", Rule_table.get(row).tmr_span);
+	SERIAL_LN("sr_window = %d", Rule_table.get(row).sr_window);
 }
 
 //------------------------------------------------------------------
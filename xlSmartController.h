@@ -105,13 +105,14 @@ public:
   bool Action_Rule(ListNode<RuleRow_t> *rulePtr);
   bool Action_Schedule(OP_FLAG parentFlag, UC uid, UC rule_uid);
 
-  bool Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _nd, UC _symbol, US _val1, US _val2);
+  bool Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _symbol, US _val1, US _val2, UC _aggr = SR_AGGR_NONE, UC _window = SR_WIN_5MIN);
+  void UpdateSensorHistory();
   bool Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init = false, const UC _sr = 255, const UC _nd = 0);
 
   //LinkedLists (Working memory tables)
   ChainClass<DevStatusRow_t> DevStatus_table = ChainClass<DevStatusRow_t>(MAX_DEVICE_PER_CONTROLLER);
-  ChainClass<ScheduleRow_t> Schedule_table = ChainClass<ScheduleRow_t>(MAX_TABLE_SIZE);
-  ChainClass<ScenarioRow_t> Scenario_table = ChainClass<ScenarioRow_t>(MAX_TABLE_SIZE);
+  LruChainClass<ScheduleRow_t> Schedule_table = LruChainClass<ScheduleRow_t>(MAX_SCT_CACHE_SIZE);
+  LruChainClass<ScenarioRow_t> Scenario_table = LruChainClass<ScenarioRow_t>(MAX_SNT_CACHE_SIZE);
   ChainClass<RuleRow_t> Rule_table = ChainClass<RuleRow_t>(256); // 65536/24 is too big = (int)(MEM_RULES_LEN / sizeof(RuleRow_t))
 
   //Print LinkedLists (Working memory tables)
@@ -158,6 +159,9 @@ public:
   BOOL ConfirmLampTop(UC _nodeID, UC *_payl, UC _len);
   BOOL ConfirmLampFilter(UC _nodeID, UC _filter);
   BOOL ConfirmLampPresent(ListNode<DevStatusRow_t> *pDev, bool _up);
+  void UpdateLampOnOff(ListNode<DevStatusRow_t> *pDev, UC _st);
+  BOOL UpdateLampBrightness(ListNode<DevStatusRow_t> *pDev, UC _st, UC _percentage, UC _ringID = RING_ID_ALL);
+  BOOL UpdateLampCCT(ListNode<DevStatusRow_t> *pDev, US _cct, UC _ringID = RING_ID_ALL);
   BOOL QueryDeviceStatus(UC _nodeID, UC _ringID = RING_ID_ALL);
   BOOL RebootNode(UC _nodeID, const UC subID = 0);
   BOOL IsAllRingHueSame(ListNode<DevStatusRow_t> *pDev);
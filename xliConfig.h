@@ -52,7 +52,7 @@
 #endif
 
 // Main Version. Must change if Config_t structure is updated
-#define VERSION_CONFIG_DATA       27
+#define VERSION_CONFIG_DATA       30
 
 // Xlight Application Identification
 #define XLA_ORGANIZATION          "xlight.ca"               // Default value. Read from EEPROM
@@ -89,6 +89,15 @@
 // Maximum number of rows for any working memory table implimented using ChainClass
 #define MAX_TABLE_SIZE              8
 
+// Rows of schedules and scenarios cached from flash, least recently used row is evicted
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define MAX_SCT_CACHE_SIZE          MAX_TABLE_SIZE
+#define MAX_SNT_CACHE_SIZE          MAX_TABLE_SIZE
+#else
+#define MAX_SCT_CACHE_SIZE          MAX_TABLE_SIZE
+#define MAX_SNT_CACHE_SIZE          16
+#endif
+
 // Maximum number of device associated to one controller
 #if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
 #define MAX_DEVICE_PER_CONTROLLER   8
@@ -103,6 +112,17 @@
 #define MAX_NODE_PER_CONTROLLER     48
 #endif
 
+// Sensor state store: (node, sensor) pairs of every node, a super-sensor reports up to 10 types
+#define SENSOR_STATE_TYPES          10
+
+// Sensor history: 1-minute buckets over the last hour, a ring per (node, sensor) of aggregated rule conditions
+#define SENSOR_HISTORY_BUCKETS      60
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define SENSOR_HISTORY_RINGS        6
+#else
+#define SENSOR_HISTORY_RINGS        16
+#endif
+
 // Maximum conditions within a rule
 #define MAX_CONDITION_PER_RULE      2
 
@@ -129,6 +149,37 @@
 #define MQ_MAX_CLOUD_MSG        12
 #endif
 
+// Maximum outgoing Cloud publish packets buffered (each up to 255 bytes)
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define MQ_MAX_CLOUD_PUB        6
+#else
+#define MQ_MAX_CLOUD_PUB        12
+#endif
+
+// Cloud publish token bucket: one event per interval, allow short burst
+#define RTE_PUB_TOKEN_INTERVAL  1000        // ms per token
+#define RTE_PUB_TOKEN_BURST     4           // Maximum tokens saved up
+
+// Outstanding RF queries, a query to the same node is not repeated before reply or timeout
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define MQ_MAX_RF_QUERY         16
+#else
+#define MQ_MAX_RF_QUERY         32
+#endif
+#define RTE_TM_RF_QUERY         2000        // ms to wait for the reply of a RF query
+
+// Received frames kept to drop retransmissions, sets of ways by sender
+#if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
+#define RF_DUP_SETS             16          // Power of 2
+#else
+#define RF_DUP_SETS             32
+#endif
+#define RF_DUP_WAYS             2
+#define RTE_TM_RF_DUP           300         // ms a repeated frame of the sender is taken as retransmission
+
+// RF send lanes are served by strict priority, a message waiting so long goes ahead every other frame
+#define RTE_TM_RF_AGING         2000
+
 // NodeID Convention
 #define NODEID_GATEWAY          0
 #define NODEID_MAINDEVICE       1